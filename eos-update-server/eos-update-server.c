@@ -22,8 +22,15 @@
  *  - Philip Withnall <withnall@endlessm.com>
  */
 
+#include <libeos-update-server/buffer-pool.h>
+#include <libeos-update-server/client-table.h>
 #include <libeos-update-server/config.h>
+#include <libeos-update-server/filez-cache.h>
+#include <libeos-update-server/mapped-file-cache.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/rate-limiter.h>
 #include <libeos-update-server/repo.h>
+#include <libeos-update-server/scheduler.h>
 #include <libeos-update-server/server.h>
 #include <libeos-updater-util/config.h>
 #include <libeos-updater-util/refcounted.h>
@@ -36,7 +43,11 @@
 #include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <netinet/in.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <systemd/sd-daemon.h>
 
 #include <errno.h>
@@ -182,7 +193,7 @@ clear_source (guint *id)
 typedef struct
 {
   GMainLoop *loop;
-  EusServer *server;
+  GPtrArray *servers;  /* (element-type EusServer) (owned) */
 
   gint timeout_seconds;
   guint timeout_id;
@@ -196,14 +207,26 @@ typedef struct
 static void
 timeout_data_setup_timeout (TimeoutData *data);
 
+/* Check whether none of the @servers, which may be running in other threads,
+ * have handled a request in the last @seconds. */
 static gboolean
-no_requests_timeout (EusServer *server,
+no_requests_timeout (GPtrArray *servers,
                      gint       seconds)
 {
-  guint pending_requests = eus_server_get_pending_requests (server);
-  gint64 last_request_time;
+  guint pending_requests = 0;
+  gint64 last_request_time = 0;
   gint64 monotonic_now;
   gint64 diff;
+  gsize i;
+
+  for (i = 0; i < servers->len; i++)
+    {
+      EusServer *server = g_ptr_array_index (servers, i);
+
+      pending_requests += eus_server_get_pending_requests (server);
+      last_request_time = MAX (last_request_time,
+                               eus_server_get_last_request_time (server));
+    }
 
   if (pending_requests > 0)
     {
@@ -211,7 +234,6 @@ no_requests_timeout (EusServer *server,
       return FALSE;
     }
 
-  last_request_time = eus_server_get_last_request_time (server);
   monotonic_now = g_get_monotonic_time ();
   diff = monotonic_now - last_request_time;
 
@@ -223,7 +245,7 @@ timeout_cb (gpointer timeout_data_ptr)
 {
   TimeoutData *data = timeout_data_ptr;
 
-  if (!no_requests_timeout (data->server, data->timeout_seconds))
+  if (!no_requests_timeout (data->servers, data->timeout_seconds))
     {
       g_message ("Resetting timeout");
       timeout_data_setup_timeout (data);
@@ -257,7 +279,7 @@ check_and_quit (gpointer timeout_data_ptr)
 {
   TimeoutData *data = timeout_data_ptr;
 
-  if (!no_requests_timeout (data->server, data->quit_file_timeout_seconds))
+  if (!no_requests_timeout (data->servers, data->quit_file_timeout_seconds))
     return EOS_QUIT_FILE_KEEP_CHECKING;
 
   g_main_loop_quit (data->loop);
@@ -292,12 +314,12 @@ timeout_data_maybe_setup_quit_file (TimeoutData *data,
 static gboolean
 timeout_data_init (TimeoutData  *data,
                    Options      *options,
-                   EusServer    *server,
+                   GPtrArray    *servers,
                    GError      **error)
 {
   memset (data, 0, sizeof (*data));
   data->loop = g_main_loop_new (NULL, FALSE);
-  data->server = g_object_ref (server);
+  data->servers = g_ptr_array_ref (servers);
   data->timeout_seconds = options->timeout_seconds;
 
   timeout_data_setup_timeout (data);
@@ -314,12 +336,28 @@ timeout_data_clear (TimeoutData *data)
   g_clear_object (&data->quit_file);
   clear_source (&data->timeout_id);
   data->timeout_seconds = 0;
-  g_clear_object (&data->server);
+  g_clear_pointer (&data->servers, g_ptr_array_unref);
   g_clear_pointer (&data->loop, g_main_loop_unref);
 }
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (TimeoutData, timeout_data_clear)
 
+static void
+log_metrics (EusServer *server)
+{
+  g_autofree gchar *metrics = eus_server_format_metrics (server);
+
+  g_message ("Metrics:\n%s", metrics);
+}
+
+static gboolean
+dump_metrics_cb (gpointer user_data)
+{
+  log_metrics (EUS_SERVER (user_data));
+
+  return G_SOURCE_CONTINUE;
+}
+
 typedef GSList URIList;
 
 static void
@@ -427,6 +465,39 @@ start_listening (SoupServer *server,
   return soup_server_listen_fd (server, SD_LISTEN_FDS_START, 0, error);
 }
 
+/* Size of each buffer which compressed objects are produced into. The
+ * configured memory limit is divided into buffers of this size. */
+#define COMPRESSION_BUFFER_SIZE (256 * 1024)
+
+/* Create the cache of compressed objects shared by all the repositories, in
+ * a subdirectory of the configured cache directory. Entries are keyed by
+ * object checksum, so objects present in several repositories are only
+ * stored once. Failing to create the cache is not fatal: the repositories are
+ * just served without one, so %NULL is returned. */
+static EusFilezCache *
+create_filez_cache (const EusServerConfig *server_config)
+{
+  g_autofree gchar *path = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (server_config->cache_max_size == 0)
+    return NULL;
+
+  path = g_build_filename (server_config->cache_path, "objects", NULL);
+  cache = eus_filez_cache_new (path, server_config->cache_max_size,
+                               NULL, &error);
+
+  if (cache == NULL)
+    {
+      g_message ("Failed to create cache ‘%s’; compressed objects will not "
+                 "be cached: %s", path, error->message);
+      return NULL;
+    }
+
+  return g_steal_pointer (&cache);
+}
+
 /* Create an #EusRepo to wrap the given #OstreeRepo and add it to the
  * #EusServer. Print an error and return %FALSE on failure. */
 static gboolean
@@ -465,6 +536,260 @@ add_repo (EusServer   *server,
   return TRUE;
 }
 
+/* Everything needed to create an #EusServer for each thread. */
+typedef struct
+{
+  const Options *options;
+  const EusServerConfig *server_config;
+  GPtrArray *repository_configs;  /* (element-type EusRepoConfig) */
+  EusScheduler *scheduler;
+  EusBufferPool *buffer_pool;  /* (nullable) */
+  EusFilezCache *filez_cache;  /* (nullable) */
+} ServerSetup;
+
+/* Create an #EusServer for @soup_server, serving all the configured
+ * repositories, each opened separately so that servers in different threads
+ * do not share #OstreeRepos. If @primary is %NULL, the server is the first,
+ * and is the only one to generate static deltas and warm up the caches;
+ * otherwise, it shares the client table, rate limiter, metrics and mapped
+ * file cache of @primary. Print an error and return %NULL on failure. */
+static EusServer *
+create_server (const ServerSetup *setup,
+               SoupServer        *soup_server,
+               EusServer         *primary)
+{
+  const EusServerConfig *server_config = setup->server_config;
+  g_autoptr(EusServer) server = NULL;
+  g_autoptr(EusClientTable) client_table = NULL;
+  g_autoptr(EusRateLimiter) rate_limiter = NULL;
+  g_autoptr(EusMetrics) metrics = NULL;
+  g_autoptr(EusMappedFileCache) mapped_file_cache = NULL;
+  g_autofree gchar *delta_cache_path = NULL;
+  gsize i;
+
+  if (primary != NULL)
+    g_object_get (primary,
+                  "client-table", &client_table,
+                  "rate-limiter", &rate_limiter,
+                  "metrics", &metrics,
+                  "mapped-file-cache", &mapped_file_cache,
+                  NULL);
+
+  /* Generated static deltas are kept out of the repositories, so they can be
+   * deleted to make room for newer ones. */
+  delta_cache_path = g_build_filename (server_config->cache_path, "deltas", NULL);
+
+  server = g_object_new (EUS_TYPE_SERVER,
+                         "server", soup_server,
+                         "scheduler", setup->scheduler,
+                         "buffer-pool", setup->buffer_pool,
+                         "client-table", client_table,
+                         "rate-limiter", rate_limiter,
+                         "metrics", metrics,
+                         "filez-cache", setup->filez_cache,
+                         "mapped-file-cache", mapped_file_cache,
+                         "min-compression-level", server_config->compression_min_level,
+                         "max-compression-level", server_config->compression_max_level,
+                         "delta-max-size", (primary == NULL) ? server_config->deltas_max_size : 0,
+                         "delta-ancestors", server_config->deltas_ancestors,
+                         "delta-cache-path", delta_cache_path,
+                         "warm-up", (primary == NULL && server_config->cache_warm_up),
+                         "max-requests-per-client", server_config->clients_max_requests,
+                         "max-rate", server_config->clients_max_total_rate,
+                         "max-rate-per-client", server_config->clients_max_rate,
+                         "max-pending-requests", server_config->admission_max_pending_requests,
+                         "max-load", server_config->admission_max_load,
+                         "retry-after", server_config->admission_retry_after,
+                         NULL);
+
+  for (i = 0; i < setup->repository_configs->len; i++)
+    {
+      const EusRepoConfig *config = g_ptr_array_index (setup->repository_configs, i);
+      g_autoptr(GFile) ostree_repo_path = NULL;
+      g_autoptr(OstreeRepo) ostree_repo = NULL;
+      g_autofree gchar *root_path = NULL;
+
+      /* Serve the (config->index == 0) repository at (root_path == "") for
+       * backwards compatibility with the old version of eos-update-server which
+       * could only serve a single repository. It’s intended that
+       * (config->index == 0) is always the system OSTree repository (though
+       * this is not enforced). */
+      ostree_repo_path = g_file_new_for_path (config->path);
+      ostree_repo = ostree_repo_new (ostree_repo_path);
+      root_path = (config->index != 0) ? g_strdup_printf ("/%u", config->index) : g_strdup ("");
+
+      if (!add_repo (server, ostree_repo, root_path, config->remote_name))
+        return NULL;
+    }
+
+  if (setup->repository_configs->len == 0)
+    {
+      g_autoptr(OstreeRepo) ostree_repo = NULL;
+
+      ostree_repo = ostree_repo_new_default ();
+      if (!add_repo (server, ostree_repo, "", setup->options->served_remote))
+        return NULL;
+    }
+
+  return g_steal_pointer (&server);
+}
+
+/* Listen on new sockets bound to the same addresses as the listening sockets
+ * of @primary, which may have come from systemd. `SO_REUSEPORT` is set on all
+ * of them, so the kernel spreads new connections between the servers.
+ * Separate sockets are needed because libsoup stops listening on a socket if
+ * another thread accepted the connection it was woken up for. */
+static gboolean
+listen_reuseport (SoupServer  *server,
+                  SoupServer  *primary,
+                  GError     **error)
+{
+  g_autoptr(GSList) listeners = soup_server_get_listeners (primary);
+  GSList *l;
+
+  for (l = listeners; l != NULL; l = l->next)
+    {
+      GSocket *listener = l->data;
+      GSocketFamily family = g_socket_get_family (listener);
+      g_autoptr(GSocketAddress) address = NULL;
+      g_autoptr(GSocket) socket = NULL;
+      gint v6only;
+
+      /* This is a no-op if systemd set it already (`ReusePort=true`). */
+      if (!g_socket_set_option (listener, SOL_SOCKET, SO_REUSEPORT, 1, error))
+        return FALSE;
+
+      address = g_socket_get_local_address (listener, error);
+      if (address == NULL)
+        return FALSE;
+
+      socket = g_socket_new (family, G_SOCKET_TYPE_STREAM,
+                             G_SOCKET_PROTOCOL_DEFAULT, error);
+      if (socket == NULL)
+        return FALSE;
+
+      if (!g_socket_set_option (socket, SOL_SOCKET, SO_REUSEPORT, 1, error))
+        return FALSE;
+
+      if (family == G_SOCKET_FAMILY_IPV6 &&
+          (!g_socket_get_option (listener, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, error) ||
+           !g_socket_set_option (socket, IPPROTO_IPV6, IPV6_V6ONLY, v6only, error)))
+        return FALSE;
+
+      if (!g_socket_bind (socket, address, TRUE, error) ||
+          !g_socket_listen (socket, error) ||
+          !soup_server_listen_socket (server, socket, 0, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* An #EusServer running in its own thread and main context, accepting
+ * connections on its own `SO_REUSEPORT` sockets. */
+typedef struct
+{
+  GMainContext *context;  /* (owned) */
+  GMainLoop *loop;  /* (owned) */
+  SoupServer *soup_server;  /* (owned) */
+  EusServer *server;  /* (owned) (nullable) */
+  GThread *thread;  /* (owned) (nullable) */
+} Shard;
+
+static gboolean
+quit_loop_cb (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Stop the shard’s thread, if it is running, and then its server. */
+static void
+shard_free (Shard *shard)
+{
+  if (shard->thread != NULL)
+    {
+      g_autoptr(GSource) source = g_idle_source_new ();
+
+      /* g_main_loop_quit() would be lost if the thread had not started
+       * running the loop yet. */
+      g_source_set_callback (source, quit_loop_cb, shard->loop, NULL);
+      g_source_attach (source, shard->context);
+      g_thread_join (g_steal_pointer (&shard->thread));
+    }
+
+  g_main_context_push_thread_default (shard->context);
+  g_clear_object (&shard->server);
+  soup_server_disconnect (shard->soup_server);
+  g_clear_object (&shard->soup_server);
+  g_main_context_pop_thread_default (shard->context);
+
+  g_main_loop_unref (shard->loop);
+  g_main_context_unref (shard->context);
+  g_free (shard);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Shard, shard_free)
+
+static gpointer
+shard_thread_cb (gpointer user_data)
+{
+  Shard *shard = user_data;
+
+  g_main_context_push_thread_default (shard->context);
+  g_main_loop_run (shard->loop);
+  g_main_context_pop_thread_default (shard->context);
+
+  return NULL;
+}
+
+/* Create a shard serving the same repositories as @primary on the same
+ * addresses as @primary_soup_server, and start its thread. Everything is
+ * created with the shard’s context as the thread-default, so the sources of
+ * its server and repositories are attached to it, and it starts listening
+ * only once its repositories are ready. */
+static Shard *
+shard_new (const ServerSetup  *setup,
+           SoupServer         *primary_soup_server,
+           EusServer          *primary,
+           guint               index,
+           GError            **error)
+{
+  g_autoptr(Shard) shard = NULL;
+  g_autofree gchar *thread_name = NULL;
+  gboolean listening;
+
+  shard = g_new0 (Shard, 1);
+  shard->context = g_main_context_new ();
+  shard->loop = g_main_loop_new (shard->context, FALSE);
+
+  g_main_context_push_thread_default (shard->context);
+  shard->soup_server = soup_server_new (NULL, NULL);
+  shard->server = create_server (setup, shard->soup_server, primary);
+  listening = (shard->server != NULL &&
+               listen_reuseport (shard->soup_server, primary_soup_server, error));
+  g_main_context_pop_thread_default (shard->context);
+
+  if (shard->server == NULL)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                           "Failed to open the repositories");
+      return NULL;
+    }
+  else if (!listening)
+    {
+      return NULL;
+    }
+
+  thread_name = g_strdup_printf ("eus-shard-%u", index);
+  shard->thread = g_thread_try_new (thread_name, shard_thread_cb, shard, error);
+  if (shard->thread == NULL)
+    return NULL;
+
+  return g_steal_pointer (&shard);
+}
+
 /* main() exit codes. */
 enum
 {
@@ -486,6 +811,15 @@ main (int argc, char **argv)
   g_auto(TimeoutData) data = TIMEOUT_DATA_CLEARED;
   gboolean advertise_updates = FALSE;
   g_autoptr(GPtrArray) repository_configs = NULL;
+  g_autoptr(EusServerConfig) server_config = NULL;
+  g_autoptr(EusScheduler) scheduler = NULL;
+  g_autoptr(EusBufferPool) buffer_pool = NULL;
+  g_autoptr(EusFilezCache) filez_cache = NULL;
+  g_autoptr(GPtrArray) servers = NULL;
+  g_autoptr(GPtrArray) shards = NULL;
+  ServerSetup setup;
+  guint n_threads;
+  guint dump_metrics_id;
   gsize i;
 
   setlocale (LC_ALL, "");
@@ -498,7 +832,7 @@ main (int argc, char **argv)
 
   /* Load our configuration. */
   if (!eus_read_config_file (options.config_file, &advertise_updates,
-                             &repository_configs, &error))
+                             &repository_configs, &server_config, &error))
     {
       g_message ("Failed to load configuration file: %s", error->message);
       return EXIT_BAD_CONFIGURATION;
@@ -512,41 +846,32 @@ main (int argc, char **argv)
       return EXIT_DISABLED;
     }
 
-  /* Set up the server and repositories. */
-  soup_server = soup_server_new (NULL, NULL);
-  eus_server = eus_server_new (soup_server);
-
-  for (i = 0; i < repository_configs->len; i++)
-    {
-      const EusRepoConfig *config = g_ptr_array_index (repository_configs, i);
-      g_autoptr(GFile) ostree_repo_path = NULL;
-      g_autoptr(OstreeRepo) ostree_repo = NULL;
-      g_autofree gchar *root_path = NULL;
-
-      /* Serve the (config->index == 0) repository at (root_path == "") for
-       * backwards compatibility with the old version of eos-update-server which
-       * could only serve a single repository. It’s intended that
-       * (config->index == 0) is always the system OSTree repository (though
-       * this is not enforced). */
-      ostree_repo_path = g_file_new_for_path (config->path);
-      ostree_repo = ostree_repo_new (ostree_repo_path);
-      root_path = (config->index != 0) ? g_strdup_printf ("/%u", config->index) : g_strdup ("");
-
-      if (!add_repo (eus_server, ostree_repo, root_path, config->remote_name))
-        return EXIT_FAILED;
-    }
+  /* Set up the server and repositories. The compression workers, buffers and
+   * caches are shared by all the threads. */
+  scheduler = eus_scheduler_new (server_config->compression_max_jobs);
+  if (server_config->compression_max_memory > 0)
+    buffer_pool = eus_buffer_pool_new (COMPRESSION_BUFFER_SIZE,
+                                       server_config->compression_max_memory);
+  filez_cache = create_filez_cache (server_config);
+
+  setup.options = &options;
+  setup.server_config = server_config;
+  setup.repository_configs = repository_configs;
+  setup.scheduler = scheduler;
+  setup.buffer_pool = buffer_pool;
+  setup.filez_cache = filez_cache;
 
-  if (repository_configs->len == 0)
-    {
-      g_autoptr(OstreeRepo) ostree_repo = NULL;
+  soup_server = soup_server_new (NULL, NULL);
+  eus_server = create_server (&setup, soup_server, NULL);
+  if (eus_server == NULL)
+    return EXIT_FAILED;
 
-      ostree_repo = ostree_repo_new_default ();
-      if (!add_repo (eus_server, ostree_repo, "", options.served_remote))
-        return EXIT_FAILED;
-    }
+  /* Unowned; the shards own their servers. */
+  servers = g_ptr_array_new ();
+  g_ptr_array_add (servers, eus_server);
 
   /* Set up exit timeout. */
-  if (!timeout_data_init (&data, &options, eus_server, &error))
+  if (!timeout_data_init (&data, &options, servers, &error))
     {
       g_message ("Failed to initialize timeout data: %s", error->message);
       return EXIT_FAILED;
@@ -559,7 +884,37 @@ main (int argc, char **argv)
       return EXIT_NO_SOCKETS;
     }
 
+  /* Serve from more threads, each with its own sockets on the same addresses.
+   * The main thread is the first. Failing to start one is not fatal. */
+  n_threads = (server_config->server_threads > 0) ? server_config->server_threads : g_get_num_processors ();
+  shards = g_ptr_array_new_with_free_func ((GDestroyNotify) shard_free);
+
+  for (i = 1; i < n_threads; i++)
+    {
+      g_autoptr(Shard) shard = NULL;
+
+      shard = shard_new (&setup, soup_server, eus_server, i, &error);
+      if (shard == NULL)
+        {
+          g_message ("Failed to start server thread %" G_GSIZE_FORMAT "; "
+                     "serving from %" G_GSIZE_FORMAT " threads: %s",
+                     i, i, error->message);
+          g_clear_error (&error);
+          break;
+        }
+
+      g_ptr_array_add (servers, shard->server);
+      g_ptr_array_add (shards, g_steal_pointer (&shard));
+    }
+
+  /* Log the metrics on request, and before exiting. */
+  dump_metrics_id = g_unix_signal_add (SIGUSR1, dump_metrics_cb, eus_server);
+
   g_main_loop_run (data.loop);
 
+  g_source_remove (dump_metrics_id);
+  g_clear_pointer (&shards, g_ptr_array_unref);
+  log_metrics (eus_server);
+
   return EXIT_OK;
 }
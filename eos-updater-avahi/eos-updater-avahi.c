@@ -249,7 +249,7 @@ main (int    argc,
     avahi_service_directory = g_strdup (eos_avahi_service_file_get_directory ());
 
   /* Load our configuration. */
-  if (!eus_read_config_file (config_file, &advertise_updates, NULL, &error))
+  if (!eus_read_config_file (config_file, &advertise_updates, NULL, NULL, &error))
     {
       return fail (quiet, EXIT_BAD_CONFIGURATION,
                    "Failed to load configuration file: %s", error->message);
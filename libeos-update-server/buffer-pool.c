@@ -0,0 +1,496 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/buffer-pool.h>
+#include <libsoup/soup.h>
+
+/**
+ * SECTION:buffer-pool
+ * @title: Buffer pool
+ * @short_description: Fixed-size buffers with a global memory budget
+ * @include: libeos-update-server/buffer-pool.h
+ *
+ * A pool of fixed-size buffers which response bodies are generated into. The
+ * total size of the buffers handed out at once is limited to
+ * #EusBufferPool:max-size, so the memory used for generated bodies stays
+ * constant however many clients are being served. Once the budget is used
+ * up, eus_buffer_pool_acquire_async() waits until a buffer is released.
+ *
+ * A filled buffer can be handed to libsoup without copying it using
+ * eus_buffer_pool_wrap(); it is returned to the pool once libsoup has written
+ * it and all other references to the #SoupBuffer are dropped.
+ *
+ * Released buffers are kept for reuse, up to a small limit, so that a steady
+ * stream of requests does not keep allocating and freeing them.
+ *
+ * All methods are thread safe.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Maximum number of unused buffers to keep around for reuse. */
+#define MAX_IDLE_BUFFERS 16
+
+/**
+ * EusBufferPool:
+ *
+ * A pool of fixed-size buffers with a global memory budget.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusBufferPool
+{
+  GObject parent_instance;
+
+  gsize buffer_size;
+  guint64 max_size;
+  guint max_buffers;
+
+  GMutex lock;  /* protects the fields below */
+  guint n_allocated;  /* handed out or idle */
+  GSList *idle;  /* (owned) (element-type gpointer) released buffers for reuse */
+  guint n_idle;
+  GQueue waiters;  /* (element-type GTask) (owned) pending acquires */
+};
+
+G_DEFINE_TYPE (EusBufferPool, eus_buffer_pool, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_BUFFER_SIZE = 1,
+  PROP_MAX_SIZE,
+} EusBufferPoolProperty;
+
+static GParamSpec *props[PROP_MAX_SIZE + 1] = { NULL, };
+
+static void
+eus_buffer_pool_init (EusBufferPool *self)
+{
+  g_mutex_init (&self->lock);
+  g_queue_init (&self->waiters);
+}
+
+static void
+eus_buffer_pool_constructed (GObject *object)
+{
+  EusBufferPool *self = EUS_BUFFER_POOL (object);
+
+  G_OBJECT_CLASS (eus_buffer_pool_parent_class)->constructed (object);
+
+  g_assert (self->buffer_size > 0);
+
+  /* Always allow at least one buffer, or nothing could ever be sent. */
+  self->max_buffers = MAX (MIN (self->max_size / self->buffer_size, G_MAXUINT), 1);
+}
+
+static void
+eus_buffer_pool_get_property (GObject    *object,
+                              guint       property_id,
+                              GValue     *value,
+                              GParamSpec *spec)
+{
+  EusBufferPool *self = EUS_BUFFER_POOL (object);
+
+  switch ((EusBufferPoolProperty) property_id)
+    {
+    case PROP_BUFFER_SIZE:
+      g_value_set_uint64 (value, self->buffer_size);
+      break;
+
+    case PROP_MAX_SIZE:
+      g_value_set_uint64 (value, self->max_size);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_buffer_pool_set_property (GObject      *object,
+                              guint         property_id,
+                              const GValue *value,
+                              GParamSpec   *spec)
+{
+  EusBufferPool *self = EUS_BUFFER_POOL (object);
+
+  switch ((EusBufferPoolProperty) property_id)
+    {
+    case PROP_BUFFER_SIZE:
+      self->buffer_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_SIZE:
+      self->max_size = g_value_get_uint64 (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_buffer_pool_finalize (GObject *object)
+{
+  EusBufferPool *self = EUS_BUFFER_POOL (object);
+  GTask *task;
+
+  /* Buffers which are still wrapped hold a reference to the pool, so none can
+   * be outstanding by now. */
+  while ((task = g_queue_pop_head (&self->waiters)) != NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                               "Buffer pool was destroyed");
+      g_object_unref (task);
+    }
+
+  g_slist_free_full (self->idle, g_free);
+  self->idle = NULL;
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_buffer_pool_parent_class)->finalize (object);
+}
+
+static void
+eus_buffer_pool_class_init (EusBufferPoolClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = eus_buffer_pool_constructed;
+  object_class->finalize = eus_buffer_pool_finalize;
+  object_class->get_property = eus_buffer_pool_get_property;
+  object_class->set_property = eus_buffer_pool_set_property;
+
+  /**
+   * EusBufferPool:buffer-size:
+   *
+   * Size of each buffer in the pool, in bytes.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_BUFFER_SIZE] = g_param_spec_uint64 ("buffer-size",
+                                                 "Buffer Size",
+                                                 "Size of each buffer in the pool, in bytes.",
+                                                 1,
+                                                 G_MAXSIZE,
+                                                 64 * 1024,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusBufferPool:max-size:
+   *
+   * Maximum total size of the buffers allocated at once, in bytes. At least
+   * one buffer can always be allocated, even if this is smaller than
+   * #EusBufferPool:buffer-size.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_SIZE] = g_param_spec_uint64 ("max-size",
+                                              "Max Size",
+                                              "Maximum total size of the buffers allocated at once, in bytes.",
+                                              0,
+                                              G_MAXUINT64,
+                                              0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/**
+ * eus_buffer_pool_new:
+ * @buffer_size: size of each buffer, in bytes; must be non-zero
+ * @max_size: maximum total size of the buffers allocated at once, in bytes
+ *
+ * Create a new #EusBufferPool.
+ *
+ * Returns: (transfer full): a new buffer pool
+ * Since: UNRELEASED
+ */
+EusBufferPool *
+eus_buffer_pool_new (gsize   buffer_size,
+                     guint64 max_size)
+{
+  g_return_val_if_fail (buffer_size > 0, NULL);
+
+  return g_object_new (EUS_TYPE_BUFFER_POOL,
+                       "buffer-size", (guint64) buffer_size,
+                       "max-size", max_size,
+                       NULL);
+}
+
+/**
+ * eus_buffer_pool_get_buffer_size:
+ * @self: an #EusBufferPool
+ *
+ * Get the value of #EusBufferPool:buffer-size.
+ *
+ * Returns: size of each buffer, in bytes
+ * Since: UNRELEASED
+ */
+gsize
+eus_buffer_pool_get_buffer_size (EusBufferPool *self)
+{
+  g_return_val_if_fail (EUS_IS_BUFFER_POOL (self), 0);
+
+  return self->buffer_size;
+}
+
+/**
+ * eus_buffer_pool_get_max_size:
+ * @self: an #EusBufferPool
+ *
+ * Get the value of #EusBufferPool:max-size.
+ *
+ * Returns: maximum total size of the allocated buffers, in bytes
+ * Since: UNRELEASED
+ */
+guint64
+eus_buffer_pool_get_max_size (EusBufferPool *self)
+{
+  g_return_val_if_fail (EUS_IS_BUFFER_POOL (self), 0);
+
+  return self->max_size;
+}
+
+/* Must be called with the lock held. */
+static gpointer
+try_acquire_locked (EusBufferPool *self)
+{
+  gpointer buffer;
+
+  if (self->idle != NULL)
+    {
+      buffer = self->idle->data;
+      self->idle = g_slist_delete_link (self->idle, self->idle);
+      self->n_idle--;
+      return buffer;
+    }
+
+  if (self->n_allocated >= self->max_buffers)
+    return NULL;
+
+  self->n_allocated++;
+  return g_malloc (self->buffer_size);
+}
+
+/**
+ * eus_buffer_pool_try_acquire:
+ * @self: an #EusBufferPool
+ *
+ * Get a buffer from the pool, if the memory budget allows it. The buffer is
+ * #EusBufferPool:buffer-size bytes long, and its contents are undefined. It
+ * must be returned using eus_buffer_pool_release() or eus_buffer_pool_wrap().
+ *
+ * Returns: (transfer full) (nullable): a buffer, or %NULL if the budget is
+ *    used up
+ * Since: UNRELEASED
+ */
+gpointer
+eus_buffer_pool_try_acquire (EusBufferPool *self)
+{
+  gpointer buffer;
+
+  g_return_val_if_fail (EUS_IS_BUFFER_POOL (self), NULL);
+
+  g_mutex_lock (&self->lock);
+  buffer = try_acquire_locked (self);
+  g_mutex_unlock (&self->lock);
+
+  return buffer;
+}
+
+/**
+ * eus_buffer_pool_acquire_async:
+ * @self: an #EusBufferPool
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to invoke when a buffer is available
+ * @user_data: data to pass to @callback
+ *
+ * Get a buffer from the pool, waiting for one to be released if the memory
+ * budget is used up. Waiters are served in the order they started waiting.
+ * Cancellation is checked when a buffer becomes available.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_buffer_pool_acquire_async (EusBufferPool       *self,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  gpointer buffer;
+
+  g_return_if_fail (EUS_IS_BUFFER_POOL (self));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  /* As with #EusScheduler, the task doesn’t reference the pool. */
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eus_buffer_pool_acquire_async);
+
+  g_mutex_lock (&self->lock);
+  buffer = try_acquire_locked (self);
+  if (buffer == NULL)
+    g_queue_push_tail (&self->waiters, g_object_ref (task));
+  g_mutex_unlock (&self->lock);
+
+  if (buffer != NULL)
+    g_task_return_pointer (task, buffer, NULL);
+}
+
+/**
+ * eus_buffer_pool_acquire_finish:
+ * @self: an #EusBufferPool
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finish an operation started with eus_buffer_pool_acquire_async().
+ *
+ * Returns: (transfer full): a buffer, or %NULL on error
+ * Since: UNRELEASED
+ */
+gpointer
+eus_buffer_pool_acquire_finish (EusBufferPool  *self,
+                                GAsyncResult   *result,
+                                GError        **error)
+{
+  g_return_val_if_fail (EUS_IS_BUFFER_POOL (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, eus_buffer_pool_acquire_async), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * eus_buffer_pool_release:
+ * @self: an #EusBufferPool
+ * @buffer: (transfer full): a buffer acquired from @self
+ *
+ * Return @buffer to the pool. If anything is waiting for a buffer, it is
+ * passed on to the first waiter.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_buffer_pool_release (EusBufferPool *self,
+                         gpointer       buffer)
+{
+  GTask *waiter;
+
+  g_return_if_fail (EUS_IS_BUFFER_POOL (self));
+  g_return_if_fail (buffer != NULL);
+
+  while (TRUE)
+    {
+      g_mutex_lock (&self->lock);
+      waiter = g_queue_pop_head (&self->waiters);
+
+      if (waiter == NULL)
+        {
+          if (self->n_idle < MAX_IDLE_BUFFERS)
+            {
+              self->idle = g_slist_prepend (self->idle, buffer);
+              self->n_idle++;
+            }
+          else
+            {
+              g_free (buffer);
+              self->n_allocated--;
+            }
+        }
+      g_mutex_unlock (&self->lock);
+
+      if (waiter == NULL)
+        return;
+
+      /* Skip waiters which have been cancelled in the meantime. The waiter
+       * is completed outside the lock, as its callback may well acquire
+       * another buffer. */
+      if (g_task_return_error_if_cancelled (waiter))
+        {
+          g_object_unref (waiter);
+          continue;
+        }
+
+      g_task_return_pointer (waiter, buffer, NULL);
+      g_object_unref (waiter);
+      return;
+    }
+}
+
+typedef struct
+{
+  EusBufferPool *pool;  /* (owned) */
+  gpointer buffer;  /* (owned) */
+} WrappedBuffer;
+
+static void
+wrapped_buffer_free (WrappedBuffer *wrapped)
+{
+  eus_buffer_pool_release (wrapped->pool, wrapped->buffer);
+  g_object_unref (wrapped->pool);
+  g_free (wrapped);
+}
+
+/**
+ * eus_buffer_pool_wrap:
+ * @self: an #EusBufferPool
+ * @buffer: (transfer full): a buffer acquired from @self
+ * @length: number of bytes of @buffer which are filled
+ *
+ * Wrap the first @length bytes of @buffer in a #SoupBuffer without copying
+ * them. @buffer is released back to the pool once the last reference to the
+ * #SoupBuffer (including copies made with soup_buffer_copy()) is freed.
+ *
+ * Returns: (transfer full): a new #SoupBuffer
+ * Since: UNRELEASED
+ */
+SoupBuffer *
+eus_buffer_pool_wrap (EusBufferPool *self,
+                      gpointer       buffer,
+                      gsize          length)
+{
+  WrappedBuffer *wrapped;
+
+  g_return_val_if_fail (EUS_IS_BUFFER_POOL (self), NULL);
+  g_return_val_if_fail (buffer != NULL, NULL);
+  g_return_val_if_fail (length <= self->buffer_size, NULL);
+
+  wrapped = g_new0 (WrappedBuffer, 1);
+  wrapped->pool = g_object_ref (self);
+  wrapped->buffer = buffer;
+
+  return soup_buffer_new_with_owner (buffer, length, wrapped,
+                                     (GDestroyNotify) wrapped_buffer_free);
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_BUFFER_POOL eus_buffer_pool_get_type ()
+G_DECLARE_FINAL_TYPE (EusBufferPool, eus_buffer_pool, EUS, BUFFER_POOL, GObject)
+
+EusBufferPool *eus_buffer_pool_new (gsize   buffer_size,
+                                    guint64 max_size);
+
+gsize eus_buffer_pool_get_buffer_size (EusBufferPool *self);
+guint64 eus_buffer_pool_get_max_size (EusBufferPool *self);
+
+gpointer eus_buffer_pool_try_acquire (EusBufferPool *self);
+void eus_buffer_pool_acquire_async (EusBufferPool       *self,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data);
+gpointer eus_buffer_pool_acquire_finish (EusBufferPool  *self,
+                                         GAsyncResult   *result,
+                                         GError        **error);
+void eus_buffer_pool_release (EusBufferPool *self,
+                              gpointer       buffer);
+
+SoupBuffer *eus_buffer_pool_wrap (EusBufferPool *self,
+                                  gpointer       buffer,
+                                  gsize          length);
+
+G_END_DECLS
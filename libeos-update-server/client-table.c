@@ -0,0 +1,685 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/client-table.h>
+#include <libsoup/soup.h>
+
+/**
+ * SECTION:client-table
+ * @title: Client table
+ * @short_description: Per-client request accounting and concurrency limits
+ * @include: libeos-update-server/client-table.h
+ *
+ * Tracks the requests in progress for each client of an #EusServer, keyed by
+ * the client’s address, so that one client pulling with many parallel
+ * connections cannot starve the others.
+ *
+ * The server reports each request to the table as it is read and finished.
+ * Before handling a request, a repository asks the table to admit it in one
+ * of two lanes: #EUS_CLIENT_TABLE_LANE_METADATA or
+ * #EUS_CLIENT_TABLE_LANE_BULK. If the client already has
+ * #EusClientTable:max-requests-per-client requests being handled in that
+ * lane, the request is paused and queued instead, and handled once one of
+ * the client’s other requests in the lane finishes. Requests are never
+ * rejected: ostree fails the whole pull if a request fails, so it is better
+ * for an aggressive client to wait than to have to start again.
+ *
+ * The lanes are limited separately so that a client walking the commit’s
+ * trees is not held up behind its own `.filez` downloads: ostree only finds
+ * out which objects to download from the metadata, so the sooner it has the
+ * metadata, the sooner it can keep all its connections busy. Metadata
+ * requests are cheap to serve, so the extra concurrency costs little.
+ *
+ * The table can be shared between several #SoupServers, each running in its
+ * own thread, so that the limit applies to a client however its connections
+ * are spread between them. A deferred request is always resumed in the
+ * thread-default main context it was deferred in. All methods are thread
+ * safe, but must be called from the main context of the #SoupServer which
+ * @msg belongs to.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Number of #EusClientTableLanes. */
+#define N_LANES (EUS_CLIENT_TABLE_LANE_BULK + 1)
+
+typedef struct
+{
+  SoupServer *server;  /* (owned) */
+  GMainContext *context;  /* (owned) */
+  EusClientTableLane lane;
+  SoupMessage *msg;  /* (owned) */
+  SoupClientContext *client;  /* (owned) */
+  EusClientTableAdmitFunc func;
+  gpointer user_data;  /* (owned) */
+  GDestroyNotify user_data_free_func;
+} DeferredRequest;
+
+static void
+deferred_request_free (DeferredRequest *request)
+{
+  if (request->user_data_free_func != NULL)
+    request->user_data_free_func (request->user_data);
+  g_boxed_free (SOUP_TYPE_CLIENT_CONTEXT, request->client);
+  g_object_unref (request->msg);
+  g_main_context_unref (request->context);
+  g_object_unref (request->server);
+  g_free (request);
+}
+
+typedef struct
+{
+  gchar *host;  /* (owned) key in the clients table */
+  guint n_requests;  /* read and not yet finished, including deferred ones */
+  guint n_active[N_LANES];  /* admitted and not yet finished, per lane */
+  GQueue deferred[N_LANES];  /* (element-type DeferredRequest) (owned) oldest first, per lane */
+} ClientState;
+
+static void
+client_state_free (ClientState *state)
+{
+  gsize i;
+
+  for (i = 0; i < N_LANES; i++)
+    {
+      g_queue_foreach (&state->deferred[i], (GFunc) deferred_request_free, NULL);
+      g_queue_clear (&state->deferred[i]);
+    }
+  g_free (state->host);
+  g_free (state);
+}
+
+/**
+ * EusClientTable:
+ *
+ * Per-client request accounting and concurrency limits for an #EusServer.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusClientTable
+{
+  GObject parent_instance;
+
+  guint max_requests_per_client;
+
+  GMutex lock;  /* protects the fields below */
+  GHashTable *clients;  /* (owned) (element-type utf8 ClientState) keyed by host */
+  GHashTable *requests;  /* (owned) (element-type SoupMessage ClientState) unowned keys, for requests in progress */
+  GHashTable *active;  /* (owned) (element-type SoupMessage EusClientTableLane) unowned keys, for admitted requests; values are the lane + 1 */
+};
+
+G_DEFINE_TYPE (EusClientTable, eus_client_table, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_MAX_REQUESTS_PER_CLIENT = 1,
+} EusClientTableProperty;
+
+static GParamSpec *props[PROP_MAX_REQUESTS_PER_CLIENT + 1] = { NULL, };
+
+static void
+eus_client_table_init (EusClientTable *self)
+{
+  self->clients = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) client_state_free);
+  self->requests = g_hash_table_new (NULL, NULL);
+  self->active = g_hash_table_new (NULL, NULL);
+  g_mutex_init (&self->lock);
+}
+
+static void
+eus_client_table_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *spec)
+{
+  EusClientTable *self = EUS_CLIENT_TABLE (object);
+
+  switch ((EusClientTableProperty) property_id)
+    {
+    case PROP_MAX_REQUESTS_PER_CLIENT:
+      g_value_set_uint (value, self->max_requests_per_client);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_client_table_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *spec)
+{
+  EusClientTable *self = EUS_CLIENT_TABLE (object);
+
+  switch ((EusClientTableProperty) property_id)
+    {
+    case PROP_MAX_REQUESTS_PER_CLIENT:
+      self->max_requests_per_client = g_value_get_uint (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_client_table_dispose (GObject *object)
+{
+  EusClientTable *self = EUS_CLIENT_TABLE (object);
+
+  /* Deferred requests hold references to the repositories handling them. */
+  g_mutex_lock (&self->lock);
+  if (self->clients != NULL)
+    g_hash_table_remove_all (self->clients);
+  if (self->requests != NULL)
+    g_hash_table_remove_all (self->requests);
+  if (self->active != NULL)
+    g_hash_table_remove_all (self->active);
+  g_mutex_unlock (&self->lock);
+
+  G_OBJECT_CLASS (eus_client_table_parent_class)->dispose (object);
+}
+
+static void
+eus_client_table_finalize (GObject *object)
+{
+  EusClientTable *self = EUS_CLIENT_TABLE (object);
+
+  g_clear_pointer (&self->active, g_hash_table_unref);
+  g_clear_pointer (&self->requests, g_hash_table_unref);
+  g_clear_pointer (&self->clients, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_client_table_parent_class)->finalize (object);
+}
+
+static void
+eus_client_table_class_init (EusClientTableClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = eus_client_table_dispose;
+  object_class->finalize = eus_client_table_finalize;
+  object_class->get_property = eus_client_table_get_property;
+  object_class->set_property = eus_client_table_set_property;
+
+  /**
+   * EusClientTable:max-requests-per-client:
+   *
+   * Maximum number of requests from a single client to handle at once, in
+   * each #EusClientTableLane. Further requests from the client are deferred
+   * until one of its requests in the same lane finishes. If zero, there is
+   * no limit.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_REQUESTS_PER_CLIENT] = g_param_spec_uint ("max-requests-per-client",
+                                                           "Max Requests Per Client",
+                                                           "Maximum number of requests from a single client to handle at once.",
+                                                           0, G_MAXUINT, 0,
+                                                           G_PARAM_READWRITE |
+                                                           G_PARAM_CONSTRUCT_ONLY |
+                                                           G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/**
+ * eus_client_table_new:
+ * @max_requests_per_client: maximum number of requests from a single client
+ *    to handle at once, or 0 for no limit
+ *
+ * Create a new, empty #EusClientTable.
+ *
+ * Returns: (transfer full): a new #EusClientTable
+ * Since: UNRELEASED
+ */
+EusClientTable *
+eus_client_table_new (guint max_requests_per_client)
+{
+  return g_object_new (EUS_TYPE_CLIENT_TABLE,
+                       "max-requests-per-client", max_requests_per_client,
+                       NULL);
+}
+
+/**
+ * eus_client_table_get_max_requests_per_client:
+ * @self: an #EusClientTable
+ *
+ * Get the value of #EusClientTable:max-requests-per-client.
+ *
+ * Returns: maximum number of requests per client, or 0 for no limit
+ * Since: UNRELEASED
+ */
+guint
+eus_client_table_get_max_requests_per_client (EusClientTable *self)
+{
+  g_return_val_if_fail (EUS_IS_CLIENT_TABLE (self), 0);
+
+  return self->max_requests_per_client;
+}
+
+/**
+ * eus_client_table_get_n_clients:
+ * @self: an #EusClientTable
+ *
+ * Get the number of clients which currently have requests in progress.
+ *
+ * Returns: number of clients
+ * Since: UNRELEASED
+ */
+guint
+eus_client_table_get_n_clients (EusClientTable *self)
+{
+  guint n_clients;
+
+  g_return_val_if_fail (EUS_IS_CLIENT_TABLE (self), 0);
+
+  g_mutex_lock (&self->lock);
+  n_clients = g_hash_table_size (self->clients);
+  g_mutex_unlock (&self->lock);
+
+  return n_clients;
+}
+
+/**
+ * eus_client_table_get_n_requests:
+ * @self: an #EusClientTable
+ *
+ * Get the number of requests in progress, from all clients, including
+ * deferred ones.
+ *
+ * Returns: number of requests
+ * Since: UNRELEASED
+ */
+guint
+eus_client_table_get_n_requests (EusClientTable *self)
+{
+  guint n_requests;
+
+  g_return_val_if_fail (EUS_IS_CLIENT_TABLE (self), 0);
+
+  g_mutex_lock (&self->lock);
+  n_requests = g_hash_table_size (self->requests);
+  g_mutex_unlock (&self->lock);
+
+  return n_requests;
+}
+
+static const gchar *
+get_client_host (SoupClientContext *client)
+{
+  const gchar *host = soup_client_context_get_host (client);
+
+  return (host != NULL) ? host : "";
+}
+
+/**
+ * eus_client_table_get_n_client_requests:
+ * @self: an #EusClientTable
+ * @client: a client
+ *
+ * Get the number of requests in progress from @client, including deferred
+ * ones.
+ *
+ * Returns: number of requests
+ * Since: UNRELEASED
+ */
+guint
+eus_client_table_get_n_client_requests (EusClientTable    *self,
+                                        SoupClientContext *client)
+{
+  ClientState *state;
+  guint n_requests;
+
+  g_return_val_if_fail (EUS_IS_CLIENT_TABLE (self), 0);
+  g_return_val_if_fail (client != NULL, 0);
+
+  g_mutex_lock (&self->lock);
+  state = g_hash_table_lookup (self->clients, get_client_host (client));
+  n_requests = (state != NULL) ? state->n_requests : 0;
+  g_mutex_unlock (&self->lock);
+
+  return n_requests;
+}
+
+/**
+ * eus_client_table_request_started:
+ * @self: an #EusClientTable
+ * @msg: a request which has been read
+ * @client: the client which sent @msg
+ *
+ * Start accounting for @msg. Call this from #SoupServer::request-read.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_client_table_request_started (EusClientTable    *self,
+                                  SoupMessage       *msg,
+                                  SoupClientContext *client)
+{
+  const gchar *host;
+  ClientState *state;
+
+  g_return_if_fail (EUS_IS_CLIENT_TABLE (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+  g_return_if_fail (client != NULL);
+
+  g_mutex_lock (&self->lock);
+
+  if (g_hash_table_contains (self->requests, msg))
+    {
+      g_mutex_unlock (&self->lock);
+      return;
+    }
+
+  host = get_client_host (client);
+  state = g_hash_table_lookup (self->clients, host);
+  if (state == NULL)
+    {
+      state = g_new0 (ClientState, 1);
+      state->host = g_strdup (host);
+      g_hash_table_insert (self->clients, state->host, state);
+      g_debug ("New client %s", host);
+    }
+
+  state->n_requests++;
+  g_hash_table_insert (self->requests, msg, state);
+
+  g_mutex_unlock (&self->lock);
+}
+
+/* Move the oldest deferred requests of @state in each lane to @admitted while
+ * the lane has capacity, metadata first. Must be called with the lock held. */
+static void
+admit_deferred_unlocked (EusClientTable *self,
+                         ClientState    *state,
+                         GQueue         *admitted)
+{
+  DeferredRequest *request;
+  gsize i;
+
+  for (i = 0; i < N_LANES; i++)
+    {
+      while ((self->max_requests_per_client == 0 ||
+              state->n_active[i] < self->max_requests_per_client) &&
+             (request = g_queue_pop_head (&state->deferred[i])) != NULL)
+        {
+          g_debug ("Admitting deferred request from %s in lane %" G_GSIZE_FORMAT " (%u active)",
+                   state->host, i, state->n_active[i]);
+
+          state->n_active[i]++;
+          g_hash_table_insert (self->active, request->msg,
+                               GUINT_TO_POINTER (request->lane + 1));
+          g_queue_push_tail (admitted, request);
+        }
+    }
+}
+
+typedef struct
+{
+  EusClientTable *table;  /* (owned) */
+  DeferredRequest *request;  /* (owned) */
+} ResumeData;
+
+static void
+resume_data_free (ResumeData *data)
+{
+  deferred_request_free (data->request);
+  g_object_unref (data->table);
+  g_free (data);
+}
+
+/* Runs in the main context the request was deferred in. */
+static gboolean
+resume_deferred_cb (gpointer user_data)
+{
+  ResumeData *data = user_data;
+  DeferredRequest *request = data->request;
+  gboolean in_progress;
+
+  /* The client may have given up on the request after it was admitted by
+   * another thread, but before this callback was dispatched. */
+  g_mutex_lock (&data->table->lock);
+  in_progress = g_hash_table_contains (data->table->active, request->msg);
+  g_mutex_unlock (&data->table->lock);
+
+  if (in_progress)
+    {
+      /* Unpausing takes effect from an idle callback, so the handler can
+       * still pause the message again. */
+      soup_server_unpause_message (request->server, request->msg);
+      request->func (request->msg, request->client, request->user_data);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Resume the requests in @admitted, without the lock held, as their handlers
+ * may call back into the table. This is immediate for requests from the
+ * calling thread. */
+static void
+resume_admitted (EusClientTable *self,
+                 GQueue         *admitted)
+{
+  DeferredRequest *request;
+
+  while ((request = g_queue_pop_head (admitted)) != NULL)
+    {
+      ResumeData *data = g_new0 (ResumeData, 1);
+
+      data->table = g_object_ref (self);
+      data->request = request;
+      g_main_context_invoke_full (request->context, G_PRIORITY_DEFAULT,
+                                  resume_deferred_cb, data,
+                                  (GDestroyNotify) resume_data_free);
+    }
+}
+
+static gint
+deferred_request_has_msg (gconstpointer a,
+                          gconstpointer b)
+{
+  const DeferredRequest *request = a;
+
+  return (request->msg == b) ? 0 : 1;
+}
+
+/**
+ * eus_client_table_request_finished:
+ * @self: an #EusClientTable
+ * @msg: a request which has finished or been aborted
+ * @client: the client which sent @msg
+ *
+ * Stop accounting for @msg, and admit the next of the client’s deferred
+ * requests if there are any. Call this from #SoupServer::request-finished and
+ * #SoupServer::request-aborted. Requests which were not started with
+ * eus_client_table_request_started() are ignored.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_client_table_request_finished (EusClientTable    *self,
+                                   SoupMessage       *msg,
+                                   SoupClientContext *client)
+{
+  ClientState *state;
+  GQueue admitted = G_QUEUE_INIT;
+  DeferredRequest *aborted = NULL;
+  gpointer lane;
+
+  g_return_if_fail (EUS_IS_CLIENT_TABLE (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+  g_mutex_lock (&self->lock);
+
+  state = g_hash_table_lookup (self->requests, msg);
+  if (state == NULL)
+    {
+      g_mutex_unlock (&self->lock);
+      return;
+    }
+
+  g_hash_table_remove (self->requests, msg);
+  state->n_requests--;
+
+  lane = g_hash_table_lookup (self->active, msg);
+  if (lane != NULL)
+    {
+      g_hash_table_remove (self->active, msg);
+      state->n_active[GPOINTER_TO_UINT (lane) - 1]--;
+    }
+  else
+    {
+      gsize i;
+
+      for (i = 0; i < N_LANES && aborted == NULL; i++)
+        {
+          GList *link = g_queue_find_custom (&state->deferred[i], msg,
+                                             deferred_request_has_msg);
+
+          /* The client gave up on a request which was still deferred. */
+          if (link != NULL)
+            {
+              aborted = link->data;
+              g_queue_delete_link (&state->deferred[i], link);
+            }
+        }
+    }
+
+  admit_deferred_unlocked (self, state, &admitted);
+
+  if (state->n_requests == 0)
+    {
+      g_debug ("Client %s has no requests left", state->host);
+      g_hash_table_remove (self->clients, state->host);
+    }
+
+  g_mutex_unlock (&self->lock);
+
+  g_clear_pointer (&aborted, deferred_request_free);
+  resume_admitted (self, &admitted);
+}
+
+/**
+ * eus_client_table_admit:
+ * @self: an #EusClientTable
+ * @server: the #SoupServer which @msg belongs to
+ * @msg: a request which is about to be handled
+ * @client: the client which sent @msg
+ * @lane: the lane to admit @msg in
+ * @func: function to handle @msg if it is deferred
+ * @user_data: data to pass to @func
+ * @user_data_free_func: (nullable): function to free @user_data with
+ *
+ * Check whether @msg can be handled now. If its client has fewer than
+ * #EusClientTable:max-requests-per-client requests being handled in @lane, it
+ * is counted as being handled, @user_data is freed, and %TRUE is returned; the
+ * caller should handle @msg straight away.
+ *
+ * Otherwise, @msg is paused and %FALSE is returned. @func is called to handle
+ * it once one of the client’s other requests in @lane finishes, in the
+ * thread-default main context of the caller. If the client aborts
+ * the request first, @func is never called. Either way, @user_data is freed
+ * with @user_data_free_func afterwards.
+ *
+ * Returns: %TRUE if @msg should be handled now, %FALSE if it was deferred
+ * Since: UNRELEASED
+ */
+gboolean
+eus_client_table_admit (EusClientTable          *self,
+                        SoupServer              *server,
+                        SoupMessage             *msg,
+                        SoupClientContext       *client,
+                        EusClientTableLane       lane,
+                        EusClientTableAdmitFunc  func,
+                        gpointer                 user_data,
+                        GDestroyNotify           user_data_free_func)
+{
+  ClientState *state;
+  DeferredRequest *request;
+
+  g_return_val_if_fail (EUS_IS_CLIENT_TABLE (self), TRUE);
+  g_return_val_if_fail (SOUP_IS_SERVER (server), TRUE);
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), TRUE);
+  g_return_val_if_fail (client != NULL, TRUE);
+  g_return_val_if_fail (lane < N_LANES, TRUE);
+  g_return_val_if_fail (func != NULL, TRUE);
+
+  g_mutex_lock (&self->lock);
+
+  state = g_hash_table_lookup (self->requests, msg);
+
+  /* Requests the table was not told about, and requests which have already
+   * been admitted (for example, by another repository on the same server),
+   * are not limited. */
+  if (state == NULL ||
+      g_hash_table_contains (self->active, msg) ||
+      self->max_requests_per_client == 0 ||
+      state->n_active[lane] < self->max_requests_per_client)
+    {
+      if (state != NULL && !g_hash_table_contains (self->active, msg))
+        {
+          g_hash_table_insert (self->active, msg, GUINT_TO_POINTER (lane + 1));
+          state->n_active[lane]++;
+        }
+
+      g_mutex_unlock (&self->lock);
+
+      if (user_data_free_func != NULL)
+        user_data_free_func (user_data);
+
+      return TRUE;
+    }
+
+  g_debug ("Deferring request from %s in lane %u (%u active, %u deferred)",
+           state->host, (guint) lane, state->n_active[lane],
+           g_queue_get_length (&state->deferred[lane]));
+
+  request = g_new0 (DeferredRequest, 1);
+  request->server = g_object_ref (server);
+  request->context = g_main_context_ref_thread_default ();
+  request->lane = lane;
+  request->msg = g_object_ref (msg);
+  request->client = g_boxed_copy (SOUP_TYPE_CLIENT_CONTEXT, client);
+  request->func = func;
+  request->user_data = user_data;
+  request->user_data_free_func = user_data_free_func;
+  g_queue_push_tail (&state->deferred[lane], request);
+
+  /* Pausing is done with the lock held, so the request cannot be resumed by
+   * another thread before it is paused. */
+  soup_server_pause_message (server, msg);
+
+  g_mutex_unlock (&self->lock);
+
+  return FALSE;
+}
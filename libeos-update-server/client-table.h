@@ -0,0 +1,93 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_CLIENT_TABLE eus_client_table_get_type ()
+G_DECLARE_FINAL_TYPE (EusClientTable, eus_client_table, EUS, CLIENT_TABLE, GObject)
+
+/**
+ * EusClientTableLane:
+ * @EUS_CLIENT_TABLE_LANE_METADATA: requests for the metadata a client needs to
+ *    work out what to pull, such as refs, summaries, commits and directory
+ *    metadata
+ * @EUS_CLIENT_TABLE_LANE_BULK: requests for bulk file data (see
+ *    eus_route_is_bulk())
+ *
+ * Lane which a request is admitted in. Each lane has its own concurrency
+ * limit, so metadata requests never wait behind a client’s bulk downloads.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_CLIENT_TABLE_LANE_METADATA,
+  EUS_CLIENT_TABLE_LANE_BULK,
+} EusClientTableLane;
+
+/**
+ * EusClientTableAdmitFunc:
+ * @msg: the deferred request
+ * @client: the client which sent @msg
+ * @user_data: data passed to eus_client_table_admit()
+ *
+ * Called to handle a request which eus_client_table_admit() deferred, once
+ * its client is below its concurrency limit again. The request has been
+ * unpaused, and the function must either respond to it or pause it again.
+ *
+ * Since: UNRELEASED
+ */
+typedef void (*EusClientTableAdmitFunc) (SoupMessage       *msg,
+                                         SoupClientContext *client,
+                                         gpointer           user_data);
+
+EusClientTable *eus_client_table_new (guint max_requests_per_client);
+
+guint eus_client_table_get_max_requests_per_client (EusClientTable *self);
+guint eus_client_table_get_n_clients (EusClientTable *self);
+guint eus_client_table_get_n_requests (EusClientTable *self);
+guint eus_client_table_get_n_client_requests (EusClientTable    *self,
+                                              SoupClientContext *client);
+
+void eus_client_table_request_started (EusClientTable    *self,
+                                       SoupMessage       *msg,
+                                       SoupClientContext *client);
+void eus_client_table_request_finished (EusClientTable    *self,
+                                        SoupMessage       *msg,
+                                        SoupClientContext *client);
+
+gboolean eus_client_table_admit (EusClientTable          *self,
+                                 SoupServer              *server,
+                                 SoupMessage             *msg,
+                                 SoupClientContext       *client,
+                                 EusClientTableLane       lane,
+                                 EusClientTableAdmitFunc  func,
+                                 gpointer                 user_data,
+                                 GDestroyNotify           user_data_free_func);
+
+G_END_DECLS
@@ -59,6 +59,52 @@ static const gchar *REPOSITORY_GROUP = "Repository ";  /* should be followed by
 static const gchar *PATH_KEY = "Path";
 static const gchar *REMOTE_NAME_KEY = "RemoteName";
 
+static const gchar *SERVER_GROUP = "Server";
+static const gchar *SERVER_THREADS_KEY = "Threads";
+
+static const gchar *CACHE_GROUP = "Cache";
+static const gchar *CACHE_PATH_KEY = "Path";
+static const gchar *CACHE_MAX_SIZE_KEY = "MaxSize";
+static const gchar *CACHE_WARM_UP_KEY = "WarmUp";
+
+static const gchar *COMPRESSION_GROUP = "Compression";
+static const gchar *COMPRESSION_MAX_JOBS_KEY = "MaxJobs";
+static const gchar *COMPRESSION_MAX_MEMORY_KEY = "MaxMemory";
+static const gchar *COMPRESSION_MIN_LEVEL_KEY = "MinLevel";
+static const gchar *COMPRESSION_MAX_LEVEL_KEY = "MaxLevel";
+
+static const gchar *DELTAS_GROUP = "Deltas";
+static const gchar *DELTAS_MAX_SIZE_KEY = "MaxSize";
+static const gchar *DELTAS_ANCESTORS_KEY = "Ancestors";
+
+static const gchar *CLIENTS_GROUP = "Clients";
+static const gchar *CLIENTS_MAX_REQUESTS_KEY = "MaxRequests";
+static const gchar *CLIENTS_MAX_RATE_KEY = "MaxRate";
+static const gchar *CLIENTS_MAX_TOTAL_RATE_KEY = "MaxTotalRate";
+
+static const gchar *ADMISSION_GROUP = "Admission";
+static const gchar *ADMISSION_MAX_PENDING_REQUESTS_KEY = "MaxPendingRequests";
+static const gchar *ADMISSION_MAX_LOAD_KEY = "MaxLoad";
+static const gchar *ADMISSION_RETRY_AFTER_KEY = "RetryAfter";
+
+/* Defaults for the optional server-wide options. */
+static const guint64 DEFAULT_SERVER_THREADS = 0;  /* number of CPUs */
+static const gchar *DEFAULT_CACHE_PATH = LOCALSTATEDIR "/cache/eos-update-server";
+static const guint64 DEFAULT_CACHE_MAX_SIZE = 1024 * 1024 * 1024;  /* 1 GiB */
+static const gboolean DEFAULT_CACHE_WARM_UP = TRUE;
+static const guint64 DEFAULT_COMPRESSION_MAX_JOBS = 0;  /* number of CPUs */
+static const guint64 DEFAULT_COMPRESSION_MAX_MEMORY = 64 * 1024 * 1024;  /* 64 MiB */
+static const guint64 DEFAULT_COMPRESSION_MIN_LEVEL = 1;
+static const guint64 DEFAULT_COMPRESSION_MAX_LEVEL = 2;
+static const guint64 DEFAULT_DELTAS_MAX_SIZE = 2ULL * 1024 * 1024 * 1024;  /* 2 GiB */
+static const guint64 DEFAULT_DELTAS_ANCESTORS = 2;
+static const guint64 DEFAULT_CLIENTS_MAX_REQUESTS = 4;
+static const guint64 DEFAULT_CLIENTS_MAX_RATE = 0;  /* unlimited */
+static const guint64 DEFAULT_CLIENTS_MAX_TOTAL_RATE = 0;  /* unlimited */
+static const guint64 DEFAULT_ADMISSION_MAX_PENDING_REQUESTS = 128;
+static const guint64 DEFAULT_ADMISSION_MAX_LOAD = 200;  /* percent of the processors */
+static const guint64 DEFAULT_ADMISSION_RETRY_AFTER = 30;  /* seconds */
+
 /**
  * eus_repo_config_free:
  * @config: (transfer full): an #EusRepoConfig
@@ -90,6 +136,241 @@ eus_repo_config_new_steal (guint  index,
   return g_steal_pointer (&config);
 }
 
+/**
+ * eus_server_config_free:
+ * @config: (transfer full): an #EusServerConfig
+ *
+ * Free the given @config, which must be non-%NULL.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_server_config_free (EusServerConfig *config)
+{
+  g_free (config->cache_path);
+  g_free (config);
+}
+
+/* Get an optional string option from the config file. If the group or key
+ * doesn’t exist, return a copy of @default_value. */
+static gchar *
+get_optional_string (GKeyFile     *config,
+                     const gchar  *group_name,
+                     const gchar  *key,
+                     const gchar  *default_value,
+                     GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *value = NULL;
+
+  value = g_key_file_get_string (config, group_name, key, &local_error);
+
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    return g_strdup (default_value);
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return NULL;
+    }
+
+  return g_steal_pointer (&value);
+}
+
+/* Get an optional boolean option from the config file. If the group or key
+ * doesn’t exist, return @default_value. */
+static gboolean
+get_optional_boolean (GKeyFile     *config,
+                      const gchar  *group_name,
+                      const gchar  *key,
+                      gboolean      default_value,
+                      gboolean     *out_value,
+                      GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  gboolean value;
+
+  value = g_key_file_get_boolean (config, group_name, key, &local_error);
+
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    {
+      *out_value = default_value;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_value = value;
+  return TRUE;
+}
+
+/* Get an optional unsigned integer option from the config file, checking it
+ * is within [@min, @max]. If the group or key doesn’t exist, return
+ * @default_value. */
+static gboolean
+get_optional_unsigned (GKeyFile     *config,
+                       const gchar  *group_name,
+                       const gchar  *key,
+                       guint64       default_value,
+                       guint64       min,
+                       guint64       max,
+                       guint64      *out_value,
+                       GError      **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *raw_value = NULL;
+  guint64 value;
+
+  raw_value = g_key_file_get_value (config, group_name, key, &local_error);
+
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    {
+      *out_value = default_value;
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  if (!eos_string_to_unsigned (raw_value, 10, min, max, &value, &local_error))
+    {
+      g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                   "Invalid value for %s in group %s: %s",
+                   key, group_name, local_error->message);
+      return FALSE;
+    }
+
+  *out_value = value;
+  return TRUE;
+}
+
+static EusServerConfig *
+read_server_config (GKeyFile  *config,
+                    GError   **error)
+{
+  g_autoptr(EusServerConfig) server_config = NULL;
+  guint64 server_threads;
+  guint64 compression_max_jobs;
+  guint64 compression_min_level, compression_max_level;
+  guint64 deltas_ancestors;
+  guint64 clients_max_requests;
+  guint64 admission_max_pending_requests;
+  guint64 admission_max_load;
+  guint64 admission_retry_after;
+
+  server_config = g_new0 (EusServerConfig, 1);
+
+  if (!get_optional_unsigned (config, SERVER_GROUP, SERVER_THREADS_KEY,
+                              DEFAULT_SERVER_THREADS, 0, 1024,
+                              &server_threads, error))
+    return NULL;
+  server_config->server_threads = server_threads;
+
+  server_config->cache_path = get_optional_string (config, CACHE_GROUP,
+                                                   CACHE_PATH_KEY,
+                                                   DEFAULT_CACHE_PATH,
+                                                   error);
+  if (server_config->cache_path == NULL)
+    return NULL;
+
+  if (!get_optional_unsigned (config, CACHE_GROUP, CACHE_MAX_SIZE_KEY,
+                              DEFAULT_CACHE_MAX_SIZE, 0, G_MAXUINT64,
+                              &server_config->cache_max_size, error))
+    return NULL;
+
+  if (!get_optional_boolean (config, CACHE_GROUP, CACHE_WARM_UP_KEY,
+                             DEFAULT_CACHE_WARM_UP,
+                             &server_config->cache_warm_up, error))
+    return NULL;
+
+  if (!get_optional_unsigned (config, COMPRESSION_GROUP,
+                              COMPRESSION_MAX_JOBS_KEY,
+                              DEFAULT_COMPRESSION_MAX_JOBS, 0, G_MAXUINT,
+                              &compression_max_jobs, error))
+    return NULL;
+  server_config->compression_max_jobs = compression_max_jobs;
+
+  if (!get_optional_unsigned (config, COMPRESSION_GROUP,
+                              COMPRESSION_MAX_MEMORY_KEY,
+                              DEFAULT_COMPRESSION_MAX_MEMORY, 0, G_MAXUINT64,
+                              &server_config->compression_max_memory, error))
+    return NULL;
+
+  if (!get_optional_unsigned (config, COMPRESSION_GROUP,
+                              COMPRESSION_MIN_LEVEL_KEY,
+                              DEFAULT_COMPRESSION_MIN_LEVEL, 0, 9,
+                              &compression_min_level, error))
+    return NULL;
+  server_config->compression_min_level = compression_min_level;
+
+  /* The maximum level must be at least the minimum level. */
+  if (!get_optional_unsigned (config, COMPRESSION_GROUP,
+                              COMPRESSION_MAX_LEVEL_KEY,
+                              MAX (DEFAULT_COMPRESSION_MAX_LEVEL, compression_min_level),
+                              compression_min_level, 9,
+                              &compression_max_level, error))
+    return NULL;
+  server_config->compression_max_level = compression_max_level;
+
+  if (!get_optional_unsigned (config, DELTAS_GROUP, DELTAS_MAX_SIZE_KEY,
+                              DEFAULT_DELTAS_MAX_SIZE, 0, G_MAXUINT64,
+                              &server_config->deltas_max_size, error))
+    return NULL;
+
+  if (!get_optional_unsigned (config, DELTAS_GROUP, DELTAS_ANCESTORS_KEY,
+                              DEFAULT_DELTAS_ANCESTORS, 0, G_MAXUINT,
+                              &deltas_ancestors, error))
+    return NULL;
+  server_config->deltas_ancestors = deltas_ancestors;
+
+  if (!get_optional_unsigned (config, CLIENTS_GROUP, CLIENTS_MAX_REQUESTS_KEY,
+                              DEFAULT_CLIENTS_MAX_REQUESTS, 0, G_MAXUINT,
+                              &clients_max_requests, error))
+    return NULL;
+  server_config->clients_max_requests = clients_max_requests;
+
+  if (!get_optional_unsigned (config, CLIENTS_GROUP, CLIENTS_MAX_RATE_KEY,
+                              DEFAULT_CLIENTS_MAX_RATE, 0, G_MAXUINT64,
+                              &server_config->clients_max_rate, error))
+    return NULL;
+
+  if (!get_optional_unsigned (config, CLIENTS_GROUP,
+                              CLIENTS_MAX_TOTAL_RATE_KEY,
+                              DEFAULT_CLIENTS_MAX_TOTAL_RATE, 0, G_MAXUINT64,
+                              &server_config->clients_max_total_rate, error))
+    return NULL;
+
+  if (!get_optional_unsigned (config, ADMISSION_GROUP,
+                              ADMISSION_MAX_PENDING_REQUESTS_KEY,
+                              DEFAULT_ADMISSION_MAX_PENDING_REQUESTS,
+                              0, G_MAXUINT,
+                              &admission_max_pending_requests, error))
+    return NULL;
+  server_config->admission_max_pending_requests = admission_max_pending_requests;
+
+  if (!get_optional_unsigned (config, ADMISSION_GROUP, ADMISSION_MAX_LOAD_KEY,
+                              DEFAULT_ADMISSION_MAX_LOAD, 0, G_MAXUINT,
+                              &admission_max_load, error))
+    return NULL;
+  server_config->admission_max_load = admission_max_load;
+
+  if (!get_optional_unsigned (config, ADMISSION_GROUP,
+                              ADMISSION_RETRY_AFTER_KEY,
+                              DEFAULT_ADMISSION_RETRY_AFTER, 0, G_MAXUINT / 2,
+                              &admission_retry_after, error))
+    return NULL;
+  server_config->admission_retry_after = admission_retry_after;
+
+  return g_steal_pointer (&server_config);
+}
+
 static gboolean
 repository_configs_contains_index (GPtrArray *repository_configs,
                                    guint16    idx)
@@ -116,6 +397,8 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  * @out_repository_configs: (out callee-allocates) (transfer container)
  *    (element-type EusRepoConfig) (optional): return location for the
  *    `[Repository 0–65535]` sections
+ * @out_server_config: (out callee-allocates) (transfer full) (optional):
+ *    return location for the server-wide tuning options
  * @error: return location for a #GError, or %NULL
  *
  * Find and load the `eos-update-server.conf` configuration file. If
@@ -124,7 +407,7 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)).
  *
  * The configuration values loaded from the file will be returned in
- * @out_advertise_updates and @out_repository_configs. See
+ * @out_advertise_updates, @out_repository_configs and @out_server_config. See
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)) for the
  * semantics of the options.
  *
@@ -135,10 +418,11 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  * Since: UNRELEASED
  */
 gboolean
-eus_read_config_file (const gchar  *config_file_path,
-                      gboolean     *out_advertise_updates,
-                      GPtrArray   **out_repository_configs,
-                      GError      **error)
+eus_read_config_file (const gchar      *config_file_path,
+                      gboolean         *out_advertise_updates,
+                      GPtrArray       **out_repository_configs,
+                      EusServerConfig **out_server_config,
+                      GError          **error)
 {
   g_autoptr(GKeyFile) config = NULL;
   g_autoptr(GError) local_error = NULL;
@@ -158,6 +442,7 @@ eus_read_config_file (const gchar  *config_file_path,
   gsize n_groups, i;
   gboolean advertise_updates;
   g_autoptr(GPtrArray) repository_configs = NULL;
+  g_autoptr(EusServerConfig) server_config = NULL;
 
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
@@ -228,11 +513,17 @@ eus_read_config_file (const gchar  *config_file_path,
                                                   g_steal_pointer (&remote_name)));
     }
 
+  server_config = read_server_config (config, error);
+  if (server_config == NULL)
+    return FALSE;
+
   /* Success. */
   if (out_advertise_updates != NULL)
     *out_advertise_updates = advertise_updates;
   if (out_repository_configs != NULL)
     *out_repository_configs = g_steal_pointer (&repository_configs);
+  if (out_server_config != NULL)
+    *out_server_config = g_steal_pointer (&server_config);
 
   return TRUE;
 }
@@ -56,9 +56,77 @@ void eus_repo_config_free (EusRepoConfig *config);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EusRepoConfig, eus_repo_config_free)
 
-gboolean eus_read_config_file (const gchar  *config_file_path,
-                               gboolean     *out_advertise_updates,
-                               GPtrArray   **out_repository_configs,
-                               GError      **error);
+/**
+ * EusServerConfig:
+ * @server_threads: value of the `Threads=` option in the `[Server]` section;
+ *    0 means the number of processors
+ * @cache_path: value of the `Path=` option in the `[Cache]` section
+ * @cache_max_size: value of the `MaxSize=` option in the `[Cache]` section,
+ *    in bytes; 0 means the cache is disabled
+ * @cache_warm_up: value of the `WarmUp=` option in the `[Cache]` section
+ * @compression_max_jobs: value of the `MaxJobs=` option in the `[Compression]`
+ *    section; 0 means the number of processors
+ * @compression_max_memory: value of the `MaxMemory=` option in the
+ *    `[Compression]` section, in bytes; 0 means unlimited
+ * @compression_min_level: value of the `MinLevel=` option in the
+ *    `[Compression]` section
+ * @compression_max_level: value of the `MaxLevel=` option in the
+ *    `[Compression]` section; always at least @compression_min_level
+ * @deltas_max_size: value of the `MaxSize=` option in the `[Deltas]` section,
+ *    in bytes; 0 means static deltas are not generated
+ * @deltas_ancestors: value of the `Ancestors=` option in the `[Deltas]`
+ *    section
+ * @clients_max_requests: value of the `MaxRequests=` option in the
+ *    `[Clients]` section; 0 means unlimited
+ * @clients_max_rate: value of the `MaxRate=` option in the `[Clients]`
+ *    section, in bytes per second; 0 means unlimited
+ * @clients_max_total_rate: value of the `MaxTotalRate=` option in the
+ *    `[Clients]` section, in bytes per second; 0 means unlimited
+ * @admission_max_pending_requests: value of the `MaxPendingRequests=` option
+ *    in the `[Admission]` section; 0 means unlimited
+ * @admission_max_load: value of the `MaxLoad=` option in the `[Admission]`
+ *    section, as a percentage of the number of processors; 0 means the load
+ *    is not checked
+ * @admission_retry_after: value of the `RetryAfter=` option in the
+ *    `[Admission]` section, in seconds
+ *
+ * Structure containing the server-wide tuning options loaded from the config
+ * file. All of the options are optional in the file; if they are not present,
+ * their defaults are used.
+ *
+ * For more information about the config options, see the
+ * [`eos-update-server.conf(5)` man page](man:eos-update-server.conf(5)).
+ *
+ * Since: UNRELEASED
+ */
+typedef struct
+{
+  guint server_threads;
+  gchar *cache_path;
+  guint64 cache_max_size;
+  gboolean cache_warm_up;
+  guint compression_max_jobs;
+  guint64 compression_max_memory;
+  guint compression_min_level;
+  guint compression_max_level;
+  guint64 deltas_max_size;
+  guint deltas_ancestors;
+  guint clients_max_requests;
+  guint64 clients_max_rate;
+  guint64 clients_max_total_rate;
+  guint admission_max_pending_requests;
+  guint admission_max_load;
+  guint admission_retry_after;
+} EusServerConfig;
+
+void eus_server_config_free (EusServerConfig *config);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EusServerConfig, eus_server_config_free)
+
+gboolean eus_read_config_file (const gchar      *config_file_path,
+                               gboolean         *out_advertise_updates,
+                               GPtrArray       **out_repository_configs,
+                               EusServerConfig **out_server_config,
+                               GError          **error);
 
 G_END_DECLS
@@ -0,0 +1,446 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/deflate-stream.h>
+#include <libeos-update-server/metrics.h>
+#include <string.h>
+#include <zlib.h>
+
+/**
+ * SECTION:deflate-stream
+ * @title: Parallel deflate stream
+ * @short_description: Input stream which deflates another one on many cores
+ * @include: libeos-update-server/deflate-stream.h
+ *
+ * An input stream which returns a raw deflate stream of the contents of its
+ * base stream, optionally preceded by some uncompressed prefix bytes.
+ *
+ * Like pigz, the input is split into fixed-size blocks which are compressed
+ * concurrently in a shared pool of threads, one per processor. Each block is
+ * compressed with the 32 KiB of input before it as a preset dictionary, so
+ * the compression ratio is close to that of a single stream, and is ended with
+ * a sync flush, so the compressed blocks can simply be concatenated. An empty
+ * final block terminates the stream.
+ *
+ * The output depends only on the input and the compression level, not on the
+ * number of threads, so it is the same every time the same input is
+ * compressed. It is not the same as the output of a single #GZlibCompressor,
+ * though.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Size of the blocks the input is split into. */
+#define BLOCK_SIZE (128 * 1024)
+
+/* Size of the deflate window, which is the most of the preceding input which
+ * can be used as a dictionary. */
+#define DICTIONARY_SIZE (32 * 1024)
+
+/* A final, empty deflate block using the fixed Huffman codes. As each block
+ * ends on a byte boundary after its sync flush, this can be appended to
+ * terminate the stream. */
+static const guint8 final_block[] = { 0x03, 0x00 };
+
+typedef struct
+{
+  EusDeflateStream *stream;  /* (unowned) */
+  gint compression_level;
+
+  guint8 *input;  /* (owned) (nullable) BLOCK_SIZE bytes */
+  gsize input_len;
+  const guint8 *dictionary;  /* (unowned) (nullable) */
+  gsize dictionary_len;
+
+  guint8 *output;  /* (owned) (nullable) */
+  gsize output_size;
+  gsize output_len;
+  gboolean failed;
+} Block;
+
+/**
+ * EusDeflateStream:
+ *
+ * An input stream which deflates its base stream in parallel.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusDeflateStream
+{
+  GInputStream parent_instance;
+
+  GInputStream *base_stream;  /* (owned) */
+  gint compression_level;
+
+  Block *blocks;  /* (array length=n_blocks) (owned) compressed at once */
+  guint n_blocks;
+  guint8 *dictionary;  /* (owned) tail of the input before the current blocks */
+  gsize dictionary_len;
+
+  GByteArray *pending;  /* (owned) output not yet returned by a read */
+  gsize pending_offset;
+  gboolean finished;  /* whether the final block has been added to @pending */
+
+  GMutex lock;
+  GCond cond;  /* signalled when @n_remaining drops to zero */
+  guint n_remaining;  /* blocks still being compressed; protected by @lock */
+};
+
+G_DEFINE_TYPE (EusDeflateStream, eus_deflate_stream, G_TYPE_INPUT_STREAM)
+
+/* CPU time spent in the block pool, in microseconds. */
+G_LOCK_DEFINE_STATIC (cpu_time);
+static gint64 cpu_time = 0;
+
+/* Deflate @block with a sync flush. Called in the block pool. */
+static void
+compress_block_cb (gpointer data,
+                   gpointer user_data)
+{
+  Block *block = data;
+  EusDeflateStream *self = block->stream;
+  z_stream zstream = { 0, };
+  gint ret;
+  gint64 start_cpu_time = eus_get_thread_cpu_time ();
+
+  block->failed = TRUE;
+  block->output_len = 0;
+
+  if (deflateInit2 (&zstream, block->compression_level, Z_DEFLATED,
+                    -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+      if (block->dictionary_len == 0 ||
+          deflateSetDictionary (&zstream, block->dictionary,
+                                block->dictionary_len) == Z_OK)
+        {
+          /* Leave room for the sync flush marker on top of the bound. */
+          gsize bound = deflateBound (&zstream, block->input_len) + 16;
+
+          if (block->output_size < bound)
+            {
+              block->output = g_realloc (block->output, bound);
+              block->output_size = bound;
+            }
+
+          zstream.next_in = block->input;
+          zstream.avail_in = block->input_len;
+
+          do
+            {
+              if (block->output_len == block->output_size)
+                {
+                  block->output_size += BLOCK_SIZE;
+                  block->output = g_realloc (block->output, block->output_size);
+                }
+
+              zstream.next_out = block->output + block->output_len;
+              zstream.avail_out = block->output_size - block->output_len;
+              ret = deflate (&zstream, Z_SYNC_FLUSH);
+              block->output_len = block->output_size - zstream.avail_out;
+            }
+          while (ret == Z_OK &&
+                 (zstream.avail_in > 0 || zstream.avail_out == 0));
+
+          block->failed = (ret != Z_OK || zstream.avail_in > 0);
+        }
+
+      deflateEnd (&zstream);
+    }
+
+  G_LOCK (cpu_time);
+  cpu_time += eus_get_thread_cpu_time () - start_cpu_time;
+  G_UNLOCK (cpu_time);
+
+  g_mutex_lock (&self->lock);
+  if (--self->n_remaining == 0)
+    g_cond_signal (&self->cond);
+  g_mutex_unlock (&self->lock);
+}
+
+/* The pool of threads which blocks are compressed in, shared between all
+ * streams so the number of threads is bounded by the number of processors. */
+static GThreadPool *
+get_block_pool (void)
+{
+  static gsize pool_initialized;
+  static GThreadPool *pool;
+
+  if (g_once_init_enter (&pool_initialized))
+    {
+      pool = g_thread_pool_new (compress_block_cb, NULL,
+                                g_get_num_processors (), FALSE, NULL);
+      g_assert (pool != NULL);
+      g_once_init_leave (&pool_initialized, 1);
+    }
+
+  return pool;
+}
+
+static void
+eus_deflate_stream_init (EusDeflateStream *self)
+{
+  self->pending = g_byte_array_new ();
+  self->dictionary = g_malloc (DICTIONARY_SIZE);
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+}
+
+static void
+eus_deflate_stream_finalize (GObject *object)
+{
+  EusDeflateStream *self = EUS_DEFLATE_STREAM (object);
+  guint i;
+
+  for (i = 0; i < self->n_blocks; i++)
+    {
+      g_free (self->blocks[i].input);
+      g_free (self->blocks[i].output);
+    }
+  g_free (self->blocks);
+  g_free (self->dictionary);
+  g_byte_array_unref (self->pending);
+  g_clear_object (&self->base_stream);
+
+  g_cond_clear (&self->cond);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_deflate_stream_parent_class)->finalize (object);
+}
+
+/* Read and compress the next batch of blocks from the base stream into
+ * @pending, adding the final block if the end of the base stream is
+ * reached. */
+static gboolean
+fill_pending (EusDeflateStream  *self,
+              GCancellable      *cancellable,
+              GError           **error)
+{
+  GThreadPool *pool = get_block_pool ();
+  guint n_filled = 0;
+  gboolean eof = FALSE;
+  guint i;
+
+  g_byte_array_set_size (self->pending, 0);
+  self->pending_offset = 0;
+
+  while (n_filled < self->n_blocks && !eof)
+    {
+      Block *block = &self->blocks[n_filled];
+      gsize bytes_read;
+
+      if (block->input == NULL)
+        block->input = g_malloc (BLOCK_SIZE);
+
+      if (!g_input_stream_read_all (self->base_stream, block->input,
+                                    BLOCK_SIZE, &bytes_read,
+                                    cancellable, error))
+        return FALSE;
+
+      eof = (bytes_read < BLOCK_SIZE);
+      if (bytes_read == 0)
+        break;
+
+      block->input_len = bytes_read;
+
+      /* All blocks but the last are full, so the dictionary for a block
+       * is the end of the one before it. */
+      if (n_filled == 0)
+        {
+          block->dictionary = self->dictionary;
+          block->dictionary_len = self->dictionary_len;
+        }
+      else
+        {
+          block->dictionary = block[-1].input + BLOCK_SIZE - DICTIONARY_SIZE;
+          block->dictionary_len = DICTIONARY_SIZE;
+        }
+
+      n_filled++;
+    }
+
+  if (n_filled > 0)
+    {
+      const Block *last;
+
+      g_mutex_lock (&self->lock);
+      self->n_remaining = n_filled;
+      g_mutex_unlock (&self->lock);
+
+      for (i = 0; i < n_filled; i++)
+        g_thread_pool_push (pool, &self->blocks[i], NULL);
+
+      g_mutex_lock (&self->lock);
+      while (self->n_remaining > 0)
+        g_cond_wait (&self->cond, &self->lock);
+      g_mutex_unlock (&self->lock);
+
+      for (i = 0; i < n_filled; i++)
+        {
+          if (self->blocks[i].failed)
+            {
+              g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   "Failed to compress block");
+              return FALSE;
+            }
+
+          g_byte_array_append (self->pending, self->blocks[i].output,
+                               self->blocks[i].output_len);
+        }
+
+      last = &self->blocks[n_filled - 1];
+      self->dictionary_len = MIN (last->input_len, DICTIONARY_SIZE);
+      memcpy (self->dictionary,
+              last->input + last->input_len - self->dictionary_len,
+              self->dictionary_len);
+    }
+
+  if (eof)
+    {
+      g_byte_array_append (self->pending, final_block, sizeof (final_block));
+      self->finished = TRUE;
+    }
+
+  return TRUE;
+}
+
+static gssize
+eus_deflate_stream_read (GInputStream  *stream,
+                         void          *buffer,
+                         gsize          count,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  EusDeflateStream *self = EUS_DEFLATE_STREAM (stream);
+  gsize n_bytes;
+
+  while (self->pending_offset == self->pending->len)
+    {
+      if (self->finished)
+        return 0;
+      if (!fill_pending (self, cancellable, error))
+        return -1;
+    }
+
+  n_bytes = MIN (count, self->pending->len - self->pending_offset);
+  memcpy (buffer, self->pending->data + self->pending_offset, n_bytes);
+  self->pending_offset += n_bytes;
+
+  return n_bytes;
+}
+
+static gboolean
+eus_deflate_stream_close (GInputStream  *stream,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+  EusDeflateStream *self = EUS_DEFLATE_STREAM (stream);
+
+  return g_input_stream_close (self->base_stream, cancellable, error);
+}
+
+static void
+eus_deflate_stream_class_init (EusDeflateStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = eus_deflate_stream_finalize;
+
+  stream_class->read_fn = eus_deflate_stream_read;
+  stream_class->close_fn = eus_deflate_stream_close;
+}
+
+/**
+ * eus_deflate_stream_new:
+ * @base_stream: stream to compress
+ * @prefix: (nullable): bytes to return uncompressed before the compressed
+ *    contents of @base_stream
+ * @compression_level: zlib compression level, from 0 to 9
+ *
+ * Create a new #EusDeflateStream which returns @prefix followed by a raw
+ * deflate stream (with no zlib or gzip header) of the contents of
+ * @base_stream. Closing the new stream closes @base_stream.
+ *
+ * Reads from the new stream block while the blocks are compressed, so should
+ * be done in a worker thread.
+ *
+ * Returns: (transfer full): a new #EusDeflateStream
+ * Since: UNRELEASED
+ */
+GInputStream *
+eus_deflate_stream_new (GInputStream *base_stream,
+                        GBytes       *prefix,
+                        gint          compression_level)
+{
+  EusDeflateStream *self;
+  guint i;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base_stream), NULL);
+  g_return_val_if_fail (compression_level >= 0 && compression_level <= 9, NULL);
+
+  self = g_object_new (EUS_TYPE_DEFLATE_STREAM, NULL);
+  self->base_stream = g_object_ref (base_stream);
+  self->compression_level = compression_level;
+
+  self->n_blocks = MAX (g_get_num_processors (), 1);
+  self->blocks = g_new0 (Block, self->n_blocks);
+  for (i = 0; i < self->n_blocks; i++)
+    {
+      self->blocks[i].stream = self;
+      self->blocks[i].compression_level = compression_level;
+    }
+
+  if (prefix != NULL)
+    {
+      gsize prefix_len;
+      const guint8 *prefix_data = g_bytes_get_data (prefix, &prefix_len);
+
+      g_byte_array_append (self->pending, prefix_data, prefix_len);
+    }
+
+  return G_INPUT_STREAM (self);
+}
+
+/**
+ * eus_deflate_stream_get_cpu_time:
+ *
+ * Get the CPU time spent compressing blocks so far, by all the
+ * #EusDeflateStreams in the process. The time spent in the threads which read
+ * from the streams is not included.
+ *
+ * Returns: CPU time, in microseconds
+ * Since: UNRELEASED
+ */
+gint64
+eus_deflate_stream_get_cpu_time (void)
+{
+  gint64 result;
+
+  G_LOCK (cpu_time);
+  result = cpu_time;
+  G_UNLOCK (cpu_time);
+
+  return result;
+}
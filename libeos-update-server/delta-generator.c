@@ -0,0 +1,949 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <libeos-update-server/delta-generator.h>
+#include <ostree.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+/**
+ * SECTION:delta-generator
+ * @title: Static delta generator
+ * @short_description: Background generation of static deltas
+ * @include: libeos-update-server/delta-generator.h
+ *
+ * Generates static deltas between pairs of commits in a repository, in the
+ * background, so that clients can pull an update as a few large delta parts
+ * rather than as thousands of individual objects.
+ *
+ * The repository itself is never modified: each delta is written, with its
+ * parts inlined into its superblock, as a single file in
+ * #EusDeltaGenerator:cache-path, which #EusRepo serves for requests for the
+ * delta’s superblock. See eus_delta_generator_build_cached_path().
+ *
+ * Only the deltas which are queued explicitly with
+ * eus_delta_generator_queue() are generated; eus_delta_generator_queue_for_path()
+ * only requeues one of those, so clients cannot make the server generate
+ * deltas between arbitrary commits.
+ *
+ * Deltas are generated one at a time, in a thread at the lowest CPU priority,
+ * so generation does not compete with serving requests. The sizes of the
+ * generated deltas are tracked as they are generated, and the oldest are
+ * deleted to keep the total within #EusDeltaGenerator:max-size bytes.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Maximum number of deltas to have queued at once. Further requests are
+ * dropped. */
+#define MAX_QUEUED_DELTAS 16
+
+/* Maximum number of delta requests to remember, so that deltas which could
+ * not be generated are not tried again for every request. The table is
+ * emptied when it fills up. */
+#define MAX_REQUESTED_DELTAS 1024
+
+/* Length of a checksum in modified base64. */
+#define B64_CHECKSUM_LEN 43
+
+/* Length of the name of a file in the cache: `$from-$to`, in hex. */
+#define CACHED_NAME_LEN (2 * 64 + 1)
+
+typedef struct
+{
+  gchar *from;  /* (owned) */
+  gchar *to;  /* (owned) */
+} DeltaJob;
+
+static void
+delta_job_free (DeltaJob *job)
+{
+  g_free (job->from);
+  g_free (job->to);
+  g_free (job);
+}
+
+/* A delta in the cache. */
+typedef struct
+{
+  gchar *key;  /* (owned) from-to pair; key in the entries table */
+  guint64 size;
+  gint64 mtime;  /* only used to order entries when loading the cache */
+} DeltaEntry;
+
+static void
+delta_entry_free (DeltaEntry *entry)
+{
+  g_free (entry->key);
+  g_free (entry);
+}
+
+typedef struct
+{
+  OstreeRepo *repo;  /* (owned) */
+  DeltaJob *job;  /* (owned) */
+  gchar *output_path;  /* (owned) */
+
+  gboolean generated;  /* set on success if a new delta was written */
+  guint64 size;  /* size of the new delta */
+} GenerateData;
+
+static void
+generate_data_free (GenerateData *data)
+{
+  g_clear_object (&data->repo);
+  g_clear_pointer (&data->job, delta_job_free);
+  g_free (data->output_path);
+  g_free (data);
+}
+
+/**
+ * EusDeltaGenerator:
+ *
+ * A queue of static deltas to generate in the background.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusDeltaGenerator
+{
+  GObject parent_instance;
+
+  OstreeRepo *repo;  /* (owned) */
+  gchar *cache_path;  /* (owned) (not nullable) */
+  guint64 max_size;
+
+  GHashTable *entries;  /* (owned) (element-type utf8 DeltaEntry) cached deltas */
+  GQueue oldest;  /* (element-type DeltaEntry) oldest first */
+  guint64 total_size;
+
+  GQueue queue;  /* (element-type DeltaJob) (owned) */
+  GHashTable *allowed;  /* (owned) (element-type utf8 utf8) set of from-to pairs */
+  GHashTable *requested;  /* (owned) (element-type utf8 utf8) set of from-to pairs */
+  GCancellable *cancellable;  /* (owned) (nullable) for the running job */
+  gboolean running;
+  gboolean cancelled;
+};
+
+G_DEFINE_TYPE (EusDeltaGenerator, eus_delta_generator, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_REPO = 1,
+  PROP_CACHE_PATH,
+  PROP_MAX_SIZE,
+  PROP_N_PENDING,
+} EusDeltaGeneratorProperty;
+
+static GParamSpec *props[PROP_N_PENDING + 1] = { NULL, };
+
+static void
+eus_delta_generator_init (EusDeltaGenerator *self)
+{
+  g_queue_init (&self->queue);
+  g_queue_init (&self->oldest);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) delta_entry_free);
+  self->allowed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->requested = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+eus_delta_generator_get_property (GObject    *object,
+                                  guint       property_id,
+                                  GValue     *value,
+                                  GParamSpec *spec)
+{
+  EusDeltaGenerator *self = EUS_DELTA_GENERATOR (object);
+
+  switch ((EusDeltaGeneratorProperty) property_id)
+    {
+    case PROP_REPO:
+      g_value_set_object (value, self->repo);
+      break;
+
+    case PROP_CACHE_PATH:
+      g_value_set_string (value, self->cache_path);
+      break;
+
+    case PROP_MAX_SIZE:
+      g_value_set_uint64 (value, self->max_size);
+      break;
+
+    case PROP_N_PENDING:
+      g_value_set_uint (value, eus_delta_generator_get_n_pending (self));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_delta_generator_set_property (GObject      *object,
+                                  guint         property_id,
+                                  const GValue *value,
+                                  GParamSpec   *spec)
+{
+  EusDeltaGenerator *self = EUS_DELTA_GENERATOR (object);
+
+  switch ((EusDeltaGeneratorProperty) property_id)
+    {
+    case PROP_REPO:
+      g_set_object (&self->repo, g_value_get_object (value));
+      break;
+
+    case PROP_CACHE_PATH:
+      g_clear_pointer (&self->cache_path, g_free);
+      self->cache_path = g_value_dup_string (value);
+      break;
+
+    case PROP_MAX_SIZE:
+      self->max_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_N_PENDING:
+      /* Read only. */
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_delta_generator_dispose (GObject *object)
+{
+  EusDeltaGenerator *self = EUS_DELTA_GENERATOR (object);
+
+  /* A running job holds a reference, so there can’t be one now. */
+  g_assert (!self->running);
+
+  g_queue_foreach (&self->queue, (GFunc) delta_job_free, NULL);
+  g_queue_clear (&self->queue);
+  g_queue_clear (&self->oldest);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+  g_clear_pointer (&self->allowed, g_hash_table_unref);
+  g_clear_pointer (&self->requested, g_hash_table_unref);
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->repo);
+
+  G_OBJECT_CLASS (eus_delta_generator_parent_class)->dispose (object);
+}
+
+static void
+eus_delta_generator_finalize (GObject *object)
+{
+  EusDeltaGenerator *self = EUS_DELTA_GENERATOR (object);
+
+  g_free (self->cache_path);
+
+  G_OBJECT_CLASS (eus_delta_generator_parent_class)->finalize (object);
+}
+
+static void
+add_entry (EusDeltaGenerator *self,
+           const gchar       *key,
+           guint64            size,
+           gint64             mtime)
+{
+  DeltaEntry *entry;
+
+  entry = g_new0 (DeltaEntry, 1);
+  entry->key = g_strdup (key);
+  entry->size = size;
+  entry->mtime = mtime;
+
+  g_hash_table_replace (self->entries, entry->key, entry);
+  g_queue_push_tail (&self->oldest, entry);
+  self->total_size += size;
+}
+
+/* Delete the oldest cached deltas until the cache is within its size
+ * limit. */
+static void
+evict (EusDeltaGenerator *self)
+{
+  while (self->total_size > self->max_size && !g_queue_is_empty (&self->oldest))
+    {
+      DeltaEntry *entry = g_queue_pop_head (&self->oldest);
+      g_autofree gchar *path = g_build_filename (self->cache_path, entry->key, NULL);
+
+      g_debug ("%s: Deleting static delta %s (%" G_GUINT64_FORMAT " bytes)",
+               G_STRFUNC, entry->key, entry->size);
+
+      if (g_unlink (path) != 0)
+        g_debug ("%s: Failed to delete ‘%s’: %s", G_STRFUNC, path,
+                 g_strerror (errno));
+
+      /* Allow it to be generated again if a client asks for it. */
+      g_hash_table_remove (self->requested, entry->key);
+
+      self->total_size -= entry->size;
+      g_hash_table_remove (self->entries, entry->key);
+    }
+}
+
+static gint
+compare_entries_by_mtime (gconstpointer a,
+                          gconstpointer b,
+                          gpointer      user_data)
+{
+  const DeltaEntry *entry_a = a;
+  const DeltaEntry *entry_b = b;
+
+  /* Oldest first. */
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+  else if (entry_a->mtime > entry_b->mtime)
+    return 1;
+  else
+    return 0;
+}
+
+/* Whether @name is a `$from-$to` pair of checksums. */
+static gboolean
+is_delta_key (const gchar *name)
+{
+  gsize len = strlen (name);
+  g_autofree gchar *from = NULL;
+
+  if (len != CACHED_NAME_LEN || name[64] != '-')
+    return FALSE;
+
+  from = g_strndup (name, 64);
+
+  return (ostree_validate_checksum_string (from, NULL) &&
+          ostree_validate_checksum_string (name + 65, NULL));
+}
+
+/* Load the index of the deltas generated by a previous instance of the
+ * server. This is the only time the cache directory is scanned; afterwards
+ * the index is kept up to date as deltas are generated and deleted. */
+static void
+load_entries (EusDeltaGenerator *self)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *name;
+
+  if (g_mkdir_with_parents (self->cache_path, 0755) != 0)
+    {
+      g_message ("Failed to create static delta cache ‘%s’: %s",
+                 self->cache_path, g_strerror (errno));
+      return;
+    }
+
+  dir = g_dir_open (self->cache_path, 0, &error);
+  if (dir == NULL)
+    {
+      g_message ("Failed to open static delta cache ‘%s’: %s",
+                 self->cache_path, error->message);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (self->cache_path, name, NULL);
+      GStatBuf stat_buf;
+
+      /* Clean up temporary files left behind by an instance of the server
+       * which exited while generating a delta. */
+      if (name[0] == '.')
+        {
+          g_unlink (path);
+          continue;
+        }
+
+      if (!is_delta_key (name) ||
+          g_stat (path, &stat_buf) != 0 ||
+          !S_ISREG (stat_buf.st_mode))
+        continue;
+
+      add_entry (self, name, stat_buf.st_size, stat_buf.st_mtime);
+    }
+
+  g_queue_sort (&self->oldest, compare_entries_by_mtime, NULL);
+  evict (self);
+
+  g_debug ("%s: Loaded %u static deltas (%" G_GUINT64_FORMAT " bytes) from ‘%s’",
+           G_STRFUNC, g_hash_table_size (self->entries), self->total_size,
+           self->cache_path);
+}
+
+static void
+eus_delta_generator_constructed (GObject *object)
+{
+  EusDeltaGenerator *self = EUS_DELTA_GENERATOR (object);
+
+  G_OBJECT_CLASS (eus_delta_generator_parent_class)->constructed (object);
+
+  g_assert (self->cache_path != NULL);
+
+  load_entries (self);
+}
+
+static void
+eus_delta_generator_class_init (EusDeltaGeneratorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = eus_delta_generator_constructed;
+  object_class->dispose = eus_delta_generator_dispose;
+  object_class->finalize = eus_delta_generator_finalize;
+  object_class->get_property = eus_delta_generator_get_property;
+  object_class->set_property = eus_delta_generator_set_property;
+
+  /**
+   * EusDeltaGenerator:repo:
+   *
+   * Repository to generate static deltas in.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_REPO] = g_param_spec_object ("repo",
+                                          "Repo",
+                                          "Repository to generate static deltas in.",
+                                          OSTREE_TYPE_REPO,
+                                          G_PARAM_READWRITE |
+                                          G_PARAM_CONSTRUCT_ONLY |
+                                          G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusDeltaGenerator:cache-path:
+   *
+   * Path to the directory to write the generated deltas to. It will be
+   * created if it does not exist. Deltas generated by a previous instance
+   * with the same path are kept, and count towards
+   * #EusDeltaGenerator:max-size.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CACHE_PATH] = g_param_spec_string ("cache-path",
+                                                "Cache Path",
+                                                "Path to the directory to write the generated deltas to.",
+                                                NULL,
+                                                G_PARAM_READWRITE |
+                                                G_PARAM_CONSTRUCT_ONLY |
+                                                G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusDeltaGenerator:max-size:
+   *
+   * Size in bytes which the generated deltas may take up. The oldest are
+   * deleted to make room for new ones. Deltas which were pulled into the
+   * repository do not count towards it.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_SIZE] = g_param_spec_uint64 ("max-size",
+                                              "Max Size",
+                                              "Size in bytes which the generated deltas may take up.",
+                                              0, G_MAXUINT64, 0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusDeltaGenerator:n-pending:
+   *
+   * Number of deltas which are queued or being generated.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_N_PENDING] = g_param_spec_uint ("n-pending",
+                                             "Pending Deltas",
+                                             "Number of deltas which are queued or being generated.",
+                                             0, G_MAXUINT, 0,
+                                             G_PARAM_READABLE |
+                                             G_PARAM_EXPLICIT_NOTIFY |
+                                             G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/* Build the path of the superblock of the delta between @from and @to,
+ * relative to the root of the repository. This matches the layout ostree
+ * uses: `deltas/$from[0:2]/$from[2:]-$to/superblock`, with both checksums in
+ * modified base64. */
+static gchar *
+build_superblock_path (const gchar *from,
+                       const gchar *to)
+{
+  guchar from_bytes[OSTREE_SHA256_DIGEST_LEN], to_bytes[OSTREE_SHA256_DIGEST_LEN];
+  g_autofree gchar *from_b64 = NULL;
+  g_autofree gchar *to_b64 = NULL;
+
+  ostree_checksum_inplace_to_bytes (from, from_bytes);
+  ostree_checksum_inplace_to_bytes (to, to_bytes);
+  from_b64 = ostree_checksum_b64_from_bytes (from_bytes);
+  to_b64 = ostree_checksum_b64_from_bytes (to_bytes);
+
+  return g_strdup_printf ("deltas/%.2s/%s-%s/superblock",
+                          from_b64, from_b64 + 2, to_b64);
+}
+
+/* Check that @checksum is a complete commit in @repo, so a delta can be
+ * generated from or to it. */
+static gboolean
+commit_is_complete (OstreeRepo   *repo,
+                    const gchar  *checksum,
+                    GError      **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  OstreeRepoCommitState state;
+
+  if (!ostree_repo_load_commit (repo, checksum, &commit, &state, error))
+    return FALSE;
+
+  if (state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Commit %s is partial", checksum);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+generate_delta (GenerateData  *data,
+                GCancellable  *cancellable,
+                GError       **error)
+{
+  g_autofree gchar *repo_path = g_file_get_path (ostree_repo_get_path (data->repo));
+  g_autofree gchar *relative_path = NULL;
+  g_autofree gchar *superblock_path = NULL;
+  g_auto(GVariantBuilder) builder = { { { 0, } } };
+  g_autoptr(GVariant) params = NULL;
+  GStatBuf stat_buf;
+
+  /* The repository may already have the delta, pulled from upstream. */
+  relative_path = build_superblock_path (data->job->from, data->job->to);
+  superblock_path = g_build_filename (repo_path, relative_path, NULL);
+  if (g_file_test (superblock_path, G_FILE_TEST_EXISTS))
+    return TRUE;
+
+  if (!commit_is_complete (data->repo, data->job->from, error) ||
+      !commit_is_complete (data->repo, data->job->to, error))
+    return FALSE;
+
+  /* Write the delta as a single file, outside the repository. */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "filename",
+                         g_variant_new_bytestring (data->output_path));
+  g_variant_builder_add (&builder, "{sv}", "inline-parts",
+                         g_variant_new_boolean (TRUE));
+  params = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_static_delta_generate (data->repo,
+                                          OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                          data->job->from,
+                                          data->job->to,
+                                          NULL,
+                                          params,
+                                          cancellable,
+                                          error))
+    return FALSE;
+
+  if (g_stat (data->output_path, &stat_buf) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to query size of ‘%s’: %s",
+                   data->output_path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  data->generated = TRUE;
+  data->size = stat_buf.st_size;
+
+  return TRUE;
+}
+
+static gpointer
+generate_thread_cb (gpointer user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  GenerateData *data = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+
+#ifdef __linux__
+  /* On Linux, this only deprioritises the calling thread, not the whole
+   * process. */
+  if (setpriority (PRIO_PROCESS, 0, 19) != 0)
+    g_debug ("%s: Failed to lower thread priority", G_STRFUNC);
+#endif
+
+  if (generate_delta (data, g_task_get_cancellable (task), &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, g_steal_pointer (&error));
+
+  return NULL;
+}
+
+static void generate_cb (GObject      *source_object,
+                         GAsyncResult *result,
+                         gpointer      user_data);
+
+static void
+maybe_start_next (EusDeltaGenerator *self)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autofree gchar *key = NULL;
+  GenerateData *data;
+
+  if (self->running || self->cancelled || g_queue_is_empty (&self->queue))
+    return;
+
+  data = g_new0 (GenerateData, 1);
+  data->repo = g_object_ref (self->repo);
+  data->job = g_queue_pop_head (&self->queue);
+  key = g_strconcat (data->job->from, "-", data->job->to, NULL);
+  data->output_path = g_build_filename (self->cache_path, key, NULL);
+
+  g_debug ("%s: Generating static delta %s-%s", G_STRFUNC,
+           data->job->from, data->job->to);
+
+  g_clear_object (&self->cancellable);
+  self->cancellable = g_cancellable_new ();
+  self->running = TRUE;
+
+  /* The task has no source object, so the generator is never finalised in the
+   * generation thread; the callback holds a reference to it instead. */
+  task = g_task_new (NULL, self->cancellable, generate_cb, g_object_ref (self));
+  g_task_set_source_tag (task, maybe_start_next);
+  g_task_set_task_data (task, data, (GDestroyNotify) generate_data_free);
+
+  /* Use a dedicated thread, as its priority is lowered. */
+  g_thread_unref (g_thread_new ("delta-generator", generate_thread_cb,
+                                g_steal_pointer (&task)));
+}
+
+static void
+generate_cb (GObject      *source_object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  g_autoptr(EusDeltaGenerator) self = EUS_DELTA_GENERATOR (user_data);
+  GenerateData *data = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) error = NULL;
+
+  if (g_task_propagate_boolean (G_TASK (result), &error))
+    {
+      if (data->generated)
+        {
+          g_autofree gchar *key = g_strconcat (data->job->from, "-",
+                                               data->job->to, NULL);
+
+          g_message ("Generated static delta %s (%" G_GUINT64_FORMAT " bytes)",
+                     key, data->size);
+          add_entry (self, key, data->size, g_get_real_time ());
+          evict (self);
+        }
+    }
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_message ("Not generating static delta %s-%s: %s",
+               data->job->from, data->job->to, error->message);
+
+  self->running = FALSE;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+
+  maybe_start_next (self);
+}
+
+/**
+ * eus_delta_generator_new:
+ * @repo: repository to generate static deltas from
+ * @cache_path: path to the directory to write the deltas to
+ * @max_size: size in bytes which the generated deltas may take up
+ *
+ * Create a new #EusDeltaGenerator, loading the index of any deltas which are
+ * already in @cache_path.
+ *
+ * Returns: (transfer full): a new #EusDeltaGenerator
+ * Since: UNRELEASED
+ */
+EusDeltaGenerator *
+eus_delta_generator_new (OstreeRepo  *repo,
+                         const gchar *cache_path,
+                         guint64      max_size)
+{
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+  g_return_val_if_fail (cache_path != NULL, NULL);
+
+  return g_object_new (EUS_TYPE_DELTA_GENERATOR,
+                       "repo", repo,
+                       "cache-path", cache_path,
+                       "max-size", max_size,
+                       NULL);
+}
+
+/**
+ * eus_delta_generator_get_max_size:
+ * @self: an #EusDeltaGenerator
+ *
+ * Get the value of #EusDeltaGenerator:max-size.
+ *
+ * Returns: maximum size of the generated deltas, in bytes
+ * Since: UNRELEASED
+ */
+guint64
+eus_delta_generator_get_max_size (EusDeltaGenerator *self)
+{
+  g_return_val_if_fail (EUS_IS_DELTA_GENERATOR (self), 0);
+
+  return self->max_size;
+}
+
+/**
+ * eus_delta_generator_get_n_pending:
+ * @self: an #EusDeltaGenerator
+ *
+ * Get the value of #EusDeltaGenerator:n-pending.
+ *
+ * Returns: number of deltas which are queued or being generated
+ * Since: UNRELEASED
+ */
+guint
+eus_delta_generator_get_n_pending (EusDeltaGenerator *self)
+{
+  g_return_val_if_fail (EUS_IS_DELTA_GENERATOR (self), 0);
+
+  return g_queue_get_length (&self->queue) + (self->running ? 1 : 0);
+}
+
+/**
+ * eus_delta_generator_queue:
+ * @self: an #EusDeltaGenerator
+ * @from: checksum of the commit to generate a delta from
+ * @to: checksum of the commit to generate a delta to
+ *
+ * Queue generation of the static delta from @from to @to. Nothing happens if
+ * the delta has already been requested or generated, or too many are queued.
+ * Failures are logged.
+ *
+ * The delta may be requeued later by eus_delta_generator_queue_for_path(),
+ * for example if it is deleted to make room for newer ones.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_delta_generator_queue (EusDeltaGenerator *self,
+                           const gchar       *from,
+                           const gchar       *to)
+{
+  g_autofree gchar *key = NULL;
+  DeltaJob *job;
+
+  g_return_if_fail (EUS_IS_DELTA_GENERATOR (self));
+  g_return_if_fail (ostree_validate_checksum_string (from, NULL));
+  g_return_if_fail (ostree_validate_checksum_string (to, NULL));
+
+  key = g_strconcat (from, "-", to, NULL);
+  if (!g_hash_table_contains (self->allowed, key))
+    g_hash_table_add (self->allowed, g_strdup (key));
+
+  if (self->cancelled || g_queue_get_length (&self->queue) >= MAX_QUEUED_DELTAS)
+    return;
+
+  if (g_hash_table_contains (self->requested, key) ||
+      g_hash_table_contains (self->entries, key))
+    return;
+
+  if (g_hash_table_size (self->requested) >= MAX_REQUESTED_DELTAS)
+    g_hash_table_remove_all (self->requested);
+  g_hash_table_add (self->requested, g_steal_pointer (&key));
+
+  job = g_new0 (DeltaJob, 1);
+  job->from = g_strdup (from);
+  job->to = g_strdup (to);
+  g_queue_push_tail (&self->queue, job);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+
+  maybe_start_next (self);
+}
+
+/* Convert a checksum in modified base64 to hex, or return %NULL if it is
+ * invalid. */
+static gchar *
+checksum_from_b64 (const gchar *b64,
+                   gsize        len)
+{
+  g_autofree gchar *b64_copy = NULL;
+  g_autofree guchar *bytes = NULL;
+  gsize i;
+
+  if (len != B64_CHECKSUM_LEN)
+    return NULL;
+
+  /* Modified base64 uses ‘_’ in place of ‘/’. */
+  for (i = 0; i < len; i++)
+    if (!g_ascii_isalnum (b64[i]) && b64[i] != '+' && b64[i] != '_')
+      return NULL;
+
+  b64_copy = g_strndup (b64, len);
+  bytes = ostree_checksum_b64_to_bytes (b64_copy);
+
+  return ostree_checksum_from_bytes (bytes);
+}
+
+/* Get the `$from-$to` pair of checksums, in hex, of the delta whose
+ * superblock is at @delta_path, or %NULL if it is not the path of a
+ * superblock between two commits. */
+static gchar *
+parse_delta_path (const gchar *delta_path)
+{
+  const gchar *prefix = "/deltas/";
+  const gchar *suffix = "/superblock";
+  const gchar *start, *end, *dash;
+  g_autofree gchar *from_b64 = NULL;
+  g_autofree gchar *from = NULL;
+  g_autofree gchar *to = NULL;
+
+  if (!g_str_has_prefix (delta_path, prefix) ||
+      !g_str_has_suffix (delta_path, suffix))
+    return NULL;
+
+  /* Of the form xx/yyyy-zzzz, where xxyyyy is the from checksum and zzzz the
+   * to checksum. */
+  start = delta_path + strlen (prefix);
+  end = delta_path + strlen (delta_path) - strlen (suffix);
+  dash = memchr (start, '-', end - start);
+  if (end - start < 3 || start[2] != '/' || dash == NULL)
+    return NULL;
+
+  from_b64 = g_strdup_printf ("%.2s%.*s", start, (gint) (dash - start - 3), start + 3);
+  from = checksum_from_b64 (from_b64, strlen (from_b64));
+  to = checksum_from_b64 (dash + 1, end - dash - 1);
+  if (from == NULL || to == NULL)
+    return NULL;
+
+  return g_strconcat (from, "-", to, NULL);
+}
+
+/**
+ * eus_delta_generator_queue_for_path:
+ * @self: an #EusDeltaGenerator
+ * @delta_path: path of a static delta superblock, relative to the root of the
+ *    repository, such as `/deltas/ab/cdef…-ghij…/superblock`
+ *
+ * Queue generation of the static delta whose superblock is at @delta_path, as
+ * with eus_delta_generator_queue(). This is intended to be called when a
+ * client requests a delta which does not exist, so it is available to later
+ * clients. Only deltas which have been passed to eus_delta_generator_queue()
+ * before are generated, so that clients cannot make the server generate
+ * deltas between arbitrary commits.
+ *
+ * Returns: %TRUE if the delta was one of those and has been queued, %FALSE
+ *    otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_delta_generator_queue_for_path (EusDeltaGenerator *self,
+                                    const gchar       *delta_path)
+{
+  g_autofree gchar *key = NULL;
+  g_autofree gchar *from = NULL;
+
+  g_return_val_if_fail (EUS_IS_DELTA_GENERATOR (self), FALSE);
+  g_return_val_if_fail (delta_path != NULL, FALSE);
+
+  key = parse_delta_path (delta_path);
+  if (key == NULL || !g_hash_table_contains (self->allowed, key))
+    return FALSE;
+
+  from = g_strndup (key, 64);
+  eus_delta_generator_queue (self, from, key + 65);
+
+  return TRUE;
+}
+
+/**
+ * eus_delta_generator_build_cached_path:
+ * @cache_path: the #EusDeltaGenerator:cache-path of a generator
+ * @delta_path: path of a static delta superblock, relative to the root of the
+ *    repository, such as `/deltas/ab/cdef…-ghij…/superblock`
+ *
+ * Build the path of the file in @cache_path which a generator writes the
+ * delta whose superblock is at @delta_path to. The delta’s parts are inlined
+ * in the file, so it can be served as the superblock. The file does not
+ * necessarily exist.
+ *
+ * This does not need an #EusDeltaGenerator, so the deltas can be served by
+ * any thread.
+ *
+ * Returns: (transfer full) (nullable): path of the file, or %NULL if
+ *    @delta_path is not the path of a superblock between two commits
+ * Since: UNRELEASED
+ */
+gchar *
+eus_delta_generator_build_cached_path (const gchar *cache_path,
+                                       const gchar *delta_path)
+{
+  g_autofree gchar *key = NULL;
+
+  g_return_val_if_fail (cache_path != NULL, NULL);
+  g_return_val_if_fail (delta_path != NULL, NULL);
+
+  key = parse_delta_path (delta_path);
+  if (key == NULL)
+    return NULL;
+
+  return g_build_filename (cache_path, key, NULL);
+}
+
+/**
+ * eus_delta_generator_cancel:
+ * @self: an #EusDeltaGenerator
+ *
+ * Drop all queued deltas, cancel the one being generated, and ignore any
+ * which are queued later.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_delta_generator_cancel (EusDeltaGenerator *self)
+{
+  g_return_if_fail (EUS_IS_DELTA_GENERATOR (self));
+
+  self->cancelled = TRUE;
+
+  g_queue_foreach (&self->queue, (GFunc) delta_job_free, NULL);
+  g_queue_clear (&self->queue);
+
+  if (self->cancellable != NULL)
+    g_cancellable_cancel (self->cancellable);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+}
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_DELTA_GENERATOR eus_delta_generator_get_type ()
+G_DECLARE_FINAL_TYPE (EusDeltaGenerator, eus_delta_generator, EUS, DELTA_GENERATOR, GObject)
+
+EusDeltaGenerator *eus_delta_generator_new (OstreeRepo  *repo,
+                                            const gchar *cache_path,
+                                            guint64      max_size);
+
+guint64 eus_delta_generator_get_max_size (EusDeltaGenerator *self);
+guint eus_delta_generator_get_n_pending (EusDeltaGenerator *self);
+
+void eus_delta_generator_queue (EusDeltaGenerator *self,
+                                const gchar       *from,
+                                const gchar       *to);
+gboolean eus_delta_generator_queue_for_path (EusDeltaGenerator *self,
+                                             const gchar       *delta_path);
+void eus_delta_generator_cancel (EusDeltaGenerator *self);
+
+gchar *eus_delta_generator_build_cached_path (const gchar *cache_path,
+                                              const gchar *delta_path);
+
+G_END_DECLS
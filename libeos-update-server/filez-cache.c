@@ -0,0 +1,1198 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <libeos-update-server/filez-cache.h>
+#include <libeos-updater-util/util.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * SECTION:filez-cache
+ * @title: Compressed object cache
+ * @short_description: Persistent cache of generated .filez objects
+ * @include: libeos-update-server/filez-cache.h
+ *
+ * An on-disk, content-addressed cache of the archive-z2 streams which
+ * #EusRepo generates from the bare objects in its repository. Compressing an
+ * object is by far the most expensive part of serving it, so the compressed
+ * form is kept around so that every client after the first can be served
+ * straight from disk.
+ *
+ * Entries are keyed by object checksum and compression level, and are stored
+ * as `$path/$level/$checksum[0:2]/$checksum[2:].filez`. The total size of the
+ * entries is kept below #EusFilezCache:max-size by evicting the least recently
+ * used entries. The modification time of each entry is bumped whenever it is
+ * used, so the LRU order is preserved when the cache is reloaded by a later
+ * instance of the server.
+ *
+ * All methods are thread safe.
+ *
+ * Entries are normally written through an #EusFilezCacheStream, which copies
+ * the stream being generated into the cache as it is read. As the stream is
+ * read in a worker thread, so is the cache written, keeping its disk I/O off
+ * the main context.
+ *
+ * Entries are synced to disk before they are renamed into place, so a crash
+ * cannot leave a truncated entry behind. Even so, each entry’s header is
+ * checked when the cache is loaded, and entries which fail the check are
+ * deleted rather than served.
+ *
+ * Since: UNRELEASED
+ */
+
+typedef struct
+{
+  gchar *key;  /* (owned) checksum and compression level; key in the entries table */
+  gchar *checksum;  /* (owned) */
+  gint compression_level;
+  guint64 size;
+  gint64 mtime;  /* only used to order entries when loading the cache */
+  GList link;  /* embedded node of EusFilezCache.lru; data points to this entry */
+} CacheEntry;
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->checksum);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+/**
+ * EusFilezCache:
+ *
+ * A size-limited on-disk cache of compressed objects.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusFilezCache
+{
+  GObject parent_instance;
+
+  gchar *path;  /* (owned) (not nullable) */
+  guint64 max_size;
+
+  GMutex lock;  /* protects all the fields below */
+  GHashTable *entries;  /* (owned) (element-type utf8 CacheEntry) */
+  GHashTable *levels;  /* (owned) (element-type utf8 guint) checksum to bitmask of cached levels */
+  GQueue lru;  /* (element-type CacheEntry) most recently used first */
+  guint64 total_size;
+};
+
+static void eus_filez_cache_initable_iface_init (GInitableIface *initable_iface);
+
+G_DEFINE_TYPE_WITH_CODE (EusFilezCache, eus_filez_cache, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE,
+                                                eus_filez_cache_initable_iface_init))
+
+typedef enum
+{
+  PROP_PATH = 1,
+  PROP_MAX_SIZE,
+} EusFilezCacheProperty;
+
+static GParamSpec *props[PROP_MAX_SIZE + 1] = { NULL, };
+
+static void
+eus_filez_cache_init (EusFilezCache *self)
+{
+  g_mutex_init (&self->lock);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) cache_entry_free);
+  self->levels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_queue_init (&self->lru);
+}
+
+static void
+eus_filez_cache_get_property (GObject    *object,
+                              guint       property_id,
+                              GValue     *value,
+                              GParamSpec *spec)
+{
+  EusFilezCache *self = EUS_FILEZ_CACHE (object);
+
+  switch ((EusFilezCacheProperty) property_id)
+    {
+    case PROP_PATH:
+      g_value_set_string (value, self->path);
+      break;
+
+    case PROP_MAX_SIZE:
+      g_value_set_uint64 (value, self->max_size);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_filez_cache_set_property (GObject      *object,
+                              guint         property_id,
+                              const GValue *value,
+                              GParamSpec   *spec)
+{
+  EusFilezCache *self = EUS_FILEZ_CACHE (object);
+
+  switch ((EusFilezCacheProperty) property_id)
+    {
+    case PROP_PATH:
+      g_clear_pointer (&self->path, g_free);
+      self->path = g_value_dup_string (value);
+      break;
+
+    case PROP_MAX_SIZE:
+      self->max_size = g_value_get_uint64 (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_filez_cache_finalize (GObject *object)
+{
+  EusFilezCache *self = EUS_FILEZ_CACHE (object);
+
+  /* The queue links are embedded in the entries, so they are freed along with
+   * the hash table. */
+  g_queue_init (&self->lru);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+  g_clear_pointer (&self->levels, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+  g_free (self->path);
+
+  G_OBJECT_CLASS (eus_filez_cache_parent_class)->finalize (object);
+}
+
+static void
+eus_filez_cache_class_init (EusFilezCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eus_filez_cache_finalize;
+  object_class->get_property = eus_filez_cache_get_property;
+  object_class->set_property = eus_filez_cache_set_property;
+
+  /**
+   * EusFilezCache:path:
+   *
+   * Path to the directory to store the cache in. It will be created if it
+   * does not exist.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_PATH] = g_param_spec_string ("path",
+                                          "Path",
+                                          "Path to the directory to store the cache in.",
+                                          NULL,
+                                          G_PARAM_READWRITE |
+                                          G_PARAM_CONSTRUCT_ONLY |
+                                          G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusFilezCache:max-size:
+   *
+   * Maximum total size of the cache entries, in bytes. Entries larger than
+   * this are never cached.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_SIZE] = g_param_spec_uint64 ("max-size",
+                                              "Max Size",
+                                              "Maximum total size of the cache entries, in bytes.",
+                                              0,
+                                              G_MAXUINT64,
+                                              0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+static gchar *
+build_key (const gchar *checksum,
+           gint         compression_level)
+{
+  return g_strdup_printf ("%s.%d", checksum, compression_level);
+}
+
+static gchar *
+build_entry_dir (EusFilezCache *self,
+                 const gchar   *checksum,
+                 gint           compression_level)
+{
+  gchar level_str[G_ASCII_DTOSTR_BUF_SIZE];
+  gchar prefix[3] = { checksum[0], checksum[1], '\0' };
+
+  g_snprintf (level_str, sizeof (level_str), "%d", compression_level);
+
+  return g_build_filename (self->path, level_str, prefix, NULL);
+}
+
+static gchar *
+build_entry_path (EusFilezCache *self,
+                  const gchar   *checksum,
+                  gint           compression_level)
+{
+  g_autofree gchar *dir = build_entry_dir (self, checksum, compression_level);
+  g_autofree gchar *basename = g_strconcat (checksum + 2, ".filez", NULL);
+
+  return g_build_filename (dir, basename, NULL);
+}
+
+/* Whether @name looks like the basename of a cache entry: the last 62 hex
+ * digits of a checksum followed by `.filez`. */
+static gboolean
+is_entry_basename (const gchar *name)
+{
+  gsize i;
+
+  if (strlen (name) != 62 + strlen (".filez") ||
+      !g_str_has_suffix (name, ".filez"))
+    return FALSE;
+
+  for (i = 0; i < 62; i++)
+    if (!g_ascii_isxdigit (name[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Add or remove @compression_level in the set of levels @checksum is cached
+ * at. Must be called with the lock held. */
+static void
+update_levels_unlocked (EusFilezCache *self,
+                        const gchar   *checksum,
+                        gint           compression_level,
+                        gboolean       cached)
+{
+  guint mask = GPOINTER_TO_UINT (g_hash_table_lookup (self->levels, checksum));
+
+  if (cached)
+    mask |= 1u << compression_level;
+  else
+    mask &= ~(1u << compression_level);
+
+  if (mask != 0)
+    g_hash_table_replace (self->levels, g_strdup (checksum), GUINT_TO_POINTER (mask));
+  else
+    g_hash_table_remove (self->levels, checksum);
+}
+
+/* Add an entry to the cache index, or update its size if it already exists.
+ * Either way, the entry becomes the most recently used one. Must be called
+ * with the lock held. */
+static CacheEntry *
+insert_entry_unlocked (EusFilezCache *self,
+                       const gchar   *checksum,
+                       gint           compression_level,
+                       guint64        size)
+{
+  g_autofree gchar *key = build_key (checksum, compression_level);
+  CacheEntry *entry = g_hash_table_lookup (self->entries, key);
+
+  if (entry != NULL)
+    {
+      self->total_size -= entry->size;
+      g_queue_unlink (&self->lru, &entry->link);
+    }
+  else
+    {
+      entry = g_new0 (CacheEntry, 1);
+      entry->key = g_steal_pointer (&key);
+      entry->checksum = g_strdup (checksum);
+      entry->compression_level = compression_level;
+      entry->link.data = entry;
+      g_hash_table_insert (self->entries, entry->key, entry);
+      update_levels_unlocked (self, checksum, compression_level, TRUE);
+    }
+
+  entry->size = size;
+  self->total_size += size;
+  g_queue_push_head_link (&self->lru, &entry->link);
+
+  return entry;
+}
+
+/* Remove @entry from the cache index and delete its file. Must be called with
+ * the lock held. @entry is freed. */
+static void
+remove_entry_unlocked (EusFilezCache *self,
+                       CacheEntry    *entry)
+{
+  g_autofree gchar *path = build_entry_path (self, entry->checksum,
+                                             entry->compression_level);
+
+  if (g_unlink (path) != 0 && errno != ENOENT)
+    g_debug ("Failed to delete cache entry ‘%s’: %s", path, g_strerror (errno));
+
+  g_queue_unlink (&self->lru, &entry->link);
+  self->total_size -= entry->size;
+  update_levels_unlocked (self, entry->checksum, entry->compression_level, FALSE);
+  g_hash_table_remove (self->entries, entry->key);
+}
+
+/* Evict least recently used entries until the cache is within its size limit.
+ * @keep is never evicted. Must be called with the lock held. */
+static void
+evict_unlocked (EusFilezCache *self,
+                CacheEntry    *keep)
+{
+  while (self->total_size > self->max_size && self->lru.tail != NULL)
+    {
+      CacheEntry *entry = self->lru.tail->data;
+
+      if (entry == keep)
+        break;
+
+      g_debug ("Evicting %s (%" G_GUINT64_FORMAT " bytes) from cache ‘%s’",
+               entry->key, entry->size, self->path);
+      remove_entry_unlocked (self, entry);
+    }
+}
+
+static gint
+compare_entries_by_mtime (gconstpointer a,
+                          gconstpointer b,
+                          gpointer      user_data)
+{
+  const CacheEntry *entry_a = a;
+  const CacheEntry *entry_b = b;
+
+  /* Most recently modified first. */
+  if (entry_a->mtime > entry_b->mtime)
+    return -1;
+  else if (entry_a->mtime < entry_b->mtime)
+    return 1;
+  else
+    return 0;
+}
+
+/* The #GVariant type of the header at the start of an archive-z2 stream:
+ * size, uid, gid, mode, rdev, symlink target and xattrs. */
+#define FILEZ_HEADER_FORMAT "(tuuuusa(ayay))"
+
+/* Check that the entry at @entry_path starts with a valid archive-z2 header,
+ * and has some compressed data after it. This catches entries which were
+ * truncated or otherwise damaged on disk, without reading all of them. */
+static gboolean
+entry_is_valid (const gchar *entry_path)
+{
+  g_autoptr(GMappedFile) mapped = NULL;
+  const guint8 *data;
+  gsize len;
+  guint32 header_size;
+  g_autoptr(GVariant) header = NULL;
+
+  mapped = g_mapped_file_new (entry_path, FALSE, NULL);
+  if (mapped == NULL)
+    return FALSE;
+
+  data = (const guint8 *) g_mapped_file_get_contents (mapped);
+  len = g_mapped_file_get_length (mapped);
+
+  if (len < 8)
+    return FALSE;
+
+  memcpy (&header_size, data, sizeof (header_size));
+  header_size = GUINT32_FROM_BE (header_size);
+
+  if (len - 8 <= header_size)
+    return FALSE;
+
+  header = g_variant_new_from_data (G_VARIANT_TYPE (FILEZ_HEADER_FORMAT),
+                                    data + 8, header_size, FALSE, NULL, NULL);
+  g_variant_ref_sink (header);
+
+  return g_variant_is_normal_form (header);
+}
+
+/* Load the entries from one `$path/$level/$prefix` directory. Errors are
+ * ignored: a broken entry just won’t be in the cache. */
+static void
+load_prefix_dir (EusFilezCache *self,
+                 const gchar   *prefix_path,
+                 const gchar   *prefix,
+                 gint           compression_level)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (prefix_path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *entry_path = g_build_filename (prefix_path, name, NULL);
+      g_autofree gchar *checksum = NULL;
+      GStatBuf stat_buf;
+      CacheEntry *entry;
+
+      /* Clean up temporary files left behind by an instance of the server
+       * which exited while writing an entry. */
+      if (name[0] == '.')
+        {
+          g_unlink (entry_path);
+          continue;
+        }
+
+      if (!is_entry_basename (name) ||
+          g_stat (entry_path, &stat_buf) != 0 ||
+          !S_ISREG (stat_buf.st_mode))
+        continue;
+
+      if (!entry_is_valid (entry_path))
+        {
+          g_debug ("Removing invalid cache entry ‘%s’", entry_path);
+          g_unlink (entry_path);
+          continue;
+        }
+
+      checksum = g_strdup_printf ("%s%.62s", prefix, name);
+      entry = insert_entry_unlocked (self, checksum, compression_level,
+                                     stat_buf.st_size);
+      entry->mtime = stat_buf.st_mtime;
+    }
+}
+
+static gboolean
+load_entries (EusFilezCache  *self,
+              GCancellable   *cancellable,
+              GError        **error)
+{
+  g_autoptr(GDir) root_dir = NULL;
+  const gchar *level_name;
+
+  root_dir = g_dir_open (self->path, 0, error);
+  if (root_dir == NULL)
+    return FALSE;
+
+  while ((level_name = g_dir_read_name (root_dir)) != NULL)
+    {
+      g_autofree gchar *level_path = NULL;
+      g_autoptr(GDir) level_dir = NULL;
+      const gchar *prefix;
+      guint64 compression_level;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      if (!eos_string_to_unsigned (level_name, 10, 0, 9, &compression_level,
+                                   NULL))
+        continue;
+
+      level_path = g_build_filename (self->path, level_name, NULL);
+      level_dir = g_dir_open (level_path, 0, NULL);
+      if (level_dir == NULL)
+        continue;
+
+      while ((prefix = g_dir_read_name (level_dir)) != NULL)
+        {
+          g_autofree gchar *prefix_path = NULL;
+
+          if (strlen (prefix) != 2 ||
+              !g_ascii_isxdigit (prefix[0]) ||
+              !g_ascii_isxdigit (prefix[1]))
+            continue;
+
+          prefix_path = g_build_filename (level_path, prefix, NULL);
+          load_prefix_dir (self, prefix_path, prefix, (gint) compression_level);
+        }
+    }
+
+  /* The entries were inserted in directory order; put them in LRU order
+   * instead, then trim the cache in case its maximum size has been reduced
+   * since it was last used. */
+  g_queue_sort (&self->lru, compare_entries_by_mtime, NULL);
+  evict_unlocked (self, NULL);
+
+  g_debug ("Loaded %u entries (%" G_GUINT64_FORMAT " bytes) from cache ‘%s’",
+           g_hash_table_size (self->entries), self->total_size, self->path);
+
+  return TRUE;
+}
+
+static gboolean
+eus_filez_cache_initable_init (GInitable     *initable,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  EusFilezCache *self = EUS_FILEZ_CACHE (initable);
+  gboolean retval;
+
+  g_assert (self->path != NULL);
+
+  if (g_mkdir_with_parents (self->path, 0755) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create cache directory ‘%s’: %s",
+                   self->path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  g_mutex_lock (&self->lock);
+  retval = load_entries (self, cancellable, error);
+  g_mutex_unlock (&self->lock);
+
+  return retval;
+}
+
+static void
+eus_filez_cache_initable_iface_init (GInitableIface *initable_iface)
+{
+  initable_iface->init = eus_filez_cache_initable_init;
+}
+
+/**
+ * eus_filez_cache_new:
+ * @path: path to the directory to store the cache in
+ * @max_size: maximum total size of the cache, in bytes
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Create a new #EusFilezCache in @path, loading any entries which are already
+ * stored there.
+ *
+ * Returns: (transfer full): the cache, or %NULL on error
+ * Since: UNRELEASED
+ */
+EusFilezCache *
+eus_filez_cache_new (const gchar   *path,
+                     guint64        max_size,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable),
+                        NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  return g_initable_new (EUS_TYPE_FILEZ_CACHE, cancellable, error,
+                         "path", path,
+                         "max-size", max_size,
+                         NULL);
+}
+
+/**
+ * eus_filez_cache_lookup:
+ * @self: an #EusFilezCache
+ * @checksum: checksum of the object
+ * @compression_level: compression level the object was generated with
+ *
+ * Look up the compressed form of the object @checksum, and map it into memory
+ * if it is in the cache. This marks the entry as recently used.
+ *
+ * Returns: (transfer full) (nullable): the mapped cache entry, or %NULL if the
+ *    object is not in the cache
+ * Since: UNRELEASED
+ */
+GMappedFile *
+eus_filez_cache_lookup (EusFilezCache *self,
+                        const gchar   *checksum,
+                        gint           compression_level)
+{
+  g_autofree gchar *key = NULL;
+  g_autofree gchar *path = NULL;
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GError) local_error = NULL;
+  CacheEntry *entry;
+
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (self), NULL);
+  g_return_val_if_fail (checksum != NULL && strlen (checksum) == 64, NULL);
+
+  key = build_key (checksum, compression_level);
+  path = build_entry_path (self, checksum, compression_level);
+
+  g_mutex_lock (&self->lock);
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry != NULL)
+    {
+      g_queue_unlink (&self->lru, &entry->link);
+      g_queue_push_head_link (&self->lru, &entry->link);
+    }
+  g_mutex_unlock (&self->lock);
+
+  if (entry == NULL)
+    return NULL;
+
+  mapping = g_mapped_file_new (path, FALSE, &local_error);
+  if (mapping == NULL)
+    {
+      g_debug ("Failed to map cache entry ‘%s’; dropping it: %s",
+               path, local_error->message);
+
+      g_mutex_lock (&self->lock);
+      entry = g_hash_table_lookup (self->entries, key);
+      if (entry != NULL)
+        remove_entry_unlocked (self, entry);
+      g_mutex_unlock (&self->lock);
+
+      return NULL;
+    }
+
+  /* Persist the LRU order. Failure is harmless. */
+  g_utime (path, NULL);
+
+  return g_steal_pointer (&mapping);
+}
+
+/**
+ * eus_filez_cache_lookup_best:
+ * @self: an #EusFilezCache
+ * @checksum: checksum of the object
+ * @out_compression_level: (out caller-allocates): return location for the
+ *    compression level of the entry found
+ *
+ * Look up the compressed form of the object @checksum at whichever level it
+ * is cached at, preferring the highest (and hence smallest) one, and map it
+ * into memory as with eus_filez_cache_lookup(). The levels each object is
+ * cached at are indexed, so this does not have to try every level in turn.
+ *
+ * Returns: (transfer full) (nullable): the mapped cache entry, or %NULL if the
+ *    object is not in the cache at any level
+ * Since: UNRELEASED
+ */
+GMappedFile *
+eus_filez_cache_lookup_best (EusFilezCache *self,
+                             const gchar   *checksum,
+                             gint          *out_compression_level)
+{
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (self), NULL);
+  g_return_val_if_fail (checksum != NULL && strlen (checksum) == 64, NULL);
+  g_return_val_if_fail (out_compression_level != NULL, NULL);
+
+  while (TRUE)
+    {
+      GMappedFile *mapping;
+      guint mask;
+      gint level;
+
+      g_mutex_lock (&self->lock);
+      mask = GPOINTER_TO_UINT (g_hash_table_lookup (self->levels, checksum));
+      g_mutex_unlock (&self->lock);
+
+      if (mask == 0)
+        return NULL;
+
+      level = g_bit_nth_msf (mask, -1);
+
+      /* If the entry cannot be mapped, it is dropped from the index, so try
+       * the next level down. */
+      mapping = eus_filez_cache_lookup (self, checksum, level);
+      if (mapping != NULL)
+        {
+          *out_compression_level = level;
+          return mapping;
+        }
+    }
+}
+
+/**
+ * eus_filez_cache_contains:
+ * @self: an #EusFilezCache
+ * @checksum: checksum of the object
+ * @compression_level: compression level the object was generated with
+ *
+ * Check whether the compressed form of the object @checksum is in the cache,
+ * without mapping it. Like eus_filez_cache_lookup(), this marks the entry as
+ * recently used.
+ *
+ * Returns: %TRUE if the object is in the cache, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_filez_cache_contains (EusFilezCache *self,
+                          const gchar   *checksum,
+                          gint           compression_level)
+{
+  g_autofree gchar *key = NULL;
+  CacheEntry *entry;
+
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (self), FALSE);
+  g_return_val_if_fail (checksum != NULL && strlen (checksum) == 64, FALSE);
+
+  key = build_key (checksum, compression_level);
+
+  g_mutex_lock (&self->lock);
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry != NULL)
+    {
+      g_queue_unlink (&self->lru, &entry->link);
+      g_queue_push_head_link (&self->lru, &entry->link);
+    }
+  g_mutex_unlock (&self->lock);
+
+  return (entry != NULL);
+}
+
+struct _EusFilezCacheWriter
+{
+  EusFilezCache *cache;  /* (owned) */
+  gchar *checksum;  /* (owned) */
+  gint compression_level;
+
+  gchar *tmp_path;  /* (owned) (nullable) NULL once the entry is committed or
+                     * abandoned */
+  int fd;  /* (owned) -1 once closed */
+  guint64 size;
+};
+
+/**
+ * eus_filez_cache_writer_new:
+ * @cache: an #EusFilezCache
+ * @checksum: checksum of the object
+ * @compression_level: compression level the object is being generated with
+ * @error: return location for a #GError
+ *
+ * Start writing a new cache entry for the compressed form of the object
+ * @checksum. Data is written to a temporary file until the writer is
+ * committed, so concurrent lookups never see a partial entry.
+ *
+ * Returns: (transfer full): a new writer, or %NULL on error
+ * Since: UNRELEASED
+ */
+EusFilezCacheWriter *
+eus_filez_cache_writer_new (EusFilezCache  *cache,
+                            const gchar    *checksum,
+                            gint            compression_level,
+                            GError        **error)
+{
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *tmp_basename = NULL;
+  g_autofree gchar *tmp_path = NULL;
+  int fd;
+  EusFilezCacheWriter *writer;
+
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (cache), NULL);
+  g_return_val_if_fail (checksum != NULL && strlen (checksum) == 64, NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  dir = build_entry_dir (cache, checksum, compression_level);
+  if (g_mkdir_with_parents (dir, 0755) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create cache directory ‘%s’: %s",
+                   dir, g_strerror (saved_errno));
+      return NULL;
+    }
+
+  /* The random suffix stops concurrent writers for the same entry from
+   * trampling on each other; the last one to commit wins. */
+  tmp_basename = g_strdup_printf (".%s.%08x.tmp", checksum + 2, g_random_int ());
+  tmp_path = g_build_filename (dir, tmp_basename, NULL);
+
+  fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to create ‘%s’: %s",
+                   tmp_path, g_strerror (saved_errno));
+      return NULL;
+    }
+
+  writer = g_new0 (EusFilezCacheWriter, 1);
+  writer->cache = g_object_ref (cache);
+  writer->checksum = g_strdup (checksum);
+  writer->compression_level = compression_level;
+  writer->tmp_path = g_steal_pointer (&tmp_path);
+  writer->fd = fd;
+
+  return writer;
+}
+
+/* Close and delete the temporary file, if it’s still around. */
+static void
+writer_abandon (EusFilezCacheWriter *writer)
+{
+  if (writer->fd >= 0)
+    {
+      close (writer->fd);
+      writer->fd = -1;
+    }
+
+  if (writer->tmp_path != NULL)
+    {
+      g_unlink (writer->tmp_path);
+      g_clear_pointer (&writer->tmp_path, g_free);
+    }
+}
+
+/**
+ * eus_filez_cache_writer_write:
+ * @writer: an #EusFilezCacheWriter
+ * @data: (array length=len): data to append to the entry
+ * @len: length of @data, in bytes
+ * @error: return location for a #GError
+ *
+ * Append @data to the cache entry being written.
+ *
+ * If this would make the entry bigger than #EusFilezCache:max-size, the entry
+ * is abandoned straight away, rather than carrying on writing something which
+ * would be discarded, and %G_IO_ERROR_MESSAGE_TOO_LARGE is returned. The
+ * @writer may only be freed after an error.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_filez_cache_writer_write (EusFilezCacheWriter  *writer,
+                              const guint8         *data,
+                              gsize                 len,
+                              GError              **error)
+{
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (writer->fd >= 0, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (len > writer->cache->max_size - writer->size)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE,
+                   "Size of %s (at least %" G_GUINT64_FORMAT " bytes) is "
+                   "bigger than the cache", writer->checksum,
+                   writer->size + len);
+      writer_abandon (writer);
+      return FALSE;
+    }
+
+  while (len > 0)
+    {
+      gssize n_written = write (writer->fd, data, len);
+
+      if (n_written < 0)
+        {
+          int saved_errno = errno;
+
+          if (saved_errno == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                       "Failed to write ‘%s’: %s",
+                       writer->tmp_path, g_strerror (saved_errno));
+          return FALSE;
+        }
+
+      data += n_written;
+      len -= n_written;
+      writer->size += n_written;
+    }
+
+  return TRUE;
+}
+
+/**
+ * eus_filez_cache_writer_commit:
+ * @writer: an #EusFilezCacheWriter
+ * @error: return location for a #GError
+ *
+ * Finish writing the cache entry and make it available to lookups, evicting
+ * other entries if needed to keep the cache within its size limit. The entry
+ * is synced to disk before it is made visible.
+ *
+ * The @writer must still be freed afterwards.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_filez_cache_writer_commit (EusFilezCacheWriter  *writer,
+                               GError              **error)
+{
+  EusFilezCache *cache;
+  g_autofree gchar *path = NULL;
+  CacheEntry *entry;
+
+  g_return_val_if_fail (writer != NULL, FALSE);
+  g_return_val_if_fail (writer->fd >= 0, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  cache = writer->cache;
+
+  /* Make sure the data is on disk before the entry is renamed into place,
+   * otherwise a crash could leave an empty or truncated entry behind. */
+  if (fdatasync (writer->fd) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to sync ‘%s’: %s",
+                   writer->tmp_path, g_strerror (saved_errno));
+      return FALSE;
+    }
+
+  close (writer->fd);
+  writer->fd = -1;
+
+  path = build_entry_path (cache, writer->checksum, writer->compression_level);
+  if (g_rename (writer->tmp_path, path) != 0)
+    {
+      int saved_errno = errno;
+
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Failed to rename ‘%s’ to ‘%s’: %s",
+                   writer->tmp_path, path, g_strerror (saved_errno));
+      return FALSE;
+    }
+  g_clear_pointer (&writer->tmp_path, g_free);
+
+  g_mutex_lock (&cache->lock);
+  entry = insert_entry_unlocked (cache, writer->checksum,
+                                 writer->compression_level, writer->size);
+  evict_unlocked (cache, entry);
+  g_mutex_unlock (&cache->lock);
+
+  return TRUE;
+}
+
+/**
+ * eus_filez_cache_writer_free:
+ * @writer: (transfer full): an #EusFilezCacheWriter
+ *
+ * Free @writer. If it has not been committed, the data written so far is
+ * discarded.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_filez_cache_writer_free (EusFilezCacheWriter *writer)
+{
+  g_return_if_fail (writer != NULL);
+
+  writer_abandon (writer);
+
+  g_free (writer->checksum);
+  g_clear_object (&writer->cache);
+  g_free (writer);
+}
+
+/**
+ * EusFilezCacheStream:
+ *
+ * An input stream which copies everything read from its base stream into a
+ * new cache entry, committing the entry when the end of the base stream is
+ * reached. If the stream is finalized before then, the entry is discarded.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusFilezCacheStream
+{
+  GInputStream parent_instance;
+
+  GInputStream *base_stream;  /* (owned) */
+  EusFilezCache *cache;  /* (owned) (nullable) NULL once the writer is created */
+  gchar *checksum;  /* (owned) */
+  gint compression_level;
+
+  EusFilezCacheWriter *writer;  /* (owned) (nullable) only used by reads */
+  gint caching;  /* (atomic) whether the entry may still be committed */
+};
+
+G_DEFINE_TYPE (EusFilezCacheStream, eus_filez_cache_stream, G_TYPE_INPUT_STREAM)
+
+static void
+eus_filez_cache_stream_init (EusFilezCacheStream *self)
+{
+  self->caching = TRUE;
+}
+
+static void
+eus_filez_cache_stream_finalize (GObject *object)
+{
+  EusFilezCacheStream *self = EUS_FILEZ_CACHE_STREAM (object);
+
+  g_clear_pointer (&self->writer, eus_filez_cache_writer_free);
+  g_clear_object (&self->cache);
+  g_clear_object (&self->base_stream);
+  g_free (self->checksum);
+
+  G_OBJECT_CLASS (eus_filez_cache_stream_parent_class)->finalize (object);
+}
+
+/* Stop caching, discarding anything written so far. */
+static void
+eus_filez_cache_stream_stop_caching (EusFilezCacheStream *self)
+{
+  g_clear_pointer (&self->writer, eus_filez_cache_writer_free);
+  g_clear_object (&self->cache);
+  g_atomic_int_set (&self->caching, FALSE);
+}
+
+static gssize
+eus_filez_cache_stream_read (GInputStream  *stream,
+                             void          *buffer,
+                             gsize          count,
+                             GCancellable  *cancellable,
+                             GError       **error)
+{
+  EusFilezCacheStream *self = EUS_FILEZ_CACHE_STREAM (stream);
+  g_autoptr(GError) local_error = NULL;
+  gssize bytes_read;
+
+  bytes_read = g_input_stream_read (self->base_stream, buffer, count,
+                                    cancellable, error);
+  if (bytes_read < 0 || !g_atomic_int_get (&self->caching))
+    return bytes_read;
+
+  /* The temporary file is created on the first read, so that creating it
+   * happens in the reading thread too. */
+  if (self->writer == NULL)
+    {
+      self->writer = eus_filez_cache_writer_new (self->cache, self->checksum,
+                                                 self->compression_level,
+                                                 &local_error);
+      if (self->writer == NULL)
+        {
+          g_debug ("Not caching %s: %s", self->checksum, local_error->message);
+          eus_filez_cache_stream_stop_caching (self);
+          return bytes_read;
+        }
+      g_clear_object (&self->cache);
+    }
+
+  if (bytes_read > 0)
+    {
+      if (!eus_filez_cache_writer_write (self->writer, buffer, bytes_read,
+                                         &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR,
+                               G_IO_ERROR_MESSAGE_TOO_LARGE))
+            g_debug ("Not caching %s: %s", self->checksum,
+                     local_error->message);
+          else
+            g_warning ("Failed to cache %s: %s", self->checksum,
+                       local_error->message);
+          eus_filez_cache_stream_stop_caching (self);
+        }
+    }
+  else
+    {
+      if (!eus_filez_cache_writer_commit (self->writer, &local_error))
+        g_warning ("Failed to cache %s: %s", self->checksum,
+                   local_error->message);
+      eus_filez_cache_stream_stop_caching (self);
+    }
+
+  return bytes_read;
+}
+
+static gboolean
+eus_filez_cache_stream_close (GInputStream  *stream,
+                              GCancellable  *cancellable,
+                              GError       **error)
+{
+  EusFilezCacheStream *self = EUS_FILEZ_CACHE_STREAM (stream);
+
+  return g_input_stream_close (self->base_stream, cancellable, error);
+}
+
+static void
+eus_filez_cache_stream_class_init (EusFilezCacheStreamClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+  object_class->finalize = eus_filez_cache_stream_finalize;
+
+  stream_class->read_fn = eus_filez_cache_stream_read;
+  stream_class->close_fn = eus_filez_cache_stream_close;
+}
+
+/**
+ * eus_filez_cache_stream_new:
+ * @base_stream: stream to copy into the cache
+ * @cache: an #EusFilezCache
+ * @checksum: checksum of the object which @base_stream is the compressed form
+ *    of
+ * @compression_level: compression level @base_stream is generated with
+ *
+ * Create a new #EusFilezCacheStream which returns the contents of
+ * @base_stream, and writes them to a new entry in @cache as they are read.
+ * Closing the new stream closes @base_stream.
+ *
+ * Reads from the new stream block on writing to the cache, so should be done
+ * in a worker thread. If writing to the cache fails, a warning is logged and
+ * the stream carries on returning the contents of @base_stream.
+ *
+ * Returns: (transfer full): a new #EusFilezCacheStream
+ * Since: UNRELEASED
+ */
+GInputStream *
+eus_filez_cache_stream_new (GInputStream  *base_stream,
+                            EusFilezCache *cache,
+                            const gchar   *checksum,
+                            gint           compression_level)
+{
+  EusFilezCacheStream *self;
+
+  g_return_val_if_fail (G_IS_INPUT_STREAM (base_stream), NULL);
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (cache), NULL);
+  g_return_val_if_fail (checksum != NULL && strlen (checksum) == 64, NULL);
+
+  self = g_object_new (EUS_TYPE_FILEZ_CACHE_STREAM, NULL);
+  self->base_stream = g_object_ref (base_stream);
+  self->cache = g_object_ref (cache);
+  self->checksum = g_strdup (checksum);
+  self->compression_level = compression_level;
+
+  return G_INPUT_STREAM (self);
+}
+
+/**
+ * eus_filez_cache_stream_is_caching:
+ * @self: an #EusFilezCacheStream
+ *
+ * Check whether the stream is still being written to the cache: that is,
+ * whether the end of the stream has not been reached yet, and no errors have
+ * happened while writing it. This may be called from any thread.
+ *
+ * Returns: %TRUE if reading the rest of the stream will add it to the cache,
+ *    %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_filez_cache_stream_is_caching (EusFilezCacheStream *self)
+{
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE_STREAM (self), FALSE);
+
+  return g_atomic_int_get (&self->caching);
+}
@@ -0,0 +1,84 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_FILEZ_CACHE eus_filez_cache_get_type ()
+G_DECLARE_FINAL_TYPE (EusFilezCache, eus_filez_cache, EUS, FILEZ_CACHE, GObject)
+
+EusFilezCache *eus_filez_cache_new (const gchar   *path,
+                                    guint64        max_size,
+                                    GCancellable  *cancellable,
+                                    GError       **error);
+
+GMappedFile *eus_filez_cache_lookup (EusFilezCache *self,
+                                     const gchar   *checksum,
+                                     gint           compression_level);
+GMappedFile *eus_filez_cache_lookup_best (EusFilezCache *self,
+                                          const gchar   *checksum,
+                                          gint          *out_compression_level);
+gboolean eus_filez_cache_contains (EusFilezCache *self,
+                                   const gchar   *checksum,
+                                   gint           compression_level);
+
+/**
+ * EusFilezCacheWriter:
+ *
+ * An opaque handle for a cache entry which is being written. Data is appended
+ * to it using eus_filez_cache_writer_write(), and it only becomes visible in
+ * the cache once eus_filez_cache_writer_commit() succeeds. Freeing an
+ * uncommitted writer discards the data written so far.
+ *
+ * Since: UNRELEASED
+ */
+typedef struct _EusFilezCacheWriter EusFilezCacheWriter;
+
+EusFilezCacheWriter *eus_filez_cache_writer_new (EusFilezCache  *cache,
+                                                 const gchar    *checksum,
+                                                 gint            compression_level,
+                                                 GError        **error);
+gboolean eus_filez_cache_writer_write (EusFilezCacheWriter  *writer,
+                                       const guint8         *data,
+                                       gsize                 len,
+                                       GError              **error);
+gboolean eus_filez_cache_writer_commit (EusFilezCacheWriter  *writer,
+                                        GError              **error);
+void eus_filez_cache_writer_free (EusFilezCacheWriter *writer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EusFilezCacheWriter, eus_filez_cache_writer_free)
+
+#define EUS_TYPE_FILEZ_CACHE_STREAM eus_filez_cache_stream_get_type ()
+G_DECLARE_FINAL_TYPE (EusFilezCacheStream, eus_filez_cache_stream, EUS, FILEZ_CACHE_STREAM, GInputStream)
+
+GInputStream *eus_filez_cache_stream_new (GInputStream  *base_stream,
+                                          EusFilezCache *cache,
+                                          const gchar   *checksum,
+                                          gint           compression_level);
+gboolean eus_filez_cache_stream_is_caching (EusFilezCacheStream *self);
+
+G_END_DECLS
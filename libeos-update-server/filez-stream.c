@@ -0,0 +1,426 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/deflate-stream.h>
+#include <libeos-update-server/filez-stream.h>
+#include <libeos-update-server/scheduler.h>
+#include <ostree.h>
+#include <string.h>
+
+/**
+ * SECTION:filez-stream
+ * @title: Compressed object streams
+ * @short_description: Generate .filez objects from a bare repository
+ * @include: libeos-update-server/filez-stream.h
+ *
+ * Bare repositories store file objects uncompressed, but clients pull
+ * archive-z2 (`.filez`) objects, so they have to be compressed on the fly.
+ * This is shared between #EusRepo, which does it for requests, and
+ * #EusFilezWarmer, which does it ahead of them.
+ *
+ * Loading an object and sampling it block on disk I/O and take CPU time, so
+ * #EusRepo does them in its #EusScheduler using
+ * eus_load_filez_stream_async().
+ *
+ * Since: UNRELEASED
+ */
+
+/* Amount of each object to sample to decide whether it is worth compressing.
+ * Objects smaller than %FILEZ_SAMPLE_MIN_SIZE are always compressed, as the
+ * level barely matters for them. */
+#define FILEZ_SAMPLE_SIZE (64 * 1024)
+#define FILEZ_SAMPLE_MIN_SIZE 4096
+
+/* Objects whose first block does not deflate to at most this percentage of
+ * its size are treated as incompressible. */
+#define FILEZ_INCOMPRESSIBLE_PERCENT 95
+
+/* Objects at least this big are compressed on several cores at once. This
+ * changes the compressed stream, so it must stay constant for an object’s
+ * ETag to keep identifying the same bytes. */
+#define FILEZ_PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+
+/* Check whether the start of @stream is worth compressing, by deflating a
+ * sample of it at the fastest level. @stream is rewound afterwards; if it is
+ * not seekable, it is assumed to be compressible. */
+static gboolean
+sample_is_compressible (GInputStream  *stream,
+                        gboolean      *out_compressible,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  g_autofree guint8 *sample = NULL;
+  g_autofree guint8 *compressed = NULL;
+  gsize sample_len, compressed_len, bytes_read, bytes_written;
+  g_autoptr(GZlibCompressor) compressor = NULL;
+  GConverterResult result;
+
+  if (!G_IS_SEEKABLE (stream) || !g_seekable_can_seek (G_SEEKABLE (stream)))
+    {
+      *out_compressible = TRUE;
+      return TRUE;
+    }
+
+  sample = g_malloc (FILEZ_SAMPLE_SIZE);
+  if (!g_input_stream_read_all (stream, sample, FILEZ_SAMPLE_SIZE, &sample_len,
+                                cancellable, error) ||
+      !g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_SET, cancellable, error))
+    return FALSE;
+
+  if (sample_len < FILEZ_SAMPLE_MIN_SIZE)
+    {
+      *out_compressible = TRUE;
+      return TRUE;
+    }
+
+  /* Only give the compressor as much space as a worthwhile result needs: if
+   * it cannot finish in that, the sample is incompressible. */
+  compressed_len = sample_len * FILEZ_INCOMPRESSIBLE_PERCENT / 100;
+  compressed = g_malloc (compressed_len);
+  compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, 1);
+  result = g_converter_convert (G_CONVERTER (compressor),
+                                sample, sample_len,
+                                compressed, compressed_len,
+                                G_CONVERTER_INPUT_AT_END,
+                                &bytes_read, &bytes_written, NULL);
+
+  *out_compressible = (result == G_CONVERTER_FINISHED);
+  return TRUE;
+}
+
+/* Get the header of the archive-z2 form of an object: everything before its
+ * compressed contents. ostree has no API for building it on its own, so
+ * convert an empty stream with the object’s metadata and cut the (empty)
+ * compressed contents off. The header is a big-endian 32-bit length, 4 bytes
+ * of padding, and then a #GVariant of that length. */
+static GBytes *
+build_archive_z2_header (GFileInfo     *info,
+                         GVariant      *xattrs,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_autoptr(GInputStream) empty = g_memory_input_stream_new ();
+  g_autoptr(GInputStream) archive = NULL;
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+  g_autoptr(GBytes) bytes = NULL;
+  const guint8 *data;
+  gsize len;
+  guint32 header_size;
+
+  if (!ostree_raw_file_to_archive_z2_stream (empty, info, xattrs, &archive,
+                                             cancellable, error))
+    return NULL;
+
+  if (g_output_stream_splice (output, archive,
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                              G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                              cancellable, error) < 0)
+    return NULL;
+
+  bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  data = g_bytes_get_data (bytes, &len);
+
+  if (len >= 8)
+    {
+      memcpy (&header_size, data, sizeof (header_size));
+      header_size = GUINT32_FROM_BE (header_size);
+    }
+
+  if (len < 8 || len - 8 < header_size)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                           "Invalid archive-z2 header");
+      return NULL;
+    }
+
+  return g_bytes_new_from_bytes (bytes, 0, 8 + header_size);
+}
+
+/**
+ * eus_load_filez_stream:
+ * @repo: bare repository containing the object
+ * @checksum: checksum of the file object
+ * @compression_level: zlib compression level to compress the object at
+ * @sample: %TRUE to check whether the object is worth compressing first
+ * @cancellable: (nullable): a #GCancellable
+ * @out_input: (out) (transfer full): return location for the stream
+ * @out_uncompressed_size: (out): return location for the size of the object
+ * @out_compression_level: (out): return location for the level used
+ * @error: return location for a #GError
+ *
+ * Load the object @checksum as a stream which produces its archive-z2
+ * (`.filez`) form, compressed at @compression_level. If @sample is %TRUE and
+ * the start of the object does not compress, level 0 is used instead. The
+ * level used is returned in @out_compression_level. Large objects are
+ * compressed in parallel by an #EusDeflateStream.
+ *
+ * The stream is fully determined by @checksum and the level used, so it can
+ * be cached and identified by those.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_load_filez_stream (OstreeRepo    *repo,
+                       const gchar   *checksum,
+                       gint           compression_level,
+                       gboolean       sample,
+                       GCancellable  *cancellable,
+                       GInputStream **out_input,
+                       guint64       *out_uncompressed_size,
+                       gint          *out_compression_level,
+                       GError       **error)
+{
+  g_autoptr(GInputStream) bare = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_auto(GVariantBuilder) builder = { { { 0, } } };
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GBytes) header = NULL;
+
+  if (!ostree_repo_load_file (repo,
+                              checksum,
+                              &bare,
+                              &info,
+                              &xattrs,
+                              cancellable,
+                              error))
+    return FALSE;
+
+  /* Symbolic links have no content stream. */
+  if (sample && compression_level > 0 && bare != NULL)
+    {
+      gboolean compressible;
+
+      if (!sample_is_compressible (bare, &compressible, cancellable, error))
+        return FALSE;
+      if (!compressible)
+        {
+          g_debug ("Object %s is incompressible; storing it uncompressed",
+                   checksum);
+          compression_level = 0;
+        }
+    }
+
+  if (bare != NULL && compression_level > 0 &&
+      g_file_info_get_size (info) >= FILEZ_PARALLEL_MIN_SIZE)
+    {
+      header = build_archive_z2_header (info, xattrs, cancellable, error);
+      if (header == NULL)
+        return FALSE;
+
+      *out_input = eus_deflate_stream_new (bare, header, compression_level);
+      *out_uncompressed_size = g_file_info_get_size (info);
+      *out_compression_level = compression_level;
+      return TRUE;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{s@v}", "compression-level",
+                         g_variant_new_variant (g_variant_new_int32 (compression_level)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_raw_file_to_archive_z2_stream_with_options (bare,
+                                                          info,
+                                                          xattrs,
+                                                          options,
+                                                          &content,
+                                                          cancellable,
+                                                          error))
+    return FALSE;
+
+  *out_input = g_steal_pointer (&content);
+  *out_uncompressed_size = g_file_info_get_size (info);
+  *out_compression_level = compression_level;
+  return TRUE;
+}
+
+typedef struct
+{
+  OstreeRepo *repo;  /* (owned) */
+  gchar *checksum;  /* (owned) */
+  gint compression_level;
+  gboolean sample;
+  EusScheduler *scheduler;  /* (owned) (nullable) */
+
+  GInputStream *stream;  /* (owned) (nullable) set on success */
+  guint64 uncompressed_size;
+} LoadData;
+
+static void
+load_data_free (LoadData *data)
+{
+  g_clear_object (&data->repo);
+  g_free (data->checksum);
+  g_clear_object (&data->scheduler);
+  g_clear_object (&data->stream);
+  g_free (data);
+}
+
+/* Runs in a worker thread. */
+static gboolean
+load_job (gpointer       data_ptr,
+          GCancellable  *cancellable,
+          GError       **error)
+{
+  LoadData *data = data_ptr;
+
+  return eus_load_filez_stream (data->repo,
+                                data->checksum,
+                                data->compression_level,
+                                data->sample,
+                                cancellable,
+                                &data->stream,
+                                &data->uncompressed_size,
+                                &data->compression_level,
+                                error);
+}
+
+static void
+load_thread_cb (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (!load_job (task_data, cancellable, &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+load_job_cb (GObject      *source_object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  LoadData *data = g_task_get_task_data (task);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!eus_scheduler_run_finish (data->scheduler, result, &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * eus_load_filez_stream_async:
+ * @repo: bare repository containing the object
+ * @checksum: checksum of the file object
+ * @compression_level: zlib compression level to compress the object at
+ * @sample: %TRUE to check whether the object is worth compressing first
+ * @scheduler: (nullable): scheduler to load the object in
+ * @client: (nullable): identifier of the client the object is for; see
+ *    eus_scheduler_read_async()
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to invoke when the stream is loaded
+ * @user_data: data to pass to @callback
+ *
+ * Asynchronous version of eus_load_filez_stream(). The object is loaded, and
+ * sampled if @sample is %TRUE, in @scheduler’s worker pool; or in a thread of
+ * its own if @scheduler is %NULL.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_load_filez_stream_async (OstreeRepo          *repo,
+                             const gchar         *checksum,
+                             gint                 compression_level,
+                             gboolean             sample,
+                             EusScheduler        *scheduler,
+                             const gchar         *client,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  LoadData *data;
+
+  g_return_if_fail (OSTREE_IS_REPO (repo));
+  g_return_if_fail (checksum != NULL);
+  g_return_if_fail (scheduler == NULL || EUS_IS_SCHEDULER (scheduler));
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eus_load_filez_stream_async);
+
+  data = g_new0 (LoadData, 1);
+  data->repo = g_object_ref (repo);
+  data->checksum = g_strdup (checksum);
+  data->compression_level = compression_level;
+  data->sample = sample;
+  data->scheduler = (scheduler != NULL) ? g_object_ref (scheduler) : NULL;
+  g_task_set_task_data (task, data, (GDestroyNotify) load_data_free);
+
+  if (scheduler == NULL)
+    {
+      g_task_run_in_thread (task, load_thread_cb);
+      return;
+    }
+
+  /* The task owns @data, and is kept alive until the job completes. */
+  eus_scheduler_run_async (scheduler, load_job, data, NULL, client,
+                           cancellable, load_job_cb, g_steal_pointer (&task));
+}
+
+/**
+ * eus_load_filez_stream_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @out_input: (out) (transfer full): return location for the stream
+ * @out_uncompressed_size: (out): return location for the size of the object
+ * @out_compression_level: (out): return location for the level used
+ * @error: return location for a #GError
+ *
+ * Finish loading a stream started with eus_load_filez_stream_async().
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_load_filez_stream_finish (GAsyncResult  *result,
+                              GInputStream **out_input,
+                              guint64       *out_uncompressed_size,
+                              gint          *out_compression_level,
+                              GError       **error)
+{
+  GTask *task;
+  LoadData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, eus_load_filez_stream_async), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  task = G_TASK (result);
+  if (!g_task_propagate_boolean (task, error))
+    return FALSE;
+
+  data = g_task_get_task_data (task);
+  *out_input = g_steal_pointer (&data->stream);
+  *out_uncompressed_size = data->uncompressed_size;
+  *out_compression_level = data->compression_level;
+  return TRUE;
+}
@@ -0,0 +1,57 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/scheduler.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+gboolean eus_load_filez_stream (OstreeRepo    *repo,
+                                const gchar   *checksum,
+                                gint           compression_level,
+                                gboolean       sample,
+                                GCancellable  *cancellable,
+                                GInputStream **out_input,
+                                guint64       *out_uncompressed_size,
+                                gint          *out_compression_level,
+                                GError       **error);
+
+void eus_load_filez_stream_async (OstreeRepo          *repo,
+                                  const gchar         *checksum,
+                                  gint                 compression_level,
+                                  gboolean             sample,
+                                  EusScheduler        *scheduler,
+                                  const gchar         *client,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data);
+gboolean eus_load_filez_stream_finish (GAsyncResult  *result,
+                                       GInputStream **out_input,
+                                       guint64       *out_uncompressed_size,
+                                       gint          *out_compression_level,
+                                       GError       **error);
+
+G_END_DECLS
@@ -0,0 +1,602 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/filez-cache.h>
+#include <libeos-update-server/filez-stream.h>
+#include <libeos-update-server/filez-warmer.h>
+#include <ostree.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * SECTION:filez-warmer
+ * @title: Compressed object warm-up
+ * @short_description: Compress a commit’s objects before clients ask for them
+ * @include: libeos-update-server/filez-warmer.h
+ *
+ * Walks the tree of a commit and compresses each of its file objects into an
+ * #EusFilezCache, so that the first clients to pull the commit are served
+ * from the cache rather than waiting for their objects to be compressed.
+ *
+ * Commits are warmed up one at a time, in a thread at the lowest CPU and I/O
+ * priority. Objects which are already in the cache are skipped, so if the
+ * warm-up is cancelled (for example, because the server exits), it carries on
+ * where it left off the next time the commit is queued.
+ *
+ * #EusFilezWarmer:n-pending counts the commits which are queued or being
+ * warmed up, so the server can stay running until the warm-up is done.
+ *
+ * No more objects are compressed once half of the cache’s size has been
+ * written in one warm-up, so that a large commit does not evict its own
+ * objects (or everything else) from the cache.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Size of the buffer to read compressed objects into. */
+#define WARM_BUFFER_SIZE (256 * 1024)
+
+/* Highest zlib compression level. */
+#define MAX_COMPRESSION_LEVEL 9
+
+#ifdef __linux__
+/* From linux/ioprio.h, which is not always installed. */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+typedef struct
+{
+  OstreeRepo *repo;  /* (owned) */
+  EusFilezCache *cache;  /* (owned) */
+  gchar *commit;  /* (owned) */
+  gint compression_level;
+} WarmData;
+
+static void
+warm_data_free (WarmData *data)
+{
+  g_clear_object (&data->repo);
+  g_clear_object (&data->cache);
+  g_free (data->commit);
+  g_free (data);
+}
+
+/**
+ * EusFilezWarmer:
+ *
+ * A queue of commits whose objects are to be compressed into a cache in the
+ * background.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusFilezWarmer
+{
+  GObject parent_instance;
+
+  OstreeRepo *repo;  /* (owned) */
+  EusFilezCache *cache;  /* (owned) */
+  gint compression_level;
+
+  GQueue queue;  /* (element-type utf8) (owned) commit checksums */
+  GCancellable *cancellable;  /* (owned) (nullable) for the running warm-up */
+  gboolean running;
+  gboolean cancelled;
+};
+
+G_DEFINE_TYPE (EusFilezWarmer, eus_filez_warmer, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_REPO = 1,
+  PROP_CACHE,
+  PROP_COMPRESSION_LEVEL,
+  PROP_N_PENDING,
+} EusFilezWarmerProperty;
+
+static GParamSpec *props[PROP_N_PENDING + 1] = { NULL, };
+
+static void
+eus_filez_warmer_init (EusFilezWarmer *self)
+{
+  g_queue_init (&self->queue);
+}
+
+static void
+eus_filez_warmer_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *spec)
+{
+  EusFilezWarmer *self = EUS_FILEZ_WARMER (object);
+
+  switch ((EusFilezWarmerProperty) property_id)
+    {
+    case PROP_REPO:
+      g_value_set_object (value, self->repo);
+      break;
+
+    case PROP_CACHE:
+      g_value_set_object (value, self->cache);
+      break;
+
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_int (value, self->compression_level);
+      break;
+
+    case PROP_N_PENDING:
+      g_value_set_uint (value, eus_filez_warmer_get_n_pending (self));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_filez_warmer_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *spec)
+{
+  EusFilezWarmer *self = EUS_FILEZ_WARMER (object);
+
+  switch ((EusFilezWarmerProperty) property_id)
+    {
+    case PROP_REPO:
+      g_set_object (&self->repo, g_value_get_object (value));
+      break;
+
+    case PROP_CACHE:
+      g_set_object (&self->cache, g_value_get_object (value));
+      break;
+
+    case PROP_COMPRESSION_LEVEL:
+      self->compression_level = g_value_get_int (value);
+      break;
+
+    case PROP_N_PENDING:
+      /* Read only. */
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_filez_warmer_dispose (GObject *object)
+{
+  EusFilezWarmer *self = EUS_FILEZ_WARMER (object);
+
+  /* A running warm-up holds a reference, so there can’t be one now. */
+  g_assert (!self->running);
+
+  g_queue_foreach (&self->queue, (GFunc) g_free, NULL);
+  g_queue_clear (&self->queue);
+  g_clear_object (&self->cancellable);
+  g_clear_object (&self->cache);
+  g_clear_object (&self->repo);
+
+  G_OBJECT_CLASS (eus_filez_warmer_parent_class)->dispose (object);
+}
+
+static void
+eus_filez_warmer_class_init (EusFilezWarmerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = eus_filez_warmer_dispose;
+  object_class->get_property = eus_filez_warmer_get_property;
+  object_class->set_property = eus_filez_warmer_set_property;
+
+  /**
+   * EusFilezWarmer:repo:
+   *
+   * Bare repository containing the commits to warm up.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_REPO] = g_param_spec_object ("repo",
+                                          "Repo",
+                                          "Bare repository containing the commits to warm up.",
+                                          OSTREE_TYPE_REPO,
+                                          G_PARAM_READWRITE |
+                                          G_PARAM_CONSTRUCT_ONLY |
+                                          G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusFilezWarmer:cache:
+   *
+   * Cache to compress the objects into.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CACHE] = g_param_spec_object ("cache",
+                                           "Cache",
+                                           "Cache to compress the objects into.",
+                                           EUS_TYPE_FILEZ_CACHE,
+                                           G_PARAM_READWRITE |
+                                           G_PARAM_CONSTRUCT_ONLY |
+                                           G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusFilezWarmer:compression-level:
+   *
+   * zlib compression level to compress the objects at. Objects which do not
+   * compress are stored at level 0, as when they are requested.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_COMPRESSION_LEVEL] = g_param_spec_int ("compression-level",
+                                                    "Compression Level",
+                                                    "zlib compression level to compress the objects at.",
+                                                    0, MAX_COMPRESSION_LEVEL, 2,
+                                                    G_PARAM_READWRITE |
+                                                    G_PARAM_CONSTRUCT_ONLY |
+                                                    G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusFilezWarmer:n-pending:
+   *
+   * Number of commits which are queued or being warmed up.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_N_PENDING] = g_param_spec_uint ("n-pending",
+                                             "Pending Commits",
+                                             "Number of commits which are queued or being warmed up.",
+                                             0, G_MAXUINT, 0,
+                                             G_PARAM_READABLE |
+                                             G_PARAM_EXPLICIT_NOTIFY |
+                                             G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/* Whether @checksum is in the cache at any compression level. */
+static gboolean
+object_is_cached (EusFilezCache *cache,
+                  const gchar   *checksum)
+{
+  gint level;
+
+  for (level = 0; level <= MAX_COMPRESSION_LEVEL; level++)
+    if (eus_filez_cache_contains (cache, checksum, level))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Compress the object @checksum into the cache, returning the compressed size
+ * in @out_size. */
+static gboolean
+warm_object (WarmData      *data,
+             const gchar   *checksum,
+             guint8        *buffer,
+             guint64       *out_size,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(EusFilezCacheWriter) writer = NULL;
+  guint64 uncompressed_size;
+  gint compression_level;
+  guint64 size = 0;
+
+  if (!eus_load_filez_stream (data->repo, checksum, data->compression_level,
+                              TRUE, cancellable, &stream, &uncompressed_size,
+                              &compression_level, error))
+    return FALSE;
+
+  writer = eus_filez_cache_writer_new (data->cache, checksum,
+                                       compression_level, error);
+  if (writer == NULL)
+    return FALSE;
+
+  while (TRUE)
+    {
+      gssize n_read = g_input_stream_read (stream, buffer, WARM_BUFFER_SIZE,
+                                           cancellable, error);
+
+      if (n_read < 0)
+        return FALSE;
+      if (n_read == 0)
+        break;
+
+      if (!eus_filez_cache_writer_write (writer, buffer, n_read, error))
+        return FALSE;
+      size += n_read;
+    }
+
+  if (!eus_filez_cache_writer_commit (writer, error))
+    return FALSE;
+
+  *out_size = size;
+  return TRUE;
+}
+
+static gboolean
+warm_commit (WarmData      *data,
+             GCancellable  *cancellable,
+             GError       **error)
+{
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autofree guint8 *buffer = NULL;
+  GHashTableIter iter;
+  GVariant *object_name;
+  guint64 cache_max_size, budget, written = 0;
+  guint n_compressed = 0, n_cached = 0, n_failed = 0;
+
+  if (!ostree_repo_traverse_commit (data->repo, data->commit, 0, &reachable,
+                                    cancellable, error))
+    return FALSE;
+
+  g_object_get (data->cache, "max-size", &cache_max_size, NULL);
+  budget = cache_max_size / 2;
+  buffer = g_malloc (WARM_BUFFER_SIZE);
+
+  g_hash_table_iter_init (&iter, reachable);
+
+  while (g_hash_table_iter_next (&iter, (gpointer *) &object_name, NULL))
+    {
+      const gchar *checksum;
+      OstreeObjectType object_type;
+      g_autoptr(GError) local_error = NULL;
+      guint64 size;
+
+      ostree_object_name_deserialize (object_name, &checksum, &object_type);
+      if (object_type != OSTREE_OBJECT_TYPE_FILE)
+        continue;
+
+      if (object_is_cached (data->cache, checksum))
+        {
+          n_cached++;
+          continue;
+        }
+
+      if (written >= budget)
+        {
+          g_message ("Stopped warming up commit %s: written %" G_GUINT64_FORMAT
+                     " bytes, which is half the cache", data->commit, written);
+          break;
+        }
+
+      if (!warm_object (data, checksum, buffer, &size, cancellable, &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+
+          /* Carry on with the other objects; this one will be compressed
+           * when it is requested. */
+          g_debug ("Failed to warm up object %s: %s", checksum,
+                   local_error->message);
+          n_failed++;
+          continue;
+        }
+
+      written += size;
+      n_compressed++;
+    }
+
+  g_message ("Warmed up commit %s: compressed %u objects (%" G_GUINT64_FORMAT
+             " bytes); %u were already cached and %u failed",
+             data->commit, n_compressed, written, n_cached, n_failed);
+
+  return TRUE;
+}
+
+static gpointer
+warm_thread_cb (gpointer user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  WarmData *data = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+
+#ifdef __linux__
+  /* On Linux, these only deprioritise the calling thread, not the whole
+   * process. */
+  if (setpriority (PRIO_PROCESS, 0, 19) != 0)
+    g_debug ("%s: Failed to lower thread CPU priority", G_STRFUNC);
+  if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+    g_debug ("%s: Failed to lower thread I/O priority", G_STRFUNC);
+#endif
+
+  if (warm_commit (data, g_task_get_cancellable (task), &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, g_steal_pointer (&error));
+
+  return NULL;
+}
+
+static void warm_cb (GObject      *source_object,
+                     GAsyncResult *result,
+                     gpointer      user_data);
+
+static void
+maybe_start_next (EusFilezWarmer *self)
+{
+  g_autoptr(GTask) task = NULL;
+  WarmData *data;
+
+  if (self->running || self->cancelled || g_queue_is_empty (&self->queue))
+    return;
+
+  data = g_new0 (WarmData, 1);
+  data->repo = g_object_ref (self->repo);
+  data->cache = g_object_ref (self->cache);
+  data->commit = g_queue_pop_head (&self->queue);
+  data->compression_level = self->compression_level;
+
+  g_debug ("%s: Warming up commit %s", G_STRFUNC, data->commit);
+
+  g_clear_object (&self->cancellable);
+  self->cancellable = g_cancellable_new ();
+  self->running = TRUE;
+
+  /* The task has no source object, so the warmer is never finalised in the
+   * warm-up thread; the callback holds a reference to it instead. */
+  task = g_task_new (NULL, self->cancellable, warm_cb, g_object_ref (self));
+  g_task_set_source_tag (task, maybe_start_next);
+  g_task_set_task_data (task, data, (GDestroyNotify) warm_data_free);
+
+  /* Use a dedicated thread, as its priority is lowered. */
+  g_thread_unref (g_thread_new ("filez-warmer", warm_thread_cb,
+                                g_steal_pointer (&task)));
+}
+
+static void
+warm_cb (GObject      *source_object,
+         GAsyncResult *result,
+         gpointer      user_data)
+{
+  g_autoptr(EusFilezWarmer) self = EUS_FILEZ_WARMER (user_data);
+  WarmData *data = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("Cancelled warming up commit %s", data->commit);
+      else
+        g_message ("Failed to warm up commit %s: %s", data->commit,
+                   error->message);
+    }
+
+  self->running = FALSE;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+
+  maybe_start_next (self);
+}
+
+/**
+ * eus_filez_warmer_new:
+ * @repo: bare repository containing the commits to warm up
+ * @cache: cache to compress the objects into
+ * @compression_level: zlib compression level to compress the objects at
+ *
+ * Create a new #EusFilezWarmer.
+ *
+ * Returns: (transfer full): a new #EusFilezWarmer
+ * Since: UNRELEASED
+ */
+EusFilezWarmer *
+eus_filez_warmer_new (OstreeRepo    *repo,
+                      EusFilezCache *cache,
+                      gint           compression_level)
+{
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), NULL);
+  g_return_val_if_fail (EUS_IS_FILEZ_CACHE (cache), NULL);
+  g_return_val_if_fail (compression_level >= 0 &&
+                        compression_level <= MAX_COMPRESSION_LEVEL, NULL);
+
+  return g_object_new (EUS_TYPE_FILEZ_WARMER,
+                       "repo", repo,
+                       "cache", cache,
+                       "compression-level", compression_level,
+                       NULL);
+}
+
+/**
+ * eus_filez_warmer_get_n_pending:
+ * @self: an #EusFilezWarmer
+ *
+ * Get the value of #EusFilezWarmer:n-pending.
+ *
+ * Returns: number of commits which are queued or being warmed up
+ * Since: UNRELEASED
+ */
+guint
+eus_filez_warmer_get_n_pending (EusFilezWarmer *self)
+{
+  g_return_val_if_fail (EUS_IS_FILEZ_WARMER (self), 0);
+
+  return g_queue_get_length (&self->queue) + (self->running ? 1 : 0);
+}
+
+/**
+ * eus_filez_warmer_queue:
+ * @self: an #EusFilezWarmer
+ * @commit: checksum of the commit to warm up
+ *
+ * Queue compressing the file objects of @commit into the cache. Nothing
+ * happens if @commit is already queued. Failures are logged.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_filez_warmer_queue (EusFilezWarmer *self,
+                        const gchar    *commit)
+{
+  g_return_if_fail (EUS_IS_FILEZ_WARMER (self));
+  g_return_if_fail (ostree_validate_checksum_string (commit, NULL));
+
+  if (self->cancelled ||
+      g_queue_find_custom (&self->queue, commit, (GCompareFunc) g_strcmp0) != NULL)
+    return;
+
+  g_queue_push_tail (&self->queue, g_strdup (commit));
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+
+  maybe_start_next (self);
+}
+
+/**
+ * eus_filez_warmer_cancel:
+ * @self: an #EusFilezWarmer
+ *
+ * Drop all queued commits, cancel the warm-up which is running, and ignore
+ * any commits which are queued later. Objects which have already been
+ * compressed stay in the cache.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_filez_warmer_cancel (EusFilezWarmer *self)
+{
+  g_return_if_fail (EUS_IS_FILEZ_WARMER (self));
+
+  self->cancelled = TRUE;
+
+  g_queue_foreach (&self->queue, (GFunc) g_free, NULL);
+  g_queue_clear (&self->queue);
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_N_PENDING]);
+
+  if (self->cancellable != NULL)
+    g_cancellable_cancel (self->cancellable);
+}
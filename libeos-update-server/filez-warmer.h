@@ -0,0 +1,46 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/filez-cache.h>
+#include <ostree.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_FILEZ_WARMER eus_filez_warmer_get_type ()
+G_DECLARE_FINAL_TYPE (EusFilezWarmer, eus_filez_warmer, EUS, FILEZ_WARMER, GObject)
+
+EusFilezWarmer *eus_filez_warmer_new (OstreeRepo    *repo,
+                                      EusFilezCache *cache,
+                                      gint           compression_level);
+
+guint eus_filez_warmer_get_n_pending (EusFilezWarmer *self);
+
+void eus_filez_warmer_queue (EusFilezWarmer *self,
+                             const gchar    *commit);
+void eus_filez_warmer_cancel (EusFilezWarmer *self);
+
+G_END_DECLS
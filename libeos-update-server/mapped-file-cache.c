@@ -0,0 +1,637 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <libeos-update-server/mapped-file-cache.h>
+
+#include <sys/stat.h>
+
+/**
+ * SECTION:mapped-file-cache
+ * @title: Mapped file cache
+ * @short_description: In-memory cache of mapped repository files
+ * @include: libeos-update-server/mapped-file-cache.h
+ *
+ * A cache of #GMappedFiles for small files in a repository, such as
+ * metadata objects and the summary, keyed by their absolute path, or by a
+ * key derived from their content for files which never change (see
+ * eus_mapped_file_cache_insert_immutable()). A pull
+ * requests thousands of these, so looking them up here saves the stat(),
+ * open() and mmap() calls which would otherwise be made for each request; a
+ * lookup does not make any system calls.
+ *
+ * Each directory which contains a cached file is watched with a
+ * #GFileMonitor, and entries are dropped as soon as the file they were loaded
+ * from is changed, replaced or deleted. The monitors are removed again once
+ * their directory has no entries left. The monitors all run in a thread
+ * owned by the cache, so entries are invalidated whichever threads insert
+ * and look them up, and whether or not their main contexts are running.
+ * Entries inserted with eus_mapped_file_cache_insert_immutable()
+ * are not watched, so a cache can be shared between several repositories
+ * and hold each content object once, whichever repository it was loaded from.
+ *
+ * The total size of the entries is kept below #EusMappedFileCache:max-size,
+ * and the number of entries below an internal limit, by evicting the least
+ * recently used entries.
+ *
+ * All methods are thread safe.
+ *
+ * Since: UNRELEASED
+ */
+
+/* Upper bound on the number of entries, so the number of mappings stays well
+ * below the kernel’s limit on them (vm.max_map_count). */
+#define MAX_ENTRIES 4096
+
+typedef struct
+{
+  GFileMonitor *monitor;  /* (owned) */
+  gchar *path;  /* (owned) key in the directories table */
+  guint n_entries;
+  gulong changed_id;
+} WatchedDir;
+
+typedef struct
+{
+  gchar *path;  /* (owned) key in the entries table */
+  WatchedDir *dir;  /* (unowned) (nullable) NULL for immutable entries */
+  GMappedFile *mapping;  /* (owned) */
+  gint64 mtime;
+  GList link;  /* embedded node of EusMappedFileCache.lru; data points to this entry */
+} CacheEntry;
+
+static void
+watched_dir_free (WatchedDir *dir)
+{
+  g_signal_handler_disconnect (dir->monitor, dir->changed_id);
+  g_file_monitor_cancel (dir->monitor);
+  g_object_unref (dir->monitor);
+  g_free (dir->path);
+  g_free (dir);
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_mapped_file_unref (entry->mapping);
+  g_free (entry->path);
+  g_free (entry);
+}
+
+/**
+ * EusMappedFileCache:
+ *
+ * A size-limited in-memory cache of mapped files.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusMappedFileCache
+{
+  GObject parent_instance;
+
+  guint64 max_size;
+
+  /* The file monitors are created in, and deliver their events to, this
+   * context, which is run by monitor_thread for the lifetime of the cache. */
+  GMainContext *monitor_context;  /* (owned) */
+  GMainLoop *monitor_loop;  /* (owned) */
+  GThread *monitor_thread;  /* (owned) */
+
+  GMutex lock;  /* protects all the fields below */
+  GHashTable *entries;  /* (owned) (element-type filename CacheEntry) */
+  GHashTable *dirs;  /* (owned) (element-type filename WatchedDir) */
+  GQueue lru;  /* (element-type CacheEntry) most recently used first */
+  guint64 total_size;
+};
+
+G_DEFINE_TYPE (EusMappedFileCache, eus_mapped_file_cache, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_MAX_SIZE = 1,
+} EusMappedFileCacheProperty;
+
+static GParamSpec *props[PROP_MAX_SIZE + 1] = { NULL, };
+
+static gpointer
+monitor_thread_cb (gpointer user_data)
+{
+  g_autoptr(GMainLoop) loop = user_data;
+  GMainContext *context = g_main_loop_get_context (loop);
+
+  g_main_context_push_thread_default (context);
+  g_main_loop_run (loop);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static gboolean
+quit_loop_cb (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+eus_mapped_file_cache_init (EusMappedFileCache *self)
+{
+  self->monitor_context = g_main_context_new ();
+  self->monitor_loop = g_main_loop_new (self->monitor_context, FALSE);
+  self->monitor_thread = g_thread_new ("eus-file-monitor", monitor_thread_cb,
+                                       g_main_loop_ref (self->monitor_loop));
+
+  g_mutex_init (&self->lock);
+  self->entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) cache_entry_free);
+  self->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                      (GDestroyNotify) watched_dir_free);
+  g_queue_init (&self->lru);
+}
+
+static void
+eus_mapped_file_cache_get_property (GObject    *object,
+                                    guint       property_id,
+                                    GValue     *value,
+                                    GParamSpec *spec)
+{
+  EusMappedFileCache *self = EUS_MAPPED_FILE_CACHE (object);
+
+  switch ((EusMappedFileCacheProperty) property_id)
+    {
+    case PROP_MAX_SIZE:
+      g_value_set_uint64 (value, self->max_size);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_mapped_file_cache_set_property (GObject      *object,
+                                    guint         property_id,
+                                    const GValue *value,
+                                    GParamSpec   *spec)
+{
+  EusMappedFileCache *self = EUS_MAPPED_FILE_CACHE (object);
+
+  switch ((EusMappedFileCacheProperty) property_id)
+    {
+    case PROP_MAX_SIZE:
+      self->max_size = g_value_get_uint64 (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_mapped_file_cache_finalize (GObject *object)
+{
+  EusMappedFileCache *self = EUS_MAPPED_FILE_CACHE (object);
+  g_autoptr(GSource) source = NULL;
+
+  /* Stop the monitor thread first, so no events are delivered while the
+   * monitors are freed. g_main_loop_quit() would be lost if the thread had
+   * not started running the loop yet. */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, quit_loop_cb, self->monitor_loop, NULL);
+  g_source_attach (source, self->monitor_context);
+  g_thread_join (g_steal_pointer (&self->monitor_thread));
+
+  /* The queue links are embedded in the entries, so they are freed along with
+   * the hash table. The entries must go before the directories they point
+   * to. */
+  g_queue_init (&self->lru);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+  g_clear_pointer (&self->dirs, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+
+  g_clear_pointer (&self->monitor_loop, g_main_loop_unref);
+  g_clear_pointer (&self->monitor_context, g_main_context_unref);
+
+  G_OBJECT_CLASS (eus_mapped_file_cache_parent_class)->finalize (object);
+}
+
+static void
+eus_mapped_file_cache_class_init (EusMappedFileCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eus_mapped_file_cache_finalize;
+  object_class->get_property = eus_mapped_file_cache_get_property;
+  object_class->set_property = eus_mapped_file_cache_set_property;
+
+  /**
+   * EusMappedFileCache:max-size:
+   *
+   * Maximum total size of the cached files, in bytes. Files larger than this
+   * are never cached.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_SIZE] = g_param_spec_uint64 ("max-size",
+                                              "Max Size",
+                                              "Maximum total size of the cached files, in bytes.",
+                                              0,
+                                              G_MAXUINT64,
+                                              0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/* Remove @entry from the cache, and stop watching its directory if it was
+ * the last entry in it. Must be called with the lock held. @entry is freed. */
+static void
+remove_entry_unlocked (EusMappedFileCache *self,
+                       CacheEntry         *entry)
+{
+  WatchedDir *dir = entry->dir;
+
+  g_queue_unlink (&self->lru, &entry->link);
+  self->total_size -= g_mapped_file_get_length (entry->mapping);
+  g_hash_table_remove (self->entries, entry->path);
+
+  if (dir != NULL && --dir->n_entries == 0)
+    g_hash_table_remove (self->dirs, dir->path);
+}
+
+static void
+invalidate_file (EusMappedFileCache *self,
+                 GFile              *file)
+{
+  g_autofree gchar *path = NULL;
+  CacheEntry *entry;
+
+  if (file == NULL)
+    return;
+
+  path = g_file_get_path (file);
+  if (path == NULL)
+    return;
+
+  g_mutex_lock (&self->lock);
+
+  entry = g_hash_table_lookup (self->entries, path);
+  if (entry != NULL)
+    {
+      g_debug ("Invalidating cached mapping of %s", path);
+      remove_entry_unlocked (self, entry);
+    }
+
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+dir_changed_cb (GFileMonitor      *monitor,
+                GFile             *file,
+                GFile             *other_file,
+                GFileMonitorEvent  event_type,
+                gpointer           user_data)
+{
+  EusMappedFileCache *self = EUS_MAPPED_FILE_CACHE (user_data);
+
+  /* Any event for a file means its cached mapping may be stale. For renames,
+   * both the old and new names are affected. */
+  invalidate_file (self, file);
+  invalidate_file (self, other_file);
+}
+
+/* A request for the monitor thread to start watching a directory. */
+typedef struct
+{
+  EusMappedFileCache *cache;  /* (unowned) */
+  const gchar *dir_path;  /* (unowned) */
+
+  GMutex lock;  /* protects all the fields below */
+  GCond cond;
+  gboolean done;
+  WatchedDir *dir;  /* (owned) (nullable) */
+  GError *error;  /* (owned) (nullable) */
+} CreateMonitorData;
+
+static gboolean
+create_monitor_cb (gpointer user_data)
+{
+  CreateMonitorData *data = user_data;
+  g_autoptr(GFile) dir_file = g_file_new_for_path (data->dir_path);
+  GFileMonitor *monitor;
+  WatchedDir *dir = NULL;
+  GError *error = NULL;
+
+  monitor = g_file_monitor_directory (dir_file, G_FILE_MONITOR_WATCH_MOVES,
+                                      NULL, &error);
+  if (monitor != NULL)
+    {
+      dir = g_new0 (WatchedDir, 1);
+      dir->path = g_strdup (data->dir_path);
+      dir->monitor = monitor;
+      dir->changed_id = g_signal_connect (dir->monitor, "changed",
+                                          (GCallback) dir_changed_cb,
+                                          data->cache);
+    }
+
+  g_mutex_lock (&data->lock);
+  data->dir = dir;
+  data->error = error;
+  data->done = TRUE;
+  g_cond_signal (&data->cond);
+  g_mutex_unlock (&data->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Start watching the directory at @dir_path, in the monitor thread, and wait
+ * until it is watched. This must not be called with the lock held, as the
+ * monitor thread takes the lock to deliver events. */
+static WatchedDir *
+create_watched_dir (EusMappedFileCache  *self,
+                    const gchar         *dir_path,
+                    GError             **error)
+{
+  CreateMonitorData data = { NULL, };
+
+  data.cache = self;
+  data.dir_path = dir_path;
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+
+  g_main_context_invoke (self->monitor_context, create_monitor_cb, &data);
+
+  g_mutex_lock (&data.lock);
+  while (!data.done)
+    g_cond_wait (&data.cond, &data.lock);
+  g_mutex_unlock (&data.lock);
+
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  if (data.error != NULL)
+    g_propagate_error (error, data.error);
+
+  return data.dir;
+}
+
+/* Get the watch for the directory containing @path, starting to watch it if
+ * needed. Must be called with the lock held; if the directory is not watched
+ * yet, the lock is released while the watch is set up, so the caller must
+ * not rely on anything it looked up before calling this. */
+static WatchedDir *
+ensure_watched_dir_unlocked (EusMappedFileCache  *self,
+                             const gchar         *path,
+                             GError             **error)
+{
+  g_autofree gchar *dir_path = g_path_get_dirname (path);
+  WatchedDir *dir, *new_dir;
+
+  dir = g_hash_table_lookup (self->dirs, dir_path);
+  if (dir != NULL)
+    return dir;
+
+  g_mutex_unlock (&self->lock);
+  new_dir = create_watched_dir (self, dir_path, error);
+  g_mutex_lock (&self->lock);
+
+  if (new_dir == NULL)
+    return NULL;
+
+  /* Another thread may have started watching the directory meanwhile. */
+  dir = g_hash_table_lookup (self->dirs, dir_path);
+  if (dir != NULL)
+    {
+      watched_dir_free (new_dir);
+      return dir;
+    }
+
+  g_hash_table_insert (self->dirs, new_dir->path, new_dir);
+
+  return new_dir;
+}
+
+/**
+ * eus_mapped_file_cache_new:
+ * @max_size: maximum total size of the cached files, in bytes
+ *
+ * Create a new, empty #EusMappedFileCache.
+ *
+ * Returns: (transfer full): a new #EusMappedFileCache
+ * Since: UNRELEASED
+ */
+EusMappedFileCache *
+eus_mapped_file_cache_new (guint64 max_size)
+{
+  return g_object_new (EUS_TYPE_MAPPED_FILE_CACHE,
+                       "max-size", max_size,
+                       NULL);
+}
+
+/* Add a new entry for @mapping under @key, and evict least recently used
+ * entries until the cache is within its limits again. Must be called with the
+ * lock held, and @key must not already be in the cache. */
+static void
+insert_entry_unlocked (EusMappedFileCache *self,
+                       const gchar        *key,
+                       WatchedDir         *dir,
+                       GMappedFile        *mapping,
+                       gint64              mtime)
+{
+  CacheEntry *entry;
+
+  entry = g_new0 (CacheEntry, 1);
+  entry->path = g_strdup (key);
+  entry->dir = dir;
+  entry->mapping = g_mapped_file_ref (mapping);
+  entry->mtime = mtime;
+  entry->link.data = entry;
+
+  g_hash_table_insert (self->entries, entry->path, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  if (dir != NULL)
+    dir->n_entries++;
+  self->total_size += g_mapped_file_get_length (mapping);
+
+  while ((self->total_size > self->max_size ||
+          g_hash_table_size (self->entries) > MAX_ENTRIES) &&
+         self->lru.tail != &entry->link)
+    remove_entry_unlocked (self, self->lru.tail->data);
+}
+
+/**
+ * eus_mapped_file_cache_lookup:
+ * @self: an #EusMappedFileCache
+ * @path: absolute path of the file to look up, or the key it was inserted
+ *    under with eus_mapped_file_cache_insert_immutable()
+ * @out_mtime: (out caller-allocates): return location for the modification
+ *    time of the file when it was mapped, in seconds since the epoch
+ *
+ * Look up the mapping of the file at @path, and mark it as the most recently
+ * used entry.
+ *
+ * Returns: (transfer full) (nullable): the mapped file, or %NULL if it is not
+ *    in the cache
+ * Since: UNRELEASED
+ */
+GMappedFile *
+eus_mapped_file_cache_lookup (EusMappedFileCache *self,
+                              const gchar        *path,
+                              gint64             *out_mtime)
+{
+  CacheEntry *entry;
+  GMappedFile *mapping = NULL;
+
+  g_return_val_if_fail (EUS_IS_MAPPED_FILE_CACHE (self), NULL);
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (out_mtime != NULL, NULL);
+
+  g_mutex_lock (&self->lock);
+
+  entry = g_hash_table_lookup (self->entries, path);
+  if (entry != NULL)
+    {
+      g_queue_unlink (&self->lru, &entry->link);
+      g_queue_push_head_link (&self->lru, &entry->link);
+
+      mapping = g_mapped_file_ref (entry->mapping);
+      *out_mtime = entry->mtime;
+    }
+
+  g_mutex_unlock (&self->lock);
+
+  return mapping;
+}
+
+/**
+ * eus_mapped_file_cache_insert:
+ * @self: an #EusMappedFileCache
+ * @path: absolute path of the file which @mapping is of
+ * @mapping: mapping of the file
+ * @stat_buf: the result of calling stat() on @path before mapping it
+ *
+ * Add @mapping to the cache, evicting least recently used entries to make
+ * space for it if needed. If the file has changed since @stat_buf was
+ * filled in, or it cannot be watched for changes, nothing is cached.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_mapped_file_cache_insert (EusMappedFileCache *self,
+                              const gchar        *path,
+                              GMappedFile        *mapping,
+                              const struct stat  *stat_buf)
+{
+  g_autoptr(GError) error = NULL;
+  struct stat current_buf;
+  WatchedDir *dir;
+  gsize size;
+
+  g_return_if_fail (EUS_IS_MAPPED_FILE_CACHE (self));
+  g_return_if_fail (g_path_is_absolute (path));
+  g_return_if_fail (mapping != NULL);
+  g_return_if_fail (stat_buf != NULL);
+
+  size = g_mapped_file_get_length (mapping);
+  if (size > self->max_size)
+    return;
+
+  g_mutex_lock (&self->lock);
+
+  if (g_hash_table_contains (self->entries, path))
+    goto out;
+
+  dir = ensure_watched_dir_unlocked (self, path, &error);
+  if (dir == NULL)
+    {
+      g_debug ("Not caching %s: %s", path, error->message);
+      goto out;
+    }
+
+  /* The directory is only watched from now on, so check the file has not been
+   * replaced or changed since it was mapped; any later change will be
+   * noticed. Another thread may also have inserted the file while the lock
+   * was released to set up the watch. */
+  if (g_hash_table_contains (self->entries, path) ||
+      g_stat (path, &current_buf) != 0 ||
+      current_buf.st_dev != stat_buf->st_dev ||
+      current_buf.st_ino != stat_buf->st_ino ||
+      current_buf.st_size != stat_buf->st_size ||
+      current_buf.st_mtime != stat_buf->st_mtime)
+    {
+      if (dir->n_entries == 0)
+        g_hash_table_remove (self->dirs, dir->path);
+      goto out;
+    }
+
+  insert_entry_unlocked (self, path, dir, mapping, stat_buf->st_mtime);
+
+out:
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * eus_mapped_file_cache_insert_immutable:
+ * @self: an #EusMappedFileCache
+ * @key: key identifying the content of @mapping, such as an object checksum;
+ *    must not be an absolute path
+ * @mapping: mapping of the file
+ * @mtime: modification time of the file, in seconds since the epoch
+ *
+ * Add @mapping to the cache under @key, evicting least recently used entries
+ * to make space for it if needed. The file is not watched for changes, so
+ * this must only be used for content which can never change for a given
+ * @key, such as content addressed objects. If @key is already in the cache,
+ * the existing entry is kept.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_mapped_file_cache_insert_immutable (EusMappedFileCache *self,
+                                        const gchar        *key,
+                                        GMappedFile        *mapping,
+                                        gint64              mtime)
+{
+  g_return_if_fail (EUS_IS_MAPPED_FILE_CACHE (self));
+  g_return_if_fail (key != NULL && !g_path_is_absolute (key));
+  g_return_if_fail (mapping != NULL);
+
+  if (g_mapped_file_get_length (mapping) > self->max_size)
+    return;
+
+  g_mutex_lock (&self->lock);
+
+  if (!g_hash_table_contains (self->entries, key))
+    insert_entry_unlocked (self, key, NULL, mapping, mtime);
+
+  g_mutex_unlock (&self->lock);
+}
@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <sys/stat.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_MAPPED_FILE_CACHE eus_mapped_file_cache_get_type ()
+G_DECLARE_FINAL_TYPE (EusMappedFileCache, eus_mapped_file_cache, EUS, MAPPED_FILE_CACHE, GObject)
+
+EusMappedFileCache *eus_mapped_file_cache_new (guint64 max_size);
+
+GMappedFile *eus_mapped_file_cache_lookup (EusMappedFileCache *self,
+                                           const gchar        *path,
+                                           gint64             *out_mtime);
+void eus_mapped_file_cache_insert (EusMappedFileCache *self,
+                                   const gchar        *path,
+                                   GMappedFile        *mapping,
+                                   const struct stat  *stat_buf);
+void eus_mapped_file_cache_insert_immutable (EusMappedFileCache *self,
+                                             const gchar        *key,
+                                             GMappedFile        *mapping,
+                                             gint64              mtime);
+
+G_END_DECLS
@@ -0,0 +1,662 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/router.h>
+#include <libsoup/soup.h>
+#include <time.h>
+
+/**
+ * SECTION:metrics
+ * @title: Metrics
+ * @short_description: Request counters and response time histograms
+ * @include: libeos-update-server/metrics.h
+ *
+ * Counts the requests handled by an #EusServer by the class of path they are
+ * for, the bytes sent and the responses by status, along with the hit rates of
+ * the caches and how often requests are deferred, rejected or aborted; and
+ * keeps a histogram of response times for each #EusMetricsHandler, from which
+ * percentiles are estimated with eus_metrics_get_percentile().
+ *
+ * The server reports each request as it is read and finished, and the
+ * repositories report which handler each request is routed to. Response
+ * times run from when the request was read until it was finished, so they
+ * include any time spent waiting to be admitted or for compression.
+ *
+ * eus_metrics_format() formats all the figures in the Prometheus text
+ * format, which the server serves at `/metrics`.
+ *
+ * All methods are thread safe.
+ *
+ * Since: UNRELEASED
+ */
+
+/* The classes of path which requests are counted by. */
+typedef enum
+{
+  PATH_CLASS_FILEZ,
+  PATH_CLASS_OBJECT,
+  PATH_CLASS_DELTA,
+  PATH_CLASS_EXTENSION,
+  PATH_CLASS_SUMMARY,
+  PATH_CLASS_CONFIG,
+  PATH_CLASS_REFS,
+  PATH_CLASS_OTHER,
+} PathClass;
+
+#define N_PATH_CLASSES (PATH_CLASS_OTHER + 1)
+#define N_HANDLERS (EUS_METRICS_HANDLER_NONE + 1)
+#define N_COUNTERS (EUS_METRICS_COUNTER_REQUESTS_REJECTED + 1)
+#define N_VALUES (EUS_METRICS_VALUE_PROCESS_CPU_TIME + 1)
+
+/* Indexed by #PathClass. */
+static const gchar * const path_class_names[] =
+  {
+    "filez", "object", "delta", "extension", "summary", "config", "refs", "other",
+  };
+
+/* Indexed by #EusMetricsHandler. */
+static const gchar * const handler_names[] =
+  {
+    "objects_filez", "as_is", "refs_heads", "config", "none",
+  };
+
+/* Indexed by status code / 100; 0 is for anything out of range. */
+static const gchar * const status_class_names[] =
+  {
+    "other", "1xx", "2xx", "3xx", "4xx", "5xx",
+  };
+
+typedef struct
+{
+  const gchar *name;
+  const gchar *labels;
+  const gchar *help;
+} CounterInfo;
+
+/* Indexed by #EusMetricsCounter. Counters with the same name must be
+ * adjacent. */
+static const CounterInfo counters[] =
+  {
+    { "eus_filez_lookups_total", "result=\"cache_hit\"", "Requests for .filez objects, by where they were sent from." },
+    { "eus_filez_lookups_total", "result=\"shared_stream\"", NULL },
+    { "eus_filez_lookups_total", "result=\"compressed\"", NULL },
+    { "eus_mapped_file_lookups_total", "result=\"hit\"", "Lookups of small files in the mapped file cache." },
+    { "eus_mapped_file_lookups_total", "result=\"miss\"", NULL },
+    { "eus_requests_deferred_total", NULL, "Requests which waited for other requests from the same client to finish." },
+    { "eus_requests_rejected_total", NULL, "Requests rejected because the server was overloaded." },
+  };
+
+typedef struct
+{
+  const gchar *name;
+  const gchar *type;
+  gboolean is_time;  /* in microseconds, formatted as seconds */
+  const gchar *help;
+} ValueInfo;
+
+/* Indexed by #EusMetricsValue. */
+static const ValueInfo values[] =
+  {
+    { "eus_pending_requests", "gauge", FALSE, "Requests in progress." },
+    { "eus_clients", "gauge", FALSE, "Clients with requests in progress." },
+    { "eus_compression_jobs", "gauge", FALSE, "Compression jobs queued or running." },
+    { "eus_compression_cpu_seconds_total", "counter", TRUE, "CPU time spent compressing objects." },
+    { "eus_process_cpu_seconds_total", "counter", TRUE, "CPU time used by the server." },
+  };
+
+G_STATIC_ASSERT (G_N_ELEMENTS (path_class_names) == N_PATH_CLASSES);
+G_STATIC_ASSERT (G_N_ELEMENTS (handler_names) == N_HANDLERS);
+G_STATIC_ASSERT (G_N_ELEMENTS (counters) == N_COUNTERS);
+G_STATIC_ASSERT (G_N_ELEMENTS (values) == N_VALUES);
+
+/* Upper bounds of the histogram buckets, in microseconds. A last bucket with
+ * no upper bound follows them. */
+static const gint64 bucket_bounds[] =
+  {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000, 300000000,
+  };
+
+#define N_BUCKETS (G_N_ELEMENTS (bucket_bounds) + 1)
+
+typedef struct
+{
+  guint64 counts[N_BUCKETS];
+  guint64 count;
+  gint64 sum;  /* microseconds */
+  gint64 max;  /* microseconds */
+} Histogram;
+
+static void
+histogram_add (Histogram *histogram,
+               gint64     duration)
+{
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (bucket_bounds); i++)
+    {
+      if (duration <= bucket_bounds[i])
+        break;
+    }
+
+  histogram->counts[i]++;
+  histogram->count++;
+  histogram->sum += duration;
+  histogram->max = MAX (histogram->max, duration);
+}
+
+/* Estimate the @percentile’th percentile by interpolating linearly within the
+ * bucket it falls in. */
+static gint64
+histogram_get_percentile (const Histogram *histogram,
+                          guint            percentile)
+{
+  guint64 target, below = 0;
+  gsize i;
+
+  if (histogram->count == 0)
+    return 0;
+
+  target = (histogram->count * percentile + 99) / 100;
+  target = CLAMP (target, 1, histogram->count);
+
+  for (i = 0; i < N_BUCKETS; i++)
+    {
+      gint64 lower, upper;
+
+      if (below + histogram->counts[i] < target)
+        {
+          below += histogram->counts[i];
+          continue;
+        }
+
+      lower = (i > 0) ? bucket_bounds[i - 1] : 0;
+      upper = (i < G_N_ELEMENTS (bucket_bounds)) ? bucket_bounds[i] : histogram->max;
+      upper = MIN (upper, histogram->max);
+      if (upper <= lower)
+        return upper;
+
+      return lower + (upper - lower) * (gint64) (target - below) / (gint64) histogram->counts[i];
+    }
+
+  return histogram->max;
+}
+
+/* Per-request state, attached to the #SoupMessage. */
+typedef struct
+{
+  gint64 start_time;  /* monotonic, in microseconds */
+  PathClass path_class;
+  EusMetricsHandler handler;
+} RequestData;
+
+/**
+ * EusMetrics:
+ *
+ * Counters and response time histograms for an #EusServer.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusMetrics
+{
+  GObject parent_instance;
+
+  GMutex lock;  /* protects the fields below */
+  guint64 requests[N_PATH_CLASSES];
+  guint64 bytes[N_PATH_CLASSES];
+  guint64 responses[G_N_ELEMENTS (status_class_names)];
+  guint64 aborted;
+  guint64 counters[N_COUNTERS];
+  guint64 values[N_VALUES];
+  Histogram histograms[N_HANDLERS];
+};
+
+G_DEFINE_TYPE (EusMetrics, eus_metrics, G_TYPE_OBJECT)
+
+static void
+eus_metrics_init (EusMetrics *self)
+{
+  g_mutex_init (&self->lock);
+}
+
+static void
+eus_metrics_finalize (GObject *object)
+{
+  EusMetrics *self = EUS_METRICS (object);
+
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_metrics_parent_class)->finalize (object);
+}
+
+static void
+eus_metrics_class_init (EusMetricsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eus_metrics_finalize;
+}
+
+static GQuark
+request_data_quark (void)
+{
+  return g_quark_from_static_string ("eus-metrics-request-data");
+}
+
+/**
+ * eus_metrics_new:
+ *
+ * Create a new #EusMetrics with all its figures at zero.
+ *
+ * Returns: (transfer full): a new #EusMetrics
+ * Since: UNRELEASED
+ */
+EusMetrics *
+eus_metrics_new (void)
+{
+  return g_object_new (EUS_TYPE_METRICS, NULL);
+}
+
+/**
+ * eus_metrics_request_started:
+ * @self: an #EusMetrics
+ * @msg: a request which has just been read
+ *
+ * Start timing @msg. Until it is routed, it is counted as a request for an
+ * unknown path, handled by %EUS_METRICS_HANDLER_NONE.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_metrics_request_started (EusMetrics  *self,
+                             SoupMessage *msg)
+{
+  RequestData *data;
+
+  g_return_if_fail (EUS_IS_METRICS (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+  data = g_new0 (RequestData, 1);
+  data->start_time = g_get_monotonic_time ();
+  data->path_class = PATH_CLASS_OTHER;
+  data->handler = EUS_METRICS_HANDLER_NONE;
+  g_object_set_qdata_full (G_OBJECT (msg), request_data_quark (), data, g_free);
+}
+
+static PathClass
+route_to_path_class (const EusRoute *route)
+{
+  switch (route->kind)
+    {
+    case EUS_ROUTE_OBJECT:
+      return (route->object_kind == EUS_OBJECT_FILEZ) ? PATH_CLASS_FILEZ : PATH_CLASS_OBJECT;
+    case EUS_ROUTE_DELTA:
+      return PATH_CLASS_DELTA;
+    case EUS_ROUTE_EXTENSION:
+      return PATH_CLASS_EXTENSION;
+    case EUS_ROUTE_SUMMARY:
+    case EUS_ROUTE_SUMMARY_SIG:
+      return PATH_CLASS_SUMMARY;
+    case EUS_ROUTE_CONFIG:
+      return PATH_CLASS_CONFIG;
+    case EUS_ROUTE_REFS_HEADS:
+      return PATH_CLASS_REFS;
+    case EUS_ROUTE_NOT_FOUND:
+    case EUS_ROUTE_FORBIDDEN:
+    default:
+      return PATH_CLASS_OTHER;
+    }
+}
+
+/**
+ * eus_metrics_request_routed:
+ * @self: an #EusMetrics
+ * @msg: a request passed to eus_metrics_request_started()
+ * @route: the parsed path of @msg
+ * @handler: the handler @msg is being passed to
+ *
+ * Record which class of path @msg is for, and which handler its response time
+ * counts towards.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_metrics_request_routed (EusMetrics        *self,
+                            SoupMessage       *msg,
+                            const EusRoute    *route,
+                            EusMetricsHandler  handler)
+{
+  RequestData *data;
+
+  g_return_if_fail (EUS_IS_METRICS (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+  g_return_if_fail (route != NULL);
+  g_return_if_fail ((guint) handler < N_HANDLERS);
+
+  data = g_object_get_qdata (G_OBJECT (msg), request_data_quark ());
+  if (data == NULL)
+    return;
+
+  data->path_class = route_to_path_class (route);
+  data->handler = handler;
+}
+
+/**
+ * eus_metrics_request_finished:
+ * @self: an #EusMetrics
+ * @msg: a request passed to eus_metrics_request_started()
+ * @aborted: %TRUE if the client went away before the response was sent
+ *
+ * Stop timing @msg, and count it.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_metrics_request_finished (EusMetrics  *self,
+                              SoupMessage *msg,
+                              gboolean     aborted)
+{
+  RequestData *data;
+  gint64 duration;
+  guint64 n_bytes;
+  guint status_class;
+
+  g_return_if_fail (EUS_IS_METRICS (self));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+
+  data = g_object_steal_qdata (G_OBJECT (msg), request_data_quark ());
+  if (data == NULL)
+    return;
+
+  duration = g_get_monotonic_time () - data->start_time;
+
+  /* Bodies sent with sendfile() are not in @msg’s body, but their length is
+   * in the headers. */
+  n_bytes = msg->response_body->length;
+  if (n_bytes == 0 && !aborted &&
+      (msg->status_code == SOUP_STATUS_OK ||
+       msg->status_code == SOUP_STATUS_PARTIAL_CONTENT))
+    n_bytes = MAX (soup_message_headers_get_content_length (msg->response_headers), 0);
+
+  status_class = msg->status_code / 100;
+  if (status_class >= G_N_ELEMENTS (status_class_names))
+    status_class = 0;
+
+  g_mutex_lock (&self->lock);
+  self->requests[data->path_class]++;
+  self->bytes[data->path_class] += n_bytes;
+  self->responses[status_class]++;
+  if (aborted)
+    self->aborted++;
+  histogram_add (&self->histograms[data->handler], duration);
+  g_mutex_unlock (&self->lock);
+
+  g_free (data);
+}
+
+/**
+ * eus_metrics_count:
+ * @self: an #EusMetrics
+ * @counter: the counter to increment
+ *
+ * Count an event.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_metrics_count (EusMetrics        *self,
+                   EusMetricsCounter  counter)
+{
+  g_return_if_fail (EUS_IS_METRICS (self));
+  g_return_if_fail ((guint) counter < N_COUNTERS);
+
+  g_mutex_lock (&self->lock);
+  self->counters[counter]++;
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * eus_metrics_set_value:
+ * @self: an #EusMetrics
+ * @value_id: the figure to set
+ * @value: its current value
+ *
+ * Update a figure which is kept by another component.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_metrics_set_value (EusMetrics      *self,
+                       EusMetricsValue  value_id,
+                       guint64          value)
+{
+  g_return_if_fail (EUS_IS_METRICS (self));
+  g_return_if_fail ((guint) value_id < N_VALUES);
+
+  g_mutex_lock (&self->lock);
+  self->values[value_id] = value;
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * eus_metrics_get_percentile:
+ * @self: an #EusMetrics
+ * @handler: the handler to get the response times of
+ * @percentile: the percentile to get, from 0 to 100
+ *
+ * Estimate a percentile of the response times of the requests routed to
+ * @handler so far. It is interpolated from the histogram, so is only
+ * accurate to within the bucket it falls in.
+ *
+ * Returns: the response time, in microseconds, or 0 if there have been no
+ *    requests
+ * Since: UNRELEASED
+ */
+guint64
+eus_metrics_get_percentile (EusMetrics        *self,
+                            EusMetricsHandler  handler,
+                            guint              percentile)
+{
+  gint64 result;
+
+  g_return_val_if_fail (EUS_IS_METRICS (self), 0);
+  g_return_val_if_fail ((guint) handler < N_HANDLERS, 0);
+  g_return_val_if_fail (percentile <= 100, 0);
+
+  g_mutex_lock (&self->lock);
+  result = histogram_get_percentile (&self->histograms[handler], percentile);
+  g_mutex_unlock (&self->lock);
+
+  return result;
+}
+
+static void
+append_seconds (GString *out,
+                gint64   usec)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  g_string_append (out, g_ascii_formatd (buf, sizeof (buf), "%.6f",
+                                         (gdouble) usec / G_USEC_PER_SEC));
+}
+
+static void
+append_header (GString     *out,
+               const gchar *name,
+               const gchar *type,
+               const gchar *help)
+{
+  g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n",
+                          name, help, name, type);
+}
+
+/* Must be called with the lock held. */
+static void
+append_histograms_unlocked (EusMetrics *self,
+                            GString    *out)
+{
+  static const guint percentiles[] = { 50, 95, 99 };
+  gsize i, j;
+
+  append_header (out, "eus_request_duration_seconds", "histogram",
+                 "Time from reading requests to finishing them, by handler.");
+
+  for (i = 0; i < N_HANDLERS; i++)
+    {
+      const Histogram *histogram = &self->histograms[i];
+      guint64 cumulative = 0;
+
+      for (j = 0; j < G_N_ELEMENTS (bucket_bounds); j++)
+        {
+          cumulative += histogram->counts[j];
+          g_string_append_printf (out, "eus_request_duration_seconds_bucket{handler=\"%s\",le=\"",
+                                  handler_names[i]);
+          append_seconds (out, bucket_bounds[j]);
+          g_string_append_printf (out, "\"} %" G_GUINT64_FORMAT "\n", cumulative);
+        }
+
+      g_string_append_printf (out,
+                              "eus_request_duration_seconds_bucket{handler=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n"
+                              "eus_request_duration_seconds_count{handler=\"%s\"} %" G_GUINT64_FORMAT "\n"
+                              "eus_request_duration_seconds_sum{handler=\"%s\"} ",
+                              handler_names[i], histogram->count,
+                              handler_names[i], histogram->count,
+                              handler_names[i]);
+      append_seconds (out, histogram->sum);
+      g_string_append_c (out, '\n');
+    }
+
+  append_header (out, "eus_request_duration_percentile_seconds", "gauge",
+                 "Estimated percentiles of the request durations, by handler.");
+
+  for (i = 0; i < N_HANDLERS; i++)
+    {
+      for (j = 0; j < G_N_ELEMENTS (percentiles); j++)
+        {
+          g_string_append_printf (out, "eus_request_duration_percentile_seconds{handler=\"%s\",percentile=\"%u\"} ",
+                                  handler_names[i], percentiles[j]);
+          append_seconds (out, histogram_get_percentile (&self->histograms[i],
+                                                         percentiles[j]));
+          g_string_append_c (out, '\n');
+        }
+    }
+}
+
+/**
+ * eus_metrics_format:
+ * @self: an #EusMetrics
+ *
+ * Format all the figures in the
+ * [Prometheus text format](https://prometheus.io/docs/instrumenting/exposition_formats/),
+ * which is also readable enough to be logged.
+ *
+ * Returns: (transfer full): the formatted figures
+ * Since: UNRELEASED
+ */
+gchar *
+eus_metrics_format (EusMetrics *self)
+{
+  GString *out;
+  gsize i;
+
+  g_return_val_if_fail (EUS_IS_METRICS (self), NULL);
+
+  out = g_string_new ("");
+
+  g_mutex_lock (&self->lock);
+
+  append_header (out, "eus_requests_total", "counter",
+                 "Requests finished, by class of path.");
+  for (i = 0; i < N_PATH_CLASSES; i++)
+    g_string_append_printf (out, "eus_requests_total{class=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            path_class_names[i], self->requests[i]);
+
+  append_header (out, "eus_response_bytes_total", "counter",
+                 "Bytes of response bodies produced, by class of path.");
+  for (i = 0; i < N_PATH_CLASSES; i++)
+    g_string_append_printf (out, "eus_response_bytes_total{class=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            path_class_names[i], self->bytes[i]);
+
+  append_header (out, "eus_responses_total", "counter",
+                 "Responses, by class of status code.");
+  for (i = 0; i < G_N_ELEMENTS (status_class_names); i++)
+    g_string_append_printf (out, "eus_responses_total{status=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                            status_class_names[i], self->responses[i]);
+
+  append_header (out, "eus_requests_aborted_total", "counter",
+                 "Requests whose clients went away before the response was sent.");
+  g_string_append_printf (out, "eus_requests_aborted_total %" G_GUINT64_FORMAT "\n",
+                          self->aborted);
+
+  for (i = 0; i < N_COUNTERS; i++)
+    {
+      if (counters[i].help != NULL)
+        append_header (out, counters[i].name, "counter", counters[i].help);
+
+      if (counters[i].labels != NULL)
+        g_string_append_printf (out, "%s{%s} %" G_GUINT64_FORMAT "\n",
+                                counters[i].name, counters[i].labels,
+                                self->counters[i]);
+      else
+        g_string_append_printf (out, "%s %" G_GUINT64_FORMAT "\n",
+                                counters[i].name, self->counters[i]);
+    }
+
+  for (i = 0; i < N_VALUES; i++)
+    {
+      append_header (out, values[i].name, values[i].type, values[i].help);
+      g_string_append_printf (out, "%s ", values[i].name);
+      if (values[i].is_time)
+        append_seconds (out, self->values[i]);
+      else
+        g_string_append_printf (out, "%" G_GUINT64_FORMAT, self->values[i]);
+      g_string_append_c (out, '\n');
+    }
+
+  append_histograms_unlocked (self, out);
+
+  g_mutex_unlock (&self->lock);
+
+  return g_string_free (out, FALSE);
+}
+
+/**
+ * eus_get_thread_cpu_time:
+ *
+ * Get the CPU time used by the calling thread so far, for measuring the CPU
+ * time spent on work done in worker threads.
+ *
+ * Returns: CPU time, in microseconds, or 0 if it is not available
+ * Since: UNRELEASED
+ */
+gint64
+eus_get_thread_cpu_time (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+
+  return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
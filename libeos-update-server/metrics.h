@@ -0,0 +1,139 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+#pragma once
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/router.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EusMetricsHandler:
+ * @EUS_METRICS_HANDLER_OBJECTS_FILEZ: `.filez` objects, compressed on the fly
+ * @EUS_METRICS_HANDLER_AS_IS: files sent as they are in the repository
+ * @EUS_METRICS_HANDLER_REFS_HEADS: refs, from the ref table
+ * @EUS_METRICS_HANDLER_CONFIG: the faked repository config
+ * @EUS_METRICS_HANDLER_NONE: requests which were not handled by a repository,
+ *    such as rejected requests and paths which are not served
+ *
+ * The request handlers whose response times are recorded separately.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_METRICS_HANDLER_OBJECTS_FILEZ,
+  EUS_METRICS_HANDLER_AS_IS,
+  EUS_METRICS_HANDLER_REFS_HEADS,
+  EUS_METRICS_HANDLER_CONFIG,
+  EUS_METRICS_HANDLER_NONE,
+} EusMetricsHandler;
+
+/**
+ * EusMetricsCounter:
+ * @EUS_METRICS_COUNTER_FILEZ_CACHE_HITS: `.filez` objects sent from the
+ *    cache
+ * @EUS_METRICS_COUNTER_FILEZ_STREAMS_SHARED: `.filez` objects sent from a
+ *    compression stream started for another request
+ * @EUS_METRICS_COUNTER_FILEZ_CACHE_MISSES: `.filez` objects which had to be
+ *    compressed
+ * @EUS_METRICS_COUNTER_MAPPED_FILE_HITS: small files found in the mapped
+ *    file cache
+ * @EUS_METRICS_COUNTER_MAPPED_FILE_MISSES: small files which had to be
+ *    opened
+ * @EUS_METRICS_COUNTER_REQUESTS_DEFERRED: requests which waited for other
+ *    requests from the same client to finish
+ * @EUS_METRICS_COUNTER_REQUESTS_REJECTED: requests rejected because the
+ *    server was overloaded
+ *
+ * Events counted by #EusMetrics, on top of the per-request figures.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_METRICS_COUNTER_FILEZ_CACHE_HITS,
+  EUS_METRICS_COUNTER_FILEZ_STREAMS_SHARED,
+  EUS_METRICS_COUNTER_FILEZ_CACHE_MISSES,
+  EUS_METRICS_COUNTER_MAPPED_FILE_HITS,
+  EUS_METRICS_COUNTER_MAPPED_FILE_MISSES,
+  EUS_METRICS_COUNTER_REQUESTS_DEFERRED,
+  EUS_METRICS_COUNTER_REQUESTS_REJECTED,
+} EusMetricsCounter;
+
+/**
+ * EusMetricsValue:
+ * @EUS_METRICS_VALUE_PENDING_REQUESTS: number of requests in progress
+ * @EUS_METRICS_VALUE_CLIENTS: number of clients with requests in progress
+ * @EUS_METRICS_VALUE_COMPRESSION_JOBS: number of compression jobs queued or
+ *    running
+ * @EUS_METRICS_VALUE_COMPRESSION_CPU_TIME: CPU time spent compressing, in
+ *    microseconds
+ * @EUS_METRICS_VALUE_PROCESS_CPU_TIME: CPU time used by the whole process,
+ *    in microseconds
+ *
+ * Figures which are kept by other components, and copied into #EusMetrics
+ * with eus_metrics_set_value() before it is formatted.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_METRICS_VALUE_PENDING_REQUESTS,
+  EUS_METRICS_VALUE_CLIENTS,
+  EUS_METRICS_VALUE_COMPRESSION_JOBS,
+  EUS_METRICS_VALUE_COMPRESSION_CPU_TIME,
+  EUS_METRICS_VALUE_PROCESS_CPU_TIME,
+} EusMetricsValue;
+
+#define EUS_TYPE_METRICS eus_metrics_get_type ()
+G_DECLARE_FINAL_TYPE (EusMetrics, eus_metrics, EUS, METRICS, GObject)
+
+EusMetrics *eus_metrics_new (void);
+
+void eus_metrics_request_started (EusMetrics  *self,
+                                  SoupMessage *msg);
+void eus_metrics_request_routed (EusMetrics        *self,
+                                 SoupMessage       *msg,
+                                 const EusRoute    *route,
+                                 EusMetricsHandler  handler);
+void eus_metrics_request_finished (EusMetrics  *self,
+                                   SoupMessage *msg,
+                                   gboolean     aborted);
+
+void eus_metrics_count (EusMetrics        *self,
+                        EusMetricsCounter  counter);
+void eus_metrics_set_value (EusMetrics      *self,
+                            EusMetricsValue  value_id,
+                            guint64          value);
+
+guint64 eus_metrics_get_percentile (EusMetrics        *self,
+                                    EusMetricsHandler  handler,
+                                    guint              percentile);
+
+gchar *eus_metrics_format (EusMetrics *self);
+
+gint64 eus_get_thread_cpu_time (void);
+
+G_END_DECLS
@@ -0,0 +1,590 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/rate-limiter.h>
+#include <libsoup/soup.h>
+
+/**
+ * SECTION:rate-limiter
+ * @title: Rate limiter
+ * @short_description: Token bucket limits on the upload rate
+ * @include: libeos-update-server/rate-limiter.h
+ *
+ * Limits the rate at which response bodies are sent, both in total
+ * (#EusRateLimiter:max-rate) and to each client
+ * (#EusRateLimiter:max-rate-per-client), so that serving updates fits in a
+ * known share of the network rather than saturating it.
+ *
+ * Each limit is a token bucket which fills at the limit rate, and can hold up
+ * to a quarter of a second’s worth of tokens, so short bursts are smoothed
+ * out. Producers of response bodies call eus_rate_limiter_consume() for the
+ * bytes they send, which may take a bucket into debt; and before sending more,
+ * wait for eus_rate_limiter_get_delay() milliseconds, which is how long it
+ * takes for the debt to be paid off. Bodies which are already in memory can
+ * be sent with eus_rate_limiter_send_buffer(), which does this in pieces of
+ * %EUS_RATE_LIMITER_PIECE_SIZE.
+ *
+ * All methods are thread safe, but eus_rate_limiter_send_buffer() must be
+ * called from the #SoupServer’s main context.
+ *
+ * Since: UNRELEASED
+ */
+
+/* How long a bucket takes to fill up, which bounds bursts. */
+#define BURST_USEC (G_USEC_PER_SEC / 4)
+
+/* How often idle per-client buckets are dropped. */
+#define PRUNE_INTERVAL_USEC (10 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  gdouble tokens;  /* in bytes; negative when in debt */
+  gint64 last_refill;  /* monotonic time, in microseconds */
+} Bucket;
+
+/* Capacity of a bucket which fills at @rate. It holds at least one piece, so
+ * a body can always make progress. */
+static gdouble
+bucket_capacity (guint64 rate)
+{
+  return MAX ((gdouble) rate * BURST_USEC / G_USEC_PER_SEC,
+              EUS_RATE_LIMITER_PIECE_SIZE);
+}
+
+static void
+bucket_refill (Bucket  *bucket,
+               guint64  rate,
+               gint64   now)
+{
+  bucket->tokens += (gdouble) rate * (now - bucket->last_refill) / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, bucket_capacity (rate));
+  bucket->last_refill = now;
+}
+
+/* Milliseconds until @bucket is out of debt, rounded up. */
+static guint
+bucket_get_delay (const Bucket *bucket,
+                  guint64       rate)
+{
+  if (bucket->tokens >= 0)
+    return 0;
+
+  return (guint) (-bucket->tokens * 1000 / rate) + 1;
+}
+
+/**
+ * EusRateLimiter:
+ *
+ * Token bucket limits on the total and per-client upload rate.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusRateLimiter
+{
+  GObject parent_instance;
+
+  guint64 max_rate;
+  guint64 max_rate_per_client;
+
+  GMutex lock;  /* protects the fields below */
+  Bucket total;
+  GHashTable *clients;  /* (owned) (element-type utf8 Bucket) */
+  gint64 last_prune;
+};
+
+G_DEFINE_TYPE (EusRateLimiter, eus_rate_limiter, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_MAX_RATE = 1,
+  PROP_MAX_RATE_PER_CLIENT,
+} EusRateLimiterProperty;
+
+static GParamSpec *props[PROP_MAX_RATE_PER_CLIENT + 1] = { NULL, };
+
+static void
+eus_rate_limiter_init (EusRateLimiter *self)
+{
+  g_mutex_init (&self->lock);
+  self->clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+eus_rate_limiter_constructed (GObject *object)
+{
+  EusRateLimiter *self = EUS_RATE_LIMITER (object);
+
+  G_OBJECT_CLASS (eus_rate_limiter_parent_class)->constructed (object);
+
+  self->last_prune = g_get_monotonic_time ();
+  self->total.last_refill = self->last_prune;
+  self->total.tokens = bucket_capacity (self->max_rate);
+}
+
+static void
+eus_rate_limiter_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *spec)
+{
+  EusRateLimiter *self = EUS_RATE_LIMITER (object);
+
+  switch ((EusRateLimiterProperty) property_id)
+    {
+    case PROP_MAX_RATE:
+      g_value_set_uint64 (value, self->max_rate);
+      break;
+
+    case PROP_MAX_RATE_PER_CLIENT:
+      g_value_set_uint64 (value, self->max_rate_per_client);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_rate_limiter_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *spec)
+{
+  EusRateLimiter *self = EUS_RATE_LIMITER (object);
+
+  switch ((EusRateLimiterProperty) property_id)
+    {
+    case PROP_MAX_RATE:
+      self->max_rate = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_RATE_PER_CLIENT:
+      self->max_rate_per_client = g_value_get_uint64 (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_rate_limiter_finalize (GObject *object)
+{
+  EusRateLimiter *self = EUS_RATE_LIMITER (object);
+
+  g_clear_pointer (&self->clients, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_rate_limiter_parent_class)->finalize (object);
+}
+
+static void
+eus_rate_limiter_class_init (EusRateLimiterClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = eus_rate_limiter_constructed;
+  object_class->finalize = eus_rate_limiter_finalize;
+  object_class->get_property = eus_rate_limiter_get_property;
+  object_class->set_property = eus_rate_limiter_set_property;
+
+  /**
+   * EusRateLimiter:max-rate:
+   *
+   * Maximum total rate to send response bodies at, in bytes per second. If
+   * zero, the total rate is not limited.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_RATE] = g_param_spec_uint64 ("max-rate",
+                                              "Max Rate",
+                                              "Maximum total rate to send response bodies at, in bytes per second.",
+                                              0, G_MAXUINT64, 0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRateLimiter:max-rate-per-client:
+   *
+   * Maximum rate to send response bodies to each client at, in bytes per
+   * second. If zero, the rate per client is not limited.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_RATE_PER_CLIENT] = g_param_spec_uint64 ("max-rate-per-client",
+                                                         "Max Rate Per Client",
+                                                         "Maximum rate to send response bodies to each client at, in bytes per second.",
+                                                         0, G_MAXUINT64, 0,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/**
+ * eus_rate_limiter_new:
+ * @max_rate: maximum total rate, in bytes per second, or 0 for no limit
+ * @max_rate_per_client: maximum rate per client, in bytes per second, or 0
+ *    for no limit
+ *
+ * Create a new #EusRateLimiter.
+ *
+ * Returns: (transfer full): a new #EusRateLimiter
+ * Since: UNRELEASED
+ */
+EusRateLimiter *
+eus_rate_limiter_new (guint64 max_rate,
+                      guint64 max_rate_per_client)
+{
+  return g_object_new (EUS_TYPE_RATE_LIMITER,
+                       "max-rate", max_rate,
+                       "max-rate-per-client", max_rate_per_client,
+                       NULL);
+}
+
+/**
+ * eus_rate_limiter_get_max_rate:
+ * @self: an #EusRateLimiter
+ *
+ * Get the value of #EusRateLimiter:max-rate.
+ *
+ * Returns: maximum total rate, in bytes per second, or 0 for no limit
+ * Since: UNRELEASED
+ */
+guint64
+eus_rate_limiter_get_max_rate (EusRateLimiter *self)
+{
+  g_return_val_if_fail (EUS_IS_RATE_LIMITER (self), 0);
+
+  return self->max_rate;
+}
+
+/**
+ * eus_rate_limiter_get_max_rate_per_client:
+ * @self: an #EusRateLimiter
+ *
+ * Get the value of #EusRateLimiter:max-rate-per-client.
+ *
+ * Returns: maximum rate per client, in bytes per second, or 0 for no limit
+ * Since: UNRELEASED
+ */
+guint64
+eus_rate_limiter_get_max_rate_per_client (EusRateLimiter *self)
+{
+  g_return_val_if_fail (EUS_IS_RATE_LIMITER (self), 0);
+
+  return self->max_rate_per_client;
+}
+
+/* Drop the buckets of clients which have been idle long enough for them to
+ * fill up; they would be recreated full anyway. Must be called with the lock
+ * held. */
+static void
+prune_clients_unlocked (EusRateLimiter *self,
+                        gint64          now)
+{
+  GHashTableIter iter;
+  Bucket *bucket;
+
+  if (now - self->last_prune < PRUNE_INTERVAL_USEC)
+    return;
+  self->last_prune = now;
+
+  g_hash_table_iter_init (&iter, self->clients);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &bucket))
+    {
+      bucket_refill (bucket, self->max_rate_per_client, now);
+      if (bucket->tokens >= bucket_capacity (self->max_rate_per_client))
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+/* Get the bucket for @client, refilled up to @now, or %NULL if there is no
+ * per-client limit. Must be called with the lock held. */
+static Bucket *
+get_client_bucket_unlocked (EusRateLimiter *self,
+                            const gchar    *client,
+                            gint64          now)
+{
+  Bucket *bucket;
+
+  if (self->max_rate_per_client == 0)
+    return NULL;
+
+  if (client == NULL)
+    client = "";
+
+  bucket = g_hash_table_lookup (self->clients, client);
+  if (bucket == NULL)
+    {
+      bucket = g_new0 (Bucket, 1);
+      bucket->tokens = bucket_capacity (self->max_rate_per_client);
+      bucket->last_refill = now;
+      g_hash_table_insert (self->clients, g_strdup (client), bucket);
+    }
+  else
+    {
+      bucket_refill (bucket, self->max_rate_per_client, now);
+    }
+
+  return bucket;
+}
+
+/**
+ * eus_rate_limiter_consume:
+ * @self: an #EusRateLimiter
+ * @client: (nullable): address of the client the bytes are sent to
+ * @n_bytes: number of bytes sent
+ *
+ * Account for @n_bytes being sent to @client. This may take the limits into
+ * debt, in which case eus_rate_limiter_get_delay() says how long to wait
+ * before sending more.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_rate_limiter_consume (EusRateLimiter *self,
+                          const gchar    *client,
+                          gsize           n_bytes)
+{
+  gint64 now;
+  Bucket *bucket;
+
+  g_return_if_fail (EUS_IS_RATE_LIMITER (self));
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->lock);
+
+  if (self->max_rate > 0)
+    {
+      bucket_refill (&self->total, self->max_rate, now);
+      self->total.tokens -= n_bytes;
+    }
+
+  prune_clients_unlocked (self, now);
+  bucket = get_client_bucket_unlocked (self, client, now);
+  if (bucket != NULL)
+    bucket->tokens -= n_bytes;
+
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * eus_rate_limiter_get_delay:
+ * @self: an #EusRateLimiter
+ * @client: (nullable): address of the client to send to
+ *
+ * Get how long to wait before sending more data to @client, so that the total
+ * and per-client limits are respected.
+ *
+ * Returns: delay in milliseconds, or 0 if data can be sent now
+ * Since: UNRELEASED
+ */
+guint
+eus_rate_limiter_get_delay (EusRateLimiter *self,
+                            const gchar    *client)
+{
+  gint64 now;
+  Bucket *bucket;
+  guint delay = 0;
+
+  g_return_val_if_fail (EUS_IS_RATE_LIMITER (self), 0);
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&self->lock);
+
+  if (self->max_rate > 0)
+    {
+      bucket_refill (&self->total, self->max_rate, now);
+      delay = bucket_get_delay (&self->total, self->max_rate);
+    }
+
+  bucket = get_client_bucket_unlocked (self, client, now);
+  if (bucket != NULL)
+    delay = MAX (delay, bucket_get_delay (bucket, self->max_rate_per_client));
+
+  g_mutex_unlock (&self->lock);
+
+  return delay;
+}
+
+typedef struct
+{
+  EusRateLimiter *limiter;  /* (owned) */
+  SoupServer *server;  /* (owned) */
+  SoupMessage *msg;  /* (owned) */
+  gchar *client;  /* (owned) (nullable) */
+  SoupBuffer *buffer;  /* (owned) */
+  gsize offset;  /* bytes of @buffer appended so far */
+  gulong wrote_chunk_id;
+  gulong finished_id;
+  GSource *timeout;  /* (owned) (nullable) */
+} PacedBody;
+
+static void
+paced_body_free (PacedBody *body)
+{
+  if (body->timeout != NULL)
+    {
+      g_source_destroy (body->timeout);
+      g_source_unref (body->timeout);
+    }
+  g_signal_handler_disconnect (body->msg, body->wrote_chunk_id);
+  g_signal_handler_disconnect (body->msg, body->finished_id);
+
+  soup_buffer_free (body->buffer);
+  g_free (body->client);
+  g_object_unref (body->msg);
+  g_object_unref (body->server);
+  g_object_unref (body->limiter);
+  g_free (body);
+}
+
+static gboolean paced_body_timeout_cb (gpointer user_data);
+
+/* Append the next piece of the body, or wait until the limits allow it.
+ * Returns %TRUE if a piece was appended. */
+static gboolean
+paced_body_append_piece (PacedBody *body)
+{
+  g_autoptr(SoupBuffer) piece = NULL;
+  gsize length;
+  guint delay;
+
+  delay = eus_rate_limiter_get_delay (body->limiter, body->client);
+  if (delay > 0)
+    {
+      body->timeout = g_timeout_source_new (delay);
+      g_source_set_callback (body->timeout, paced_body_timeout_cb, body, NULL);
+      g_source_attach (body->timeout, g_main_context_get_thread_default ());
+      return FALSE;
+    }
+
+  length = MIN (body->buffer->length - body->offset, EUS_RATE_LIMITER_PIECE_SIZE);
+  piece = soup_buffer_new_subbuffer (body->buffer, body->offset, length);
+  soup_message_body_append_buffer (body->msg->response_body, piece);
+  body->offset += length;
+  eus_rate_limiter_consume (body->limiter, body->client, length);
+
+  if (body->offset == body->buffer->length)
+    soup_message_body_complete (body->msg->response_body);
+
+  return TRUE;
+}
+
+static gboolean
+paced_body_timeout_cb (gpointer user_data)
+{
+  PacedBody *body = user_data;
+
+  g_clear_pointer (&body->timeout, g_source_unref);
+
+  /* libsoup pauses the message when it runs out of body to write. */
+  if (paced_body_append_piece (body))
+    soup_server_unpause_message (body->server, body->msg);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+paced_body_wrote_chunk_cb (SoupMessage *msg,
+                           gpointer     user_data)
+{
+  PacedBody *body = user_data;
+
+  if (body->offset < body->buffer->length && body->timeout == NULL)
+    paced_body_append_piece (body);
+}
+
+static void
+paced_body_finished_cb (SoupMessage *msg,
+                        gpointer     user_data)
+{
+  paced_body_free (user_data);
+}
+
+/**
+ * eus_rate_limiter_send_buffer:
+ * @self: an #EusRateLimiter
+ * @server: the #SoupServer handling @msg
+ * @msg: a request being handled
+ * @client: (nullable): address of the client which sent @msg
+ * @buffer: the whole response body
+ *
+ * Send @buffer as the response body of @msg, in pieces of
+ * %EUS_RATE_LIMITER_PIECE_SIZE, at a rate within the limits. The
+ * `Content-Length` of the response is set to the length of @buffer; its
+ * status and other headers must be set by the caller.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_rate_limiter_send_buffer (EusRateLimiter *self,
+                              SoupServer     *server,
+                              SoupMessage    *msg,
+                              const gchar    *client,
+                              SoupBuffer     *buffer)
+{
+  PacedBody *body;
+
+  g_return_if_fail (EUS_IS_RATE_LIMITER (self));
+  g_return_if_fail (SOUP_IS_SERVER (server));
+  g_return_if_fail (SOUP_IS_MESSAGE (msg));
+  g_return_if_fail (buffer != NULL);
+
+  soup_message_headers_set_content_length (msg->response_headers,
+                                           buffer->length);
+
+  if (buffer->length == 0)
+    {
+      soup_message_body_complete (msg->response_body);
+      return;
+    }
+
+  /* Drop each piece once it has been written. */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  body = g_new0 (PacedBody, 1);
+  body->limiter = g_object_ref (self);
+  body->server = g_object_ref (server);
+  body->msg = g_object_ref (msg);
+  body->client = g_strdup (client);
+  body->buffer = soup_buffer_copy (buffer);
+  body->wrote_chunk_id = g_signal_connect (msg, "wrote-chunk",
+                                           G_CALLBACK (paced_body_wrote_chunk_cb),
+                                           body);
+  body->finished_id = g_signal_connect (msg, "finished",
+                                        G_CALLBACK (paced_body_finished_cb),
+                                        body);
+
+  paced_body_append_piece (body);
+}
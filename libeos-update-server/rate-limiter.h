@@ -0,0 +1,61 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <glib-object.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EUS_RATE_LIMITER_PIECE_SIZE:
+ *
+ * Size, in bytes, of the pieces which rate-limited bodies are written in.
+ *
+ * Since: UNRELEASED
+ */
+#define EUS_RATE_LIMITER_PIECE_SIZE (64 * 1024)
+
+#define EUS_TYPE_RATE_LIMITER eus_rate_limiter_get_type ()
+G_DECLARE_FINAL_TYPE (EusRateLimiter, eus_rate_limiter, EUS, RATE_LIMITER, GObject)
+
+EusRateLimiter *eus_rate_limiter_new (guint64 max_rate,
+                                      guint64 max_rate_per_client);
+
+guint64 eus_rate_limiter_get_max_rate (EusRateLimiter *self);
+guint64 eus_rate_limiter_get_max_rate_per_client (EusRateLimiter *self);
+
+void eus_rate_limiter_consume (EusRateLimiter *self,
+                               const gchar    *client,
+                               gsize           n_bytes);
+guint eus_rate_limiter_get_delay (EusRateLimiter *self,
+                                  const gchar    *client);
+
+void eus_rate_limiter_send_buffer (EusRateLimiter *self,
+                                   SoupServer     *server,
+                                   SoupMessage    *msg,
+                                   const gchar    *client,
+                                   SoupBuffer     *buffer);
+
+G_END_DECLS
@@ -0,0 +1,409 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+#include <libeos-update-server/ref-table.h>
+
+#include <sys/stat.h>
+
+/**
+ * SECTION:ref-table
+ * @title: Ref table
+ * @short_description: In-memory table of the refs served by a repository
+ * @include: libeos-update-server/ref-table.h
+ *
+ * Clients resolve a ref by requesting `/refs/heads/$ref`. Refs which the
+ * repository has locally, in `refs/heads`, are served as they are; refs which
+ * are only available as remote refs of the served remote, in
+ * `refs/remotes/$remote`, are served in their place. An #EusRefTable holds the
+ * contents of all of those ref files in memory, resolved in that order, so a
+ * request can be answered with a single hash table lookup rather than up to
+ * two stat() and open() calls.
+ *
+ * Every directory under those two, and their parents, is watched with a
+ * #GFileMonitor. Any change to them marks the table as stale, and it is
+ * reloaded on the next lookup. Ref directories are small, so reloading them
+ * entirely is simpler than tracking individual changes, and cheap. Events are
+ * delivered in the thread-default main context of the thread which does the
+ * first lookup after a change.
+ *
+ * All methods are thread safe.
+ *
+ * Since: UNRELEASED
+ */
+
+typedef struct
+{
+  GBytes *contents;  /* (owned) */
+  gint64 mtime;
+} RefEntry;
+
+static void
+ref_entry_free (RefEntry *entry)
+{
+  g_bytes_unref (entry->contents);
+  g_free (entry);
+}
+
+/**
+ * EusRefTable:
+ *
+ * An in-memory table of the refs served by an #EusRepo.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusRefTable
+{
+  GObject parent_instance;
+
+  gchar *repo_path;  /* (owned) (not nullable) */
+  gchar *remote_name;  /* (owned) (not nullable) */
+
+  GMutex lock;  /* protects all the fields below */
+  GHashTable *refs;  /* (owned) (element-type utf8 RefEntry) keyed by ref name */
+  GPtrArray *monitors;  /* (owned) (element-type GFileMonitor) */
+  gboolean stale;
+};
+
+G_DEFINE_TYPE (EusRefTable, eus_ref_table, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_REPO_PATH = 1,
+  PROP_REMOTE_NAME,
+} EusRefTableProperty;
+
+static GParamSpec *props[PROP_REMOTE_NAME + 1] = { NULL, };
+
+/* A cancelled monitor emits no more events, and the table outlives its
+ * monitors, so the signal handler does not need disconnecting. */
+static void
+monitor_free (GFileMonitor *monitor)
+{
+  g_file_monitor_cancel (monitor);
+  g_object_unref (monitor);
+}
+
+static void
+eus_ref_table_init (EusRefTable *self)
+{
+  g_mutex_init (&self->lock);
+  self->refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify) ref_entry_free);
+  self->monitors = g_ptr_array_new_with_free_func ((GDestroyNotify) monitor_free);
+  self->stale = TRUE;
+}
+
+static void
+eus_ref_table_get_property (GObject    *object,
+                            guint       property_id,
+                            GValue     *value,
+                            GParamSpec *spec)
+{
+  EusRefTable *self = EUS_REF_TABLE (object);
+
+  switch ((EusRefTableProperty) property_id)
+    {
+    case PROP_REPO_PATH:
+      g_value_set_string (value, self->repo_path);
+      break;
+
+    case PROP_REMOTE_NAME:
+      g_value_set_string (value, self->remote_name);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_ref_table_set_property (GObject      *object,
+                            guint         property_id,
+                            const GValue *value,
+                            GParamSpec   *spec)
+{
+  EusRefTable *self = EUS_REF_TABLE (object);
+
+  switch ((EusRefTableProperty) property_id)
+    {
+    case PROP_REPO_PATH:
+      g_clear_pointer (&self->repo_path, g_free);
+      self->repo_path = g_value_dup_string (value);
+      break;
+
+    case PROP_REMOTE_NAME:
+      g_clear_pointer (&self->remote_name, g_free);
+      self->remote_name = g_value_dup_string (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_ref_table_finalize (GObject *object)
+{
+  EusRefTable *self = EUS_REF_TABLE (object);
+
+  g_clear_pointer (&self->monitors, g_ptr_array_unref);
+  g_clear_pointer (&self->refs, g_hash_table_unref);
+  g_mutex_clear (&self->lock);
+  g_free (self->remote_name);
+  g_free (self->repo_path);
+
+  G_OBJECT_CLASS (eus_ref_table_parent_class)->finalize (object);
+}
+
+static void
+eus_ref_table_class_init (EusRefTableClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eus_ref_table_finalize;
+  object_class->get_property = eus_ref_table_get_property;
+  object_class->set_property = eus_ref_table_set_property;
+
+  /**
+   * EusRefTable:repo-path:
+   *
+   * Path to the root of the repository whose refs are served.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_REPO_PATH] = g_param_spec_string ("repo-path",
+                                               "Repo Path",
+                                               "Path to the root of the repository whose refs are served.",
+                                               NULL,
+                                               G_PARAM_READWRITE |
+                                               G_PARAM_CONSTRUCT_ONLY |
+                                               G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRefTable:remote-name:
+   *
+   * Name of the remote whose refs are served in place of missing local ones.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_REMOTE_NAME] = g_param_spec_string ("remote-name",
+                                                 "Remote Name",
+                                                 "Name of the remote whose refs are served in place of missing local ones.",
+                                                 NULL,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+static void
+dir_changed_cb (GFileMonitor      *monitor,
+                GFile             *file,
+                GFile             *other_file,
+                GFileMonitorEvent  event_type,
+                gpointer           user_data)
+{
+  EusRefTable *self = EUS_REF_TABLE (user_data);
+
+  g_mutex_lock (&self->lock);
+  self->stale = TRUE;
+  g_mutex_unlock (&self->lock);
+}
+
+/* Start watching @dir_path for changes. Must be called with the lock held. */
+static void
+watch_dir_unlocked (EusRefTable *self,
+                    const gchar *dir_path)
+{
+  g_autoptr(GFile) dir_file = g_file_new_for_path (dir_path);
+  g_autoptr(GError) error = NULL;
+  GFileMonitor *monitor;
+
+  monitor = g_file_monitor_directory (dir_file, G_FILE_MONITOR_NONE, NULL,
+                                      &error);
+  if (monitor == NULL)
+    {
+      /* Without the monitor, changes in this directory will not be noticed
+       * until something else causes a reload. */
+      g_warning ("Failed to watch ‘%s’ for ref changes: %s",
+                 dir_path, error->message);
+      return;
+    }
+
+  g_signal_connect (monitor, "changed", (GCallback) dir_changed_cb, self);
+  g_ptr_array_add (self->monitors, monitor);
+}
+
+/* Load the refs in @dir_path, prefixing their names with @prefix, and watch
+ * it and its subdirectories. Refs already in the table are not replaced.
+ * Errors are ignored: an unreadable ref is just not served. Must be called
+ * with the lock held. */
+static void
+load_dir_unlocked (EusRefTable *self,
+                   const gchar *dir_path,
+                   const gchar *prefix)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  watch_dir_unlocked (self, dir_path);
+
+  dir = g_dir_open (dir_path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *path = g_build_filename (dir_path, name, NULL);
+      g_autofree gchar *ref = g_strconcat (prefix, name, NULL);
+      gchar *contents = NULL;
+      gsize len;
+      struct stat buf;
+      RefEntry *entry;
+
+      if (g_stat (path, &buf) != 0)
+        continue;
+
+      if (S_ISDIR (buf.st_mode))
+        {
+          g_autofree gchar *subprefix = g_strconcat (ref, "/", NULL);
+
+          load_dir_unlocked (self, path, subprefix);
+          continue;
+        }
+
+      if (!S_ISREG (buf.st_mode) ||
+          g_hash_table_contains (self->refs, ref) ||
+          !g_file_get_contents (path, &contents, &len, NULL))
+        continue;
+
+      entry = g_new0 (RefEntry, 1);
+      entry->contents = g_bytes_new_take (contents, len);
+      entry->mtime = buf.st_mtime;
+      g_hash_table_insert (self->refs, g_steal_pointer (&ref), entry);
+    }
+}
+
+/* Reload all the refs, and watch their directories afresh. Must be called
+ * with the lock held. */
+static void
+reload_unlocked (EusRefTable *self)
+{
+  g_autofree gchar *refs_path = g_build_filename (self->repo_path, "refs", NULL);
+  g_autofree gchar *heads_path = g_build_filename (refs_path, "heads", NULL);
+  g_autofree gchar *remotes_path = g_build_filename (refs_path, "remotes", NULL);
+  g_autofree gchar *remote_path = g_build_filename (remotes_path,
+                                                    self->remote_name, NULL);
+
+  g_debug ("Loading refs from ‘%s’", refs_path);
+
+  /* Any changes from here on will mark the table as stale again. */
+  self->stale = FALSE;
+  g_ptr_array_set_size (self->monitors, 0);
+  g_hash_table_remove_all (self->refs);
+
+  /* Watch the parents too, so the table is reloaded if a watched directory is
+   * created or replaced. */
+  watch_dir_unlocked (self, refs_path);
+  watch_dir_unlocked (self, remotes_path);
+
+  /* Local refs take precedence over remote ones. */
+  load_dir_unlocked (self, heads_path, "");
+  load_dir_unlocked (self, remote_path, "");
+}
+
+/**
+ * eus_ref_table_new:
+ * @repo_path: path to the root of the repository
+ * @remote_name: name of the served remote
+ *
+ * Create a new #EusRefTable for the refs in the repository at @repo_path.
+ * The refs are loaded on the first lookup.
+ *
+ * Returns: (transfer full): a new #EusRefTable
+ * Since: UNRELEASED
+ */
+EusRefTable *
+eus_ref_table_new (const gchar *repo_path,
+                   const gchar *remote_name)
+{
+  g_return_val_if_fail (repo_path != NULL, NULL);
+  g_return_val_if_fail (remote_name != NULL, NULL);
+
+  return g_object_new (EUS_TYPE_REF_TABLE,
+                       "repo-path", repo_path,
+                       "remote-name", remote_name,
+                       NULL);
+}
+
+/**
+ * eus_ref_table_lookup:
+ * @self: an #EusRefTable
+ * @head: name of the ref, relative to `refs/heads`, such as
+ *    `os/eos/amd64/master`
+ * @out_mtime: (out caller-allocates): return location for the modification
+ *    time of the ref file, in seconds since the epoch
+ *
+ * Look up the contents of the ref file to serve for @head: the local ref if
+ * there is one, or the served remote’s ref otherwise.
+ *
+ * Returns: (transfer full) (nullable): the contents of the ref file, or %NULL
+ *    if neither exists
+ * Since: UNRELEASED
+ */
+GBytes *
+eus_ref_table_lookup (EusRefTable *self,
+                      const gchar *head,
+                      gint64      *out_mtime)
+{
+  RefEntry *entry;
+  GBytes *contents = NULL;
+
+  g_return_val_if_fail (EUS_IS_REF_TABLE (self), NULL);
+  g_return_val_if_fail (head != NULL, NULL);
+  g_return_val_if_fail (out_mtime != NULL, NULL);
+
+  g_mutex_lock (&self->lock);
+
+  if (self->stale)
+    reload_unlocked (self);
+
+  entry = g_hash_table_lookup (self->refs, head);
+  if (entry != NULL)
+    {
+      contents = g_bytes_ref (entry->contents);
+      *out_mtime = entry->mtime;
+    }
+
+  g_mutex_unlock (&self->lock);
+
+  return contents;
+}
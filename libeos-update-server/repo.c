@@ -22,10 +22,28 @@
  *  - Philip Withnall <withnall@endlessm.com>
  */
 
+#include <libeos-update-server/buffer-pool.h>
+#include <libeos-update-server/client-table.h>
+#include <libeos-update-server/delta-generator.h>
+#include <libeos-update-server/filez-cache.h>
+#include <libeos-update-server/filez-stream.h>
+#include <libeos-update-server/filez-warmer.h>
+#include <libeos-update-server/mapped-file-cache.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/rate-limiter.h>
+#include <libeos-update-server/ref-table.h>
+#include <libeos-update-server/scheduler.h>
 #include <libeos-update-server/repo.h>
+#include <libeos-update-server/router.h>
+#include <libeos-update-server/send-file.h>
 #include <libeos-updater-util/util.h>
 
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * SECTION:repo
@@ -39,6 +57,71 @@
  *
  * It currently only supports version 1 of the repository format
  * (`repo_version=1` in the configuration file).
+ *
+ * As the repository is bare, `.filez` objects have to be compressed on the
+ * fly. If an #EusRepo:filez-cache is set, the compressed objects are stored in
+ * it, and later requests for the same object are served from there.
+ * Concurrent requests for an object which is still being compressed share a
+ * single compression stream.
+ *
+ * If an #EusRepo:scheduler is set, the compression is done in its worker
+ * pool, which bounds how many objects are compressed at once, and shares the
+ * pool fairly between clients. Compression of an object is only run ahead of
+ * what its clients have been sent by a couple of chunks, so slow clients do
+ * not cause unbounded buffering. If an
+ * #EusRepo:buffer-pool is set, the chunks are produced into buffers from it,
+ * which bounds the memory used for them across all requests. Either way, the
+ * chunks are passed to libsoup without being copied.
+ *
+ * Objects are compressed at #EusRepo:max-compression-level when the
+ * #EusRepo:scheduler is idle, and at progressively lower levels down to
+ * #EusRepo:min-compression-level as it becomes loaded, trading compression
+ * ratio for throughput. The first block of each object is sampled before
+ * compressing it, and objects whose contents do not compress (such as images
+ * or squashfs blobs) are stored at level 0. Cached objects are served at
+ * whichever level they were compressed at. Large objects are split into blocks
+ * which are compressed on all processors at once, like pigz does.
+ *
+ * `.filez` responses carry a strong ETag derived from the object checksum and
+ * compression level, as the compressed stream is fully determined by those.
+ * Once the compressed size of an object is known (because it is in the cache,
+ * or it has been compressed before), responses for it are sent with a
+ * `Content-Length`, and single byte ranges can be requested, so interrupted
+ * downloads can be resumed.
+ *
+ * If #EusRepo:delta-cache-path is set and #EusRepo:delta-max-size is
+ * non-zero, static deltas to each of the served remote’s commits from its last
+ * #EusRepo:delta-ancestors ancestors are generated in the background once the
+ * repository is connected, so peers which are a few commits behind can pull a
+ * delta rather than individual objects. They are written to
+ * #EusRepo:delta-cache-path rather than to the repository, and served from
+ * there if the repository does not have the delta itself. A request for one
+ * of those deltas which does not exist yet gets a 404, and queues the delta to
+ * be generated for later clients. See #EusDeltaGenerator.
+ *
+ * If #EusRepo:warm-up is set, the objects of each of the served remote’s
+ * commits are compressed into the #EusRepo:filez-cache in the background once
+ * the repository is connected, at #EusRepo:max-compression-level, so the first
+ * clients to pull them do not have to wait for them to be compressed. See
+ * #EusFilezWarmer. Like the deltas being generated, the commits being warmed
+ * up are counted in #EusRepo:pending-warm-ups, so the server is not idle until
+ * they are done.
+ *
+ * If an #EusRepo:client-table is set, it limits how many requests from each
+ * client are handled at once, so one client cannot starve the others.
+ *
+ * Content-addressed objects never change, so they are sent with a strong ETag
+ * and `Cache-Control: immutable`. Static delta files are named after the
+ * commits they go between, but may be regenerated differently, so they are
+ * sent with an ETag made from the file’s inode, modification time and size,
+ * and `Last-Modified`. Other files, such as the summary and refs, are sent
+ * with `Last-Modified`. Conditional requests for any of them are answered
+ * with 304 Not Modified if the client’s copy is current.
+ *
+ * Refs are served from an in-memory #EusRefTable, and small files served as
+ * they are, such as metadata objects and the summary, are kept mapped in an
+ * #EusMappedFileCache, so most requests are answered without touching the
+ * file system. Both are invalidated by watching the repository for changes.
  */
 
 /**
@@ -57,6 +140,24 @@ struct _EusRepo
   GCancellable *cancellable;
   gchar *cached_repo_root;
   GBytes *cached_config;
+  EusFilezCache *filez_cache;  /* (owned) (nullable) */
+  GHashTable *filez_in_flight;  /* (owned) (element-type utf8 EosFilezReadData) keyed by checksum */
+  GHashTable *filez_sizes;  /* (owned) (element-type utf8 guint64) compressed sizes keyed by ETag */
+  EusScheduler *scheduler;  /* (owned) (nullable) */
+  EusBufferPool *buffer_pool;  /* (owned) (nullable) */
+  guint min_compression_level;
+  guint max_compression_level;
+  guint64 delta_max_size;
+  guint delta_ancestors;
+  gchar *delta_cache_path;  /* (owned) (nullable) */
+  EusDeltaGenerator *delta_generator;  /* (owned) (nullable) */
+  gboolean warm_up;
+  EusFilezWarmer *filez_warmer;  /* (owned) (nullable) */
+  EusRefTable *ref_table;  /* (owned) */
+  EusMappedFileCache *mapped_files;  /* (owned) (nullable) until initialised */
+  EusClientTable *client_table;  /* (owned) (nullable) */
+  EusRateLimiter *rate_limiter;  /* (owned) (nullable) */
+  EusMetrics *metrics;  /* (owned) (nullable) */
 };
 
 static void eus_repo_initable_iface_init (GInitableIface *initable_iface);
@@ -71,9 +172,33 @@ typedef enum
   PROP_REPO,
   PROP_ROOT_PATH,
   PROP_SERVED_REMOTE,
+  PROP_FILEZ_CACHE,
+  PROP_SCHEDULER,
+  PROP_BUFFER_POOL,
+  PROP_MIN_COMPRESSION_LEVEL,
+  PROP_MAX_COMPRESSION_LEVEL,
+  PROP_DELTA_MAX_SIZE,
+  PROP_DELTA_ANCESTORS,
+  PROP_DELTA_CACHE_PATH,
+  PROP_PENDING_DELTAS,
+  PROP_WARM_UP,
+  PROP_PENDING_WARM_UPS,
+  PROP_CLIENT_TABLE,
+  PROP_RATE_LIMITER,
+  PROP_METRICS,
+  PROP_MAPPED_FILE_CACHE,
 } EusRepoProperty;
 
-static GParamSpec *props[PROP_SERVED_REMOTE + 1] = { NULL, };
+static GParamSpec *props[PROP_MAPPED_FILE_CACHE + 1] = { NULL, };
+
+/* By default, use compression level 2 (the maximum is 9) as a balance between
+ * CPU usage and compression attained. This gives fairly low CPU usage (a third
+ * of what’s needed for level 9) while halving the size of the uncompressed
+ * files. */
+#define FILEZ_COMPRESSION_LEVEL 2
+
+/* Highest zlib compression level. */
+#define FILEZ_MAX_COMPRESSION_LEVEL 9
 
 static gboolean
 generate_faked_config (OstreeRepo *repo,
@@ -127,6 +252,12 @@ static void
 eus_repo_init (EusRepo *self)
 {
   self->cancellable = g_cancellable_new ();
+  self->filez_in_flight = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, g_object_unref);
+  self->filez_sizes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, g_free);
+  self->min_compression_level = FILEZ_COMPRESSION_LEVEL;
+  self->max_compression_level = FILEZ_COMPRESSION_LEVEL;
 }
 
 static void
@@ -155,6 +286,68 @@ eus_repo_get_property (GObject    *object,
       g_value_set_string (value, self->remote_name);
       break;
 
+    case PROP_FILEZ_CACHE:
+      g_value_set_object (value, self->filez_cache);
+      break;
+
+    case PROP_SCHEDULER:
+      g_value_set_object (value, self->scheduler);
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_value_set_object (value, self->buffer_pool);
+      break;
+
+    case PROP_MIN_COMPRESSION_LEVEL:
+      g_value_set_uint (value, self->min_compression_level);
+      break;
+
+    case PROP_MAX_COMPRESSION_LEVEL:
+      g_value_set_uint (value, self->max_compression_level);
+      break;
+
+    case PROP_DELTA_MAX_SIZE:
+      g_value_set_uint64 (value, self->delta_max_size);
+      break;
+
+    case PROP_DELTA_ANCESTORS:
+      g_value_set_uint (value, self->delta_ancestors);
+      break;
+
+    case PROP_DELTA_CACHE_PATH:
+      g_value_set_string (value, self->delta_cache_path);
+      break;
+
+    case PROP_PENDING_DELTAS:
+      g_value_set_uint (value, (self->delta_generator != NULL) ?
+                        eus_delta_generator_get_n_pending (self->delta_generator) : 0);
+      break;
+
+    case PROP_WARM_UP:
+      g_value_set_boolean (value, self->warm_up);
+      break;
+
+    case PROP_PENDING_WARM_UPS:
+      g_value_set_uint (value, (self->filez_warmer != NULL) ?
+                        eus_filez_warmer_get_n_pending (self->filez_warmer) : 0);
+      break;
+
+    case PROP_CLIENT_TABLE:
+      g_value_set_object (value, self->client_table);
+      break;
+
+    case PROP_RATE_LIMITER:
+      g_value_set_object (value, self->rate_limiter);
+      break;
+
+    case PROP_METRICS:
+      g_value_set_object (value, self->metrics);
+      break;
+
+    case PROP_MAPPED_FILE_CACHE:
+      g_value_set_object (value, self->mapped_files);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
       break;
@@ -198,7 +391,62 @@ eus_repo_set_property (GObject      *object,
       self->remote_name = g_value_dup_string (value);
       break;
 
+    case PROP_FILEZ_CACHE:
+      g_set_object (&self->filez_cache, g_value_get_object (value));
+      break;
+
+    case PROP_SCHEDULER:
+      g_set_object (&self->scheduler, g_value_get_object (value));
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_set_object (&self->buffer_pool, g_value_get_object (value));
+      break;
+
+    case PROP_MIN_COMPRESSION_LEVEL:
+      self->min_compression_level = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_COMPRESSION_LEVEL:
+      self->max_compression_level = g_value_get_uint (value);
+      break;
+
+    case PROP_DELTA_MAX_SIZE:
+      self->delta_max_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_DELTA_ANCESTORS:
+      self->delta_ancestors = g_value_get_uint (value);
+      break;
+
+    case PROP_DELTA_CACHE_PATH:
+      g_clear_pointer (&self->delta_cache_path, g_free);
+      self->delta_cache_path = g_value_dup_string (value);
+      break;
+
+    case PROP_WARM_UP:
+      self->warm_up = g_value_get_boolean (value);
+      break;
+
+    case PROP_CLIENT_TABLE:
+      g_set_object (&self->client_table, g_value_get_object (value));
+      break;
+
+    case PROP_RATE_LIMITER:
+      g_set_object (&self->rate_limiter, g_value_get_object (value));
+      break;
+
+    case PROP_METRICS:
+      g_set_object (&self->metrics, g_value_get_object (value));
+      break;
+
+    case PROP_MAPPED_FILE_CACHE:
+      g_set_object (&self->mapped_files, g_value_get_object (value));
+      break;
+
     case PROP_SERVER:
+    case PROP_PENDING_DELTAS:
+    case PROP_PENDING_WARM_UPS:
       /* Read only. */
 
     default:
@@ -207,6 +455,16 @@ eus_repo_set_property (GObject      *object,
     }
 }
 
+static void
+clear_delta_generator (EusRepo *self)
+{
+  if (self->delta_generator == NULL)
+    return;
+
+  g_signal_handlers_disconnect_by_data (self->delta_generator, self);
+  g_clear_object (&self->delta_generator);
+}
+
 static void
 eus_repo_dispose (GObject *object)
 {
@@ -214,8 +472,19 @@ eus_repo_dispose (GObject *object)
 
   eus_repo_disconnect (self);
 
+  clear_delta_generator (self);
   g_clear_object (&self->cancellable);
+  g_clear_pointer (&self->filez_in_flight, g_hash_table_unref);
+  g_clear_pointer (&self->filez_sizes, g_hash_table_unref);
   g_clear_pointer (&self->cached_config, g_bytes_unref);
+  g_clear_object (&self->filez_cache);
+  g_clear_object (&self->ref_table);
+  g_clear_object (&self->mapped_files);
+  g_clear_object (&self->scheduler);
+  g_clear_object (&self->buffer_pool);
+  g_clear_object (&self->client_table);
+  g_clear_object (&self->rate_limiter);
+  g_clear_object (&self->metrics);
   g_clear_object (&self->repo);
   g_clear_object (&self->server);
 
@@ -228,6 +497,7 @@ eus_repo_finalize (GObject *object)
   EusRepo *self = EUS_REPO (object);
 
   g_free (self->cached_repo_root);
+  g_free (self->delta_cache_path);
   g_free (self->remote_name);
   g_free (self->root_path);
 
@@ -303,171 +573,871 @@ eus_repo_class_init (EusRepoClass *klass)
                                                    G_PARAM_CONSTRUCT_ONLY |
                                                    G_PARAM_STATIC_STRINGS);
 
+  /**
+   * EusRepo:filez-cache:
+   *
+   * Cache to store compressed `.filez` objects in, so they don’t have to be
+   * compressed again for each request. If %NULL, objects are compressed for
+   * every request.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_FILEZ_CACHE] = g_param_spec_object ("filez-cache",
+                                                 "Filez Cache",
+                                                 "Cache to store compressed .filez objects in.",
+                                                 EUS_TYPE_FILEZ_CACHE,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:scheduler:
+   *
+   * Worker pool to compress `.filez` objects in. If %NULL, objects are
+   * compressed in the main context, with no limit on how many are compressed
+   * at once.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_SCHEDULER] = g_param_spec_object ("scheduler",
+                                               "Scheduler",
+                                               "Worker pool to compress .filez objects in.",
+                                               EUS_TYPE_SCHEDULER,
+                                               G_PARAM_READWRITE |
+                                               G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:buffer-pool:
+   *
+   * Pool of buffers to compress `.filez` objects into. If %NULL, a buffer is
+   * allocated for each chunk, with no limit on the total memory used.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_BUFFER_POOL] = g_param_spec_object ("buffer-pool",
+                                                 "Buffer Pool",
+                                                 "Pool of buffers to compress .filez objects into.",
+                                                 EUS_TYPE_BUFFER_POOL,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:min-compression-level:
+   *
+   * Lowest zlib compression level to compress `.filez` objects at, used when
+   * the #EusRepo:scheduler is fully loaded.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MIN_COMPRESSION_LEVEL] = g_param_spec_uint ("min-compression-level",
+                                                         "Minimum Compression Level",
+                                                         "Lowest zlib compression level to compress .filez objects at.",
+                                                         0,
+                                                         FILEZ_MAX_COMPRESSION_LEVEL,
+                                                         FILEZ_COMPRESSION_LEVEL,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:max-compression-level:
+   *
+   * Highest zlib compression level to compress `.filez` objects at, used when
+   * the #EusRepo:scheduler is idle. If it is lower than
+   * #EusRepo:min-compression-level, that is used instead.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_COMPRESSION_LEVEL] = g_param_spec_uint ("max-compression-level",
+                                                         "Maximum Compression Level",
+                                                         "Highest zlib compression level to compress .filez objects at.",
+                                                         0,
+                                                         FILEZ_MAX_COMPRESSION_LEVEL,
+                                                         FILEZ_COMPRESSION_LEVEL,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:delta-max-size:
+   *
+   * Size in bytes which the static deltas generated for the repository may
+   * take up; the oldest are deleted to make room for new ones. If it is zero,
+   * no deltas are generated. See #EusDeltaGenerator:max-size.
+   *
+   * Changes take effect the next time eus_repo_connect() is called.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_MAX_SIZE] = g_param_spec_uint64 ("delta-max-size",
+                                                    "Delta Max Size",
+                                                    "Size in bytes which the generated static deltas may take up.",
+                                                    0, G_MAXUINT64, 0,
+                                                    G_PARAM_READWRITE |
+                                                    G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:delta-ancestors:
+   *
+   * Number of ancestors of each of the served remote’s commits to generate
+   * static deltas from, in the background.
+   *
+   * Changes take effect the next time eus_repo_connect() is called.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_ANCESTORS] = g_param_spec_uint ("delta-ancestors",
+                                                   "Delta Ancestors",
+                                                   "Number of ancestors of each commit to generate static deltas from.",
+                                                   0, G_MAXUINT, 0,
+                                                   G_PARAM_READWRITE |
+                                                   G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:delta-cache-path:
+   *
+   * Path to the directory to write the static deltas generated for the
+   * repository to, and to serve them from. If it is %NULL, no deltas are
+   * generated. It must not be shared with other repositories. See
+   * #EusDeltaGenerator:cache-path.
+   *
+   * Changes take effect the next time eus_repo_connect() is called.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_CACHE_PATH] = g_param_spec_string ("delta-cache-path",
+                                                      "Delta Cache Path",
+                                                      "Path to the directory to write generated static deltas to.",
+                                                      NULL,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:pending-deltas:
+   *
+   * Number of static deltas which are queued or being generated.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_PENDING_DELTAS] = g_param_spec_uint ("pending-deltas",
+                                                  "Pending Deltas",
+                                                  "Number of static deltas which are queued or being generated.",
+                                                  0, G_MAXUINT, 0,
+                                                  G_PARAM_READABLE |
+                                                  G_PARAM_EXPLICIT_NOTIFY |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:warm-up:
+   *
+   * Whether to compress the objects of each of the served remote’s commits
+   * into the #EusRepo:filez-cache in the background. This has no effect if
+   * there is no cache.
+   *
+   * Changes take effect the next time eus_repo_connect() is called.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_WARM_UP] = g_param_spec_boolean ("warm-up",
+                                              "Warm Up",
+                                              "Whether to compress served commits into the cache in the background.",
+                                              FALSE,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:pending-warm-ups:
+   *
+   * Number of commits which are queued or being warmed up. See
+   * #EusRepo:warm-up.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_PENDING_WARM_UPS] = g_param_spec_uint ("pending-warm-ups",
+                                                    "Pending Warm-ups",
+                                                    "Number of commits which are queued or being warmed up.",
+                                                    0, G_MAXUINT, 0,
+                                                    G_PARAM_READABLE |
+                                                    G_PARAM_EXPLICIT_NOTIFY |
+                                                    G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:client-table:
+   *
+   * Table of the server’s clients, which limits how many requests from each
+   * client are handled at once. Requests over the limit are deferred until
+   * the client’s other requests finish. If %NULL, there is no limit.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CLIENT_TABLE] = g_param_spec_object ("client-table",
+                                                  "Client Table",
+                                                  "Table of the server’s clients, which limits how many requests from each client are handled at once.",
+                                                  EUS_TYPE_CLIENT_TABLE,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:rate-limiter:
+   *
+   * Limits on the rate to send response bodies at. If %NULL, bodies are sent
+   * as fast as the clients take them.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_RATE_LIMITER] = g_param_spec_object ("rate-limiter",
+                                                  "Rate Limiter",
+                                                  "Limits on the rate to send response bodies at.",
+                                                  EUS_TYPE_RATE_LIMITER,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:metrics:
+   *
+   * Metrics to record which handler each request is routed to, and the cache
+   * hit rates, in. If %NULL, nothing is recorded.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_METRICS] = g_param_spec_object ("metrics",
+                                             "Metrics",
+                                             "Metrics to record requests in.",
+                                             EUS_TYPE_METRICS,
+                                             G_PARAM_READWRITE |
+                                             G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusRepo:mapped-file-cache:
+   *
+   * Cache of mapped small files, such as metadata objects. Objects are cached
+   * by checksum, so a cache shared between several repositories holds each
+   * object once. If %NULL when the repository is initialised, a private cache
+   * is created.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAPPED_FILE_CACHE] = g_param_spec_object ("mapped-file-cache",
+                                                       "Mapped File Cache",
+                                                       "Cache of mapped small files, such as metadata objects.",
+                                                       EUS_TYPE_MAPPED_FILE_CACHE,
+                                                       G_PARAM_READWRITE |
+                                                       G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class,
                                      G_N_ELEMENTS (props),
                                      props);
 }
 
-#define HEX_CLASS "[a-fA-F0-9]"
+static void
+count_event (EusRepo           *self,
+             EusMetricsCounter  counter)
+{
+  if (self->metrics != NULL)
+    eus_metrics_count (self->metrics, counter);
+}
 
-static GRegex *
-get_filez_regex (void)
+/* Append @buffer, which is the whole body, to the response to @msg; paced by
+ * the #EusRepo:rate-limiter if there is one. */
+static void
+send_buffer (EusRepo           *self,
+             SoupMessage       *msg,
+             SoupClientContext *client,
+             SoupBuffer        *buffer)
 {
-  static gsize regex_initialized;
-  static GRegex *regex;
+  const gchar *host = (client != NULL) ? soup_client_context_get_host (client) : NULL;
 
-  if (g_once_init_enter (&regex_initialized))
+  /* libsoup applies Range headers to 200 responses itself, which needs the
+   * whole body up front; so those are only accounted for. */
+  if (self->rate_limiter != NULL && self->server != NULL &&
+      (msg->status_code != SOUP_STATUS_OK ||
+       soup_message_headers_get_one (msg->request_headers, "Range") == NULL))
     {
-      regex = g_regex_new ("^/objects/(" HEX_CLASS "{2})/(" HEX_CLASS "{62})\\.filez$", G_REGEX_OPTIMIZE, 0, NULL);
-      g_assert (regex);
-      g_once_init_leave (&regex_initialized, 1);
+      eus_rate_limiter_send_buffer (self->rate_limiter, self->server, msg,
+                                    host, buffer);
+      return;
     }
 
-  return regex;
+  if (self->rate_limiter != NULL)
+    eus_rate_limiter_consume (self->rate_limiter, host, buffer->length);
+  if (buffer->length > 0)
+    soup_message_body_append_buffer (msg->response_body, buffer);
 }
 
-#undef HEX_CLASS
+static void
+send_mapped_file (EusRepo           *self,
+                  SoupMessage       *msg,
+                  SoupClientContext *client,
+                  GMappedFile       *mapping)
+{
+  g_autoptr(SoupBuffer) buffer = NULL;
 
-static gchar *
-get_checksum_from_filez (const gchar *filez_path,
-                         GError **error)
+  buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
+                                       g_mapped_file_get_length (mapping),
+                                       g_mapped_file_ref (mapping),
+                                       (GDestroyNotify)g_mapped_file_unref);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  send_buffer (self, msg, client, buffer);
+}
+
+static void
+send_mapped_file_range (EusRepo           *self,
+                        SoupMessage       *msg,
+                        SoupClientContext *client,
+                        GMappedFile       *mapping,
+                        guint64            start,
+                        guint64            end)
 {
-  g_autoptr(GMatchInfo) match = NULL;
-  g_autofree gchar *first_two = NULL;
-  g_autofree gchar *rest = NULL;
-  g_autofree gchar *checksum = NULL;
+  g_autoptr(SoupBuffer) buffer = NULL;
+  g_autoptr(SoupBuffer) range = NULL;
+  gsize length = g_mapped_file_get_length (mapping);
 
-  if (!g_regex_match (get_filez_regex (), filez_path, 0, &match))
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "Invalid filez path %s", filez_path);
-      return NULL;
-    }
+  if (length == 0 || start >= length || start > end)
+    return;
+  end = MIN (end, length - 1);
+
+  buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
+                                       length,
+                                       g_mapped_file_ref (mapping),
+                                       (GDestroyNotify)g_mapped_file_unref);
+  range = soup_buffer_new_subbuffer (buffer, start, end - start + 1);
+  send_buffer (self, msg, client, range);
+}
 
-  first_two = g_match_info_fetch (match, 1);
-  rest = g_match_info_fetch (match, 2);
-  checksum = g_strdup_printf ("%s%s", first_two, rest);
+#define IMMUTABLE_CACHE_CONTROL "public, max-age=31536000, immutable"
 
-  if (!ostree_validate_structureof_checksum_string (checksum, error))
-    return NULL;
+/* Set the validators for a response: @etag, if non-%NULL; and either
+ * `Cache-Control: immutable` if the resource is @immutable, or the
+ * modification time @mtime (seconds since the epoch, or -1 if unknown) if it
+ * is not. */
+static void
+set_validators (SoupMessage *msg,
+                const gchar *etag,
+                gboolean     immutable,
+                gint64       mtime)
+{
+  if (etag != NULL)
+    soup_message_headers_replace (msg->response_headers, "ETag", etag);
+
+  if (immutable)
+    soup_message_headers_replace (msg->response_headers, "Cache-Control",
+                                  IMMUTABLE_CACHE_CONTROL);
+  else if (mtime >= 0)
+    {
+      g_autoptr(SoupDate) date = soup_date_new_from_time_t (mtime);
+      g_autofree gchar *last_modified = soup_date_to_string (date, SOUP_DATE_HTTP);
 
-  return g_steal_pointer (&checksum);
+      soup_message_headers_replace (msg->response_headers, "Last-Modified",
+                                    last_modified);
+    }
 }
 
+/* Whether the client’s copy of the resource is current, going by the
+ * If-None-Match and If-Modified-Since request headers (RFC 7232, §6) and the
+ * validators passed to set_validators(). */
 static gboolean
-load_compressed_file_stream (OstreeRepo *repo,
-                             const gchar *checksum,
-                             GCancellable *cancellable,
-                             GInputStream **out_input,
-                             guint64 *out_uncompressed_size,
-                             GError **error)
-{
-  g_autoptr(GInputStream) bare = NULL;
-  g_autoptr(GFileInfo) info = NULL;
-  g_autoptr(GVariant) xattrs = NULL;
-  g_autoptr(GInputStream) content = NULL;
-  g_auto(GVariantBuilder) builder = { { { 0, } } };
-  g_autoptr(GVariant) options = NULL;
-
-  if (!ostree_repo_load_file (repo,
-                              checksum,
-                              &bare,
-                              &info,
-                              &xattrs,
-                              cancellable,
-                              error))
-    return FALSE;
+request_is_not_modified (SoupMessage *msg,
+                         const gchar *etag,
+                         gint64       mtime)
+{
+  const gchar *if_none_match;
+  const gchar *if_modified_since;
 
-  /* Use compression level 2 (the maximum is 9) as a balance between CPU usage
-   * and compression attained. This gives fairly low CPU usage (a third of
-   * what’s needed for level 9) while halving the size of the uncompressed
-   * files. */
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
-  g_variant_builder_add (&builder, "{s@v}", "compression-level",
-                         g_variant_new_variant (g_variant_new_int32 (2)));
-  options = g_variant_ref_sink (g_variant_builder_end (&builder));
-
-  if (!ostree_raw_file_to_archive_z2_stream_with_options (bare,
-                                                          info,
-                                                          xattrs,
-                                                          options,
-                                                          &content,
-                                                          cancellable,
-                                                          error))
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD)
     return FALSE;
 
-  *out_input = g_steal_pointer (&content);
-  *out_uncompressed_size = g_file_info_get_size (info);
-  return TRUE;
-}
+  if_none_match = soup_message_headers_get_one (msg->request_headers,
+                                                "If-None-Match");
+  if (if_none_match != NULL)
+    {
+      g_auto(GStrv) tags = g_strsplit (if_none_match, ",", -1);
+      gsize i;
 
-#define EOS_TYPE_FILEZ_READ_DATA eos_filez_read_data_get_type ()
-EOS_DECLARE_REFCOUNTED (EosFilezReadData,
-                        eos_filez_read_data,
-                        EOS,
-                        FILEZ_READ_DATA)
+      for (i = 0; tags[i] != NULL; i++)
+        {
+          const gchar *tag = g_strstrip (tags[i]);
 
-struct _EosFilezReadData
-{
-  GObject parent_instance;
+          /* If-None-Match uses the weak comparison function (RFC 7232,
+           * §3.2). */
+          if (g_str_has_prefix (tag, "W/"))
+            tag += 2;
 
-  EusRepo *server_repo;
-  gpointer buffer;
-  gsize buflen;
-  SoupMessage *msg;
-  gchar *filez_path;
+          if (g_str_equal (tag, "*") ||
+              (etag != NULL && g_str_equal (tag, etag)))
+            return TRUE;
+        }
 
-  gulong finished_signal_id;
-};
+      /* If-Modified-Since is ignored if If-None-Match is present. */
+      return FALSE;
+    }
 
-static void
-eos_filez_read_data_disconnect_and_clear_msg (EosFilezReadData *read_data)
-{
-  if (read_data->finished_signal_id > 0)
-    g_signal_handler_disconnect (read_data->msg, read_data->finished_signal_id);
-  read_data->finished_signal_id = 0;
-  g_clear_object (&read_data->msg);
-  g_clear_object (&read_data->server_repo);
+  if_modified_since = soup_message_headers_get_one (msg->request_headers,
+                                                    "If-Modified-Since");
+  if (if_modified_since != NULL && mtime >= 0)
+    {
+      g_autoptr(SoupDate) date = soup_date_new_from_string (if_modified_since);
+
+      return (date != NULL && mtime <= soup_date_to_time_t (date));
+    }
+
+  return FALSE;
 }
 
-static void
-eos_filez_read_data_dispose_impl (EosFilezReadData *read_data)
+/* Maximum number of compressed object sizes to remember, so that objects
+ * which have to be compressed again (because they are not in the cache) can
+ * still be sent with a Content-Length and support range requests. The table
+ * is emptied when it fills up. */
+#define FILEZ_SIZES_MAX 65536
+
+/* A strong entity tag for a .filez object: the compressed stream is fully
+ * determined by the object and the compression level. */
+static gchar *
+filez_etag (const gchar *checksum,
+            gint         compression_level)
 {
-  eos_filez_read_data_disconnect_and_clear_msg (read_data);
+  return g_strdup_printf ("\"%s.z%d\"", checksum, compression_level);
 }
 
-static void
-eos_filez_read_data_finalize_impl (EosFilezReadData *read_data)
+/* Parse @etag as returned by filez_etag(), and return its compression level if
+ * it is for the object @checksum, or -1 otherwise. */
+static gint
+filez_etag_get_level (const gchar *etag,
+                      const gchar *checksum)
 {
-  g_free (read_data->buffer);
-  g_free (read_data->filez_path);
-}
+  gsize checksum_len = strlen (checksum);
 
-EOS_DEFINE_REFCOUNTED (EOS_FILEZ_READ_DATA,
-                       EosFilezReadData,
-                       eos_filez_read_data,
-                       eos_filez_read_data_dispose_impl,
-                       eos_filez_read_data_finalize_impl)
+  if (etag[0] != '"' ||
+      strncmp (etag + 1, checksum, checksum_len) != 0)
+    return -1;
 
-static void
-filez_read_data_finished_cb (SoupMessage *msg,
-                             gpointer read_data_ptr)
-{
-  EosFilezReadData *read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
+  etag += 1 + checksum_len;
+  if (etag[0] != '.' || etag[1] != 'z' ||
+      !g_ascii_isdigit (etag[2]) || etag[3] != '"' || etag[4] != '\0' ||
+      g_ascii_digit_value (etag[2]) > FILEZ_MAX_COMPRESSION_LEVEL)
+    return -1;
 
-  g_debug ("Downloading %s cancelled by client", read_data->filez_path);
-  eos_filez_read_data_disconnect_and_clear_msg (read_data);
+  return g_ascii_digit_value (etag[2]);
 }
 
-static EosFilezReadData *
-filez_read_data_new (EusRepo     *self,
-                     gsize        buflen,
-                     SoupMessage *msg,
-                     const gchar *filez_path)
+/* Check whether the client already has the object @checksum compressed at any
+ * level. Returns the matching ETag if so, or %NULL otherwise. */
+static gchar *
+filez_request_is_not_modified (SoupMessage *msg,
+                               const gchar *checksum)
 {
-  EosFilezReadData *read_data;
+  const gchar *if_none_match;
+  g_auto(GStrv) tags = NULL;
+  gsize i;
 
-  /* Small buffer length may happen for empty/small files, but zipping
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD)
+    return NULL;
+
+  if_none_match = soup_message_headers_get_one (msg->request_headers,
+                                                "If-None-Match");
+  if (if_none_match == NULL)
+    return NULL;
+
+  /* As in request_is_not_modified(). A wildcard matches any level, but which
+   * one the client has is unknown; the response only needs some ETag. */
+  tags = g_strsplit (if_none_match, ",", -1);
+  for (i = 0; tags[i] != NULL; i++)
+    {
+      const gchar *tag = g_strstrip (tags[i]);
+      gint level;
+
+      if (g_str_has_prefix (tag, "W/"))
+        tag += 2;
+
+      if (g_str_equal (tag, "*"))
+        return filez_etag (checksum, 0);
+
+      level = filez_etag_get_level (tag, checksum);
+      if (level >= 0)
+        return filez_etag (checksum, level);
+    }
+
+  return NULL;
+}
+
+/* Get the compression level which the client is resuming a download of
+ * @checksum at, from its If-Range header, or -1 if it is not resuming one.
+ * Compressing at that level again produces the same stream, so the download
+ * can carry on where it left off. */
+static gint
+filez_request_resume_level (SoupMessage *msg,
+                            const gchar *checksum)
+{
+  const gchar *if_range;
+
+  if_range = soup_message_headers_get_one (msg->request_headers, "If-Range");
+  if (if_range == NULL ||
+      soup_message_headers_get_one (msg->request_headers, "Range") == NULL)
+    return -1;
+
+  return filez_etag_get_level (if_range, checksum);
+}
+
+/* Choose the level to compress a new object at: #EusRepo:max-compression-level
+ * if nothing else is being compressed, scaling linearly down to
+ * #EusRepo:min-compression-level once there are as many compression jobs as
+ * workers. Without a scheduler, the objects being compressed by this
+ * repository are counted against the number of processors. */
+static gint
+choose_compression_level (EusRepo *self)
+{
+  guint min_level = self->min_compression_level;
+  guint max_level = MAX (self->max_compression_level, min_level);
+  guint n_jobs, max_jobs;
+
+  if (self->scheduler != NULL)
+    {
+      n_jobs = eus_scheduler_get_n_jobs (self->scheduler);
+      max_jobs = eus_scheduler_get_max_jobs (self->scheduler);
+    }
+  else
+    {
+      n_jobs = g_hash_table_size (self->filez_in_flight);
+      max_jobs = g_get_num_processors ();
+    }
+
+  max_jobs = MAX (max_jobs, 1);
+  n_jobs = MIN (n_jobs, max_jobs);
+
+  return max_level - (max_level - min_level) * n_jobs / max_jobs;
+}
+
+/* Returns the compressed size of the object with @etag, or -1 if unknown. */
+static gint64
+lookup_filez_size (EusRepo     *self,
+                   const gchar *etag)
+{
+  const guint64 *size = g_hash_table_lookup (self->filez_sizes, etag);
+
+  return (size != NULL) ? (gint64) *size : -1;
+}
+
+static void
+remember_filez_size (EusRepo     *self,
+                     const gchar *etag,
+                     guint64      size)
+{
+  guint64 *value;
+
+  if (g_hash_table_size (self->filez_sizes) >= FILEZ_SIZES_MAX &&
+      !g_hash_table_contains (self->filez_sizes, etag))
+    g_hash_table_remove_all (self->filez_sizes);
+
+  value = g_new (guint64, 1);
+  *value = size;
+  g_hash_table_replace (self->filez_sizes, g_strdup (etag), value);
+}
+
+/* Set up the status and headers of a .filez response, where the compressed
+ * object is @total_size bytes long, or -1 if that is not known yet. Range
+ * requests are honoured if the size is known, a single range is requested,
+ * and an If-Range header matches @etag; the range of bytes to send is
+ * returned in @out_start and @out_end (inclusive, with %G_MAXUINT64 meaning
+ * the end of the object). Returns %FALSE if the requested range is not
+ * satisfiable, in which case the response is complete. */
+static gboolean
+prepare_filez_response (SoupMessage *msg,
+                        const gchar *etag,
+                        gint64       total_size,
+                        guint64     *out_start,
+                        guint64     *out_end)
+{
+  const gchar *if_range;
+  SoupRange *ranges = NULL;
+  gint n_ranges = 0;
+
+  *out_start = 0;
+  *out_end = G_MAXUINT64;
+
+  set_validators (msg, etag, TRUE, -1);
+
+  if (total_size < 0)
+    {
+      soup_message_headers_set_encoding (msg->response_headers,
+                                         SOUP_ENCODING_CHUNKED);
+      soup_message_set_status (msg, SOUP_STATUS_OK);
+      return TRUE;
+    }
+
+  soup_message_headers_replace (msg->response_headers, "Accept-Ranges", "bytes");
+
+  /* If the client’s partial copy is of a different version of the object,
+   * it has to be sent in full (RFC 7233, §3.2). The same object compressed at
+   * different levels gives different bytes, so without an If-Range header
+   * there is no telling which version the client has, and it is sent in full
+   * too. Remove the Range header so libsoup doesn’t apply it either. */
+  if_range = soup_message_headers_get_one (msg->request_headers, "If-Range");
+  if (if_range == NULL || g_strcmp0 (if_range, etag) != 0)
+    soup_message_headers_remove (msg->request_headers, "Range");
+
+  if (soup_message_headers_get_one (msg->request_headers, "Range") != NULL)
+    {
+      if (!soup_message_headers_get_ranges (msg->request_headers, total_size,
+                                            &ranges, &n_ranges))
+        {
+          g_autofree gchar *content_range = NULL;
+
+          content_range = g_strdup_printf ("bytes */%" G_GINT64_FORMAT, total_size);
+          soup_message_headers_replace (msg->response_headers, "Content-Range",
+                                        content_range);
+          soup_message_set_status (msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+          return FALSE;
+        }
+
+      /* Multiple ranges are not supported, so the whole object is sent. */
+      if (n_ranges == 1)
+        {
+          *out_start = ranges[0].start;
+          *out_end = ranges[0].end;
+        }
+      soup_message_headers_free_ranges (msg->request_headers, ranges);
+
+      if (n_ranges == 1)
+        {
+          soup_message_headers_set_content_range (msg->response_headers,
+                                                  *out_start, *out_end,
+                                                  total_size);
+          soup_message_headers_set_content_length (msg->response_headers,
+                                                   *out_end - *out_start + 1);
+          soup_message_set_status (msg, SOUP_STATUS_PARTIAL_CONTENT);
+          return TRUE;
+        }
+    }
+
+  soup_message_headers_set_content_length (msg->response_headers, total_size);
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  return TRUE;
+}
+
+/* Late requests for an object which is already being compressed are replayed
+ * the chunks produced so far, and then share the rest of the stream. The
+ * chunks are only kept for replaying while their total size is below this
+ * limit; beyond it, later requests start a stream of their own. */
+#define FILEZ_REPLAY_LIMIT (8 * 1024 * 1024)
+
+/* The stream is only read ahead while every subscriber has fewer than this
+ * many chunks queued which have not been written to its socket yet, so the
+ * chunks queued for the slowest subscriber stay bounded. */
+#define FILEZ_MAX_PENDING_CHUNKS 2
+
+/* A subscriber which has chunks queued but has not written any of them to its
+ * socket for this long is disconnected, so that a stalled client cannot hold
+ * on to pooled buffers, or hold back the other subscribers, indefinitely. */
+#define FILEZ_WRITE_TIMEOUT_SECONDS 60
+
+#define EOS_TYPE_FILEZ_READ_DATA eos_filez_read_data_get_type ()
+EOS_DECLARE_REFCOUNTED (EosFilezReadData,
+                        eos_filez_read_data,
+                        EOS,
+                        FILEZ_READ_DATA)
+
+/* A single compression stream for an object, whose output is fanned out to
+ * all the requests (subscribers) for that object. */
+struct _EosFilezReadData
+{
+  GObject parent_instance;
+
+  EusRepo *server_repo;
+  GInputStream *stream;  /* (owned) (nullable) NULL once finished */
+  EusScheduler *scheduler;  /* (owned) (nullable) */
+  EusBufferPool *buffer_pool;  /* (owned) (nullable) */
+  EusRateLimiter *rate_limiter;  /* (owned) (nullable) */
+  GSource *throttle;  /* (owned) (nullable) pending while a subscriber is over its rate */
+  gchar *client;  /* (owned) (nullable) address of the client which started the stream */
+  gboolean reading;
+  gpointer buffer;  /* (owned) (nullable) buffer for the next chunk */
+  gsize buflen;
+  gchar *checksum;
+  gchar *etag;
+  gchar *filez_path;
+  gint64 total_size;  /* expected compressed size, or -1 if unknown */
+  guint64 offset;  /* number of bytes produced so far */
+
+  GPtrArray *subscribers;  /* (owned) (element-type FilezSubscriber) */
+  GPtrArray *chunks;  /* (owned) (nullable) (element-type SoupBuffer) NULL once too big to replay */
+  gsize chunks_length;
+};
+
+typedef struct
+{
+  EosFilezReadData *read_data;  /* (owned) */
+  SoupMessage *msg;  /* (owned) */
+  gchar *client;  /* (owned) (nullable) */
+  GSocket *socket;  /* (owned) (nullable) */
+  GSource *write_timeout;  /* (owned) (nullable) pending while chunks are queued */
+  gulong finished_signal_id;
+  gulong wrote_chunk_signal_id;
+  guint n_pending_chunks;  /* appended to the body but not yet written */
+  guint64 n_appended;  /* bytes appended to the body so far */
+  guint64 range_start;
+  guint64 range_end;  /* inclusive; G_MAXUINT64 for the end of the stream */
+} FilezSubscriber;
+
+static void
+filez_subscriber_free (FilezSubscriber *subscriber)
+{
+  if (subscriber->finished_signal_id > 0)
+    g_signal_handler_disconnect (subscriber->msg, subscriber->finished_signal_id);
+  subscriber->finished_signal_id = 0;
+  if (subscriber->wrote_chunk_signal_id > 0)
+    g_signal_handler_disconnect (subscriber->msg, subscriber->wrote_chunk_signal_id);
+  subscriber->wrote_chunk_signal_id = 0;
+  if (subscriber->write_timeout != NULL)
+    g_source_destroy (subscriber->write_timeout);
+  g_clear_pointer (&subscriber->write_timeout, g_source_unref);
+  g_clear_object (&subscriber->socket);
+  g_clear_object (&subscriber->msg);
+  g_clear_object (&subscriber->read_data);
+  g_free (subscriber->client);
+  g_free (subscriber);
+}
+
+/* Return the buffer for the next chunk, if one has been allocated. */
+static void
+filez_read_data_release_buffer (EosFilezReadData *read_data)
+{
+  if (read_data->buffer == NULL)
+    return;
+
+  if (read_data->buffer_pool != NULL)
+    eus_buffer_pool_release (read_data->buffer_pool, g_steal_pointer (&read_data->buffer));
+  else
+    g_clear_pointer (&read_data->buffer, g_free);
+}
+
+static void
+eos_filez_read_data_dispose_impl (EosFilezReadData *read_data)
+{
+  if (read_data->subscribers != NULL)
+    g_ptr_array_set_size (read_data->subscribers, 0);
+  g_clear_object (&read_data->server_repo);
+}
+
+static void
+eos_filez_read_data_finalize_impl (EosFilezReadData *read_data)
+{
+  if (read_data->throttle != NULL)
+    g_source_destroy (read_data->throttle);
+  g_clear_pointer (&read_data->throttle, g_source_unref);
+  g_clear_pointer (&read_data->chunks, g_ptr_array_unref);
+  g_clear_pointer (&read_data->subscribers, g_ptr_array_unref);
+  filez_read_data_release_buffer (read_data);
+  g_clear_object (&read_data->stream);
+  g_clear_object (&read_data->scheduler);
+  g_clear_object (&read_data->buffer_pool);
+  g_clear_object (&read_data->rate_limiter);
+  g_free (read_data->client);
+  g_free (read_data->checksum);
+  g_free (read_data->etag);
+  g_free (read_data->filez_path);
+}
+
+EOS_DEFINE_REFCOUNTED (EOS_FILEZ_READ_DATA,
+                       EosFilezReadData,
+                       eos_filez_read_data,
+                       eos_filez_read_data_dispose_impl,
+                       eos_filez_read_data_finalize_impl)
+
+static void filez_read_data_maybe_read (EosFilezReadData *read_data);
+static void filez_read_data_read (EosFilezReadData *read_data);
+static void filez_buffer_acquired_cb (GObject      *source_object,
+                                      GAsyncResult *result,
+                                      gpointer      read_data_ptr);
+
+/* Whether the whole response body has been appended and written. libsoup
+ * finishes a message as soon as its Content-Length has been written, which
+ * can be before the stream is read to its end. */
+static gboolean
+filez_subscriber_is_written (const FilezSubscriber *subscriber)
+{
+  SoupMessageHeaders *headers = subscriber->msg->response_headers;
+
+  return (soup_message_headers_get_encoding (headers) == SOUP_ENCODING_CONTENT_LENGTH &&
+          subscriber->n_appended == (guint64) soup_message_headers_get_content_length (headers) &&
+          subscriber->n_pending_chunks == 0);
+}
+
+static void
+filez_read_data_finished_cb (SoupMessage *msg,
+                             gpointer subscriber_ptr)
+{
+  FilezSubscriber *subscriber = subscriber_ptr;
+  g_autoptr(EosFilezReadData) read_data = g_object_ref (subscriber->read_data);
+
+  /* The stream carries on for the other subscribers (if any), which this one
+   * might have been holding back. */
+  if (!filez_subscriber_is_written (subscriber))
+    g_debug ("Downloading %s cancelled by client", read_data->filez_path);
+  g_ptr_array_remove_fast (read_data->subscribers, subscriber);
+  filez_read_data_maybe_read (read_data);
+}
+
+static gboolean
+filez_subscriber_write_timeout_cb (gpointer subscriber_ptr)
+{
+  FilezSubscriber *subscriber = subscriber_ptr;
+  g_autoptr(EosFilezReadData) read_data = g_object_ref (subscriber->read_data);
+
+  g_clear_pointer (&subscriber->write_timeout, g_source_unref);
+
+  /* libsoup has no way to abort a server-side message, so shut the socket
+   * down; the pending write then fails, and libsoup finishes the message as
+   * aborted. The stream carries on for the other subscribers. */
+  g_debug ("Downloading %s timed out writing to client %s",
+           read_data->filez_path,
+           (subscriber->client != NULL) ? subscriber->client : "(unknown)");
+  g_socket_shutdown (subscriber->socket, TRUE, TRUE, NULL);
+  g_ptr_array_remove_fast (read_data->subscribers, subscriber);
+  filez_read_data_maybe_read (read_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* (Re)start the subscriber’s write timeout if it has chunks queued, or stop it
+ * if it has none. */
+static void
+filez_subscriber_update_write_timeout (FilezSubscriber *subscriber)
+{
+  if (subscriber->write_timeout != NULL)
+    g_source_destroy (subscriber->write_timeout);
+  g_clear_pointer (&subscriber->write_timeout, g_source_unref);
+
+  if (subscriber->n_pending_chunks == 0 || subscriber->socket == NULL)
+    return;
+
+  subscriber->write_timeout = g_timeout_source_new_seconds (FILEZ_WRITE_TIMEOUT_SECONDS);
+  g_source_set_callback (subscriber->write_timeout,
+                         filez_subscriber_write_timeout_cb, subscriber, NULL);
+  g_source_attach (subscriber->write_timeout, g_main_context_get_thread_default ());
+}
+
+static void
+filez_read_data_wrote_chunk_cb (SoupMessage *msg,
+                                gpointer subscriber_ptr)
+{
+  FilezSubscriber *subscriber = subscriber_ptr;
+
+  if (subscriber->n_pending_chunks > 0)
+    subscriber->n_pending_chunks--;
+  filez_subscriber_update_write_timeout (subscriber);
+
+  filez_read_data_maybe_read (subscriber->read_data);
+}
+
+static EosFilezReadData *
+filez_read_data_new (EusRepo      *self,
+                     GInputStream *stream,
+                     gsize         buflen,
+                     const gchar  *checksum,
+                     const gchar  *etag,
+                     gint64        total_size,
+                     const gchar  *filez_path,
+                     const gchar  *client)
+{
+  EosFilezReadData *read_data;
+
+  /* Small buffer length may happen for empty/small files, but zipping
    * empty/small files may produce larger files, presumably due to
    * some zlib file header or something. Let's allocate a larger
    * buffer, so we send the short data over the socket in an ideally
@@ -477,242 +1447,1029 @@ filez_read_data_new (EusRepo     *self,
     buflen = 1024;
   read_data = g_object_new (EOS_TYPE_FILEZ_READ_DATA, NULL);
   read_data->server_repo = g_object_ref (self);
-  read_data->buffer = g_malloc (buflen);
+  read_data->stream = g_object_ref (stream);
+  read_data->scheduler = (self->scheduler != NULL) ? g_object_ref (self->scheduler) : NULL;
+  read_data->buffer_pool = (self->buffer_pool != NULL) ? g_object_ref (self->buffer_pool) : NULL;
+  read_data->rate_limiter = (self->rate_limiter != NULL) ? g_object_ref (self->rate_limiter) : NULL;
+  if (read_data->buffer_pool != NULL)
+    buflen = MIN (buflen, eus_buffer_pool_get_buffer_size (read_data->buffer_pool));
   read_data->buflen = buflen;
-  read_data->msg = g_object_ref (msg);
+  read_data->checksum = g_strdup (checksum);
+  read_data->etag = g_strdup (etag);
+  read_data->total_size = total_size;
   read_data->filez_path = g_strdup (filez_path);
-  read_data->finished_signal_id = g_signal_connect (msg, "finished", G_CALLBACK (filez_read_data_finished_cb), read_data);
+  read_data->client = g_strdup (client);
+  read_data->subscribers = g_ptr_array_new_with_free_func ((GDestroyNotify) filez_subscriber_free);
+  read_data->chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) soup_buffer_free);
+
+  return read_data;
+}
+
+/* Append the part of @chunk, which starts at @chunk_offset in the stream,
+ * which lies in the subscriber’s range. Returns %TRUE if anything was
+ * appended. */
+static gboolean
+filez_subscriber_append_chunk (FilezSubscriber *subscriber,
+                               SoupBuffer      *chunk,
+                               guint64          chunk_offset)
+{
+  g_autoptr(SoupBuffer) part = NULL;
+  guint64 start, end;
+
+  if (chunk->length == 0)
+    return FALSE;
+
+  start = MAX (chunk_offset, subscriber->range_start);
+  end = MIN (chunk_offset + chunk->length - 1, subscriber->range_end);
+  if (start > end)
+    return FALSE;
+
+  part = soup_buffer_new_subbuffer (chunk, start - chunk_offset, end - start + 1);
+  soup_message_body_append_buffer (subscriber->msg->response_body, part);
+  subscriber->n_pending_chunks++;
+  subscriber->n_appended += part->length;
+  if (subscriber->write_timeout == NULL)
+    filez_subscriber_update_write_timeout (subscriber);
+
+  if (subscriber->read_data->rate_limiter != NULL)
+    eus_rate_limiter_consume (subscriber->read_data->rate_limiter,
+                              subscriber->client, part->length);
+
+  return TRUE;
+}
+
+/* Whether all of the subscriber’s range has been produced, once the stream
+ * has reached @offset. */
+static gboolean
+filez_subscriber_is_done (const FilezSubscriber *subscriber,
+                          guint64                offset)
+{
+  return (subscriber->range_end != G_MAXUINT64 && offset > subscriber->range_end);
+}
+
+/* Start sending bytes @range_start to @range_end (inclusive) of the stream to
+ * @msg, whose status and headers must already have been set up, replaying the
+ * chunks produced so far. */
+static void
+filez_read_data_add_subscriber (EosFilezReadData  *read_data,
+                                SoupMessage       *msg,
+                                SoupClientContext *client,
+                                guint64            range_start,
+                                guint64            range_end)
+{
+  EusRepo *self = read_data->server_repo;
+  FilezSubscriber *subscriber;
+  guint64 chunk_offset = 0;
+  gboolean appended = FALSE;
+  gsize i;
+
+  g_assert (read_data->chunks != NULL);
+
+  /* Drop each chunk once it has been written, so its buffer can be reused. */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+
+  subscriber = g_new0 (FilezSubscriber, 1);
+  subscriber->read_data = g_object_ref (read_data);
+  subscriber->msg = g_object_ref (msg);
+  subscriber->client = (client != NULL) ? g_strdup (soup_client_context_get_host (client)) : NULL;
+  if (client != NULL && soup_client_context_get_gsocket (client) != NULL)
+    subscriber->socket = g_object_ref (soup_client_context_get_gsocket (client));
+  subscriber->range_start = range_start;
+  subscriber->range_end = range_end;
+
+  for (i = 0; i < read_data->chunks->len; i++)
+    {
+      SoupBuffer *chunk = g_ptr_array_index (read_data->chunks, i);
+
+      if (filez_subscriber_append_chunk (subscriber, chunk, chunk_offset))
+        appended = TRUE;
+      chunk_offset += chunk->length;
+    }
+
+  /* The whole range may have been replayed already. */
+  if (filez_subscriber_is_done (subscriber, read_data->offset))
+    {
+      soup_message_body_complete (msg->response_body);
+      filez_subscriber_free (subscriber);
+      return;
+    }
+
+  subscriber->finished_signal_id = g_signal_connect (msg, "finished", G_CALLBACK (filez_read_data_finished_cb), subscriber);
+  subscriber->wrote_chunk_signal_id = g_signal_connect (msg, "wrote-chunk", G_CALLBACK (filez_read_data_wrote_chunk_cb), subscriber);
+  g_ptr_array_add (read_data->subscribers, subscriber);
+
+  if (!appended)
+    soup_server_pause_message (self->server, msg);
+}
+
+/* Stop new requests from joining this stream. This may drop the last
+ * reference to @read_data if the caller doesn’t hold one. */
+static void
+filez_read_data_unregister (EosFilezReadData *read_data)
+{
+  EusRepo *self = read_data->server_repo;
+
+  if (self->filez_in_flight != NULL &&
+      g_hash_table_lookup (self->filez_in_flight, read_data->checksum) == read_data)
+    g_hash_table_remove (self->filez_in_flight, read_data->checksum);
+}
+
+/* Finish all the subscribers’ responses, successfully or with an error
+ * @status_code. */
+static void
+filez_read_data_complete (EosFilezReadData *read_data,
+                          guint             status_code)
+{
+  EusRepo *self = read_data->server_repo;
+  gsize i;
+
+  filez_read_data_release_buffer (read_data);
+  g_clear_object (&read_data->stream);
+  filez_read_data_unregister (read_data);
+
+  for (i = 0; i < read_data->subscribers->len; i++)
+    {
+      FilezSubscriber *subscriber = g_ptr_array_index (read_data->subscribers, i);
+
+      /* The headers have probably been sent already, so also close the
+       * connection to make sure the client sees the response as failed
+       * rather than short. */
+      if (status_code != SOUP_STATUS_OK)
+        {
+          soup_message_set_status (subscriber->msg, status_code);
+          soup_message_headers_replace (subscriber->msg->response_headers,
+                                        "Connection", "close");
+        }
+      soup_message_body_complete (subscriber->msg->response_body);
+      soup_server_unpause_message (self->server, subscriber->msg);
+    }
+
+  g_ptr_array_set_size (read_data->subscribers, 0);
+}
+
+/* Drop the replay history, and stop new requests from joining this stream.
+ * This may drop the last reference to @read_data if the caller doesn’t hold
+ * one. */
+static void
+filez_read_data_stop_replaying (EosFilezReadData *read_data)
+{
+  g_clear_pointer (&read_data->chunks, g_ptr_array_unref);
+  read_data->chunks_length = 0;
+  filez_read_data_unregister (read_data);
+}
+
+/* Whether the stream is being copied into the filez cache as it is read, in
+ * which case it is worth reading to the end even with no clients left. */
+static gboolean
+filez_read_data_is_caching (EosFilezReadData *read_data)
+{
+  return (read_data->stream != NULL &&
+          EUS_IS_FILEZ_CACHE_STREAM (read_data->stream) &&
+          eus_filez_cache_stream_is_caching (EUS_FILEZ_CACHE_STREAM (read_data->stream)));
+}
+
+static void
+filez_stream_read_chunk_cb (GObject *source_object,
+                            GAsyncResult *result,
+                            gpointer read_data_ptr)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosFilezReadData) read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
+  gssize bytes_read;
+  EusRepo *self;
+  g_autoptr(SoupBuffer) chunk = NULL;
+  guint64 chunk_offset;
+  gsize i;
+
+  if (read_data->scheduler != NULL)
+    bytes_read = eus_scheduler_read_finish (read_data->scheduler, result, &error);
+  else
+    bytes_read = g_input_stream_read_finish (read_data->stream, result, &error);
+  read_data->reading = FALSE;
+
+  /* If all the clients have gone away, only carry on if the output is being
+   * cached, since the work will be useful for the next client. The cache
+   * entry is committed by the read which reaches the end of the stream. */
+  if (read_data->subscribers->len == 0 && bytes_read != 0 &&
+      !filez_read_data_is_caching (read_data))
+    {
+      g_debug ("Stopped reading the file %s: no clients left", read_data->filez_path);
+      filez_read_data_release_buffer (read_data);
+      g_clear_object (&read_data->stream);
+      filez_read_data_unregister (read_data);
+      return;
+    }
+
+  self = read_data->server_repo;
+  if (bytes_read < 0)
+    {
+      g_warning ("Failed to read the file %s: %s", read_data->filez_path, error->message);
+      filez_read_data_complete (read_data, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      return;
+    }
+  if (bytes_read == 0)
+    {
+      g_debug ("Finished reading file %s", read_data->filez_path);
+
+      remember_filez_size (self, read_data->etag, read_data->offset);
+
+      if (read_data->total_size >= 0 &&
+          read_data->offset != (guint64) read_data->total_size)
+        {
+          g_warning ("Compressed size of %s changed from %" G_GINT64_FORMAT
+                     " to %" G_GUINT64_FORMAT " bytes",
+                     read_data->filez_path, read_data->total_size,
+                     read_data->offset);
+          filez_read_data_complete (read_data, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+          return;
+        }
+
+      filez_read_data_complete (read_data, SOUP_STATUS_OK);
+      return;
+    }
+
+  g_debug ("Read %" G_GSSIZE_FORMAT " bytes of the file %s", bytes_read, read_data->filez_path);
+
+  /* Hand the buffer over to libsoup, and share it between all the
+   * subscribers and the replay history. A new buffer is needed for the next
+   * chunk. */
+  if (read_data->buffer_pool != NULL)
+    chunk = eus_buffer_pool_wrap (read_data->buffer_pool,
+                                  g_steal_pointer (&read_data->buffer),
+                                  bytes_read);
+  else
+    chunk = soup_buffer_new (SOUP_MEMORY_TAKE,
+                             g_steal_pointer (&read_data->buffer),
+                             bytes_read);
+
+  chunk_offset = read_data->offset;
+  read_data->offset += bytes_read;
+
+  /* Iterate backwards, as subscribers whose range is complete are removed. */
+  for (i = read_data->subscribers->len; i > 0; i--)
+    {
+      FilezSubscriber *subscriber = g_ptr_array_index (read_data->subscribers, i - 1);
+
+      if (filez_subscriber_is_done (subscriber, read_data->offset))
+        {
+          filez_subscriber_append_chunk (subscriber, chunk, chunk_offset);
+          soup_message_body_complete (subscriber->msg->response_body);
+          soup_server_unpause_message (self->server, subscriber->msg);
+          g_ptr_array_remove_index_fast (read_data->subscribers, i - 1);
+        }
+      else if (filez_subscriber_append_chunk (subscriber, chunk, chunk_offset))
+        {
+          soup_server_unpause_message (self->server, subscriber->msg);
+        }
+    }
+
+  if (read_data->chunks != NULL &&
+      read_data->chunks_length + bytes_read <= FILEZ_REPLAY_LIMIT)
+    {
+      g_ptr_array_add (read_data->chunks, soup_buffer_copy (chunk));
+      read_data->chunks_length += bytes_read;
+    }
+  else if (read_data->chunks != NULL)
+    {
+      g_debug ("Not accepting more clients for %s: too much to replay", read_data->filez_path);
+      filez_read_data_stop_replaying (read_data);
+    }
+
+  filez_read_data_maybe_read (read_data);
+}
+
+/* Whether to read the next chunk of the stream now: only if every subscriber
+ * is ready for more data, or if there are no subscribers left and the output
+ * is only going to the cache. Otherwise, reading is resumed when the slowest
+ * subscriber writes a chunk to its socket, or is dropped by its write
+ * timeout. */
+static gboolean
+filez_read_data_can_read (EosFilezReadData *read_data)
+{
+  gsize i;
+
+  if (read_data->subscribers->len == 0)
+    return filez_read_data_is_caching (read_data);
+
+  for (i = 0; i < read_data->subscribers->len; i++)
+    {
+      const FilezSubscriber *subscriber = g_ptr_array_index (read_data->subscribers, i);
+
+      if (subscriber->n_pending_chunks >= FILEZ_MAX_PENDING_CHUNKS)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+filez_read_data_throttle_cb (gpointer read_data_ptr)
+{
+  EosFilezReadData *read_data = read_data_ptr;
+
+  g_clear_pointer (&read_data->throttle, g_source_unref);
+  filez_read_data_maybe_read (read_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Get how long to wait, in milliseconds, before producing more of the stream,
+ * so that no subscriber goes over its rate limit. The stream is shared, so it
+ * goes at the pace of the most limited subscriber. */
+static guint
+filez_read_data_get_delay (EosFilezReadData *read_data)
+{
+  guint delay = 0;
+  gsize i;
+
+  if (read_data->rate_limiter == NULL)
+    return 0;
+
+  for (i = 0; i < read_data->subscribers->len; i++)
+    {
+      const FilezSubscriber *subscriber = g_ptr_array_index (read_data->subscribers, i);
+
+      delay = MAX (delay, eus_rate_limiter_get_delay (read_data->rate_limiter,
+                                                      subscriber->client));
+    }
+
+  return delay;
+}
+
+/* Read the next chunk of the stream, unless a read is already in progress or
+ * the subscribers are still busy sending earlier chunks. This may drop the
+ * last reference to @read_data if the caller doesn’t hold one. */
+static void
+filez_read_data_maybe_read (EosFilezReadData *read_data)
+{
+  EusRepo *self = read_data->server_repo;
+  guint delay;
+
+  if (read_data->reading || read_data->stream == NULL ||
+      read_data->throttle != NULL)
+    return;
+
+  if (read_data->subscribers->len == 0 && !filez_read_data_is_caching (read_data))
+    {
+      g_debug ("Stopped reading the file %s: no clients left", read_data->filez_path);
+      filez_read_data_release_buffer (read_data);
+      g_clear_object (&read_data->stream);
+      filez_read_data_unregister (read_data);
+      return;
+    }
+
+  if (!filez_read_data_can_read (read_data))
+    return;
+
+  delay = filez_read_data_get_delay (read_data);
+  if (delay > 0)
+    {
+      read_data->throttle = g_timeout_source_new (delay);
+      g_source_set_priority (read_data->throttle, EUS_ROUTE_BULK_PRIORITY);
+      g_source_set_callback (read_data->throttle, filez_read_data_throttle_cb,
+                             g_object_ref (read_data), g_object_unref);
+      g_source_attach (read_data->throttle, g_main_context_get_thread_default ());
+      return;
+    }
+
+  read_data->reading = TRUE;
+
+  if (read_data->buffer_pool == NULL)
+    {
+      read_data->buffer = g_malloc (read_data->buflen);
+      filez_read_data_read (read_data);
+      return;
+    }
+
+  read_data->buffer = eus_buffer_pool_try_acquire (read_data->buffer_pool);
+  if (read_data->buffer != NULL)
+    {
+      filez_read_data_read (read_data);
+      return;
+    }
+
+  /* The memory budget is used up, so wait for a buffer to be released. Other
+   * streams may be waiting for the buffers held by this stream’s replay
+   * history, which would only be released once this stream finishes; so drop
+   * it to avoid a deadlock. */
+  if (read_data->chunks != NULL)
+    {
+      g_debug ("Not accepting more clients for %s: out of buffers", read_data->filez_path);
+      filez_read_data_stop_replaying (read_data);
+    }
+
+  eus_buffer_pool_acquire_async (read_data->buffer_pool,
+                                 self->cancellable,
+                                 filez_buffer_acquired_cb,
+                                 g_object_ref (read_data));
+}
+
+static void
+filez_buffer_acquired_cb (GObject      *source_object,
+                          GAsyncResult *result,
+                          gpointer      read_data_ptr)
+{
+  g_autoptr(EosFilezReadData) read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
+  g_autoptr(GError) error = NULL;
+
+  read_data->buffer = eus_buffer_pool_acquire_finish (read_data->buffer_pool,
+                                                      result, &error);
+  if (read_data->buffer == NULL)
+    {
+      read_data->reading = FALSE;
+      g_warning ("Failed to get a buffer for the file %s: %s", read_data->filez_path, error->message);
+      filez_read_data_complete (read_data, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+      return;
+    }
+
+  filez_read_data_read (read_data);
+}
+
+/* Read the next chunk of the stream into read_data->buffer. */
+static void
+filez_read_data_read (EosFilezReadData *read_data)
+{
+  EusRepo *self = read_data->server_repo;
+
+  if (read_data->scheduler != NULL)
+    eus_scheduler_read_async (read_data->scheduler,
+                              read_data->stream,
+                              read_data->buffer,
+                              read_data->buflen,
+                              read_data->client,
+                              self->cancellable,
+                              filez_stream_read_chunk_cb,
+                              g_object_ref (read_data));
+  else
+    g_input_stream_read_async (read_data->stream,
+                               read_data->buffer,
+                               read_data->buflen,
+                               EUS_ROUTE_BULK_PRIORITY,
+                               self->cancellable,
+                               filez_stream_read_chunk_cb,
+                               g_object_ref (read_data));
+}
 
-  return read_data;
+/* If the object @checksum is already being compressed for another client,
+ * share that stream rather than compressing it again. Returns %TRUE if the
+ * request has been handled. */
+static gboolean
+join_in_flight_filez (EusRepo           *self,
+                      SoupMessage       *msg,
+                      SoupClientContext *client,
+                      const gchar       *requested_path,
+                      const gchar       *checksum)
+{
+  EosFilezReadData *in_flight;
+  guint64 range_start, range_end;
+
+  in_flight = g_hash_table_lookup (self->filez_in_flight, checksum);
+  if (in_flight == NULL)
+    return FALSE;
+
+  g_debug ("Sending %s from an in-flight stream", requested_path);
+  count_event (self, EUS_METRICS_COUNTER_FILEZ_STREAMS_SHARED);
+  if (!prepare_filez_response (msg, in_flight->etag, in_flight->total_size,
+                               &range_start, &range_end))
+    return TRUE;
+  filez_read_data_add_subscriber (in_flight, msg, client,
+                                  range_start, range_end);
+  filez_read_data_maybe_read (in_flight);
+  return TRUE;
 }
 
+/* Start compressing the object @checksum from @stream, at
+ * @compression_level, and send it to @msg. */
 static void
-filez_stream_read_chunk_cb (GObject *stream_object,
-                            GAsyncResult *result,
-                            gpointer read_data_ptr)
+send_filez_stream (EusRepo           *self,
+                   SoupMessage       *msg,
+                   SoupClientContext *client,
+                   const gchar       *requested_path,
+                   const gchar       *checksum,
+                   GInputStream      *stream,
+                   guint64            uncompressed_size,
+                   gint               compression_level)
 {
-  g_autoptr(GError) error = NULL;
-  g_autoptr(EosFilezReadData) read_data = EOS_FILEZ_READ_DATA (read_data_ptr);
-  GInputStream *stream = G_INPUT_STREAM (stream_object);
-  gssize bytes_read = g_input_stream_read_finish (stream,
-                                                  result,
-                                                  &error);
-  EusRepo *self;
+  g_autoptr(EosFilezReadData) read_data = NULL;
+  g_autoptr(GInputStream) cache_stream = NULL;
+  g_autofree gchar *etag = NULL;
+  gint64 total_size;
+  guint64 range_start, range_end;
+
+  /* Another request may have started compressing the object while this one
+   * was loading it. */
+  if (join_in_flight_filez (self, msg, client, requested_path, checksum))
+    return;
 
-  if (read_data->msg == NULL)
-    /* got cancelled */
+  g_debug ("Compressing %s at level %d", requested_path, compression_level);
+  count_event (self, EUS_METRICS_COUNTER_FILEZ_CACHE_MISSES);
+  etag = filez_etag (checksum, compression_level);
+  total_size = lookup_filez_size (self, etag);
+  if (!prepare_filez_response (msg, etag, total_size, &range_start, &range_end))
     return;
 
-  self = read_data->server_repo;
-  if (bytes_read < 0)
+  /* Copy the stream into the cache as it is read. The reads, and so the cache
+   * writes, happen in the scheduler’s worker threads. */
+  if (self->filez_cache != NULL)
     {
-      g_warning ("Failed to read the file %s: %s", read_data->filez_path, error->message);
-      soup_message_set_status (read_data->msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-      soup_message_body_complete (read_data->msg->response_body);
-      soup_server_unpause_message (self->server, read_data->msg);
-      return;
-    }
-  if (bytes_read > 0)
-    {
-      gpointer buffer;
-      gsize buflen;
-      GCancellable *cancellable;
-
-      g_debug ("Read %" G_GSSIZE_FORMAT " bytes of the file %s", bytes_read, read_data->filez_path);
-      soup_message_body_append (read_data->msg->response_body,
-                                SOUP_MEMORY_COPY,
-                                read_data->buffer,
-                                bytes_read);
-      soup_server_unpause_message (self->server, read_data->msg);
-
-      buffer = read_data->buffer;
-      buflen = read_data->buflen;
-      cancellable = self->cancellable;
-      g_input_stream_read_async (stream,
-                                 buffer,
-                                 buflen,
-                                 G_PRIORITY_DEFAULT,
-                                 cancellable,
-                                 filez_stream_read_chunk_cb,
-                                 g_steal_pointer (&read_data));
-      return;
+      cache_stream = eus_filez_cache_stream_new (stream, self->filez_cache,
+                                                 checksum, compression_level);
+      stream = cache_stream;
     }
-  g_debug ("Finished reading file %s", read_data->filez_path);
-  soup_message_body_complete (read_data->msg->response_body);
-  soup_server_unpause_message (self->server, read_data->msg);
+
+  /* The compression is scheduled on behalf of the first client to ask for
+   * the object; later clients joining the stream share its turns. */
+  g_debug ("Sending %s", requested_path);
+  read_data = filez_read_data_new (self,
+                                   stream,
+                                   MIN(2 * 1024 * 1024, uncompressed_size + 1),
+                                   checksum,
+                                   etag,
+                                   total_size,
+                                   requested_path,
+                                   (client != NULL) ? soup_client_context_get_host (client) : NULL);
+
+  g_hash_table_insert (self->filez_in_flight, g_strdup (checksum),
+                       g_object_ref (read_data));
+  filez_read_data_add_subscriber (read_data, msg, client,
+                                  range_start, range_end);
+  filez_read_data_maybe_read (read_data);
 }
 
+/* A .filez request which is paused while its object is loaded. */
+typedef struct
+{
+  EusRepo *self;  /* (owned) */
+  SoupMessage *msg;  /* (owned) */
+  SoupClientContext *client;  /* (owned) (nullable) */
+  gchar *requested_path;  /* (owned) */
+  gchar *checksum;  /* (owned) */
+  gulong finished_id;
+  gboolean finished;  /* whether the client has gone away */
+} FilezLoadData;
+
 static void
-handle_objects_filez (EusRepo     *self,
-                      SoupMessage *msg,
-                      const gchar *requested_path)
+filez_load_data_free (FilezLoadData *data)
 {
-  g_autoptr(GError) error = NULL;
-  g_autofree gchar *checksum = NULL;
+  if (data->finished_id != 0)
+    g_signal_handler_disconnect (data->msg, data->finished_id);
+  g_clear_object (&data->msg);
+  if (data->client != NULL)
+    g_boxed_free (SOUP_TYPE_CLIENT_CONTEXT, data->client);
+  g_clear_object (&data->self);
+  g_free (data->requested_path);
+  g_free (data->checksum);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FilezLoadData, filez_load_data_free)
+
+static void
+filez_load_finished_cb (SoupMessage *msg,
+                        gpointer     user_data)
+{
+  FilezLoadData *data = user_data;
+
+  data->finished = TRUE;
+}
+
+static void
+filez_stream_loaded_cb (GObject      *source_object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr(FilezLoadData) data = user_data;
+  EusRepo *self = data->self;
   g_autoptr(GInputStream) stream = NULL;
-  gpointer buffer;
+  g_autoptr(GError) error = NULL;
   guint64 uncompressed_size;
-  gsize buflen;
-  g_autoptr(EosFilezReadData) read_data = NULL;
+  gint compression_level;
 
-  checksum = get_checksum_from_filez (requested_path,
-                                      &error);
-  if (checksum == NULL)
+  if (!eus_load_filez_stream_finish (result, &stream, &uncompressed_size,
+                                     &compression_level, &error))
     {
-      g_warning ("Failed to get checksum of the filez object %s: %s", requested_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Failed to get stream to the filez object %s: %s",
+                   data->requested_path, error->message);
+      if (!data->finished)
+        {
+          soup_message_set_status (data->msg, SOUP_STATUS_NOT_FOUND);
+          soup_server_unpause_message (self->server, data->msg);
+        }
+      return;
+    }
+
+  if (data->finished)
+    {
+      g_debug ("Not sending %s: client has gone away", data->requested_path);
       return;
     }
+
+  /* Unpausing takes effect from an idle callback, so the stream can still
+   * pause the message again. */
+  soup_server_unpause_message (self->server, data->msg);
+  send_filez_stream (self, data->msg, data->client, data->requested_path,
+                     data->checksum, stream, uncompressed_size,
+                     compression_level);
+}
+
+/* Check whether this repository contains the file object @checksum. This is a
+ * single fstatat() or so, rather than loading the object. Errors count as the
+ * object not being there. */
+static gboolean
+repo_has_file_object (EusRepo     *self,
+                      const gchar *checksum)
+{
+  gboolean has_object = FALSE;
+  g_autoptr(GError) error = NULL;
+
+  if (!ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                               &has_object, NULL, &error))
+    {
+      g_debug ("Failed to check whether %s is in the repository: %s",
+               checksum, error->message);
+      return FALSE;
+    }
+
+  return has_object;
+}
+
+static void
+handle_objects_filez (EusRepo           *self,
+                      SoupMessage       *msg,
+                      SoupClientContext *client,
+                      const gchar       *requested_path,
+                      const EusRoute    *route)
+{
+  const gchar *checksum = route->checksum_string;
+  g_autofree gchar *etag = NULL;
+  gint64 total_size;
+  guint64 range_start, range_end;
+  gint compression_level, resume_level;
+  FilezLoadData *data;
+
   g_debug ("Got checksum: %s", checksum);
 
-  if (!load_compressed_file_stream (self->repo,
-                                    checksum,
-                                    self->cancellable,
-                                    &stream,
-                                    &uncompressed_size,
-                                    &error))
+  /* The client’s copy is good whatever level it was compressed at. */
+  etag = filez_request_is_not_modified (msg, checksum);
+  if (etag != NULL)
     {
-      g_warning ("Failed to get stream to the filez object %s: %s", requested_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      g_debug ("Not modified: %s", requested_path);
+      set_validators (msg, etag, TRUE, -1);
+      soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
       return;
     }
 
-  g_debug ("Sending %s", requested_path);
-  soup_message_headers_set_encoding (msg->response_headers,
-                                     SOUP_ENCODING_CHUNKED);
-  soup_message_set_status (msg, SOUP_STATUS_OK);
-  read_data = filez_read_data_new (self,
-                                   MIN(2 * 1024 * 1024, uncompressed_size + 1),
-                                   msg,
-                                   requested_path);
-  buffer = read_data->buffer;
-  buflen = read_data->buflen;
-  g_input_stream_read_async (stream,
-                             buffer,
-                             buflen,
-                             G_PRIORITY_DEFAULT,
-                             self->cancellable,
-                             filez_stream_read_chunk_cb,
-                             g_steal_pointer (&read_data));
+  if (self->filez_cache != NULL)
+    {
+      g_autoptr(GMappedFile) mapping = NULL;
+
+      /* Look the object up at any compression level, preferring the
+       * smallest. The cache may be shared with other repositories, so only
+       * serve a hit if this repository has the object too: otherwise it would
+       * serve objects it doesn’t contain. */
+      mapping = eus_filez_cache_lookup_best (self->filez_cache, checksum,
+                                             &compression_level);
+      if (mapping != NULL && !repo_has_file_object (self, checksum))
+        {
+          g_debug ("Not sending %s from the cache: it is not in the repository",
+                   requested_path);
+          g_clear_pointer (&mapping, g_mapped_file_unref);
+        }
+
+      if (mapping != NULL)
+        {
+          g_debug ("Sending %s from the cache", requested_path);
+          count_event (self, EUS_METRICS_COUNTER_FILEZ_CACHE_HITS);
+          etag = filez_etag (checksum, compression_level);
+          total_size = g_mapped_file_get_length (mapping);
+          remember_filez_size (self, etag, total_size);
+          if (prepare_filez_response (msg, etag, total_size,
+                                      &range_start, &range_end))
+            send_mapped_file_range (self, msg, client, mapping,
+                                    range_start, range_end);
+          return;
+        }
+    }
+
+  if (join_in_flight_filez (self, msg, client, requested_path, checksum))
+    return;
+
+  /* A client resuming an interrupted download needs the same stream as
+   * before, so use the same level, without sampling. */
+  resume_level = filez_request_resume_level (msg, checksum);
+  compression_level = (resume_level >= 0) ? resume_level : choose_compression_level (self);
+
+  /* Opening the object, and sampling it to check whether it is worth
+   * compressing, block on the disk; so do them in the scheduler, with the
+   * request paused meanwhile, rather than holding up the main context. */
+  data = g_new0 (FilezLoadData, 1);
+  data->self = g_object_ref (self);
+  data->msg = g_object_ref (msg);
+  data->client = (client != NULL) ? g_boxed_copy (SOUP_TYPE_CLIENT_CONTEXT, client) : NULL;
+  data->requested_path = g_strdup (requested_path);
+  data->checksum = g_strdup (checksum);
+  data->finished_id = g_signal_connect (msg, "finished",
+                                        G_CALLBACK (filez_load_finished_cb),
+                                        data);
+
   soup_server_pause_message (self->server, msg);
-  return;
+  eus_load_filez_stream_async (self->repo,
+                               checksum,
+                               compression_level,
+                               resume_level < 0,
+                               self->scheduler,
+                               (client != NULL) ? soup_client_context_get_host (client) : NULL,
+                               self->cancellable,
+                               filez_stream_loaded_cb,
+                               data);
+}
+
+/* Get a strong entity tag for the file requested by @route if its contents
+ * can never change, or %NULL if they can. Objects are identified by their
+ * checksum and type. */
+static gchar *
+get_immutable_etag (const EusRoute *route)
+{
+  if (!route->immutable)
+    return NULL;
+
+  return g_strdup_printf ("\"%s%s\"", route->checksum_string,
+                          eus_object_kind_to_suffix (route->object_kind));
+}
+
+/* Get an entity tag for the file at @raw_path which changes whenever the file
+ * is replaced or modified, or %NULL if it does not exist. */
+static gchar *
+get_file_etag (const gchar *raw_path)
+{
+  struct stat buf;
+
+  if (g_stat (raw_path, &buf) != 0 || !S_ISREG (buf.st_mode))
+    return NULL;
+
+  return g_strdup_printf ("\"%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x-%"
+                          G_GINT64_MODIFIER "x\"",
+                          (gint64) buf.st_ino, (gint64) buf.st_mtime,
+                          (gint64) buf.st_size);
+}
+
+/* Build the path of @requested_path within the repository into @buf, which
+ * is @buf_len bytes long, without allocating. Returns %FALSE if it is too
+ * long. */
+static gboolean
+build_raw_path (EusRepo     *self,
+                const gchar *requested_path,
+                gchar       *buf,
+                gsize        buf_len)
+{
+  return ((gsize) g_snprintf (buf, buf_len, "%s%s", self->cached_repo_root,
+                              requested_path) < buf_len);
 }
 
-static const gchar *const as_is_allowed_object_suffices[] =
-  {
-    ".commit",
-    ".commitmeta",
-    ".dirmeta",
-    ".dirtree",
-    ".sig",
-    ".sizes2",
-    NULL
-  };
+/* Files at least this big are sent using sendfile() where possible, if the
+ * client has asked for its connection to be closed after the response anyway.
+ * Smaller ones are not worth the extra work. */
+#define SEND_FILE_MIN_SIZE (1024 * 1024)
+
+/* sendfile() closes the connection after the response, so files are only sent
+ * with it on a connection the client wants to keep alive if they are at least
+ * this big; reconnecting then costs little compared to the transfer, while
+ * pulls of many smaller files keep reusing their connections. */
+#define SEND_FILE_KEEP_ALIVE_MIN_SIZE (16 * 1024 * 1024)
+
+/* Files smaller than this which are served as they are, which are mostly
+ * metadata objects, are kept mapped in #EusRepo:mapped-file-cache; the
+ * private cache created if none is given holds up to MAPPED_FILES_MAX_SIZE. */
+#define MAPPED_FILES_MAX_ENTRY_SIZE SEND_FILE_MIN_SIZE
+#define MAPPED_FILES_MAX_SIZE (64 * 1024 * 1024)
+
+/* Whether the client has asked for its connection to be closed after the
+ * response to @msg. */
+static gboolean
+request_closes_connection (SoupMessage *msg)
+{
+  if (soup_message_get_http_version (msg) == SOUP_HTTP_1_0)
+    return !soup_message_headers_header_contains (msg->request_headers,
+                                                  "Connection", "Keep-Alive");
+
+  return soup_message_headers_header_contains (msg->request_headers,
+                                               "Connection", "close");
+}
 
+/* Try to send @raw_path to @client using sendfile(), at main context
+ * @priority, if it is big enough for that to be worth closing the connection
+ * for. Range requests are left to libsoup, which can only apply them to
+ * in-memory bodies. */
 static gboolean
-path_is_handled_as_is (const gchar *requested_path)
+try_send_file (EusRepo           *self,
+               SoupMessage       *msg,
+               SoupClientContext *client,
+               const gchar       *raw_path,
+               const gchar       *etag,
+               gboolean           immutable,
+               gint64             mtime,
+               gint               priority)
 {
-  guint idx;
+  struct stat buf;
+  goffset min_size;
+  gint fd;
+
+  if (self->server == NULL || client == NULL ||
+      soup_message_headers_get_one (msg->request_headers, "Range") != NULL)
+    return FALSE;
+
+  fd = g_open (raw_path, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    return FALSE;
+
+  min_size = request_closes_connection (msg) ? SEND_FILE_MIN_SIZE : SEND_FILE_KEEP_ALIVE_MIN_SIZE;
 
-  if (g_str_has_prefix (requested_path, "/objects/"))
+  if (fstat (fd, &buf) == 0 && buf.st_size >= min_size)
     {
-      for (idx = 0; as_is_allowed_object_suffices[idx]; ++idx)
-        if (g_str_has_suffix (requested_path,
-                              as_is_allowed_object_suffices[idx]))
-          return TRUE;
+      set_validators (msg, etag, immutable, mtime);
 
-      return FALSE;
+      if (eus_send_file (self->server, msg, client, fd, buf.st_size,
+                         self->rate_limiter, priority))
+        return TRUE;
     }
 
-  if (g_str_has_prefix (requested_path, "/deltas/") ||
-      g_str_has_prefix (requested_path, "/extensions/") ||
-      g_str_equal (requested_path, "/summary") ||
-      g_str_equal (requested_path, "/summary.sig"))
-    return TRUE;
-
+  g_close (fd, NULL);
   return FALSE;
 }
 
+/* Serve the file at @raw_path, if it exists. If @etag is non-%NULL, it is used
+ * to validate the client’s copy, along with the file’s modification time
+ * unless the file is @immutable. If the repository is connected and
+ * @client is non-%NULL, large files are sent using sendfile(), at main context
+ * @priority. Small files are looked up in, and added to, the mapped file
+ * cache: under @content_key if it is non-%NULL, which must then identify the
+ * file’s content in every repository sharing the cache; or under @raw_path
+ * otherwise. */
 static gboolean
-serve_file_if_exists (SoupMessage *msg,
-                      const gchar *root,
-                      const gchar *raw_path,
-                      GCancellable *cancellable,
-                      gboolean *served)
-{
-  g_autoptr(GFile) path = g_file_new_for_path (raw_path);
-  g_autoptr(GFile) root_path = g_file_new_for_path (root);
+serve_file_if_exists (EusRepo           *self,
+                      SoupMessage       *msg,
+                      SoupClientContext *client,
+                      const gchar       *raw_path,
+                      const gchar       *etag,
+                      gboolean           immutable,
+                      const gchar       *content_key,
+                      gint               priority,
+                      gboolean          *served)
+{
   g_autoptr(GMappedFile) mapping = NULL;
   g_autoptr(GError) error = NULL;
-  g_autoptr(SoupBuffer) buffer = NULL;
-
-  /* Security check to ensure we don’t get tricked into serving files which
-   * are outside the document root. This canonicalises the paths but does not
-   * follow symlinks.
-   *
-   * FIXME: Do we also want to resolve symlinks to ensure a malicious symlink
-   * inside the root can’t cause us to serve a file from outside the root
-   * (for example, /etc/shadow)? */
-  if (!g_file_has_prefix (path, root_path))
+  struct stat buf = { 0, };
+  gint64 mtime;
+
+  /* A content keyed entry may have been loaded through another repository
+   * sharing the cache. The object is identical whichever repository it came
+   * from, but it is only served if this repository has a copy too, so that a
+   * repository never serves objects it doesn’t contain. That costs a system
+   * call, but still saves opening and mapping the file. */
+  mapping = eus_mapped_file_cache_lookup (self->mapped_files,
+                                          (content_key != NULL) ? content_key : raw_path,
+                                          &mtime);
+  if (mapping != NULL && content_key != NULL && g_access (raw_path, F_OK) != 0)
     {
-      g_debug ("File ‘%s’ not within root ‘%s’", raw_path, root);
       *served = FALSE;
       return TRUE;
     }
 
-  if (!g_file_query_exists (path, cancellable))
+  if (mapping == NULL)
     {
-      *served = FALSE;
+      /* eus_route_parse() forbids paths containing ‘..’, so @raw_path cannot
+       * be outside the repository.
+       *
+       * FIXME: Do we also want to resolve symlinks to ensure a malicious
+       * symlink inside the root can’t cause us to serve a file from outside
+       * the root (for example, /etc/shadow)? */
+      if (g_stat (raw_path, &buf) != 0 || !S_ISREG (buf.st_mode))
+        {
+          *served = FALSE;
+          return TRUE;
+        }
+      mtime = buf.st_mtime;
+    }
+
+  if (request_is_not_modified (msg, etag, mtime))
+    {
+      g_debug ("Not modified: %s", raw_path);
+      set_validators (msg, etag, immutable, mtime);
+      soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+      *served = TRUE;
+      return TRUE;
+    }
+
+  if (mapping == NULL &&
+      try_send_file (self, msg, client, raw_path, etag, immutable, mtime,
+                     priority))
+    {
+      g_debug ("Sending %s", raw_path);
+      *served = TRUE;
       return TRUE;
     }
 
-  mapping = g_mapped_file_new (raw_path, FALSE, &error);
   if (mapping == NULL)
     {
-      g_warning ("Failed to map %s: %s", raw_path, error->message);
-      soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-      return FALSE;
+      mapping = g_mapped_file_new (raw_path, FALSE, &error);
+      if (mapping == NULL)
+        {
+          g_warning ("Failed to map %s: %s", raw_path, error->message);
+          soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+          return FALSE;
+        }
+
+      if (buf.st_size < MAPPED_FILES_MAX_ENTRY_SIZE)
+        {
+          count_event (self, EUS_METRICS_COUNTER_MAPPED_FILE_MISSES);
+          if (content_key != NULL)
+            eus_mapped_file_cache_insert_immutable (self->mapped_files,
+                                                    content_key, mapping,
+                                                    mtime);
+          else
+            eus_mapped_file_cache_insert (self->mapped_files, raw_path,
+                                          mapping, &buf);
+        }
+    }
+  else
+    {
+      count_event (self, EUS_METRICS_COUNTER_MAPPED_FILE_HITS);
     }
 
   g_debug ("Serving %s", raw_path);
-  buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
-                                       g_mapped_file_get_length (mapping),
-                                       g_mapped_file_ref (mapping),
-                                       (GDestroyNotify)g_mapped_file_unref);
-  if (buffer->length > 0)
-    soup_message_body_append_buffer (msg->response_body, buffer);
-  soup_message_set_status (msg, SOUP_STATUS_OK);
+  set_validators (msg, etag, immutable, mtime);
+  send_mapped_file (self, msg, client, mapping);
   *served = TRUE;
 
   return TRUE;
 }
 
 static void
-serve_file (SoupMessage *msg,
-            const gchar *root,
-            const gchar *raw_path,
-            GCancellable *cancellable)
+handle_as_is (EusRepo           *self,
+              SoupMessage       *msg,
+              SoupClientContext *client,
+              const gchar       *requested_path,
+              const EusRoute    *route)
 {
+  gchar raw_path[PATH_MAX];
+  g_autofree gchar *etag = NULL;
   gboolean served = FALSE;
 
-  if (!serve_file_if_exists (msg, root, raw_path, cancellable, &served))
+  if (!build_raw_path (self, requested_path, raw_path, sizeof (raw_path)))
+    {
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+  /* Static delta files are named after the commits they go between, but may
+   * be regenerated with different contents, so they are not immutable. */
+  if (route->kind == EUS_ROUTE_DELTA)
+    etag = get_file_etag (raw_path);
+  else
+    etag = get_immutable_etag (route);
+
+  /* Objects are content addressed, so the mapped file cache can share them
+   * between repositories. Deltas are not: independently generated deltas
+   * between the same commits may differ. */
+  if (!serve_file_if_exists (self, msg, client, raw_path, etag,
+                             route->immutable,
+                             (route->kind == EUS_ROUTE_OBJECT) ? etag : NULL,
+                             eus_route_get_priority (route), &served))
+    return;
+
+  if (served)
     return;
 
-  if (!served)
+  /* Deltas generated by the server are kept outside the repository. */
+  if (route->kind == EUS_ROUTE_DELTA && self->delta_cache_path != NULL)
     {
-      g_debug ("File %s not found", raw_path);
-      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      g_autofree gchar *cached_path = NULL;
+      g_autofree gchar *cached_etag = NULL;
+
+      cached_path = eus_delta_generator_build_cached_path (self->delta_cache_path,
+                                                           requested_path);
+      if (cached_path != NULL)
+        {
+          cached_etag = get_file_etag (cached_path);
+          if (!serve_file_if_exists (self, msg, client, cached_path,
+                                     cached_etag, FALSE, NULL,
+                                     eus_route_get_priority (route), &served))
+            return;
+
+          if (served)
+            return;
+        }
     }
-}
 
-static void
-handle_as_is (EusRepo     *self,
-              SoupMessage *msg,
-              const gchar *requested_path)
-{
-  g_autofree gchar *raw_path = g_build_filename (self->cached_repo_root, requested_path, NULL);
+  g_debug ("File %s not found", raw_path);
+  soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
 
-  serve_file (msg, self->cached_repo_root, raw_path, self->cancellable);
+  /* Generate missing deltas for the next client to ask for them. */
+  if (route->kind == EUS_ROUTE_DELTA &&
+      self->delta_generator != NULL &&
+      eus_delta_generator_queue_for_path (self->delta_generator, requested_path))
+    g_debug ("Queued generation of missing static delta %s", requested_path);
 }
 
 static SoupBuffer *
@@ -747,54 +2504,73 @@ handle_config (EusRepo     *self,
 }
 
 static void
-handle_refs_heads (EusRepo     *self,
-                   SoupMessage *msg,
-                   const gchar *requested_path)
+handle_refs_heads (EusRepo        *self,
+                   SoupMessage    *msg,
+                   const EusRoute *route)
 {
-  gsize prefix_len = strlen ("/refs/heads/");
-  size_t len = strlen (requested_path);
-  g_autofree gchar *raw_path = NULL;
-  gboolean served = FALSE;
-  const gchar *head;
+  g_autoptr(GBytes) contents = NULL;
+  const gchar *head = route->subpath;  /* e.g eos2/i386 */
+  gint64 mtime;
 
-  if (len <= prefix_len)
+  if (*head == '\0')
     {
       g_debug ("Invalid request for /refs/heads/");
       soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
       return;
     }
 
-  /* Pass through requests to things like /refs/heads/ostree/1/1/0 if they
-   * exist. */
-  raw_path = g_build_filename (self->cached_repo_root, requested_path, NULL);
-  if (!serve_file_if_exists (msg, self->cached_repo_root, raw_path, self->cancellable, &served))
-    return;
+  /* Requests for things like /refs/heads/ostree/1/1/0 are passed through if
+   * they exist. If not, this is probably a request for a head which is only
+   * available on the server — and hence available in our repository as a
+   * remote ref. The table transparently maps those to
+   * /refs/remotes/$remote_name; for example, /refs/heads/os/eos/amd64/master
+   * to /refs/remotes/eos/os/eos/amd64/master. */
+  contents = eus_ref_table_lookup (self->ref_table, head, &mtime);
+  if (contents == NULL)
+    {
+      g_debug ("Ref %s not found", head);
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
 
-  if (served)
-    return;
+  if (request_is_not_modified (msg, NULL, mtime))
+    {
+      g_debug ("Not modified: ref %s", head);
+      set_validators (msg, NULL, FALSE, mtime);
+      soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+      return;
+    }
 
-  /* If not, this is probably a request for a head which is only available on
-   * the server — and hence available in our repository as a remote ref.
-   * Transparently redirect to /refs/remotes/$remote_name. For example, map
-   * /refs/heads/os/eos/amd64/master to
-   * /refs/remotes/eos/os/eos/amd64/master. */
-  head = requested_path + prefix_len; /* e.g eos2/i386 */
-  g_clear_pointer (&raw_path, g_free);
-  raw_path = g_build_filename (self->cached_repo_root,
-                               "refs",
-                               "remotes",
-                               self->remote_name,
-                               head,
-                               NULL);
+  g_debug ("Serving ref %s", head);
+  set_validators (msg, NULL, FALSE, mtime);
+  send_bytes (msg, contents);
+}
 
-  serve_file (msg, self->cached_repo_root, raw_path, self->cancellable);
+static void
+record_route (EusRepo           *self,
+              SoupMessage       *msg,
+              const EusRoute    *route,
+              EusMetricsHandler  handler)
+{
+  if (self->metrics != NULL)
+    eus_metrics_request_routed (self->metrics, msg, route, handler);
 }
 
+static void deferred_request_cb (SoupMessage       *msg,
+                                 SoupClientContext *client,
+                                 gpointer           user_data);
+
+/* Classify the request for @path, admit it in its lane of the
+ * #EusRepo:client-table, and handle it. */
 static void
-handle_path (EusRepo     *self,
-             SoupMessage *msg,
-             const gchar *path)
+handle_path (EusRepo           *self,
+             SoupMessage       *msg,
+             SoupClientContext *client,
+             const gchar       *path)
 {
+  EusRoute route;
+  EusClientTableLane lane;
+
   if (g_cancellable_is_cancelled (self->cancellable))
     {
       soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
@@ -814,23 +2590,85 @@ handle_path (EusRepo     *self,
       goto out;
     }
 
-  if (strstr (path, "..") != NULL)
-    soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
-  else if (g_str_has_prefix (path, "/objects/") && g_str_has_suffix (path, ".filez"))
-    handle_objects_filez (self, msg, path);
-  else if (path_is_handled_as_is (path))
-    handle_as_is (self, msg, path);
-  else if (g_strcmp0 (path, "/config") == 0)
-    handle_config (self, msg);
-  else if (g_str_has_prefix (path, "/refs/heads/"))
-    handle_refs_heads (self, msg, path);
-  else
-    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+  eus_route_parse (path, &route);
+
+  /* Metadata and bulk data are admitted in separate lanes, so a client walking
+   * the commit’s trees is not held up behind its own downloads. A deferred
+   * request comes back through here once it is admitted. */
+  lane = eus_route_is_bulk (&route) ? EUS_CLIENT_TABLE_LANE_BULK : EUS_CLIENT_TABLE_LANE_METADATA;
+
+  if (self->client_table != NULL &&
+      !eus_client_table_admit (self->client_table, self->server, msg, client,
+                               lane, deferred_request_cb, g_object_ref (self),
+                               g_object_unref))
+    {
+      count_event (self, EUS_METRICS_COUNTER_REQUESTS_DEFERRED);
+      return;
+    }
+
+  switch (route.kind)
+    {
+    case EUS_ROUTE_FORBIDDEN:
+      record_route (self, msg, &route, EUS_METRICS_HANDLER_NONE);
+      soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
+      break;
+
+    case EUS_ROUTE_OBJECT:
+      if (route.object_kind == EUS_OBJECT_FILEZ)
+        {
+          record_route (self, msg, &route, EUS_METRICS_HANDLER_OBJECTS_FILEZ);
+          handle_objects_filez (self, msg, client, path, &route);
+        }
+      else
+        {
+          record_route (self, msg, &route, EUS_METRICS_HANDLER_AS_IS);
+          handle_as_is (self, msg, client, path, &route);
+        }
+      break;
+
+    case EUS_ROUTE_DELTA:
+    case EUS_ROUTE_EXTENSION:
+    case EUS_ROUTE_SUMMARY:
+    case EUS_ROUTE_SUMMARY_SIG:
+      record_route (self, msg, &route, EUS_METRICS_HANDLER_AS_IS);
+      handle_as_is (self, msg, client, path, &route);
+      break;
+
+    case EUS_ROUTE_CONFIG:
+      record_route (self, msg, &route, EUS_METRICS_HANDLER_CONFIG);
+      handle_config (self, msg);
+      break;
+
+    case EUS_ROUTE_REFS_HEADS:
+      record_route (self, msg, &route, EUS_METRICS_HANDLER_REFS_HEADS);
+      handle_refs_heads (self, msg, &route);
+      break;
+
+    case EUS_ROUTE_NOT_FOUND:
+    default:
+      record_route (self, msg, &route, EUS_METRICS_HANDLER_NONE);
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      break;
+    }
 
 out:
   g_debug ("Returning status %u (%s)", msg->status_code, msg->reason_phrase);
 }
 
+/* Handle a request which the #EusRepo:client-table deferred. */
+static void
+deferred_request_cb (SoupMessage       *msg,
+                     SoupClientContext *client,
+                     gpointer           user_data)
+{
+  EusRepo *self = EUS_REPO (user_data);
+  g_autofree gchar *path = NULL;
+
+  /* As libsoup does before calling server_cb(). */
+  path = soup_uri_decode (soup_message_get_uri (msg)->path);
+  handle_path (self, msg, client, path);
+}
+
 static void
 server_cb (SoupServer *soup_server,
            SoupMessage *msg,
@@ -841,7 +2679,7 @@ server_cb (SoupServer *soup_server,
 {
   EusRepo *self = EUS_REPO (user_data);
 
-  handle_path (self, msg, path);
+  handle_path (self, msg, context, path);
 }
 
 static gboolean
@@ -857,6 +2695,10 @@ eus_repo_initable_init (GInitable     *initable,
     return FALSE;
 
   self->cached_repo_root = g_file_get_path (ostree_repo_get_path (self->repo));
+  self->ref_table = eus_ref_table_new (self->cached_repo_root,
+                                       self->remote_name);
+  if (self->mapped_files == NULL)
+    self->mapped_files = eus_mapped_file_cache_new (MAPPED_FILES_MAX_SIZE);
 
   return TRUE;
 }
@@ -901,6 +2743,95 @@ eus_repo_new (OstreeRepo    *repo,
                          NULL);
 }
 
+static void
+pending_deltas_notify_cb (GObject    *object,
+                          GParamSpec *pspec,
+                          gpointer    user_data)
+{
+  EusRepo *self = EUS_REPO (user_data);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PENDING_DELTAS]);
+}
+
+static void
+pending_warm_ups_notify_cb (GObject    *object,
+                            GParamSpec *pspec,
+                            gpointer    user_data)
+{
+  EusRepo *self = EUS_REPO (user_data);
+
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PENDING_WARM_UPS]);
+}
+
+/* Get the checksums of the commits which the served remote’s refs point to.
+ * Errors are logged, and give an empty array. */
+static GPtrArray *
+list_served_commits (EusRepo *self)
+{
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) refs = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *prefix = g_strconcat (self->remote_name, ":", NULL);
+  GHashTableIter iter;
+  const gchar *ref, *checksum;
+
+  if (!ostree_repo_list_refs (self->repo, NULL, &refs, NULL, &error))
+    {
+      g_message ("Failed to list refs of remote %s: %s",
+                 self->remote_name, error->message);
+      return g_steal_pointer (&commits);
+    }
+
+  g_hash_table_iter_init (&iter, refs);
+
+  while (g_hash_table_iter_next (&iter, (gpointer *) &ref, (gpointer *) &checksum))
+    {
+      if (g_str_has_prefix (ref, prefix))
+        g_ptr_array_add (commits, g_strdup (checksum));
+    }
+
+  return g_steal_pointer (&commits);
+}
+
+/* Queue static deltas to each of @commits from their last
+ * #EusRepo:delta-ancestors ancestors. The previously deployed commit is
+ * normally the parent of the current one, so this covers it. */
+static void
+queue_ancestor_deltas (EusRepo   *self,
+                       GPtrArray *commits)
+{
+  gsize i;
+
+  for (i = 0; i < commits->len; i++)
+    {
+      const gchar *checksum = g_ptr_array_index (commits, i);
+      g_autofree gchar *ancestor = g_strdup (checksum);
+      guint j;
+
+      for (j = 0; j < self->delta_ancestors; j++)
+        {
+          g_autoptr(GVariant) commit = NULL;
+          g_autofree gchar *parent = NULL;
+
+          /* Stop at the first ancestor which has not been pulled. */
+          if (!ostree_repo_load_variant_if_exists (self->repo,
+                                                   OSTREE_OBJECT_TYPE_COMMIT,
+                                                   ancestor, &commit, NULL) ||
+              commit == NULL)
+            break;
+
+          parent = ostree_commit_get_parent (commit);
+          if (parent == NULL)
+            break;
+
+          eus_delta_generator_queue (self->delta_generator, parent, checksum);
+
+          g_free (ancestor);
+          ancestor = g_steal_pointer (&parent);
+        }
+    }
+}
+
 /**
  * eus_repo_connect:
  * @self: an #EusRepo
@@ -919,12 +2850,46 @@ void
 eus_repo_connect (EusRepo    *self,
                   SoupServer *server)
 {
+  g_autoptr(GPtrArray) commits = NULL;
+  gboolean generate_deltas;
+  gsize i;
+
   g_return_if_fail (EUS_IS_REPO (self));
   g_return_if_fail (SOUP_IS_SERVER (server));
   g_return_if_fail (self->server == NULL);
 
   self->server = g_object_ref (server);
 
+  generate_deltas = (self->delta_max_size > 0 && self->delta_cache_path != NULL);
+  if (generate_deltas || (self->warm_up && self->filez_cache != NULL))
+    commits = list_served_commits (self);
+
+  clear_delta_generator (self);
+  if (generate_deltas)
+    {
+      self->delta_generator = eus_delta_generator_new (self->repo,
+                                                       self->delta_cache_path,
+                                                       self->delta_max_size);
+      g_signal_connect (self->delta_generator, "notify::n-pending",
+                        (GCallback) pending_deltas_notify_cb, self);
+      queue_ancestor_deltas (self, commits);
+    }
+
+  /* Objects are compressed at the level used when the server is idle, so
+   * they are the same as if a client had requested them then. */
+  if (self->warm_up && self->filez_cache != NULL)
+    {
+      self->filez_warmer = eus_filez_warmer_new (self->repo, self->filez_cache,
+                                                 MAX (self->max_compression_level,
+                                                      self->min_compression_level));
+      g_signal_connect (self->filez_warmer, "notify::n-pending",
+                        (GCallback) pending_warm_ups_notify_cb, self);
+
+      for (i = 0; i < commits->len; i++)
+        eus_filez_warmer_queue (self->filez_warmer,
+                                g_ptr_array_index (commits, i));
+    }
+
   soup_server_add_handler (self->server,
                            self->root_path,
                            server_cb,
@@ -956,6 +2921,21 @@ eus_repo_disconnect (EusRepo *self)
   if (self->server != NULL)
     soup_server_remove_handler (self->server, self->root_path);
 
+  /* Keep the generator until its running job finishes, so
+   * #EusRepo:pending-deltas drops to zero. */
+  if (self->delta_generator != NULL)
+    eus_delta_generator_cancel (self->delta_generator);
+
+  /* Whatever has been compressed so far stays in the cache, so the warm-up
+   * carries on from there next time. */
+  if (self->filez_warmer != NULL)
+    {
+      g_signal_handlers_disconnect_by_data (self->filez_warmer, self);
+      eus_filez_warmer_cancel (self->filez_warmer);
+      g_clear_object (&self->filez_warmer);
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_PENDING_WARM_UPS]);
+    }
+
   g_clear_object (&self->server);
   g_object_notify_by_pspec (G_OBJECT (self), props[PROP_SERVER]);
 }
@@ -0,0 +1,265 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <libeos-update-server/router.h>
+#include <string.h>
+
+/**
+ * SECTION:router
+ * @title: Request router
+ * @short_description: Parse request paths without allocating
+ * @include: libeos-update-server/router.h
+ *
+ * Parses the path of a request to a repository into an #EusRoute, which says
+ * how #EusRepo should handle it. Object paths are fully validated, and their
+ * checksums are decoded in place, so the handlers do not need to parse them
+ * again. Parsing walks a couple of small static tables and never allocates,
+ * as it is done for every request and pulls consist mostly of many small
+ * requests.
+ *
+ * Since: UNRELEASED
+ */
+
+typedef struct
+{
+  const gchar *prefix;
+  gsize prefix_len;
+  gboolean exact;  /* the whole path must match, rather than just the prefix */
+  EusRouteKind kind;
+} RouteEntry;
+
+#define ROUTE(prefix, exact, kind) { prefix, sizeof (prefix) - 1, exact, kind }
+
+/* Most frequently requested first. */
+static const RouteEntry routes[] =
+  {
+    ROUTE ("/objects/", FALSE, EUS_ROUTE_OBJECT),
+    ROUTE ("/deltas/", FALSE, EUS_ROUTE_DELTA),
+    ROUTE ("/summary", TRUE, EUS_ROUTE_SUMMARY),
+    ROUTE ("/summary.sig", TRUE, EUS_ROUTE_SUMMARY_SIG),
+    ROUTE ("/refs/heads/", FALSE, EUS_ROUTE_REFS_HEADS),
+    ROUTE ("/config", TRUE, EUS_ROUTE_CONFIG),
+    ROUTE ("/extensions/", FALSE, EUS_ROUTE_EXTENSION),
+  };
+
+#undef ROUTE
+
+typedef struct
+{
+  const gchar *suffix;
+  EusObjectKind kind;
+  gboolean immutable;
+} ObjectEntry;
+
+/* Indexed by #EusObjectKind. Content-addressed objects never change once
+ * written. Detached commit metadata is not content addressed, as signatures
+ * can be added to it; and the contents of a .filez object depend on the
+ * level it is compressed at. */
+static const ObjectEntry objects[] =
+  {
+    { ".filez", EUS_OBJECT_FILEZ, FALSE },
+    { ".commit", EUS_OBJECT_COMMIT, TRUE },
+    { ".commitmeta", EUS_OBJECT_COMMITMETA, FALSE },
+    { ".dirmeta", EUS_OBJECT_DIRMETA, TRUE },
+    { ".dirtree", EUS_OBJECT_DIRTREE, TRUE },
+    { ".sig", EUS_OBJECT_SIG, FALSE },
+    { ".sizes2", EUS_OBJECT_SIZES2, TRUE },
+  };
+
+/* Value of each lower case hex digit, plus one; zero for other characters.
+ * ostree only accepts lower case checksums. */
+static const guint8 hex_values[256] =
+  {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  };
+
+/* Length of `xx/yyyy` in an object path. */
+#define OBJECT_CHECKSUM_LEN 65
+
+/* Parse @object, which is of the form `xx/yyyy.type`, where xxyyyy is a
+ * checksum. */
+static gboolean
+parse_object (const gchar *object,
+              EusRoute    *route)
+{
+  gsize i;
+
+  if (object[0] == '\0' || object[1] == '\0' || object[2] != '/')
+    return FALSE;
+
+  /* The first byte is split from the rest by the ‘/’. */
+  for (i = 0; i < G_N_ELEMENTS (route->checksum); i++)
+    {
+      const gchar *digits = object + ((i == 0) ? 0 : 2 * i + 1);
+      guint8 high = hex_values[(guchar) digits[0]];
+      guint8 low = (high != 0) ? hex_values[(guchar) digits[1]] : 0;
+
+      if (high == 0 || low == 0)
+        return FALSE;
+
+      route->checksum[i] = ((high - 1) << 4) | (low - 1);
+      route->checksum_string[2 * i] = digits[0];
+      route->checksum_string[2 * i + 1] = digits[1];
+    }
+
+  route->checksum_string[2 * G_N_ELEMENTS (route->checksum)] = '\0';
+
+  for (i = 0; i < G_N_ELEMENTS (objects); i++)
+    {
+      if (strcmp (object + OBJECT_CHECKSUM_LEN, objects[i].suffix) == 0)
+        {
+          route->object_kind = objects[i].kind;
+          route->immutable = objects[i].immutable;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/**
+ * eus_route_parse:
+ * @path: path of the request, relative to the root of the repository, such
+ *    as `/objects/ab/cdef….dirtree`
+ * @route: (out caller-allocates): return location for the parsed path
+ *
+ * Work out how to handle a request for @path. Paths containing `..` are
+ * %EUS_ROUTE_FORBIDDEN; paths which are not served, including object paths
+ * with an invalid checksum or an unknown type, are %EUS_ROUTE_NOT_FOUND.
+ *
+ * This does not allocate. @route->subpath points into @path, so it is only
+ * valid as long as @path is.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_route_parse (const gchar *path,
+                 EusRoute    *route)
+{
+  gsize i;
+
+  g_return_if_fail (path != NULL);
+  g_return_if_fail (route != NULL);
+
+  route->kind = EUS_ROUTE_NOT_FOUND;
+  route->immutable = FALSE;
+  route->subpath = NULL;
+
+  if (strstr (path, "..") != NULL)
+    {
+      route->kind = EUS_ROUTE_FORBIDDEN;
+      return;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (routes); i++)
+    {
+      const RouteEntry *entry = &routes[i];
+
+      if (strncmp (path, entry->prefix, entry->prefix_len) != 0 ||
+          (entry->exact && path[entry->prefix_len] != '\0'))
+        continue;
+
+      route->subpath = path + entry->prefix_len;
+
+      if (entry->kind == EUS_ROUTE_OBJECT &&
+          !parse_object (route->subpath, route))
+        return;
+
+      route->kind = entry->kind;
+      return;
+    }
+}
+
+/**
+ * eus_route_is_bulk:
+ * @route: an #EusRoute from eus_route_parse()
+ *
+ * Get whether @route is for bulk file data, rather than for the metadata a
+ * client needs to work out what to pull. Bulk requests are `.filez` objects
+ * and static delta parts; delta superblocks are metadata. Pulls consist of
+ * many more bulk requests than metadata ones, and each takes much more work
+ * to serve.
+ *
+ * Returns: %TRUE if @route is for bulk data, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_route_is_bulk (const EusRoute *route)
+{
+  g_return_val_if_fail (route != NULL, FALSE);
+
+  switch (route->kind)
+    {
+    case EUS_ROUTE_OBJECT:
+      return (route->object_kind == EUS_OBJECT_FILEZ);
+    case EUS_ROUTE_DELTA:
+      return !g_str_has_suffix (route->subpath, "/superblock");
+    case EUS_ROUTE_NOT_FOUND:
+    case EUS_ROUTE_FORBIDDEN:
+    case EUS_ROUTE_EXTENSION:
+    case EUS_ROUTE_SUMMARY:
+    case EUS_ROUTE_SUMMARY_SIG:
+    case EUS_ROUTE_CONFIG:
+    case EUS_ROUTE_REFS_HEADS:
+    default:
+      return FALSE;
+    }
+}
+
+/**
+ * eus_route_get_priority:
+ * @route: an #EusRoute from eus_route_parse()
+ *
+ * Get the main context priority to send the response to @route at:
+ * %EUS_ROUTE_BULK_PRIORITY for bulk data, and %G_PRIORITY_DEFAULT for
+ * metadata.
+ *
+ * Returns: a main context priority
+ * Since: UNRELEASED
+ */
+gint
+eus_route_get_priority (const EusRoute *route)
+{
+  g_return_val_if_fail (route != NULL, G_PRIORITY_DEFAULT);
+
+  return eus_route_is_bulk (route) ? EUS_ROUTE_BULK_PRIORITY : G_PRIORITY_DEFAULT;
+}
+
+/**
+ * eus_object_kind_to_suffix:
+ * @kind: an #EusObjectKind
+ *
+ * Get the file name suffix for objects of type @kind, such as `.dirtree`.
+ *
+ * Returns: the suffix, including the leading `.`
+ * Since: UNRELEASED
+ */
+const gchar *
+eus_object_kind_to_suffix (EusObjectKind kind)
+{
+  g_return_val_if_fail ((gsize) kind < G_N_ELEMENTS (objects), NULL);
+
+  return objects[kind].suffix;
+}
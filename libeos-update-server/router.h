@@ -0,0 +1,130 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EusRouteKind:
+ * @EUS_ROUTE_NOT_FOUND: the path is not one which is served
+ * @EUS_ROUTE_FORBIDDEN: the path tries to escape the repository
+ * @EUS_ROUTE_OBJECT: `/objects/xx/yyyy.type`; see #EusObjectKind
+ * @EUS_ROUTE_DELTA: anything under `/deltas/`
+ * @EUS_ROUTE_EXTENSION: anything under `/extensions/`
+ * @EUS_ROUTE_SUMMARY: `/summary`
+ * @EUS_ROUTE_SUMMARY_SIG: `/summary.sig`
+ * @EUS_ROUTE_CONFIG: `/config`
+ * @EUS_ROUTE_REFS_HEADS: anything under `/refs/heads/`
+ *
+ * The kinds of path within a repository which #EusRepo handles.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_ROUTE_NOT_FOUND = 0,
+  EUS_ROUTE_FORBIDDEN,
+  EUS_ROUTE_OBJECT,
+  EUS_ROUTE_DELTA,
+  EUS_ROUTE_EXTENSION,
+  EUS_ROUTE_SUMMARY,
+  EUS_ROUTE_SUMMARY_SIG,
+  EUS_ROUTE_CONFIG,
+  EUS_ROUTE_REFS_HEADS,
+} EusRouteKind;
+
+/**
+ * EusObjectKind:
+ * @EUS_OBJECT_FILEZ: `.filez`, compressed on the fly
+ * @EUS_OBJECT_COMMIT: `.commit`
+ * @EUS_OBJECT_COMMITMETA: `.commitmeta`
+ * @EUS_OBJECT_DIRMETA: `.dirmeta`
+ * @EUS_OBJECT_DIRTREE: `.dirtree`
+ * @EUS_OBJECT_SIG: `.sig`
+ * @EUS_OBJECT_SIZES2: `.sizes2`
+ *
+ * The types of object which can be requested, by file name suffix.
+ *
+ * Since: UNRELEASED
+ */
+typedef enum
+{
+  EUS_OBJECT_FILEZ,
+  EUS_OBJECT_COMMIT,
+  EUS_OBJECT_COMMITMETA,
+  EUS_OBJECT_DIRMETA,
+  EUS_OBJECT_DIRTREE,
+  EUS_OBJECT_SIG,
+  EUS_OBJECT_SIZES2,
+} EusObjectKind;
+
+/**
+ * EusRoute:
+ * @kind: kind of path
+ * @object_kind: type of the object, if @kind is %EUS_ROUTE_OBJECT
+ * @immutable: %TRUE if the file at the path can never change, so it can be
+ *    identified by its path
+ * @checksum: binary checksum of the object, if @kind is %EUS_ROUTE_OBJECT
+ * @checksum_string: nul-terminated lower case hex form of @checksum, if
+ *    @kind is %EUS_ROUTE_OBJECT
+ * @subpath: the rest of the path after the `/deltas/`, `/extensions/` or
+ *    `/refs/heads/` prefix; points into the parsed path
+ *
+ * The result of parsing a request path with eus_route_parse(). It is
+ * intended to be allocated on the stack.
+ *
+ * Since: UNRELEASED
+ */
+typedef struct
+{
+  EusRouteKind kind;
+  EusObjectKind object_kind;
+  gboolean immutable;
+  guint8 checksum[32];
+  gchar checksum_string[65];
+  const gchar *subpath;
+} EusRoute;
+
+void eus_route_parse (const gchar *path,
+                      EusRoute    *route);
+gboolean eus_route_is_bulk (const EusRoute *route);
+
+/**
+ * EUS_ROUTE_BULK_PRIORITY:
+ *
+ * Main context priority to send the bodies of bulk responses (see
+ * eus_route_is_bulk()) at. It is below %G_PRIORITY_DEFAULT, which libsoup
+ * reads requests and writes responses at, so that metadata requests are
+ * handled first when the server is busy.
+ *
+ * Since: UNRELEASED
+ */
+#define EUS_ROUTE_BULK_PRIORITY (G_PRIORITY_DEFAULT + 50)
+
+gint eus_route_get_priority (const EusRoute *route);
+
+const gchar *eus_object_kind_to_suffix (EusObjectKind kind);
+
+G_END_DECLS
@@ -0,0 +1,607 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/scheduler.h>
+
+/**
+ * SECTION:scheduler
+ * @title: Compression scheduler
+ * @short_description: Bounded worker pool for producing response bodies
+ * @include: libeos-update-server/scheduler.h
+ *
+ * A fixed-size pool of worker threads which read chunks from the compression
+ * streams of `.filez` objects. Reading a chunk from such a stream is what
+ * does the compression, so it is CPU bound; doing it in the worker pool
+ * keeps the main context free to handle other requests, and bounds the
+ * number of objects which are compressed at once to
+ * #EusScheduler:max-jobs. Jobs beyond that are queued. Other blocking work
+ * needed to produce a response body, such as opening an object and sampling
+ * it, can be run in the pool too, using eus_scheduler_run_async().
+ *
+ * Each stream should only have one read outstanding at once. Callers apply
+ * backpressure by not scheduling the next read for a stream until its
+ * clients’ sockets have caught up with the data produced so far, so a queue
+ * of slow clients does not tie up the pool.
+ *
+ * Jobs are queued per client, and the worker pool takes the next job from
+ * each client with queued jobs in turn, so a client with many parallel
+ * requests gets the same share of the pool as a client with one, and all
+ * clients finish at roughly the same time.
+ *
+ * The results of each read are returned in the thread-default main context
+ * of the caller of eus_scheduler_read_async().
+ *
+ * Since: UNRELEASED
+ */
+
+/**
+ * EusScheduler:
+ *
+ * A bounded worker pool for producing response bodies.
+ *
+ * Since: UNRELEASED
+ */
+struct _EusScheduler
+{
+  GObject parent_instance;
+
+  guint max_jobs;
+  GThreadPool *pool;  /* (owned) */
+
+  GMutex lock;  /* protects the fields below */
+  GHashTable *clients;  /* (owned) (element-type utf8 ClientQueue) clients with queued jobs */
+  GQueue ready;  /* (element-type ClientQueue) clients with queued jobs, next to run first */
+  guint n_queued;
+  guint n_running;
+  gint64 cpu_time;  /* microseconds spent running jobs */
+};
+
+G_DEFINE_TYPE (EusScheduler, eus_scheduler, G_TYPE_OBJECT)
+
+typedef enum
+{
+  PROP_MAX_JOBS = 1,
+} EusSchedulerProperty;
+
+static GParamSpec *props[PROP_MAX_JOBS + 1] = { NULL, };
+
+/* A queued job: either a read of @stream, or a call to @func. */
+typedef struct
+{
+  GInputStream *stream;  /* (owned) (nullable) */
+  gpointer buffer;  /* (unowned) */
+  gsize count;
+
+  EusSchedulerJobFunc func;  /* (nullable) */
+  gpointer data;  /* (owned) (nullable) */
+  GDestroyNotify data_free_func;  /* (nullable) */
+} Job;
+
+static void
+job_free (Job *job)
+{
+  g_clear_object (&job->stream);
+  if (job->data_free_func != NULL)
+    job->data_free_func (job->data);
+  g_free (job);
+}
+
+typedef struct
+{
+  gchar *client;  /* (owned) key in the clients table */
+  GQueue jobs;  /* (element-type GTask) (owned) jobs not yet picked up, oldest first */
+  GList link;  /* embedded node of EusScheduler.ready; data points to this */
+} ClientQueue;
+
+static void
+client_queue_free (ClientQueue *queue)
+{
+  GTask *task;
+
+  /* Jobs which were never started are failed. */
+  while ((task = g_queue_pop_head (&queue->jobs)) != NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                               "Scheduler was destroyed");
+      g_object_unref (task);
+    }
+
+  g_free (queue->client);
+  g_free (queue);
+}
+
+static void worker_cb (gpointer data,
+                       gpointer user_data);
+
+static void
+eus_scheduler_init (EusScheduler *self)
+{
+  g_mutex_init (&self->lock);
+  self->clients = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                         (GDestroyNotify) client_queue_free);
+  g_queue_init (&self->ready);
+}
+
+static void
+eus_scheduler_constructed (GObject *object)
+{
+  EusScheduler *self = EUS_SCHEDULER (object);
+
+  G_OBJECT_CLASS (eus_scheduler_parent_class)->constructed (object);
+
+  if (self->max_jobs == 0)
+    self->max_jobs = g_get_num_processors ();
+
+  /* This can only fail for exclusive pools. */
+  self->pool = g_thread_pool_new (worker_cb, self, self->max_jobs, FALSE, NULL);
+  g_assert (self->pool != NULL);
+}
+
+static void
+eus_scheduler_get_property (GObject    *object,
+                            guint       property_id,
+                            GValue     *value,
+                            GParamSpec *spec)
+{
+  EusScheduler *self = EUS_SCHEDULER (object);
+
+  switch ((EusSchedulerProperty) property_id)
+    {
+    case PROP_MAX_JOBS:
+      g_value_set_uint (value, self->max_jobs);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_scheduler_set_property (GObject      *object,
+                            guint         property_id,
+                            const GValue *value,
+                            GParamSpec   *spec)
+{
+  EusScheduler *self = EUS_SCHEDULER (object);
+
+  switch ((EusSchedulerProperty) property_id)
+    {
+    case PROP_MAX_JOBS:
+      self->max_jobs = g_value_get_uint (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
+      break;
+    }
+}
+
+static void
+eus_scheduler_finalize (GObject *object)
+{
+  EusScheduler *self = EUS_SCHEDULER (object);
+
+  /* Wait for the running jobs to finish, then fail the ones which were never
+   * started (when the client queues are freed). The jobs don’t hold a
+   * reference to the scheduler, so that the last reference to it can never be
+   * dropped from a worker thread (which would deadlock here). */
+  g_thread_pool_free (self->pool, TRUE, TRUE);
+
+  g_queue_init (&self->ready);
+  g_clear_pointer (&self->clients, g_hash_table_unref);
+
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_scheduler_parent_class)->finalize (object);
+}
+
+static void
+eus_scheduler_class_init (EusSchedulerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = eus_scheduler_constructed;
+  object_class->finalize = eus_scheduler_finalize;
+  object_class->get_property = eus_scheduler_get_property;
+  object_class->set_property = eus_scheduler_set_property;
+
+  /**
+   * EusScheduler:max-jobs:
+   *
+   * Maximum number of jobs to run concurrently, which is the number of worker
+   * threads. If set to 0 on construction, the number of processors is used.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_JOBS] = g_param_spec_uint ("max-jobs",
+                                            "Max Jobs",
+                                            "Maximum number of jobs to run concurrently.",
+                                            0,
+                                            G_MAXUINT,
+                                            0,
+                                            G_PARAM_READWRITE |
+                                            G_PARAM_CONSTRUCT_ONLY |
+                                            G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class,
+                                     G_N_ELEMENTS (props),
+                                     props);
+}
+
+/* Pop the oldest job of the next client in turn, and move the client to the
+ * back of the line. Must be called with the lock held. */
+static GTask *
+pop_next_job_unlocked (EusScheduler *self)
+{
+  ClientQueue *queue;
+  GTask *task;
+
+  if (self->ready.head == NULL)
+    return NULL;
+
+  queue = self->ready.head->data;
+  task = g_queue_pop_head (&queue->jobs);
+  self->n_queued--;
+
+  g_queue_unlink (&self->ready, &queue->link);
+  if (g_queue_is_empty (&queue->jobs))
+    g_hash_table_remove (self->clients, queue->client);
+  else
+    g_queue_push_tail_link (&self->ready, &queue->link);
+
+  return task;
+}
+
+/* Runs in a worker thread. Each push to the thread pool corresponds to one
+ * queued job; which job is run is decided here, rather than by the thread
+ * pool, so the queue order stays under our control. */
+static void
+worker_cb (gpointer data,
+           gpointer user_data)
+{
+  EusScheduler *self = EUS_SCHEDULER (user_data);
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GError) error = NULL;
+  Job *job;
+  gssize bytes_read;
+  gint64 start_cpu_time;
+
+  g_mutex_lock (&self->lock);
+  task = pop_next_job_unlocked (self);
+  if (task != NULL)
+    self->n_running++;
+  g_mutex_unlock (&self->lock);
+
+  if (task == NULL)
+    return;
+
+  job = g_task_get_task_data (task);
+  start_cpu_time = eus_get_thread_cpu_time ();
+
+  if (g_task_return_error_if_cancelled (task))
+    {
+      /* Nothing to do. */
+    }
+  else if (job->func != NULL)
+    {
+      if (!job->func (job->data, g_task_get_cancellable (task), &error))
+        g_task_return_error (task, g_steal_pointer (&error));
+      else
+        g_task_return_boolean (task, TRUE);
+    }
+  else
+    {
+      bytes_read = g_input_stream_read (job->stream, job->buffer, job->count,
+                                        g_task_get_cancellable (task), &error);
+
+      if (bytes_read < 0)
+        g_task_return_error (task, g_steal_pointer (&error));
+      else
+        g_task_return_int (task, bytes_read);
+    }
+
+  g_mutex_lock (&self->lock);
+  self->n_running--;
+  self->cpu_time += eus_get_thread_cpu_time () - start_cpu_time;
+  g_mutex_unlock (&self->lock);
+}
+
+/**
+ * eus_scheduler_new:
+ * @max_jobs: maximum number of jobs to run concurrently, or 0 to use the
+ *    number of processors
+ *
+ * Create a new #EusScheduler.
+ *
+ * Returns: (transfer full): a new scheduler
+ * Since: UNRELEASED
+ */
+EusScheduler *
+eus_scheduler_new (guint max_jobs)
+{
+  return g_object_new (EUS_TYPE_SCHEDULER,
+                       "max-jobs", max_jobs,
+                       NULL);
+}
+
+/**
+ * eus_scheduler_get_max_jobs:
+ * @self: an #EusScheduler
+ *
+ * Get the value of #EusScheduler:max-jobs.
+ *
+ * Returns: maximum number of concurrent jobs
+ * Since: UNRELEASED
+ */
+guint
+eus_scheduler_get_max_jobs (EusScheduler *self)
+{
+  g_return_val_if_fail (EUS_IS_SCHEDULER (self), 0);
+
+  return self->max_jobs;
+}
+
+/**
+ * eus_scheduler_get_n_jobs:
+ * @self: an #EusScheduler
+ *
+ * Get the number of jobs which are currently queued or running. This is a
+ * measure of how loaded the scheduler is.
+ *
+ * Returns: number of queued and running jobs
+ * Since: UNRELEASED
+ */
+guint
+eus_scheduler_get_n_jobs (EusScheduler *self)
+{
+  guint n_jobs;
+
+  g_return_val_if_fail (EUS_IS_SCHEDULER (self), 0);
+
+  g_mutex_lock (&self->lock);
+  n_jobs = self->n_queued + self->n_running;
+  g_mutex_unlock (&self->lock);
+
+  return n_jobs;
+}
+
+/**
+ * eus_scheduler_get_cpu_time:
+ * @self: an #EusScheduler
+ *
+ * Get the CPU time spent running jobs so far, in the worker threads. Any
+ * work which the jobs hand off to other threads is not included.
+ *
+ * Returns: CPU time, in microseconds
+ * Since: UNRELEASED
+ */
+gint64
+eus_scheduler_get_cpu_time (EusScheduler *self)
+{
+  gint64 cpu_time;
+
+  g_return_val_if_fail (EUS_IS_SCHEDULER (self), 0);
+
+  g_mutex_lock (&self->lock);
+  cpu_time = self->cpu_time;
+  g_mutex_unlock (&self->lock);
+
+  return cpu_time;
+}
+
+/* Queue @task (transfer full), which must have a #Job as its task data, on
+ * behalf of @client. */
+static void
+queue_task (EusScheduler *self,
+            GTask        *task,
+            const gchar  *client)
+{
+  ClientQueue *queue;
+
+  if (client == NULL)
+    client = "";
+
+  g_mutex_lock (&self->lock);
+
+  queue = g_hash_table_lookup (self->clients, client);
+  if (queue == NULL)
+    {
+      queue = g_new0 (ClientQueue, 1);
+      queue->client = g_strdup (client);
+      g_queue_init (&queue->jobs);
+      queue->link.data = queue;
+      g_hash_table_insert (self->clients, queue->client, queue);
+      g_queue_push_tail_link (&self->ready, &queue->link);
+    }
+
+  g_queue_push_tail (&queue->jobs, task);
+  self->n_queued++;
+
+  g_mutex_unlock (&self->lock);
+
+  /* The data is ignored by worker_cb(), but must be non-%NULL. */
+  g_thread_pool_push (self->pool, GUINT_TO_POINTER (1), NULL);
+}
+
+/**
+ * eus_scheduler_read_async:
+ * @self: an #EusScheduler
+ * @stream: stream to read from
+ * @buffer: (out caller-allocates) (array length=count): buffer to read into;
+ *    it must stay valid until the operation completes
+ * @count: number of bytes to read
+ * @client: (nullable): identifier of the client the read is for, such as its
+ *    address, used to share the worker pool fairly between clients
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to invoke when the read is complete
+ * @user_data: data to pass to @callback
+ *
+ * Queue a g_input_stream_read() of @stream in the worker pool. Reads for the
+ * same @client are run in the order they are queued, and clients take turns.
+ * Reads with a %NULL @client are treated as being for the same client. The
+ * @callback is invoked in the thread-default main context of the caller.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_scheduler_read_async (EusScheduler        *self,
+                          GInputStream        *stream,
+                          gpointer             buffer,
+                          gsize                count,
+                          const gchar         *client,
+                          GCancellable        *cancellable,
+                          GAsyncReadyCallback  callback,
+                          gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  Job *job;
+
+  g_return_if_fail (EUS_IS_SCHEDULER (self));
+  g_return_if_fail (G_IS_INPUT_STREAM (stream));
+  g_return_if_fail (buffer != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eus_scheduler_read_async);
+
+  job = g_new0 (Job, 1);
+  job->stream = g_object_ref (stream);
+  job->buffer = buffer;
+  job->count = count;
+  g_task_set_task_data (task, job, (GDestroyNotify) job_free);
+
+  queue_task (self, g_steal_pointer (&task), client);
+}
+
+/**
+ * eus_scheduler_read_finish:
+ * @self: an #EusScheduler
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finish a read started with eus_scheduler_read_async().
+ *
+ * Returns: number of bytes read, 0 at the end of the stream, or -1 on error
+ * Since: UNRELEASED
+ */
+gssize
+eus_scheduler_read_finish (EusScheduler  *self,
+                           GAsyncResult  *result,
+                           GError       **error)
+{
+  g_return_val_if_fail (EUS_IS_SCHEDULER (self), -1);
+  g_return_val_if_fail (g_task_is_valid (result, NULL), -1);
+  g_return_val_if_fail (g_async_result_is_tagged (result, eus_scheduler_read_async), -1);
+  g_return_val_if_fail (error == NULL || *error == NULL, -1);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/**
+ * EusSchedulerJobFunc:
+ * @data: the data passed to eus_scheduler_run_async()
+ * @cancellable: (nullable): the #GCancellable passed to
+ *    eus_scheduler_run_async()
+ * @error: return location for a #GError
+ *
+ * A job to run in a worker thread of an #EusScheduler.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+
+/**
+ * eus_scheduler_run_async:
+ * @self: an #EusScheduler
+ * @func: function to run in the worker pool
+ * @data: (nullable): data to pass to @func
+ * @data_free_func: (nullable): function to free @data with once the job is
+ *    finished
+ * @client: (nullable): identifier of the client the job is for; see
+ *    eus_scheduler_read_async()
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: callback to invoke when the job is complete
+ * @user_data: data to pass to @callback
+ *
+ * Queue a call to @func in the worker pool. It is queued and accounted for in
+ * the same way as the reads queued by eus_scheduler_read_async(). The
+ * @callback is invoked in the thread-default main context of the caller.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_scheduler_run_async (EusScheduler        *self,
+                         EusSchedulerJobFunc  func,
+                         gpointer             data,
+                         GDestroyNotify       data_free_func,
+                         const gchar         *client,
+                         GCancellable        *cancellable,
+                         GAsyncReadyCallback  callback,
+                         gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  Job *job;
+
+  g_return_if_fail (EUS_IS_SCHEDULER (self));
+  g_return_if_fail (func != NULL);
+  g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eus_scheduler_run_async);
+
+  job = g_new0 (Job, 1);
+  job->func = func;
+  job->data = data;
+  job->data_free_func = data_free_func;
+  g_task_set_task_data (task, job, (GDestroyNotify) job_free);
+
+  queue_task (self, g_steal_pointer (&task), client);
+}
+
+/**
+ * eus_scheduler_run_finish:
+ * @self: an #EusScheduler
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Finish a job started with eus_scheduler_run_async().
+ *
+ * Returns: %TRUE if the job succeeded, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_scheduler_run_finish (EusScheduler  *self,
+                          GAsyncResult  *result,
+                          GError       **error)
+{
+  g_return_val_if_fail (EUS_IS_SCHEDULER (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, eus_scheduler_run_async), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,68 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define EUS_TYPE_SCHEDULER eus_scheduler_get_type ()
+G_DECLARE_FINAL_TYPE (EusScheduler, eus_scheduler, EUS, SCHEDULER, GObject)
+
+EusScheduler *eus_scheduler_new (guint max_jobs);
+
+guint eus_scheduler_get_max_jobs (EusScheduler *self);
+guint eus_scheduler_get_n_jobs (EusScheduler *self);
+gint64 eus_scheduler_get_cpu_time (EusScheduler *self);
+
+void eus_scheduler_read_async (EusScheduler        *self,
+                               GInputStream        *stream,
+                               gpointer             buffer,
+                               gsize                count,
+                               const gchar         *client,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data);
+gssize eus_scheduler_read_finish (EusScheduler  *self,
+                                  GAsyncResult  *result,
+                                  GError       **error);
+
+typedef gboolean (*EusSchedulerJobFunc) (gpointer       data,
+                                         GCancellable  *cancellable,
+                                         GError       **error);
+
+void eus_scheduler_run_async (EusScheduler        *self,
+                              EusSchedulerJobFunc  func,
+                              gpointer             data,
+                              GDestroyNotify       data_free_func,
+                              const gchar         *client,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data);
+gboolean eus_scheduler_run_finish (EusScheduler  *self,
+                                   GAsyncResult  *result,
+                                   GError       **error);
+
+G_END_DECLS
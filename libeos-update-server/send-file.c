@@ -0,0 +1,368 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/rate-limiter.h>
+#include <libeos-update-server/send-file.h>
+#include <libsoup/soup.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+/**
+ * SECTION:send-file
+ * @title: Zero-copy file responses
+ * @short_description: Send files to clients using sendfile()
+ * @include: libeos-update-server/send-file.h
+ *
+ * Large files, such as static delta parts, are sent to clients using
+ * sendfile(), so their contents go straight from the page cache to the socket
+ * without being copied through user space.
+ *
+ * libsoup can only send bodies it holds in memory, so the connection is
+ * stolen from libsoup once it has written the response headers, and closed
+ * once the body has been sent. The response therefore carries
+ * `Connection: close`. As libsoup does not emit #SoupServer::request-finished
+ * for stolen connections, it is emitted (or #SoupServer::request-aborted, on
+ * failure) once the body has been sent, so that request accounting still
+ * works.
+ *
+ * If an #EusRateLimiter is given, the file is sent in pieces of
+ * %EUS_RATE_LIMITER_PIECE_SIZE, waiting between them as needed to stay within
+ * its limits.
+ *
+ * Since: UNRELEASED
+ */
+
+#ifdef HAVE_SYS_SENDFILE_H
+
+/* Maximum number of bytes to send in one main context iteration, so that
+ * other clients are not starved when the socket is fast. */
+#define SEND_FILE_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct
+{
+  SoupServer *server;  /* (owned) */
+  SoupMessage *msg;  /* (owned) */
+  SoupClientContext *client;  /* (owned) */
+  GSocket *socket;  /* (owned) */
+  GIOStream *stream;  /* (owned) (nullable) until the connection is stolen */
+  EusRateLimiter *rate_limiter;  /* (owned) (nullable) */
+  gchar *host;  /* (owned) (nullable) address of the client, for rate limiting */
+  GSource *source;  /* (owned) (nullable) waiting for the socket or the rate limiter */
+  gint priority;  /* of @source */
+  gulong wrote_headers_id;
+  gulong finished_id;
+  gint fd;  /* (owned) */
+  goffset offset;
+  goffset size;
+} SendFileData;
+
+static void
+send_file_data_free (SendFileData *data)
+{
+  if (data->source != NULL)
+    {
+      g_source_destroy (data->source);
+      g_source_unref (data->source);
+    }
+  if (data->wrote_headers_id != 0)
+    g_signal_handler_disconnect (data->msg, data->wrote_headers_id);
+  if (data->finished_id != 0)
+    g_signal_handler_disconnect (data->msg, data->finished_id);
+
+  /* Until the connection is stolen, the socket still belongs to libsoup. */
+  if (data->stream != NULL)
+    {
+      g_io_stream_close (data->stream, NULL, NULL);
+      g_socket_close (data->socket, NULL);
+    }
+  g_clear_object (&data->stream);
+  g_clear_object (&data->socket);
+
+  g_close (data->fd, NULL);
+  g_clear_object (&data->rate_limiter);
+  g_free (data->host);
+  g_boxed_free (SOUP_TYPE_CLIENT_CONTEXT, data->client);
+  g_clear_object (&data->msg);
+  g_clear_object (&data->server);
+  g_free (data);
+}
+
+static void
+send_file_data_finish (SendFileData *data,
+                       gboolean      success)
+{
+  g_debug ("%s: Sent %" G_GOFFSET_FORMAT " of %" G_GOFFSET_FORMAT " bytes",
+           G_STRFUNC, data->offset, data->size);
+
+  /* Let the client see the end of the body before the connection is
+   * closed. */
+  g_socket_shutdown (data->socket, FALSE, TRUE, NULL);
+
+  g_signal_emit_by_name (data->server,
+                         success ? "request-finished" : "request-aborted",
+                         data->msg, data->client);
+  send_file_data_free (data);
+}
+
+static void send_file_pump (SendFileData *data);
+
+static gboolean
+socket_writable_cb (GSocket      *socket,
+                    GIOCondition  condition,
+                    gpointer      user_data)
+{
+  SendFileData *data = user_data;
+
+  g_clear_pointer (&data->source, g_source_unref);
+  send_file_pump (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+send_file_wait_writable (SendFileData *data)
+{
+  data->source = g_socket_create_source (data->socket, G_IO_OUT, NULL);
+  g_source_set_priority (data->source, data->priority);
+  g_source_set_callback (data->source, (GSourceFunc) socket_writable_cb,
+                         data, NULL);
+  g_source_attach (data->source, g_main_context_get_thread_default ());
+}
+
+static gboolean
+rate_limit_timeout_cb (gpointer user_data)
+{
+  SendFileData *data = user_data;
+
+  g_clear_pointer (&data->source, g_source_unref);
+  send_file_pump (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+send_file_wait_rate_limit (SendFileData *data,
+                           guint         delay)
+{
+  data->source = g_timeout_source_new (delay);
+  g_source_set_priority (data->source, data->priority);
+  g_source_set_callback (data->source, rate_limit_timeout_cb, data, NULL);
+  g_source_attach (data->source, g_main_context_get_thread_default ());
+}
+
+/* Send as much of the file as the socket will take, up to
+ * %SEND_FILE_CHUNK_SIZE, then wait for the socket to become writable again;
+ * or as much as the rate limiter allows, then wait for it. */
+static void
+send_file_pump (SendFileData *data)
+{
+  gint socket_fd = g_socket_get_fd (data->socket);
+  goffset sent = 0;
+
+  while (data->offset < data->size)
+    {
+      off_t offset = data->offset;
+      gsize count = MIN (data->size - data->offset, SEND_FILE_CHUNK_SIZE);
+      gssize n_sent;
+      gint saved_errno;
+
+      if (sent >= SEND_FILE_CHUNK_SIZE)
+        {
+          send_file_wait_writable (data);
+          return;
+        }
+
+      if (data->rate_limiter != NULL)
+        {
+          guint delay = eus_rate_limiter_get_delay (data->rate_limiter,
+                                                    data->host);
+
+          if (delay > 0)
+            {
+              send_file_wait_rate_limit (data, delay);
+              return;
+            }
+
+          count = MIN (count, EUS_RATE_LIMITER_PIECE_SIZE);
+        }
+
+      n_sent = sendfile (socket_fd, data->fd, &offset, count);
+      saved_errno = errno;
+
+      if (n_sent > 0)
+        {
+          data->offset = offset;
+          sent += n_sent;
+
+          if (data->rate_limiter != NULL)
+            eus_rate_limiter_consume (data->rate_limiter, data->host, n_sent);
+        }
+      else if (n_sent < 0 && saved_errno == EINTR)
+        {
+          continue;
+        }
+      else if (n_sent < 0 && (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK))
+        {
+          send_file_wait_writable (data);
+          return;
+        }
+      else
+        {
+          /* Zero bytes sent means the file has been truncated. */
+          g_debug ("%s: Failed to send file: %s", G_STRFUNC,
+                   (n_sent < 0) ? g_strerror (saved_errno) : "unexpected end of file");
+          send_file_data_finish (data, FALSE);
+          return;
+        }
+    }
+
+  send_file_data_finish (data, TRUE);
+}
+
+/* The message finished before its headers were written, typically because
+ * the client disconnected or the server was shut down. libsoup accounts for
+ * the request itself, so all that is left is to free @data. */
+static void
+finished_cb (SoupMessage *msg,
+             gpointer     user_data)
+{
+  SendFileData *data = user_data;
+
+  if (data->stream != NULL)
+    return;
+
+  g_debug ("%s: Message finished before its headers were written", G_STRFUNC);
+  send_file_data_free (data);
+}
+
+static void
+wrote_headers_cb (SoupMessage *msg,
+                  gpointer     user_data)
+{
+  SendFileData *data = user_data;
+
+  g_signal_handler_disconnect (data->msg, data->wrote_headers_id);
+  data->wrote_headers_id = 0;
+  g_signal_handler_disconnect (data->msg, data->finished_id);
+  data->finished_id = 0;
+
+  data->stream = soup_client_context_steal_connection (data->client);
+  if (data->stream == NULL)
+    {
+      send_file_data_finish (data, FALSE);
+      return;
+    }
+
+  send_file_pump (data);
+}
+
+#endif  /* HAVE_SYS_SENDFILE_H */
+
+/**
+ * eus_send_file:
+ * @server: the #SoupServer handling @msg
+ * @msg: a request being handled
+ * @client: the client which sent @msg
+ * @fd: file descriptor of the file to send, positioned anywhere
+ * @size: size of the file, in bytes
+ * @rate_limiter: (nullable): limits to send the file within
+ * @priority: main context priority to send the file at, such as
+ *    %G_PRIORITY_DEFAULT
+ *
+ * Set up @msg to send the contents of @fd as its 200 OK response body using
+ * sendfile(). Any other response headers, such as validators, must already
+ * have been set. Once the headers are written, the file is sent from sources
+ * at @priority, so that bulk responses can give way to others.
+ *
+ * The connection is closed once the file has been sent, so this is only worth
+ * using for files big enough that the client reconnecting costs little, or
+ * for clients which asked for the connection to be closed anyway.
+ *
+ * This is only possible for GET requests over plain HTTP on platforms which
+ * support sendfile(); if it is not possible, %FALSE is returned, @msg is
+ * unchanged, and the caller must send the file some other way. If it is
+ * possible, %TRUE is returned and ownership of @fd is transferred.
+ *
+ * Returns: %TRUE if the file will be sent, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_send_file (SoupServer        *server,
+               SoupMessage       *msg,
+               SoupClientContext *client,
+               gint               fd,
+               goffset            size,
+               EusRateLimiter    *rate_limiter,
+               gint               priority)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+  SendFileData *data;
+  GSocket *socket;
+
+  g_return_val_if_fail (SOUP_IS_SERVER (server), FALSE);
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), FALSE);
+  g_return_val_if_fail (client != NULL, FALSE);
+  g_return_val_if_fail (fd >= 0, FALSE);
+  g_return_val_if_fail (size >= 0, FALSE);
+  g_return_val_if_fail (rate_limiter == NULL || EUS_IS_RATE_LIMITER (rate_limiter), FALSE);
+
+  /* Bodies of HEAD responses are not sent, and sendfile() would bypass TLS. */
+  if (msg->method != SOUP_METHOD_GET || soup_server_is_https (server))
+    return FALSE;
+
+  socket = soup_client_context_get_gsocket (client);
+  if (socket == NULL)
+    return FALSE;
+
+  data = g_new0 (SendFileData, 1);
+  data->server = g_object_ref (server);
+  data->msg = g_object_ref (msg);
+  data->client = g_boxed_copy (SOUP_TYPE_CLIENT_CONTEXT, client);
+  data->socket = g_object_ref (socket);
+  data->fd = fd;
+  data->size = size;
+  data->rate_limiter = (rate_limiter != NULL) ? g_object_ref (rate_limiter) : NULL;
+  data->host = g_strdup (soup_client_context_get_host (client));
+  data->priority = priority;
+
+  soup_message_headers_set_content_length (msg->response_headers, size);
+  soup_message_headers_replace (msg->response_headers, "Connection", "close");
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+
+  data->wrote_headers_id = g_signal_connect (msg, "wrote-headers",
+                                             G_CALLBACK (wrote_headers_cb),
+                                             data);
+  data->finished_id = g_signal_connect (msg, "finished",
+                                        G_CALLBACK (finished_cb), data);
+
+  return TRUE;
+#else  /* if !HAVE_SYS_SENDFILE_H */
+  return FALSE;
+#endif  /* !HAVE_SYS_SENDFILE_H */
+}
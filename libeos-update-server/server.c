@@ -24,8 +24,20 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 
+#include <libeos-update-server/buffer-pool.h>
+#include <libeos-update-server/client-table.h>
+#include <libeos-update-server/deflate-stream.h>
+#include <libeos-update-server/filez-cache.h>
+#include <libeos-update-server/mapped-file-cache.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/rate-limiter.h>
 #include <libeos-update-server/repo.h>
+#include <libeos-update-server/router.h>
+#include <libeos-update-server/scheduler.h>
 #include <libeos-update-server/server.h>
 
 /**
@@ -40,9 +52,63 @@
  *
  * Each repository is served under its #EusRepo:root-path prefix.
  *
+ * All the repositories share the server’s #EusServer:scheduler and
+ * #EusServer:buffer-pool, so the limits on concurrent compression jobs and on
+ * the memory used for compressed data apply across the whole server. They are
+ * also given the server’s #EusServer:min-compression-level and
+ * #EusServer:max-compression-level, generate static deltas within the
+ * server’s #EusServer:delta-max-size into subdirectories of its
+ * #EusServer:delta-cache-path, and warm up their caches if #EusServer:warm-up
+ * is set.
+ *
+ * Repositories served together often contain many identical objects, so the
+ * caches of their content are shared too, and keyed by object checksum rather
+ * than path: each object is compressed once into the #EusServer:filez-cache,
+ * and mapped once into the #EusServer:mapped-file-cache, whichever repository
+ * it is requested from.
+ *
+ * Requests are accounted per client in an #EusClientTable shared by all the
+ * repositories, so no client has more than
+ * #EusServer:max-requests-per-client requests handled at once, however many
+ * connections it opens; and the scheduler takes turns between clients when
+ * compressing objects.
+ *
+ * When the server is overloaded — it has #EusServer:max-pending-requests
+ * requests in progress, or the load average is over #EusServer:max-load — new
+ * pulls are rejected with `503 Service Unavailable` and a `Retry-After`
+ * header, so clients which can pull from another peer or the main server do
+ * so, rather than every client of this one slowing down. Only requests for
+ * the `config` or `summary` file from a client with no other requests in
+ * progress are rejected, as that is how a poll or pull starts: ostree fails
+ * the whole pull if any request fails, so once a client has started pulling,
+ * all its requests are handled.
+ *
+ * Requests are counted and timed in an #EusMetrics, which the repositories
+ * also record their cache hit rates in. The figures are served at
+ * %EUS_SERVER_METRICS_PATH to loopback clients only, since peers on the
+ * network have no need for them, and can be got with
+ * eus_server_format_metrics().
+ *
+ * To use several threads, create one #SoupServer and #EusServer per thread,
+ * each constructed and run in its own thread-default main context, and pass
+ * them all the same #EusServer:scheduler, #EusServer:buffer-pool,
+ * #EusServer:client-table, #EusServer:rate-limiter, #EusServer:metrics,
+ * #EusServer:filez-cache and #EusServer:mapped-file-cache, so the limits,
+ * figures and caches apply across the threads. Each should have its own
+ * #EusRepos. Admission control is
+ * based on the requests in progress in the shared client table.
+ * eus_server_get_pending_requests() and eus_server_get_last_request_time()
+ * may be called from any thread.
+ *
  * Since: UNRELEASED
  */
 
+/* Size of the #EusServer:mapped-file-cache created if none is given. */
+#define MAPPED_FILE_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+/* How often to sample the load average, in microseconds. */
+#define LOAD_SAMPLE_INTERVAL_USEC (G_USEC_PER_SEC)
+
 /**
  * EusServer:
  *
@@ -56,8 +122,33 @@ struct _EusServer
 
   SoupServer *server;  /* owned */
   GPtrArray *repos;  /* (element-type EusRepo), owned */
+  EusScheduler *scheduler;  /* owned */
+  EusBufferPool *buffer_pool;  /* (owned) (nullable) */
+  guint min_compression_level;
+  guint max_compression_level;
+  guint64 delta_max_size;
+  guint delta_ancestors;
+  gchar *delta_cache_path;  /* (owned) (nullable) */
+  gboolean warm_up;
+  guint max_requests_per_client;
+  EusClientTable *client_table;  /* (owned) */
+  guint64 max_rate;
+  guint64 max_rate_per_client;
+  EusRateLimiter *rate_limiter;  /* (owned) (nullable) */
+  guint max_pending_requests;
+  guint max_load;
+  guint retry_after;
+
+  EusMetrics *metrics;  /* (owned) */
+  EusFilezCache *filez_cache;  /* (owned) (nullable) */
+  EusMappedFileCache *mapped_file_cache;  /* (owned) */
+
+  guint load;  /* last sampled load average per processor, as a percentage */
+  gint64 load_sample_time;  /* monotonic time of the last sample, in microseconds */
 
+  GMutex lock;  /* protects pending_requests and last_request_time */
   guint pending_requests;
+  guint pending_jobs;  /* deltas and warm-ups; included in pending_requests */
   gint64 last_request_time;
 };
 
@@ -68,9 +159,28 @@ typedef enum
   PROP_SERVER = 1,
   PROP_PENDING_REQUESTS,
   PROP_LAST_REQUEST_TIME,
+  PROP_SCHEDULER,
+  PROP_BUFFER_POOL,
+  PROP_MIN_COMPRESSION_LEVEL,
+  PROP_MAX_COMPRESSION_LEVEL,
+  PROP_DELTA_MAX_SIZE,
+  PROP_DELTA_ANCESTORS,
+  PROP_DELTA_CACHE_PATH,
+  PROP_WARM_UP,
+  PROP_MAX_REQUESTS_PER_CLIENT,
+  PROP_MAX_RATE,
+  PROP_MAX_RATE_PER_CLIENT,
+  PROP_MAX_PENDING_REQUESTS,
+  PROP_MAX_LOAD,
+  PROP_RETRY_AFTER,
+  PROP_CLIENT_TABLE,
+  PROP_RATE_LIMITER,
+  PROP_METRICS,
+  PROP_FILEZ_CACHE,
+  PROP_MAPPED_FILE_CACHE,
 } EusServerProperty;
 
-static GParamSpec *props[PROP_LAST_REQUEST_TIME + 1] = { NULL, };
+static GParamSpec *props[PROP_MAPPED_FILE_CACHE + 1] = { NULL, };
 
 static void request_read_cb (SoupServer        *soup_server,
                              SoupMessage       *message,
@@ -85,10 +195,18 @@ static void request_aborted_cb (SoupServer        *soup_server,
                                 SoupClientContext *client,
                                 gpointer           user_data);
 
+static void metrics_cb (SoupServer        *soup_server,
+                        SoupMessage       *msg,
+                        const gchar       *path,
+                        GHashTable        *query,
+                        SoupClientContext *client,
+                        gpointer           user_data);
+
 static void
 eus_server_init (EusServer *self)
 {
   self->repos = g_ptr_array_new_with_free_func (g_object_unref);
+  g_mutex_init (&self->lock);
 }
 
 static void
@@ -100,6 +218,26 @@ eus_server_constructed (GObject *object)
 
   g_assert (self->server != NULL);
 
+  if (self->scheduler == NULL)
+    self->scheduler = eus_scheduler_new (0);
+
+  if (self->client_table == NULL)
+    self->client_table = eus_client_table_new (self->max_requests_per_client);
+
+  if (self->rate_limiter == NULL &&
+      (self->max_rate > 0 || self->max_rate_per_client > 0))
+    self->rate_limiter = eus_rate_limiter_new (self->max_rate,
+                                               self->max_rate_per_client);
+
+  if (self->metrics == NULL)
+    self->metrics = eus_metrics_new ();
+
+  if (self->mapped_file_cache == NULL)
+    self->mapped_file_cache = eus_mapped_file_cache_new (MAPPED_FILE_CACHE_MAX_SIZE);
+
+  soup_server_add_handler (self->server, EUS_SERVER_METRICS_PATH, metrics_cb,
+                           self, NULL);
+
   g_signal_connect (self->server, "request-read", (GCallback) request_read_cb, self);
   g_signal_connect (self->server, "request-finished", (GCallback) request_finished_cb, self);
   g_signal_connect (self->server, "request-aborted", (GCallback) request_aborted_cb, self);
@@ -120,11 +258,87 @@ eus_server_get_property (GObject    *object,
       break;
 
     case PROP_PENDING_REQUESTS:
-      g_value_set_uint (value, self->pending_requests);
+      g_value_set_uint (value, eus_server_get_pending_requests (self));
       break;
 
     case PROP_LAST_REQUEST_TIME:
-      g_value_set_int64 (value, self->last_request_time);
+      g_value_set_int64 (value, eus_server_get_last_request_time (self));
+      break;
+
+    case PROP_SCHEDULER:
+      g_value_set_object (value, self->scheduler);
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_value_set_object (value, self->buffer_pool);
+      break;
+
+    case PROP_MIN_COMPRESSION_LEVEL:
+      g_value_set_uint (value, self->min_compression_level);
+      break;
+
+    case PROP_MAX_COMPRESSION_LEVEL:
+      g_value_set_uint (value, self->max_compression_level);
+      break;
+
+    case PROP_DELTA_MAX_SIZE:
+      g_value_set_uint64 (value, self->delta_max_size);
+      break;
+
+    case PROP_DELTA_ANCESTORS:
+      g_value_set_uint (value, self->delta_ancestors);
+      break;
+
+    case PROP_DELTA_CACHE_PATH:
+      g_value_set_string (value, self->delta_cache_path);
+      break;
+
+    case PROP_WARM_UP:
+      g_value_set_boolean (value, self->warm_up);
+      break;
+
+    case PROP_MAX_REQUESTS_PER_CLIENT:
+      g_value_set_uint (value, self->max_requests_per_client);
+      break;
+
+    case PROP_MAX_RATE:
+      g_value_set_uint64 (value, self->max_rate);
+      break;
+
+    case PROP_MAX_RATE_PER_CLIENT:
+      g_value_set_uint64 (value, self->max_rate_per_client);
+      break;
+
+    case PROP_MAX_PENDING_REQUESTS:
+      g_value_set_uint (value, self->max_pending_requests);
+      break;
+
+    case PROP_MAX_LOAD:
+      g_value_set_uint (value, self->max_load);
+      break;
+
+    case PROP_RETRY_AFTER:
+      g_value_set_uint (value, self->retry_after);
+      break;
+
+    case PROP_CLIENT_TABLE:
+      g_value_set_object (value, self->client_table);
+      break;
+
+    case PROP_RATE_LIMITER:
+      g_value_set_object (value, self->rate_limiter);
+      break;
+
+    case PROP_METRICS:
+      g_value_set_object (value, self->metrics);
+      break;
+
+    case PROP_FILEZ_CACHE:
+      g_value_set_object (value, self->filez_cache);
+      break;
+
+    case PROP_MAPPED_FILE_CACHE:
+      g_value_set_object (value, self->mapped_file_cache);
       break;
 
     default:
@@ -147,6 +361,83 @@ eus_server_set_property (GObject      *object,
       g_set_object (&self->server, g_value_get_object (value));
       break;
 
+    case PROP_SCHEDULER:
+      g_set_object (&self->scheduler, g_value_get_object (value));
+      break;
+
+    case PROP_BUFFER_POOL:
+      g_set_object (&self->buffer_pool, g_value_get_object (value));
+      break;
+
+    case PROP_MIN_COMPRESSION_LEVEL:
+      self->min_compression_level = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_COMPRESSION_LEVEL:
+      self->max_compression_level = g_value_get_uint (value);
+      break;
+
+    case PROP_DELTA_MAX_SIZE:
+      self->delta_max_size = g_value_get_uint64 (value);
+      break;
+
+    case PROP_DELTA_ANCESTORS:
+      self->delta_ancestors = g_value_get_uint (value);
+      break;
+
+    case PROP_DELTA_CACHE_PATH:
+      g_clear_pointer (&self->delta_cache_path, g_free);
+      self->delta_cache_path = g_value_dup_string (value);
+      break;
+
+    case PROP_WARM_UP:
+      self->warm_up = g_value_get_boolean (value);
+      break;
+
+    case PROP_MAX_REQUESTS_PER_CLIENT:
+      self->max_requests_per_client = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_RATE:
+      self->max_rate = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_RATE_PER_CLIENT:
+      self->max_rate_per_client = g_value_get_uint64 (value);
+      break;
+
+    case PROP_MAX_PENDING_REQUESTS:
+      self->max_pending_requests = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_LOAD:
+      self->max_load = g_value_get_uint (value);
+      break;
+
+    case PROP_RETRY_AFTER:
+      self->retry_after = g_value_get_uint (value);
+      break;
+
+    case PROP_CLIENT_TABLE:
+      g_set_object (&self->client_table, g_value_get_object (value));
+      break;
+
+    case PROP_RATE_LIMITER:
+      g_set_object (&self->rate_limiter, g_value_get_object (value));
+      break;
+
+    case PROP_METRICS:
+      g_set_object (&self->metrics, g_value_get_object (value));
+      break;
+
+    case PROP_FILEZ_CACHE:
+      g_set_object (&self->filez_cache, g_value_get_object (value));
+      break;
+
+    case PROP_MAPPED_FILE_CACHE:
+      g_set_object (&self->mapped_file_cache, g_value_get_object (value));
+      break;
+
     case PROP_PENDING_REQUESTS:
     case PROP_LAST_REQUEST_TIME:
       /* Read only. */
@@ -165,8 +456,11 @@ eus_server_dispose (GObject *object)
   if (self->repos != NULL)
     eus_server_disconnect (self);
 
+  g_mutex_lock (&self->lock);
   self->pending_requests = 0;
+  self->pending_jobs = 0;
   self->last_request_time = 0;
+  g_mutex_unlock (&self->lock);
   g_clear_pointer (&self->repos, g_ptr_array_unref);
 
   if (self->server != NULL)
@@ -178,9 +472,28 @@ eus_server_dispose (GObject *object)
       g_clear_object (&self->server);
     }
 
+  g_clear_object (&self->client_table);
+  g_clear_object (&self->rate_limiter);
+  g_clear_object (&self->metrics);
+  g_clear_object (&self->filez_cache);
+  g_clear_object (&self->mapped_file_cache);
+  g_clear_object (&self->scheduler);
+  g_clear_object (&self->buffer_pool);
+
   G_OBJECT_CLASS (eus_server_parent_class)->dispose (object);
 }
 
+static void
+eus_server_finalize (GObject *object)
+{
+  EusServer *self = EUS_SERVER (object);
+
+  g_free (self->delta_cache_path);
+  g_mutex_clear (&self->lock);
+
+  G_OBJECT_CLASS (eus_server_parent_class)->finalize (object);
+}
+
 static void
 eus_server_class_init (EusServerClass *klass)
 {
@@ -188,6 +501,7 @@ eus_server_class_init (EusServerClass *klass)
 
   object_class->constructed = eus_server_constructed;
   object_class->dispose = eus_server_dispose;
+  object_class->finalize = eus_server_finalize;
   object_class->get_property = eus_server_get_property;
   object_class->set_property = eus_server_set_property;
 
@@ -210,7 +524,8 @@ eus_server_class_init (EusServerClass *klass)
    * EusServer:pending-requests:
    *
    * Pending requests are usually requests for file objects that happen
-   * asynchronously, mostly due to their larger size. Use this property
+   * asynchronously, mostly due to their larger size. Static deltas which are
+   * queued or being generated are counted too. Use this property
    * together with #EusServer:last-request-time if you want to stop the server
    * after the timeout.
    */
@@ -243,6 +558,327 @@ eus_server_class_init (EusServerClass *klass)
                                                       G_PARAM_EXPLICIT_NOTIFY |
                                                       G_PARAM_STATIC_STRINGS);
 
+  /**
+   * EusServer:scheduler:
+   *
+   * Worker pool which the repositories compress `.filez` objects in. If %NULL
+   * on construction, a scheduler with one worker per processor is created.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_SCHEDULER] = g_param_spec_object ("scheduler",
+                                               "Scheduler",
+                                               "Worker pool which the repositories compress .filez objects in.",
+                                               EUS_TYPE_SCHEDULER,
+                                               G_PARAM_READWRITE |
+                                               G_PARAM_CONSTRUCT_ONLY |
+                                               G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:buffer-pool:
+   *
+   * Pool of buffers which the repositories compress `.filez` objects into. If
+   * %NULL, the memory used for compressed data is not limited.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_BUFFER_POOL] = g_param_spec_object ("buffer-pool",
+                                                 "Buffer Pool",
+                                                 "Pool of buffers which the repositories compress .filez objects into.",
+                                                 EUS_TYPE_BUFFER_POOL,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:min-compression-level:
+   *
+   * Lowest zlib compression level for the repositories to compress `.filez`
+   * objects at. See #EusRepo:min-compression-level.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MIN_COMPRESSION_LEVEL] = g_param_spec_uint ("min-compression-level",
+                                                         "Minimum Compression Level",
+                                                         "Lowest zlib compression level to compress .filez objects at.",
+                                                         0, 9, 2,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-compression-level:
+   *
+   * Highest zlib compression level for the repositories to compress `.filez`
+   * objects at. See #EusRepo:max-compression-level.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_COMPRESSION_LEVEL] = g_param_spec_uint ("max-compression-level",
+                                                         "Maximum Compression Level",
+                                                         "Highest zlib compression level to compress .filez objects at.",
+                                                         0, 9, 2,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:delta-max-size:
+   *
+   * Size in bytes which each repository’s static deltas may take up. If zero,
+   * no static deltas are generated. See #EusRepo:delta-max-size.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_MAX_SIZE] = g_param_spec_uint64 ("delta-max-size",
+                                                    "Delta Max Size",
+                                                    "Size in bytes which each repository’s static deltas may take up.",
+                                                    0, G_MAXUINT64, 0,
+                                                    G_PARAM_READWRITE |
+                                                    G_PARAM_CONSTRUCT_ONLY |
+                                                    G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:delta-ancestors:
+   *
+   * Number of ancestors of each commit for the repositories to generate
+   * static deltas from. See #EusRepo:delta-ancestors.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_ANCESTORS] = g_param_spec_uint ("delta-ancestors",
+                                                   "Delta Ancestors",
+                                                   "Number of ancestors of each commit to generate static deltas from.",
+                                                   0, G_MAXUINT, 0,
+                                                   G_PARAM_READWRITE |
+                                                   G_PARAM_CONSTRUCT_ONLY |
+                                                   G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:delta-cache-path:
+   *
+   * Path to the directory to keep generated static deltas in. Each repository
+   * has a subdirectory of its own, named after its #EusRepo:root-path, so
+   * #EusServer:delta-max-size applies to each separately. If it is %NULL, no
+   * static deltas are generated. See #EusRepo:delta-cache-path.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_DELTA_CACHE_PATH] = g_param_spec_string ("delta-cache-path",
+                                                      "Delta Cache Path",
+                                                      "Path to the directory to keep generated static deltas in.",
+                                                      NULL,
+                                                      G_PARAM_READWRITE |
+                                                      G_PARAM_CONSTRUCT_ONLY |
+                                                      G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:warm-up:
+   *
+   * Whether the repositories compress the objects of the commits they serve
+   * into their caches in the background. See #EusRepo:warm-up.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_WARM_UP] = g_param_spec_boolean ("warm-up",
+                                              "Warm Up",
+                                              "Whether to compress served commits into the caches in the background.",
+                                              FALSE,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-requests-per-client:
+   *
+   * Maximum number of requests from a single client, across all the
+   * repositories, to handle at once in each #EusClientTableLane. Further
+   * requests from the client wait until one of them finishes. If zero, there
+   * is no limit. See #EusClientTable:max-requests-per-client.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_REQUESTS_PER_CLIENT] = g_param_spec_uint ("max-requests-per-client",
+                                                           "Max Requests Per Client",
+                                                           "Maximum number of requests from a single client to handle at once.",
+                                                           0, G_MAXUINT, 0,
+                                                           G_PARAM_READWRITE |
+                                                           G_PARAM_CONSTRUCT_ONLY |
+                                                           G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-rate:
+   *
+   * Maximum rate, in bytes per second, to send response bodies at, across
+   * all the clients and repositories. If zero, there is no limit. See
+   * #EusRateLimiter:max-rate.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_RATE] = g_param_spec_uint64 ("max-rate",
+                                              "Max Rate",
+                                              "Maximum rate in bytes per second to send to all clients at.",
+                                              0, G_MAXUINT64, 0,
+                                              G_PARAM_READWRITE |
+                                              G_PARAM_CONSTRUCT_ONLY |
+                                              G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-rate-per-client:
+   *
+   * Maximum rate, in bytes per second, to send response bodies to a single
+   * client at. If zero, there is no limit. See
+   * #EusRateLimiter:max-rate-per-client.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_RATE_PER_CLIENT] = g_param_spec_uint64 ("max-rate-per-client",
+                                                         "Max Rate Per Client",
+                                                         "Maximum rate in bytes per second to send to a single client at.",
+                                                         0, G_MAXUINT64, 0,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_CONSTRUCT_ONLY |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-pending-requests:
+   *
+   * Number of requests in progress, across all the clients and repositories,
+   * at which new pulls are rejected. Requests deferred by
+   * #EusServer:max-requests-per-client count as in progress, as do requests to
+   * other servers sharing the #EusServer:client-table. If zero, there is no
+   * limit.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_PENDING_REQUESTS] = g_param_spec_uint ("max-pending-requests",
+                                                        "Max Pending Requests",
+                                                        "Number of requests in progress at which new pulls are rejected.",
+                                                        0, G_MAXUINT, 0,
+                                                        G_PARAM_READWRITE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:max-load:
+   *
+   * One minute load average, as a percentage of the number of processors,
+   * above which new pulls are rejected. If zero, the load is not checked.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAX_LOAD] = g_param_spec_uint ("max-load",
+                                            "Max Load",
+                                            "Load average per processor, as a percentage, above which new pulls are rejected.",
+                                            0, G_MAXUINT, 0,
+                                            G_PARAM_READWRITE |
+                                            G_PARAM_CONSTRUCT_ONLY |
+                                            G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:retry-after:
+   *
+   * Number of seconds which clients are told to wait before retrying a
+   * rejected request. Up to half as much again is added at random, so that
+   * the retries are spread out.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_RETRY_AFTER] = g_param_spec_uint ("retry-after",
+                                               "Retry After",
+                                               "Seconds for clients to wait before retrying a rejected request.",
+                                               0, G_MAXUINT / 2, 30,
+                                               G_PARAM_READWRITE |
+                                               G_PARAM_CONSTRUCT_ONLY |
+                                               G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:client-table:
+   *
+   * Table which requests are accounted per client in. If %NULL on
+   * construction, one limited to #EusServer:max-requests-per-client is
+   * created. Servers running in different threads can share a table, so the
+   * limits apply across them.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CLIENT_TABLE] = g_param_spec_object ("client-table",
+                                                  "Client Table",
+                                                  "Table which requests are accounted per client in.",
+                                                  EUS_TYPE_CLIENT_TABLE,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_CONSTRUCT_ONLY |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:rate-limiter:
+   *
+   * Limiter which response bodies are paced by. If %NULL on construction, one
+   * is created if #EusServer:max-rate or #EusServer:max-rate-per-client is
+   * set; otherwise, the rate is not limited.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_RATE_LIMITER] = g_param_spec_object ("rate-limiter",
+                                                  "Rate Limiter",
+                                                  "Limiter which response bodies are paced by.",
+                                                  EUS_TYPE_RATE_LIMITER,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_CONSTRUCT_ONLY |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:metrics:
+   *
+   * Metrics which requests are counted and timed in. If %NULL on
+   * construction, a new #EusMetrics is created.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_METRICS] = g_param_spec_object ("metrics",
+                                             "Metrics",
+                                             "Metrics which requests are counted and timed in.",
+                                             EUS_TYPE_METRICS,
+                                             G_PARAM_READWRITE |
+                                             G_PARAM_CONSTRUCT_ONLY |
+                                             G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:filez-cache:
+   *
+   * Cache of compressed `.filez` objects shared by all the repositories. As
+   * entries are keyed by object checksum, an object present in several
+   * repositories is only compressed and stored once. If %NULL, each
+   * repository keeps the #EusRepo:filez-cache it was created with.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_FILEZ_CACHE] = g_param_spec_object ("filez-cache",
+                                                 "Filez Cache",
+                                                 "Cache of compressed .filez objects shared by all the repositories.",
+                                                 EUS_TYPE_FILEZ_CACHE,
+                                                 G_PARAM_READWRITE |
+                                                 G_PARAM_CONSTRUCT_ONLY |
+                                                 G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:mapped-file-cache:
+   *
+   * Cache of mapped small files shared by all the repositories. Objects in it
+   * are keyed by checksum, so an object present in several repositories is
+   * only held in memory once. If %NULL on construction, a new
+   * #EusMappedFileCache is created.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_MAPPED_FILE_CACHE] = g_param_spec_object ("mapped-file-cache",
+                                                       "Mapped File Cache",
+                                                       "Cache of mapped small files shared by all the repositories.",
+                                                       EUS_TYPE_MAPPED_FILE_CACHE,
+                                                       G_PARAM_READWRITE |
+                                                       G_PARAM_CONSTRUCT_ONLY |
+                                                       G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class,
                                      G_N_ELEMENTS (props),
                                      props);
@@ -263,8 +899,10 @@ update_pending_requests (EusServer *self,
   g_debug ("%s: Updating from %u to %u", G_STRFUNC, self->pending_requests,
            self->pending_requests + delta);
 
+  g_mutex_lock (&self->lock);
   self->pending_requests += delta;
   self->last_request_time = g_get_monotonic_time ();
+  g_mutex_unlock (&self->lock);
 
   g_object_freeze_notify (obj);
   g_object_notify_by_pspec (obj, props[PROP_PENDING_REQUESTS]);
@@ -272,6 +910,87 @@ update_pending_requests (EusServer *self,
   g_object_thaw_notify (obj);
 }
 
+/* Get the one minute load average per processor, as a percentage. It is
+ * sampled at most every %LOAD_SAMPLE_INTERVAL_USEC, as the kernel only
+ * updates it every few seconds anyway. */
+static guint
+get_load (EusServer *self)
+{
+  gint64 now = g_get_monotonic_time ();
+  gdouble loadavg;
+
+  if (self->load_sample_time != 0 &&
+      now - self->load_sample_time < LOAD_SAMPLE_INTERVAL_USEC)
+    return self->load;
+
+  self->load_sample_time = now;
+  if (getloadavg (&loadavg, 1) == 1)
+    self->load = (guint) (loadavg * 100 / g_get_num_processors ());
+  else
+    self->load = 0;
+
+  return self->load;
+}
+
+/* Whether the server is too busy to take on more pulls. */
+static gboolean
+is_overloaded (EusServer *self)
+{
+  /* The client table counts the requests to all the servers sharing it, not
+   * including static deltas being generated. */
+  if (self->max_pending_requests > 0 &&
+      eus_client_table_get_n_requests (self->client_table) >= self->max_pending_requests)
+    return TRUE;
+
+  return (self->max_load > 0 && get_load (self) > self->max_load);
+}
+
+/* Whether @message starts a new poll or pull from one of the repositories:
+ * it is for the `config` or `summary` file, and @client has nothing else in
+ * flight. Must be called before the client table counts @message. */
+static gboolean
+is_new_pull (EusServer         *self,
+             SoupMessage       *message,
+             SoupClientContext *client)
+{
+  g_autofree gchar *path = NULL;
+  gsize i;
+
+  /* As libsoup does before calling the handlers. */
+  path = soup_uri_decode (soup_message_get_uri (message)->path);
+
+  for (i = 0; i < self->repos->len; i++)
+    {
+      EusRepo *repo = g_ptr_array_index (self->repos, i);
+      g_autofree gchar *root_path = NULL;
+      EusRoute route;
+
+      g_object_get (repo, "root-path", &root_path, NULL);
+      if (!g_str_has_prefix (path, root_path))
+        continue;
+
+      eus_route_parse (path + strlen (root_path), &route);
+      if (route.kind == EUS_ROUTE_CONFIG || route.kind == EUS_ROUTE_SUMMARY)
+        return (eus_client_table_get_n_client_requests (self->client_table,
+                                                        client) == 0);
+    }
+
+  return FALSE;
+}
+
+static void
+reject_request (EusServer   *self,
+                SoupMessage *message)
+{
+  g_autofree gchar *retry_after = NULL;
+
+  retry_after = g_strdup_printf ("%u", self->retry_after +
+                                 g_random_int_range (0, self->retry_after / 2 + 1));
+  soup_message_headers_replace (message->response_headers, "Retry-After",
+                                retry_after);
+  soup_message_set_status (message, SOUP_STATUS_SERVICE_UNAVAILABLE);
+}
+
 static void
 request_read_cb (SoupServer        *soup_server,
                  SoupMessage       *message,
@@ -280,6 +999,20 @@ request_read_cb (SoupServer        *soup_server,
 {
   EusServer *self = EUS_SERVER (user_data);
 
+  /* Setting a status here stops libsoup calling the handlers. The request is
+   * still counted, as request-finished is emitted for it as usual. */
+  eus_metrics_request_started (self->metrics, message);
+
+  if (self->repos != NULL && is_overloaded (self) &&
+      is_new_pull (self, message, client))
+    {
+      g_debug ("Rejecting request for %s: server overloaded",
+               soup_message_get_uri (message)->path);
+      reject_request (self, message);
+      eus_metrics_count (self->metrics, EUS_METRICS_COUNTER_REQUESTS_REJECTED);
+    }
+
+  eus_client_table_request_started (self->client_table, message, client);
   update_pending_requests (self, 1);
 }
 
@@ -291,6 +1024,8 @@ request_finished_cb (SoupServer        *soup_server,
 {
   EusServer *self = EUS_SERVER (user_data);
 
+  eus_metrics_request_finished (self->metrics, message, FALSE);
+  eus_client_table_request_finished (self->client_table, message, client);
   update_pending_requests (self, -1);
 }
 
@@ -302,9 +1037,100 @@ request_aborted_cb (SoupServer        *soup_server,
 {
   EusServer *self = EUS_SERVER (user_data);
 
+  eus_metrics_request_finished (self->metrics, message, TRUE);
+  eus_client_table_request_finished (self->client_table, message, client);
   update_pending_requests (self, -1);
 }
 
+/* Copy the figures which other components keep into the metrics. */
+static void
+update_metrics (EusServer *self)
+{
+  struct rusage usage;
+
+  eus_metrics_set_value (self->metrics, EUS_METRICS_VALUE_PENDING_REQUESTS,
+                         eus_client_table_get_n_requests (self->client_table));
+  eus_metrics_set_value (self->metrics, EUS_METRICS_VALUE_CLIENTS,
+                         eus_client_table_get_n_clients (self->client_table));
+  eus_metrics_set_value (self->metrics, EUS_METRICS_VALUE_COMPRESSION_JOBS,
+                         eus_scheduler_get_n_jobs (self->scheduler));
+  eus_metrics_set_value (self->metrics, EUS_METRICS_VALUE_COMPRESSION_CPU_TIME,
+                         eus_scheduler_get_cpu_time (self->scheduler) +
+                         eus_deflate_stream_get_cpu_time ());
+
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+    eus_metrics_set_value (self->metrics, EUS_METRICS_VALUE_PROCESS_CPU_TIME,
+                           (guint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+                           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static void
+metrics_cb (SoupServer        *soup_server,
+            SoupMessage       *msg,
+            const gchar       *path,
+            GHashTable        *query,
+            SoupClientContext *client,
+            gpointer           user_data)
+{
+  EusServer *self = EUS_SERVER (user_data);
+  GSocketAddress *address;
+  gchar *text;
+
+  if (msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD)
+    {
+      soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+      return;
+    }
+
+  address = soup_client_context_get_remote_address (client);
+  if (!G_IS_INET_SOCKET_ADDRESS (address) ||
+      !g_inet_address_get_is_loopback (g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address))))
+    {
+      soup_message_set_status (msg, SOUP_STATUS_FORBIDDEN);
+      return;
+    }
+
+  if (strcmp (path, EUS_SERVER_METRICS_PATH) != 0)
+    {
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+
+  text = eus_server_format_metrics (self);
+  soup_message_headers_replace (msg->response_headers, "Cache-Control",
+                                "no-cache");
+  soup_message_set_response (msg, "text/plain; version=0.0.4",
+                             SOUP_MEMORY_TAKE, text, strlen (text));
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+}
+
+/* Count static deltas being generated and commits being warmed up as pending
+ * requests, so the server is not considered idle until they are done. */
+static void
+pending_jobs_notify_cb (GObject    *object,
+                          GParamSpec *pspec,
+                          gpointer    user_data)
+{
+  EusServer *self = EUS_SERVER (user_data);
+  guint pending_jobs = 0;
+  gsize i;
+
+  for (i = 0; i < self->repos->len; i++)
+    {
+      EusRepo *repo = g_ptr_array_index (self->repos, i);
+      guint n_deltas, n_warm_ups;
+
+      g_object_get (repo,
+                    "pending-deltas", &n_deltas,
+                    "pending-warm-ups", &n_warm_ups,
+                    NULL);
+      pending_jobs += n_deltas + n_warm_ups;
+    }
+
+  update_pending_requests (self, (gint) pending_jobs - (gint) self->pending_jobs);
+  self->pending_jobs = pending_jobs;
+}
+
 /**
  * eus_server_new:
  * @server: #SoupServer to handle requests from
@@ -329,7 +1155,12 @@ eus_server_new (SoupServer *server)
  * @repo: repository to start serving
  *
  * Add an #EusRepo to the server, and immediately make its contents available
- * to clients of the server.
+ * to clients of the server. The repository’s #EusRepo:scheduler,
+ * #EusRepo:buffer-pool, #EusRepo:client-table, #EusRepo:rate-limiter,
+ * #EusRepo:metrics, #EusRepo:mapped-file-cache, compression levels, static
+ * delta settings and #EusRepo:warm-up are set to the server’s, as is its
+ * #EusRepo:filez-cache if the server has one. Its #EusRepo:delta-cache-path
+ * is a subdirectory of the server’s #EusServer:delta-cache-path.
  *
  * The repository will be available until eus_server_disconnect() is called.
  *
@@ -339,10 +1170,44 @@ void
 eus_server_add_repo (EusServer *self,
                      EusRepo   *repo)
 {
+  g_autofree gchar *delta_cache_path = NULL;
+
   g_return_if_fail (EUS_IS_SERVER (self));
   g_return_if_fail (EUS_IS_REPO (repo));
 
+  /* The repository at the root, which is the system one, has root path "";
+   * the others have "/1", "/2" and so on. */
+  if (self->delta_cache_path != NULL)
+    {
+      g_autofree gchar *root_path = NULL;
+
+      g_object_get (repo, "root-path", &root_path, NULL);
+      delta_cache_path = g_build_filename (self->delta_cache_path,
+                                           (root_path[0] == '/') ? root_path + 1 : "0",
+                                           NULL);
+    }
+
   g_ptr_array_add (self->repos, g_object_ref (repo));
+  g_object_set (repo,
+                "scheduler", self->scheduler,
+                "buffer-pool", self->buffer_pool,
+                "client-table", self->client_table,
+                "rate-limiter", self->rate_limiter,
+                "metrics", self->metrics,
+                "mapped-file-cache", self->mapped_file_cache,
+                "min-compression-level", self->min_compression_level,
+                "max-compression-level", self->max_compression_level,
+                "delta-max-size", self->delta_max_size,
+                "delta-ancestors", self->delta_ancestors,
+                "delta-cache-path", delta_cache_path,
+                "warm-up", self->warm_up,
+                NULL);
+  if (self->filez_cache != NULL)
+    g_object_set (repo, "filez-cache", self->filez_cache, NULL);
+  g_signal_connect (repo, "notify::pending-deltas",
+                    (GCallback) pending_jobs_notify_cb, self);
+  g_signal_connect (repo, "notify::pending-warm-ups",
+                    (GCallback) pending_jobs_notify_cb, self);
   eus_repo_connect (repo, self->server);
 }
 
@@ -371,36 +1236,78 @@ eus_server_disconnect (EusServer *self)
     {
       EusRepo *repo = g_ptr_array_index (self->repos, i);
 
+      g_signal_handlers_disconnect_by_func (repo, pending_jobs_notify_cb, self);
       eus_repo_disconnect (repo);
     }
 
   g_ptr_array_set_size (self->repos, 0);
+
+  if (self->server != NULL)
+    soup_server_remove_handler (self->server, EUS_SERVER_METRICS_PATH);
+
+  update_pending_requests (self, -(gint) self->pending_jobs);
+  self->pending_jobs = 0;
 }
 
 /**
  * eus_server_get_pending_requests:
  * @self: The #EusServer
  *
- * Get the value of #EusServer:pending-requests.
+ * Get the value of #EusServer:pending-requests. This may be called from any
+ * thread.
  *
  * Returns: Number of pending remotes.
  */
 guint
 eus_server_get_pending_requests (EusServer *self)
 {
-  return self->pending_requests;
+  guint pending_requests;
+
+  g_mutex_lock (&self->lock);
+  pending_requests = self->pending_requests;
+  g_mutex_unlock (&self->lock);
+
+  return pending_requests;
 }
 
 /**
  * eus_server_get_last_request_time:
  * @self: The #EusServer
  *
- * Get the value of #EusServer:last-request-time.
+ * Get the value of #EusServer:last-request-time. This may be called from any
+ * thread.
  *
  * Returns: When was the last request handled
  */
 gint64
 eus_server_get_last_request_time (EusServer *self)
 {
-  return self->last_request_time;
+  gint64 last_request_time;
+
+  g_mutex_lock (&self->lock);
+  last_request_time = self->last_request_time;
+  g_mutex_unlock (&self->lock);
+
+  return last_request_time;
+}
+
+/**
+ * eus_server_format_metrics:
+ * @self: an #EusServer
+ *
+ * Get the server’s request counters and response time histograms, in the
+ * same format as they are served at %EUS_SERVER_METRICS_PATH. See
+ * eus_metrics_format().
+ *
+ * Returns: (transfer full): the formatted metrics
+ * Since: UNRELEASED
+ */
+gchar *
+eus_server_format_metrics (EusServer *self)
+{
+  g_return_val_if_fail (EUS_IS_SERVER (self), NULL);
+
+  update_metrics (self);
+
+  return eus_metrics_format (self->metrics);
 }
@@ -31,6 +31,17 @@
 
 G_BEGIN_DECLS
 
+/**
+ * EUS_SERVER_METRICS_PATH:
+ *
+ * Path which an #EusServer serves its metrics at, as returned by
+ * eus_server_format_metrics(). Requests for it from anywhere other than the
+ * loopback interface are refused with `403 Forbidden`.
+ *
+ * Since: UNRELEASED
+ */
+#define EUS_SERVER_METRICS_PATH "/metrics"
+
 #define EUS_TYPE_SERVER eus_server_get_type ()
 G_DECLARE_FINAL_TYPE (EusServer, eus_server, EUS, SERVER, GObject)
 
@@ -44,4 +55,6 @@ void eus_server_disconnect (EusServer *self);
 guint eus_server_get_pending_requests (EusServer *self);
 gint64 eus_server_get_last_request_time (EusServer *self);
 
+gchar *eus_server_format_metrics (EusServer *self);
+
 G_END_DECLS
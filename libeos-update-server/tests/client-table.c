@@ -0,0 +1,355 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <libeos-update-server/client-table.h>
+#include <libsoup/soup.h>
+#include <locale.h>
+#include <string.h>
+
+/* Number of lanes in #EusClientTableLane. */
+#define N_LANES (EUS_CLIENT_TABLE_LANE_BULK + 1)
+
+typedef struct
+{
+  guint max_requests_per_client;
+  guint handle_msec;  /* how long each request takes to handle */
+} TestData;
+
+/* A loopback server whose requests are admitted by a client table, and take
+ * a while to handle, and a session to send requests to it. */
+typedef struct
+{
+  EusClientTable *table;
+  SoupServer *server;
+  SoupURI *base_uri;
+  SoupSession *session;
+  guint handle_msec;
+
+  guint n_active[N_LANES];
+  guint max_active[N_LANES];
+  GPtrArray *admitted;  /* (element-type utf8) paths, in the order they were admitted */
+  guint n_sent;
+  guint n_finished;
+} Fixture;
+
+typedef struct
+{
+  Fixture *fixture;  /* (unowned) */
+  SoupMessage *msg;  /* (owned) */
+  EusClientTableLane lane;
+} HandleData;
+
+static EusClientTableLane
+get_lane (SoupMessage *msg)
+{
+  return g_str_has_prefix (soup_message_get_uri (msg)->path, "/bulk/") ?
+         EUS_CLIENT_TABLE_LANE_BULK : EUS_CLIENT_TABLE_LANE_METADATA;
+}
+
+static gboolean
+finish_cb (gpointer user_data)
+{
+  HandleData *data = user_data;
+  Fixture *fixture = data->fixture;
+
+  fixture->n_active[data->lane]--;
+
+  soup_message_set_status (data->msg, SOUP_STATUS_OK);
+  soup_message_set_response (data->msg, "text/plain", SOUP_MEMORY_STATIC,
+                             "", 0);
+  soup_server_unpause_message (fixture->server, data->msg);
+
+  g_object_unref (data->msg);
+  g_free (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Handle @msg, now it has been admitted, by pausing it and finishing it after
+ * a while, as the handler for a large file would. */
+static void
+handle_admitted (Fixture           *fixture,
+                 SoupMessage       *msg,
+                 SoupClientContext *client)
+{
+  EusClientTableLane lane = get_lane (msg);
+  HandleData *data;
+
+  /* This request counts, as well as any others the client has sent. */
+  g_assert_cmpuint (eus_client_table_get_n_client_requests (fixture->table, client),
+                    >=, 1);
+  g_assert_cmpuint (eus_client_table_get_n_requests (fixture->table), >=,
+                    eus_client_table_get_n_client_requests (fixture->table, client));
+  g_assert_cmpuint (eus_client_table_get_n_clients (fixture->table), ==, 1);
+
+  fixture->n_active[lane]++;
+  fixture->max_active[lane] = MAX (fixture->max_active[lane],
+                                   fixture->n_active[lane]);
+  g_ptr_array_add (fixture->admitted,
+                   g_strdup (soup_message_get_uri (msg)->path));
+
+  data = g_new0 (HandleData, 1);
+  data->fixture = fixture;
+  data->msg = g_object_ref (msg);
+  data->lane = lane;
+
+  soup_server_pause_message (fixture->server, msg);
+  g_timeout_add (fixture->handle_msec, finish_cb, data);
+}
+
+static void
+admitted_cb (SoupMessage       *msg,
+             SoupClientContext *client,
+             gpointer           user_data)
+{
+  handle_admitted (user_data, msg, client);
+}
+
+static void
+server_cb (SoupServer        *server,
+           SoupMessage       *msg,
+           const char        *path,
+           GHashTable        *query,
+           SoupClientContext *client,
+           gpointer           user_data)
+{
+  Fixture *fixture = user_data;
+
+  if (eus_client_table_admit (fixture->table, server, msg, client,
+                              get_lane (msg), admitted_cb, fixture, NULL))
+    handle_admitted (fixture, msg, client);
+}
+
+static void
+request_read_cb (SoupServer        *server,
+                 SoupMessage       *msg,
+                 SoupClientContext *client,
+                 gpointer           user_data)
+{
+  Fixture *fixture = user_data;
+
+  eus_client_table_request_started (fixture->table, msg, client);
+}
+
+static void
+request_finished_cb (SoupServer        *server,
+                     SoupMessage       *msg,
+                     SoupClientContext *client,
+                     gpointer           user_data)
+{
+  Fixture *fixture = user_data;
+
+  eus_client_table_request_finished (fixture->table, msg, client);
+}
+
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data)
+{
+  const TestData *data = user_data;
+  g_autoptr(GError) error = NULL;
+  GSList *uris;
+
+  fixture->table = eus_client_table_new (data->max_requests_per_client);
+  fixture->handle_msec = data->handle_msec;
+  fixture->admitted = g_ptr_array_new_with_free_func (g_free);
+
+  fixture->server = soup_server_new (NULL, NULL);
+  g_signal_connect (fixture->server, "request-read",
+                    (GCallback) request_read_cb, fixture);
+  g_signal_connect (fixture->server, "request-finished",
+                    (GCallback) request_finished_cb, fixture);
+  g_signal_connect (fixture->server, "request-aborted",
+                    (GCallback) request_finished_cb, fixture);
+  soup_server_add_handler (fixture->server, NULL, server_cb, fixture, NULL);
+
+  soup_server_listen_local (fixture->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY,
+                            &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (fixture->server);
+  g_assert_nonnull (uris);
+  fixture->base_uri = soup_uri_copy (uris->data);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  /* Allow more connections than the table admits requests, so that it is the
+   * table which limits them. */
+  fixture->session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS, 64,
+                                                    SOUP_SESSION_MAX_CONNS_PER_HOST, 64,
+                                                    NULL);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  soup_session_abort (fixture->session);
+  g_clear_object (&fixture->session);
+  soup_server_disconnect (fixture->server);
+  g_clear_object (&fixture->server);
+  g_clear_pointer (&fixture->base_uri, soup_uri_free);
+  g_clear_pointer (&fixture->admitted, g_ptr_array_unref);
+  g_clear_object (&fixture->table);
+}
+
+static void
+message_finished_cb (SoupSession *session,
+                     SoupMessage *msg,
+                     gpointer     user_data)
+{
+  Fixture *fixture = user_data;
+
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+  fixture->n_finished++;
+}
+
+/* Send a request for @path without waiting for it to finish. */
+static void
+send_request (Fixture     *fixture,
+              const gchar *path)
+{
+  g_autoptr(SoupURI) uri = soup_uri_new_with_base (fixture->base_uri, path);
+  SoupMessage *msg = soup_message_new_from_uri ("GET", uri);
+
+  soup_session_queue_message (fixture->session, msg, message_finished_cb,
+                              fixture);
+  fixture->n_sent++;
+}
+
+/* Wait until all the requests sent so far have finished. */
+static void
+wait_for_requests (Fixture *fixture)
+{
+  while (fixture->n_finished < fixture->n_sent)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The server emits request-finished after the client has read the
+   * response, so the table may not have caught up yet. */
+  while (eus_client_table_get_n_requests (fixture->table) > 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (eus_client_table_get_n_clients (fixture->table), ==, 0);
+  g_assert_cmpuint (fixture->n_active[EUS_CLIENT_TABLE_LANE_METADATA], ==, 0);
+  g_assert_cmpuint (fixture->n_active[EUS_CLIENT_TABLE_LANE_BULK], ==, 0);
+}
+
+/* Test that no more than max-requests-per-client requests from a client are
+ * handled at once, and that the deferred ones are all handled eventually. */
+static void
+test_client_table_limit (Fixture       *fixture,
+                         gconstpointer  user_data)
+{
+  const TestData *data = user_data;
+  gsize i;
+
+  for (i = 0; i < 8; i++)
+    {
+      g_autofree gchar *path = g_strdup_printf ("/bulk/%" G_GSIZE_FORMAT, i);
+      send_request (fixture, path);
+    }
+
+  wait_for_requests (fixture);
+
+  g_assert_cmpuint (fixture->admitted->len, ==, 8);
+  g_assert_cmpuint (fixture->max_active[EUS_CLIENT_TABLE_LANE_BULK], ==,
+                    data->max_requests_per_client);
+  g_assert_cmpuint (fixture->max_active[EUS_CLIENT_TABLE_LANE_METADATA], ==, 0);
+}
+
+/* Test that, with no limit, the table does not hold any requests back. */
+static void
+test_client_table_unlimited (Fixture       *fixture,
+                             gconstpointer  user_data G_GNUC_UNUSED)
+{
+  gsize i;
+
+  for (i = 0; i < 8; i++)
+    {
+      g_autofree gchar *path = g_strdup_printf ("/bulk/%" G_GSIZE_FORMAT, i);
+      send_request (fixture, path);
+    }
+
+  wait_for_requests (fixture);
+
+  g_assert_cmpuint (fixture->admitted->len, ==, 8);
+  g_assert_cmpuint (fixture->max_active[EUS_CLIENT_TABLE_LANE_BULK], >, 2);
+}
+
+/* Test that a metadata request is not held up behind a client’s deferred bulk
+ * requests, as the lanes are limited separately. */
+static void
+test_client_table_lanes (Fixture       *fixture,
+                         gconstpointer  user_data)
+{
+  const TestData *data = user_data;
+  gsize i, metadata_index = G_MAXSIZE, last_bulk_index = 0;
+
+  for (i = 0; i < 3 * data->max_requests_per_client; i++)
+    {
+      g_autofree gchar *path = g_strdup_printf ("/bulk/%" G_GSIZE_FORMAT, i);
+      send_request (fixture, path);
+    }
+
+  send_request (fixture, "/summary");
+
+  wait_for_requests (fixture);
+
+  for (i = 0; i < fixture->admitted->len; i++)
+    {
+      const gchar *path = g_ptr_array_index (fixture->admitted, i);
+
+      if (g_str_equal (path, "/summary"))
+        metadata_index = i;
+      else
+        last_bulk_index = i;
+    }
+
+  g_assert_cmpuint (fixture->admitted->len, ==,
+                    3 * data->max_requests_per_client + 1);
+  g_assert_cmpuint (metadata_index, <, last_bulk_index);
+  g_assert_cmpuint (fixture->max_active[EUS_CLIENT_TABLE_LANE_BULK], ==,
+                    data->max_requests_per_client);
+  g_assert_cmpuint (fixture->max_active[EUS_CLIENT_TABLE_LANE_METADATA], ==, 1);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  const TestData limited_data = { 2, 100 };
+  const TestData unlimited_data = { 0, 200 };
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/client-table/limit", Fixture, &limited_data, setup,
+              test_client_table_limit, teardown);
+  g_test_add ("/client-table/unlimited", Fixture, &unlimited_data, setup,
+              test_client_table_unlimited, teardown);
+  g_test_add ("/client-table/lanes", Fixture, &limited_data, setup,
+              test_client_table_lanes, teardown);
+
+  return g_test_run ();
+}
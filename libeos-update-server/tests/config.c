@@ -0,0 +1,404 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-update-server/config.h>
+#include <locale.h>
+#include <string.h>
+
+/* Every configuration file needs this. */
+#define ADVERTISE_UPDATES "[Local Network Updates]\nAdvertiseUpdates=true\n"
+
+typedef struct
+{
+  gchar *tmp_dir;
+  gchar *config_path;
+} Fixture;
+
+/* Set up a temporary directory to write the configuration file in. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-update-server-tests-config-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  fixture->config_path = g_build_filename (fixture->tmp_dir,
+                                           "eos-update-server.conf", NULL);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_unlink (fixture->config_path);
+  g_free (fixture->config_path);
+
+  g_assert_cmpint (g_rmdir (fixture->tmp_dir), ==, 0);
+  g_free (fixture->tmp_dir);
+}
+
+/* Write @contents to the configuration file and load it. */
+static gboolean
+load_config (Fixture          *fixture,
+             const gchar      *contents,
+             GPtrArray       **out_repository_configs,
+             EusServerConfig **out_server_config,
+             GError          **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  g_file_set_contents (fixture->config_path, contents, -1, &local_error);
+  g_assert_no_error (local_error);
+
+  return eus_read_config_file (fixture->config_path, NULL,
+                               out_repository_configs, out_server_config,
+                               error);
+}
+
+/* Write @contents, after the mandatory section, to the configuration file
+ * and load it, checking that it is valid. */
+static EusServerConfig *
+load_valid_config (Fixture     *fixture,
+                   const gchar *contents)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *full_contents = g_strconcat (ADVERTISE_UPDATES, contents,
+                                                 NULL);
+  g_autoptr(EusServerConfig) config = NULL;
+
+  load_config (fixture, full_contents, NULL, &config, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (config);
+
+  return g_steal_pointer (&config);
+}
+
+/* Check that each of @vectors, after the mandatory section, is rejected,
+ * rather than being clamped or replaced by the default. */
+static void
+assert_config_invalid (Fixture            *fixture,
+                       const gchar * const *vectors,
+                       gsize               n_vectors)
+{
+  gsize i;
+
+  for (i = 0; i < n_vectors; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autofree gchar *contents = NULL;
+      g_autoptr(EusServerConfig) config = NULL;
+      gboolean success;
+
+      g_test_message ("%" G_GSIZE_FORMAT ": %s", i, vectors[i]);
+
+      contents = g_strconcat (ADVERTISE_UPDATES, vectors[i], NULL);
+      success = load_config (fixture, contents, NULL, &config, &error);
+      g_assert_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE);
+      g_assert_false (success);
+      g_assert_null (config);
+    }
+}
+
+/* Test the [Cache] Path= and MaxSize= keys of the .filez cache. */
+static void
+test_config_cache (Fixture       *fixture,
+                   gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Cache]\nMaxSize=1G\n",
+      "[Cache]\nMaxSize=18446744073709551616\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_true (g_str_has_suffix (config->cache_path,
+                                   "/cache/eos-update-server"));
+  g_assert_cmpuint (config->cache_max_size, ==, 1024 * 1024 * 1024);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Cache]\nPath=/tmp/cache\nMaxSize=0\n");
+  g_assert_cmpstr (config->cache_path, ==, "/tmp/cache");
+  g_assert_cmpuint (config->cache_max_size, ==, 0);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Compression] MaxJobs= key of the worker pool. */
+static void
+test_config_compression_max_jobs (Fixture       *fixture,
+                                  gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Compression]\nMaxJobs=4294967296\n",
+      "[Compression]\nMaxJobs=-1\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->compression_max_jobs, ==, 0);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Compression]\nMaxJobs=5\n");
+  g_assert_cmpuint (config->compression_max_jobs, ==, 5);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Compression] MaxMemory= key of the chunk buffer pool. */
+static void
+test_config_compression_max_memory (Fixture       *fixture,
+                                    gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Compression]\nMaxMemory=lots\n",
+      "[Compression]\nMaxMemory=18446744073709551616\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->compression_max_memory, ==, 64 * 1024 * 1024);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Compression]\nMaxMemory=1048576\n");
+  g_assert_cmpuint (config->compression_max_memory, ==, 1048576);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Compression] MinLevel= and MaxLevel= keys, including that, if
+ * only MinLevel= is set above the default MaxLevel=, the maximum is raised to
+ * it. */
+static void
+test_config_compression_levels (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Compression]\nMinLevel=10\n",
+      "[Compression]\nMaxLevel=10\n",
+      "[Compression]\nMinLevel=3\nMaxLevel=2\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->compression_min_level, ==, 1);
+  g_assert_cmpuint (config->compression_max_level, ==, 2);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Compression]\nMinLevel=0\nMaxLevel=9\n");
+  g_assert_cmpuint (config->compression_min_level, ==, 0);
+  g_assert_cmpuint (config->compression_max_level, ==, 9);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Compression]\nMinLevel=6\n");
+  g_assert_cmpuint (config->compression_min_level, ==, 6);
+  g_assert_cmpuint (config->compression_max_level, ==, 6);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Deltas] MaxSize= and Ancestors= keys. */
+static void
+test_config_deltas (Fixture       *fixture,
+                    gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Deltas]\nMaxSize=\n",
+      "[Deltas]\nAncestors=1,2\n",
+      "[Deltas]\nAncestors=4294967296\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->deltas_max_size, ==, 2ULL * 1024 * 1024 * 1024);
+  g_assert_cmpuint (config->deltas_ancestors, ==, 2);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Deltas]\nMaxSize=12345\nAncestors=7\n");
+  g_assert_cmpuint (config->deltas_max_size, ==, 12345);
+  g_assert_cmpuint (config->deltas_ancestors, ==, 7);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Cache] WarmUp= key. */
+static void
+test_config_warm_up (Fixture       *fixture,
+                     gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Cache]\nWarmUp=maybe\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_true (config->cache_warm_up);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Cache]\nWarmUp=false\n");
+  g_assert_false (config->cache_warm_up);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Clients] MaxRequests= key. */
+static void
+test_config_clients_max_requests (Fixture       *fixture,
+                                  gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Clients]\nMaxRequests=+4\n",
+      "[Clients]\nMaxRequests=4294967296\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->clients_max_requests, ==, 4);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Clients]\nMaxRequests=0\n");
+  g_assert_cmpuint (config->clients_max_requests, ==, 0);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Clients] MaxRate= and MaxTotalRate= keys. */
+static void
+test_config_clients_rates (Fixture       *fixture,
+                           gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Clients]\nMaxRate=0x10\n",
+      "[Clients]\nMaxTotalRate=18446744073709551616\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->clients_max_rate, ==, 0);
+  g_assert_cmpuint (config->clients_max_total_rate, ==, 0);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture,
+                              "[Clients]\nMaxRate=1000\n"
+                              "MaxTotalRate=18446744073709551615\n");
+  g_assert_cmpuint (config->clients_max_rate, ==, 1000);
+  g_assert_cmpuint (config->clients_max_total_rate, ==, G_MAXUINT64);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Admission] keys. */
+static void
+test_config_admission (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Admission]\nMaxPendingRequests=many\n",
+      "[Admission]\nMaxLoad=1.5\n",
+      "[Admission]\nRetryAfter=2147483648\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->admission_max_pending_requests, ==, 128);
+  g_assert_cmpuint (config->admission_max_load, ==, 200);
+  g_assert_cmpuint (config->admission_retry_after, ==, 30);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture,
+                              "[Admission]\nMaxPendingRequests=0\n"
+                              "MaxLoad=150\nRetryAfter=0\n");
+  g_assert_cmpuint (config->admission_max_pending_requests, ==, 0);
+  g_assert_cmpuint (config->admission_max_load, ==, 150);
+  g_assert_cmpuint (config->admission_retry_after, ==, 0);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+/* Test the [Server] Threads= key. */
+static void
+test_config_server_threads (Fixture       *fixture,
+                            gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *invalid[] =
+    {
+      "[Server]\nThreads=1025\n",
+      "[Server]\nThreads=-1\n",
+    };
+  g_autoptr(EusServerConfig) config = NULL;
+
+  config = load_valid_config (fixture, "");
+  g_assert_cmpuint (config->server_threads, ==, 0);
+  g_clear_pointer (&config, eus_server_config_free);
+
+  config = load_valid_config (fixture, "[Server]\nThreads=3\n");
+  g_assert_cmpuint (config->server_threads, ==, 3);
+
+  assert_config_invalid (fixture, invalid, G_N_ELEMENTS (invalid));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/config/cache", Fixture, NULL, setup,
+              test_config_cache, teardown);
+  g_test_add ("/config/compression-max-jobs", Fixture, NULL, setup,
+              test_config_compression_max_jobs, teardown);
+  g_test_add ("/config/compression-max-memory", Fixture, NULL, setup,
+              test_config_compression_max_memory, teardown);
+  g_test_add ("/config/compression-levels", Fixture, NULL, setup,
+              test_config_compression_levels, teardown);
+  g_test_add ("/config/deltas", Fixture, NULL, setup,
+              test_config_deltas, teardown);
+  g_test_add ("/config/warm-up", Fixture, NULL, setup,
+              test_config_warm_up, teardown);
+  g_test_add ("/config/clients-max-requests", Fixture, NULL, setup,
+              test_config_clients_max_requests, teardown);
+  g_test_add ("/config/clients-rates", Fixture, NULL, setup,
+              test_config_clients_rates, teardown);
+  g_test_add ("/config/admission", Fixture, NULL, setup,
+              test_config_admission, teardown);
+  g_test_add ("/config/server-threads", Fixture, NULL, setup,
+              test_config_server_threads, teardown);
+
+  return g_test_run ();
+}
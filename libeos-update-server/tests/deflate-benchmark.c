@@ -0,0 +1,310 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+/* Microbenchmark comparing the single-stream #GZlibCompressor which ostree
+ * uses for archive-z2 objects against #EusDeflateStream, for objects from
+ * 1 KiB up to --max-size. For each size, the throughput in MiB of input per
+ * second and the compressed size as a percentage of the input are printed.
+ * The output of #EusDeflateStream is checked by inflating it. */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/deflate-stream.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the generated data which inputs are made up of. It is bigger than
+ * the deflate window, so repeating it does not make inputs unrealistically
+ * compressible. */
+#define SAMPLE_SIZE (16 * 1024 * 1024)
+
+/* Small objects are compressed repeatedly until at least this much input has
+ * been processed, so their timings are meaningful. */
+#define MIN_TOTAL_SIZE (64 * 1024 * 1024)
+
+#define READ_SIZE (256 * 1024)
+
+/* Generate data which compresses roughly as well as a typical OS tree: runs
+ * of words from a small vocabulary, mixed with runs of random bytes. */
+static GBytes *
+generate_sample (void)
+{
+  static const gchar *const words[] =
+    {
+      "ostree ", "commit ", "dirtree ", "dirmeta ", "filez ", "summary ",
+      "\x7f" "ELF\x02\x01\x01", "        ", "libglib-2.0.so.0 ",
+    };
+  g_autoptr(GRand) rand = g_rand_new_with_seed (0);
+  guint8 *data = g_malloc (SAMPLE_SIZE);
+  gsize len = 0;
+
+  while (len < SAMPLE_SIZE)
+    {
+      if (g_rand_int_range (rand, 0, 4) == 0)
+        {
+          gsize n = MIN ((gsize) g_rand_int_range (rand, 1, 64), SAMPLE_SIZE - len);
+          gsize i;
+
+          for (i = 0; i < n; i++)
+            data[len++] = g_rand_int_range (rand, 0, 256);
+        }
+      else
+        {
+          const gchar *word = words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))];
+          gsize n = MIN (strlen (word), SAMPLE_SIZE - len);
+
+          memcpy (data + len, word, n);
+          len += n;
+        }
+    }
+
+  return g_bytes_new_take (data, SAMPLE_SIZE);
+}
+
+/* Build an input stream of @size bytes out of repeats of @sample, without
+ * copying it. */
+static GInputStream *
+input_for_size (GBytes  *sample,
+                guint64  size)
+{
+  GInputStream *input = g_memory_input_stream_new ();
+  guint64 remaining = size;
+
+  while (remaining > 0)
+    {
+      g_autoptr(GBytes) bytes = NULL;
+      gsize n = MIN (remaining, g_bytes_get_size (sample));
+
+      bytes = g_bytes_new_from_bytes (sample, 0, n);
+      g_memory_input_stream_add_bytes (G_MEMORY_INPUT_STREAM (input), bytes);
+      remaining -= n;
+    }
+
+  return input;
+}
+
+/* Read @stream to the end, returning how many bytes it produced, or -1 on
+ * error. If @verify is non-%NULL, the output is inflated and checked against
+ * it. */
+static gint64
+drain (GInputStream *stream,
+       GBytes       *verify,
+       guint64       verify_size)
+{
+  g_autofree guint8 *buffer = g_malloc (READ_SIZE);
+  g_autoptr(GConverter) decompressor = NULL;
+  g_autofree guint8 *inflated = NULL;
+  const guint8 *expected = NULL;
+  gsize expected_len = 0;
+  guint64 inflated_offset = 0;
+  gint64 total = 0;
+  g_autoptr(GError) error = NULL;
+
+  if (verify != NULL)
+    {
+      decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+      inflated = g_malloc (READ_SIZE);
+      expected = g_bytes_get_data (verify, &expected_len);
+    }
+
+  while (TRUE)
+    {
+      gssize n_read = g_input_stream_read (stream, buffer, READ_SIZE, NULL, &error);
+      gsize in_offset = 0;
+
+      if (n_read < 0)
+        {
+          g_printerr ("Error compressing: %s\n", error->message);
+          return -1;
+        }
+      total += n_read;
+
+      /* Inflate whatever has been read, comparing it against the input. */
+      while (decompressor != NULL && (in_offset < (gsize) n_read || n_read == 0))
+        {
+          gsize bytes_read, bytes_written, i;
+          GConverterResult result;
+
+          result = g_converter_convert (decompressor,
+                                        buffer + in_offset, n_read - in_offset,
+                                        inflated, READ_SIZE,
+                                        (n_read == 0) ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                                        &bytes_read, &bytes_written, &error);
+          if (result == G_CONVERTER_ERROR)
+            {
+              g_printerr ("Error inflating: %s\n", error->message);
+              return -1;
+            }
+
+          for (i = 0; i < bytes_written; i++)
+            if (inflated[i] != expected[(inflated_offset + i) % expected_len])
+              {
+                g_printerr ("Mismatch at offset %" G_GUINT64_FORMAT "\n",
+                            inflated_offset + i);
+                return -1;
+              }
+
+          in_offset += bytes_read;
+          inflated_offset += bytes_written;
+
+          if (result == G_CONVERTER_FINISHED)
+            break;
+          if (n_read == 0 && bytes_written == 0)
+            {
+              g_printerr ("Truncated stream\n");
+              return -1;
+            }
+        }
+
+      if (n_read == 0)
+        break;
+    }
+
+  if (verify != NULL && inflated_offset != verify_size)
+    {
+      g_printerr ("Inflated %" G_GUINT64_FORMAT " bytes, expected %"
+                  G_GUINT64_FORMAT "\n", inflated_offset, verify_size);
+      return -1;
+    }
+
+  return total;
+}
+
+typedef GInputStream *(*CompressFunc) (GInputStream *input,
+                                       gint          level);
+
+static GInputStream *
+compress_single (GInputStream *input,
+                 gint          level)
+{
+  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, level);
+
+  return g_converter_input_stream_new (input, G_CONVERTER (compressor));
+}
+
+static GInputStream *
+compress_parallel (GInputStream *input,
+                   gint          level)
+{
+  return eus_deflate_stream_new (input, NULL, level);
+}
+
+/* Time compressing @size bytes with @func, returning the throughput in MiB/s
+ * and the compressed size as a percentage of @size. */
+static gboolean
+run (CompressFunc  func,
+     GBytes       *sample,
+     guint64       size,
+     gint          level,
+     gboolean      verify,
+     gdouble      *out_throughput,
+     gdouble      *out_ratio)
+{
+  guint n_iterations = MAX (MIN_TOTAL_SIZE / size, 1);
+  gint64 start, end;
+  gint64 compressed_size = 0;
+  guint i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < n_iterations; i++)
+    {
+      g_autoptr(GInputStream) input = input_for_size (sample, size);
+      g_autoptr(GInputStream) stream = func (input, level);
+
+      compressed_size = drain (stream, verify ? sample : NULL, size);
+      if (compressed_size < 0)
+        return FALSE;
+    }
+
+  end = g_get_monotonic_time ();
+
+  *out_throughput = ((gdouble) size * n_iterations / (1024 * 1024)) /
+                    ((gdouble) MAX (end - start, 1) / G_USEC_PER_SEC);
+  *out_ratio = 100.0 * compressed_size / size;
+
+  return TRUE;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) sample = NULL;
+  gint64 max_size = 1024 * 1024 * 1024;
+  gint level = 2;
+  gboolean verify = FALSE;
+  guint64 size;
+  const GOptionEntry entries[] =
+    {
+      { "max-size", 0, 0, G_OPTION_ARG_INT64, &max_size,
+        "Largest object size to benchmark, in bytes (default: 1 GiB)", "BYTES" },
+      { "level", 'l', 0, G_OPTION_ARG_INT, &level,
+        "Compression level (default: 2)", "LEVEL" },
+      { "verify", 0, 0, G_OPTION_ARG_NONE, &verify,
+        "Check the parallel output inflates to the input", NULL },
+      { NULL }
+    };
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("— compare serial and parallel deflate");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (level < 0 || level > 9 || max_size < 1024)
+    {
+      g_printerr ("Invalid --level or --max-size\n");
+      return EXIT_FAILURE;
+    }
+
+  sample = generate_sample ();
+
+  g_print ("%12s  %14s  %8s  %14s  %8s\n",
+           "Size", "Serial MiB/s", "Ratio", "Parallel MiB/s", "Ratio");
+
+  for (size = 1024; size <= (guint64) max_size; size *= 16)
+    {
+      gdouble serial_throughput, serial_ratio;
+      gdouble parallel_throughput, parallel_ratio;
+
+      if (!run (compress_single, sample, size, level, FALSE,
+                &serial_throughput, &serial_ratio) ||
+          !run (compress_parallel, sample, size, level, verify,
+                &parallel_throughput, &parallel_ratio))
+        return EXIT_FAILURE;
+
+      g_print ("%12" G_GUINT64_FORMAT "  %14.1f  %7.1f%%  %14.1f  %7.1f%%\n",
+               size, serial_throughput, serial_ratio,
+               parallel_throughput, parallel_ratio);
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,365 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-update-server/deflate-stream.h>
+#include <libeos-update-server/filez-stream.h>
+#include <locale.h>
+#include <ostree.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* These match the block size used by #EusDeflateStream and the size from
+ * which eus_load_filez_stream() uses it. */
+#define BLOCK_SIZE (128 * 1024)
+#define PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+
+typedef struct
+{
+  gsize size;
+  gboolean compressible;
+  gint compression_level;
+} RoundTripData;
+
+/* Generate @size bytes of input: either text-like data which deflates well,
+ * or pseudo-random data which does not. The output is the same every time. */
+static GBytes *
+make_input (gsize    size,
+            gboolean compressible)
+{
+  const gchar text[] = "The quick brown fox jumps over the lazy dog. ";
+  g_autoptr(GRand) rand = g_rand_new_with_seed (size);
+  guint8 *data = g_malloc (size);
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    {
+      if (compressible)
+        data[i] = text[(i + i / 4096) % strlen (text)];
+      else
+        data[i] = g_rand_int (rand) & 0xff;
+    }
+
+  return g_bytes_new_take (data, size);
+}
+
+/* Read all of @stream into memory. */
+static GBytes *
+read_all (GInputStream *stream)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+
+  g_output_stream_splice (output, stream,
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                          G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                          NULL, &error);
+  g_assert_no_error (error);
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+}
+
+/* Test that the output of an #EusDeflateStream is a complete raw deflate
+ * stream which inflates back to the input, preceded by the prefix. */
+static void
+test_deflate_stream_round_trip (gconstpointer user_data)
+{
+  const RoundTripData *data = user_data;
+  g_autoptr(GBytes) input = NULL;
+  g_autoptr(GBytes) prefix = NULL;
+  g_autoptr(GInputStream) base_stream = NULL;
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GBytes) output = NULL;
+  g_autoptr(GBytes) compressed = NULL;
+  g_autoptr(GInputStream) compressed_stream = NULL;
+  g_autoptr(GConverter) decompressor = NULL;
+  g_autoptr(GInputStream) inflated_stream = NULL;
+  g_autoptr(GBytes) inflated = NULL;
+  const gchar prefix_data[] = "prefix";
+
+  input = make_input (data->size, data->compressible);
+  prefix = g_bytes_new_static (prefix_data, strlen (prefix_data));
+
+  base_stream = g_memory_input_stream_new_from_bytes (input);
+  stream = eus_deflate_stream_new (base_stream, prefix,
+                                   data->compression_level);
+  output = read_all (stream);
+
+  /* The prefix is passed through unchanged. */
+  g_assert_cmpuint (g_bytes_get_size (output), >, strlen (prefix_data));
+  g_assert_cmpmem (g_bytes_get_data (output, NULL), strlen (prefix_data),
+                   prefix_data, strlen (prefix_data));
+
+  if (data->compressible && data->compression_level > 0 &&
+      data->size >= BLOCK_SIZE)
+    g_assert_cmpuint (g_bytes_get_size (output), <, data->size / 2);
+
+  /* Inflating fails if the stream is not terminated properly. */
+  compressed = g_bytes_new_from_bytes (output, strlen (prefix_data),
+                                       g_bytes_get_size (output) - strlen (prefix_data));
+  compressed_stream = g_memory_input_stream_new_from_bytes (compressed);
+  decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+  inflated_stream = g_converter_input_stream_new (compressed_stream,
+                                                  decompressor);
+  inflated = read_all (inflated_stream);
+
+  g_assert_true (g_bytes_equal (inflated, input));
+}
+
+/* Test that compressing the same input twice gives the same output, as the
+ * output is cached and identified by its ETag. */
+static void
+test_deflate_stream_deterministic (void)
+{
+  g_autoptr(GBytes) input = make_input (3 * BLOCK_SIZE + 17, TRUE);
+  g_autoptr(GInputStream) base_stream1 = NULL;
+  g_autoptr(GInputStream) base_stream2 = NULL;
+  g_autoptr(GInputStream) stream1 = NULL;
+  g_autoptr(GInputStream) stream2 = NULL;
+  g_autoptr(GBytes) output1 = NULL;
+  g_autoptr(GBytes) output2 = NULL;
+
+  base_stream1 = g_memory_input_stream_new_from_bytes (input);
+  stream1 = eus_deflate_stream_new (base_stream1, NULL, 6);
+  output1 = read_all (stream1);
+
+  base_stream2 = g_memory_input_stream_new_from_bytes (input);
+  stream2 = eus_deflate_stream_new (base_stream2, NULL, 6);
+  output2 = read_all (stream2);
+
+  g_assert_true (g_bytes_equal (output1, output2));
+}
+
+typedef struct
+{
+  gchar *tmp_dir;
+  OstreeRepo *repo;
+} Fixture;
+
+/* Set up an empty repository. The objects are loaded uncompressed by
+ * eus_load_filez_stream() whatever the repository mode is, so use an
+ * archive-z2 one, which does not need xattr support in the file system. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) repo_dir = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-update-server-tests-deflate-stream-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  repo_dir = g_file_new_for_path (fixture->tmp_dir);
+  fixture->repo = ostree_repo_new (repo_dir);
+  ostree_repo_create (fixture->repo, OSTREE_REPO_MODE_ARCHIVE_Z2, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+remove_recursive (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_assert_cmpint (g_unlink (path), ==, 0);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_recursive (child);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_clear_object (&fixture->repo);
+  remove_recursive (fixture->tmp_dir);
+  g_free (fixture->tmp_dir);
+}
+
+/* Add a regular file containing @contents to the repository, and return its
+ * checksum. */
+static gchar *
+write_file_object (Fixture *fixture,
+                   GBytes  *contents)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFileInfo) info = g_file_info_new ();
+  g_autoptr(GInputStream) raw = NULL;
+  g_autoptr(GInputStream) object = NULL;
+  g_autofree guchar *csum = NULL;
+  guint64 length;
+
+  g_file_info_set_file_type (info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (info, g_bytes_get_size (contents));
+  g_file_info_set_attribute_uint32 (info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", S_IFREG | 0644);
+
+  raw = g_memory_input_stream_new_from_bytes (contents);
+  ostree_raw_file_to_content_stream (raw, info, NULL, &object, &length,
+                                     NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_prepare_transaction (fixture->repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_content (fixture->repo, NULL, object, length, &csum,
+                             NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_commit_transaction (fixture->repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return ostree_checksum_from_bytes (csum);
+}
+
+/* Test that the streams produced by eus_load_filez_stream() parse as
+ * archive-z2 objects with the original contents and checksum, both below
+ * and at the size from which #EusDeflateStream is used. */
+static void
+test_deflate_stream_filez (Fixture       *fixture,
+                           gconstpointer  user_data)
+{
+  const RoundTripData *data = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) input = NULL;
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(GInputStream) filez_stream = NULL;
+  g_autoptr(GBytes) filez = NULL;
+  g_autoptr(GInputStream) filez_input = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GVariant) xattrs = NULL;
+  g_autoptr(GBytes) parsed = NULL;
+  g_autoptr(GInputStream) parsed_stream = NULL;
+  g_autofree guchar *parsed_csum = NULL;
+  g_autofree gchar *parsed_checksum = NULL;
+  guint64 uncompressed_size;
+  gint compression_level;
+
+  input = make_input (data->size, data->compressible);
+  checksum = write_file_object (fixture, input);
+
+  eus_load_filez_stream (fixture->repo, checksum, data->compression_level,
+                         FALSE, NULL, &filez_stream, &uncompressed_size,
+                         &compression_level, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (uncompressed_size, ==, data->size);
+  g_assert_cmpint (compression_level, ==, data->compression_level);
+
+  filez = read_all (filez_stream);
+
+  filez_input = g_memory_input_stream_new_from_bytes (filez);
+  ostree_content_stream_parse (TRUE, filez_input, g_bytes_get_size (filez),
+                               FALSE, &content, &info, &xattrs, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (g_file_info_get_size (info), ==, data->size);
+
+  parsed = read_all (content);
+  g_assert_true (g_bytes_equal (parsed, input));
+
+  parsed_stream = g_memory_input_stream_new_from_bytes (parsed);
+  ostree_checksum_file_from_input (info, xattrs, parsed_stream,
+                                   OSTREE_OBJECT_TYPE_FILE, &parsed_csum,
+                                   NULL, &error);
+  g_assert_no_error (error);
+  parsed_checksum = ostree_checksum_from_bytes (parsed_csum);
+  g_assert_cmpstr (parsed_checksum, ==, checksum);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  const RoundTripData round_trip_data[] =
+    {
+      /* Empty input. */
+      { 0, TRUE, 6 },
+      { 1, TRUE, 6 },
+      /* Either side of a block boundary. */
+      { BLOCK_SIZE - 1, TRUE, 6 },
+      { BLOCK_SIZE, TRUE, 6 },
+      { BLOCK_SIZE + 1, TRUE, 6 },
+      /* Several batches of blocks, as there is at most one block per
+       * processor in each. */
+      { PARALLEL_MIN_SIZE, TRUE, 1 },
+      { PARALLEL_MIN_SIZE, TRUE, 9 },
+      { PARALLEL_MIN_SIZE + 1, TRUE, 6 },
+      /* Incompressible input, whose blocks deflate to more than their size. */
+      { BLOCK_SIZE + 1, FALSE, 6 },
+      { PARALLEL_MIN_SIZE, FALSE, 9 },
+      /* Stored blocks. */
+      { 3 * BLOCK_SIZE + 17, TRUE, 0 },
+    };
+  const RoundTripData filez_data[] =
+    {
+      { 0, TRUE, 6 },
+      { PARALLEL_MIN_SIZE - 1, TRUE, 6 },
+      { PARALLEL_MIN_SIZE, TRUE, 6 },
+      { PARALLEL_MIN_SIZE + BLOCK_SIZE + 1, FALSE, 6 },
+    };
+  gsize i;
+
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (round_trip_data); i++)
+    {
+      g_autofree gchar *test_name = NULL;
+
+      test_name = g_strdup_printf ("/deflate-stream/round-trip/%s/%" G_GSIZE_FORMAT "/%d",
+                                   round_trip_data[i].compressible ? "compressible" : "incompressible",
+                                   round_trip_data[i].size,
+                                   round_trip_data[i].compression_level);
+      g_test_add_data_func (test_name, &round_trip_data[i],
+                            test_deflate_stream_round_trip);
+    }
+
+  g_test_add_func ("/deflate-stream/deterministic",
+                   test_deflate_stream_deterministic);
+
+  for (i = 0; i < G_N_ELEMENTS (filez_data); i++)
+    {
+      g_autofree gchar *test_name = NULL;
+
+      test_name = g_strdup_printf ("/deflate-stream/filez/%s/%" G_GSIZE_FORMAT,
+                                   filez_data[i].compressible ? "compressible" : "incompressible",
+                                   filez_data[i].size);
+      g_test_add (test_name, Fixture, &filez_data[i], setup,
+                  test_deflate_stream_filez, teardown);
+    }
+
+  return g_test_run ();
+}
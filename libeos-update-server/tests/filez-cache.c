@@ -0,0 +1,495 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-update-server/filez-cache.h>
+#include <locale.h>
+#include <string.h>
+#include <utime.h>
+
+#define CHECKSUM_A "aa00000000000000000000000000000000000000000000000000000000000000"
+#define CHECKSUM_B "bb00000000000000000000000000000000000000000000000000000000000000"
+#define CHECKSUM_C "cc00000000000000000000000000000000000000000000000000000000000000"
+
+typedef struct
+{
+  gchar *tmp_dir;
+} Fixture;
+
+/* Set up an empty temporary directory to hold the cache. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-update-server-tests-filez-cache-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+}
+
+static void
+remove_recursive (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_assert_cmpint (g_unlink (path), ==, 0);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_recursive (child);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  remove_recursive (fixture->tmp_dir);
+  g_free (fixture->tmp_dir);
+}
+
+/* Build @size bytes of entry data: a valid archive-z2 header, followed by
+ * copies of @c. */
+static guint8 *
+build_entry_data (gsize  size,
+                  guint8 c)
+{
+  g_autoptr(GVariant) header = NULL;
+  guint8 *data;
+  guint32 header_size;
+
+  header = g_variant_ref_sink (g_variant_new ("(tuuuus@a(ayay))",
+                                              (guint64) 0, 0, 0, 0100644, 0,
+                                              "",
+                                              g_variant_new_array (G_VARIANT_TYPE ("(ayay)"),
+                                                                   NULL, 0)));
+  header_size = g_variant_get_size (header);
+  g_assert_cmpuint (size, >, 8 + header_size);
+
+  data = g_malloc (size);
+  memset (data, c, size);
+  memset (data, 0, 8);
+  *((guint32 *) data) = GUINT32_TO_BE (header_size);
+  g_variant_store (header, data + 8);
+
+  return data;
+}
+
+/* Add an entry for @checksum at level 1 to @cache, consisting of a header
+ * followed by copies of @c, @size bytes in total. */
+static void
+write_entry (EusFilezCache *cache,
+             const gchar   *checksum,
+             gsize          size,
+             guint8         c)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCacheWriter) writer = NULL;
+  g_autofree guint8 *data = build_entry_data (size, c);
+
+  writer = eus_filez_cache_writer_new (cache, checksum, 1, &error);
+  g_assert_no_error (error);
+  eus_filez_cache_writer_write (writer, data, size, &error);
+  g_assert_no_error (error);
+  eus_filez_cache_writer_commit (writer, &error);
+  g_assert_no_error (error);
+}
+
+/* Build the path of the entry for @checksum at level 1. */
+static gchar *
+build_entry_path (Fixture     *fixture,
+                  const gchar *checksum)
+{
+  g_autofree gchar *prefix = g_strndup (checksum, 2);
+  g_autofree gchar *basename = g_strconcat (checksum + 2, ".filez", NULL);
+
+  return g_build_filename (fixture->tmp_dir, "1", prefix, basename, NULL);
+}
+
+/* Set the modification time of the entry for @checksum at level 1. */
+static void
+set_entry_mtime (Fixture     *fixture,
+                 const gchar *checksum,
+                 time_t       mtime)
+{
+  g_autofree gchar *path = build_entry_path (fixture, checksum);
+  struct utimbuf times = { mtime, mtime };
+
+  g_assert_cmpint (g_utime (path, &times), ==, 0);
+}
+
+/* Count the files in the prefix directory for @checksum at level 1. */
+static guint
+count_files (Fixture     *fixture,
+             const gchar *checksum)
+{
+  g_autofree gchar *prefix = g_strndup (checksum, 2);
+  g_autofree gchar *path = g_build_filename (fixture->tmp_dir, "1", prefix,
+                                             NULL);
+  g_autoptr(GDir) dir = NULL;
+  guint n_files = 0;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return 0;
+
+  while (g_dir_read_name (dir) != NULL)
+    n_files++;
+
+  return n_files;
+}
+
+/* Test that entries which are written can be looked up, at the right level
+ * and with the right contents. */
+static void
+test_filez_cache_lookup (Fixture       *fixture,
+                         gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(GMappedFile) mapping = NULL;
+  gint level = -1;
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_null (eus_filez_cache_lookup (cache, CHECKSUM_A, 1));
+  g_assert_null (eus_filez_cache_lookup_best (cache, CHECKSUM_A, &level));
+
+  write_entry (cache, CHECKSUM_A, 100, 'a');
+
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_A, 2));
+  g_assert_null (eus_filez_cache_lookup (cache, CHECKSUM_A, 2));
+
+  mapping = eus_filez_cache_lookup_best (cache, CHECKSUM_A, &level);
+  g_assert_nonnull (mapping);
+  g_assert_cmpint (level, ==, 1);
+  g_assert_cmpuint (g_mapped_file_get_length (mapping), ==, 100);
+  g_assert_cmpint (g_mapped_file_get_contents (mapping)[99], ==, 'a');
+}
+
+/* Test that the least recently used entries are evicted when the cache goes
+ * over its maximum size, and that lookups count as uses. */
+static void
+test_filez_cache_lru_eviction (Fixture       *fixture,
+                               gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(GMappedFile) mapping = NULL;
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 250, NULL, &error);
+  g_assert_no_error (error);
+
+  write_entry (cache, CHECKSUM_A, 100, 'a');
+  write_entry (cache, CHECKSUM_B, 100, 'b');
+
+  /* Use A, so that B is the least recently used. */
+  mapping = eus_filez_cache_lookup (cache, CHECKSUM_A, 1);
+  g_assert_nonnull (mapping);
+
+  write_entry (cache, CHECKSUM_C, 100, 'c');
+
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_B, 1));
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_C, 1));
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_B), ==, 0);
+
+}
+
+/* Test that an entry bigger than the whole cache is abandoned as soon as it
+ * goes over the limit, rather than when it is committed, and that it does not
+ * evict anything. */
+static void
+test_filez_cache_oversized (Fixture       *fixture,
+                            gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(EusFilezCacheWriter) writer = NULL;
+  g_autofree guint8 *data = build_entry_data (200, 'b');
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 250, NULL, &error);
+  g_assert_no_error (error);
+
+  write_entry (cache, CHECKSUM_A, 100, 'a');
+
+  writer = eus_filez_cache_writer_new (cache, CHECKSUM_B, 1, &error);
+  g_assert_no_error (error);
+  eus_filez_cache_writer_write (writer, data, 200, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_B), ==, 1);
+
+  /* The temporary file is deleted straight away. */
+  eus_filez_cache_writer_write (writer, data, 100, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE);
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_B), ==, 0);
+
+  g_clear_pointer (&writer, eus_filez_cache_writer_free);
+
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_B, 1));
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+}
+
+/* Test that the entries are reloaded by a new cache in the same directory,
+ * in LRU order according to their modification times, and that temporary
+ * files left behind by a previous instance are cleaned up. */
+static void
+test_filez_cache_reload (Fixture       *fixture,
+                         gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(EusFilezCacheWriter) writer = NULL;
+  const guint8 data[] = { 1, 2, 3 };
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+  g_assert_no_error (error);
+
+  write_entry (cache, CHECKSUM_A, 100, 'a');
+  write_entry (cache, CHECKSUM_B, 100, 'b');
+  write_entry (cache, CHECKSUM_C, 100, 'c');
+
+  /* Make B the least recently used, and A the most. */
+  set_entry_mtime (fixture, CHECKSUM_B, 1000000000);
+  set_entry_mtime (fixture, CHECKSUM_C, 1100000000);
+  set_entry_mtime (fixture, CHECKSUM_A, 1200000000);
+
+  /* Leave a partially written entry behind. */
+  writer = eus_filez_cache_writer_new (cache, CHECKSUM_A, 1, &error);
+  g_assert_no_error (error);
+  eus_filez_cache_writer_write (writer, data, sizeof (data), &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_A), ==, 2);
+
+  /* Reload with all the entries fitting. */
+  g_clear_object (&cache);
+  cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_B, 1));
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_C, 1));
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_A), ==, 1);
+
+  /* Freeing the stale writer is harmless. */
+  g_clear_pointer (&writer, eus_filez_cache_writer_free);
+
+  /* Reload with room for only two entries: the least recently used one is
+   * evicted. */
+  g_clear_object (&cache);
+  cache = eus_filez_cache_new (fixture->tmp_dir, 250, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_B, 1));
+  g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_C, 1));
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_B), ==, 0);
+}
+
+/* Test that entries which are damaged on disk are dropped, and deleted, when
+ * the cache is reloaded, rather than being served. */
+static void
+test_filez_cache_reload_invalid (Fixture       *fixture,
+                                 gconstpointer  user_data G_GNUC_UNUSED)
+{
+  /* The header built by build_entry_data() is 8 bytes of size and padding,
+   * then the #GVariant, whose symlink target string starts at offset 24. */
+  const struct
+    {
+      gsize truncated_size;  /* G_MAXSIZE to not truncate */
+      gsize corrupt_offset;  /* G_MAXSIZE to not corrupt */
+      const gchar *description;
+    }
+  vectors[] =
+    {
+      { 0, G_MAXSIZE, "empty" },
+      { 4, G_MAXSIZE, "truncated header size" },
+      { 20, G_MAXSIZE, "truncated header" },
+      { G_MAXSIZE, 0, "header size corrupted" },
+      { G_MAXSIZE, 8 + 24, "header corrupted" },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(EusFilezCache) cache = NULL;
+      g_autofree gchar *path_a = build_entry_path (fixture, CHECKSUM_A);
+      g_autofree gchar *contents = NULL;
+      gsize len;
+
+      g_test_message ("Vector %" G_GSIZE_FORMAT ": %s", i,
+                      vectors[i].description);
+
+      cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+      g_assert_no_error (error);
+
+      write_entry (cache, CHECKSUM_A, 100, 'a');
+      write_entry (cache, CHECKSUM_B, 100, 'b');
+      g_clear_object (&cache);
+
+      g_file_get_contents (path_a, &contents, &len, &error);
+      g_assert_no_error (error);
+
+      if (vectors[i].truncated_size < len)
+        len = vectors[i].truncated_size;
+      if (vectors[i].corrupt_offset < len)
+        contents[vectors[i].corrupt_offset] = 0x7f;
+
+      g_file_set_contents (path_a, contents, len, &error);
+      g_assert_no_error (error);
+
+      cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+      g_assert_no_error (error);
+
+      g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+      g_assert_null (eus_filez_cache_lookup (cache, CHECKSUM_A, 1));
+      g_assert_cmpuint (count_files (fixture, CHECKSUM_A), ==, 0);
+      g_assert_true (eus_filez_cache_contains (cache, CHECKSUM_B, 1));
+    }
+}
+
+/* Test that a writer which is freed without being committed leaves nothing
+ * behind. */
+static void
+test_filez_cache_abandoned_writer (Fixture       *fixture,
+                                   gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(EusFilezCacheWriter) writer = NULL;
+  const guint8 data[] = { 1, 2, 3 };
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 1000, NULL, &error);
+  g_assert_no_error (error);
+
+  writer = eus_filez_cache_writer_new (cache, CHECKSUM_A, 1, &error);
+  g_assert_no_error (error);
+  eus_filez_cache_writer_write (writer, data, sizeof (data), &error);
+  g_assert_no_error (error);
+
+  /* Partial entries are not visible. */
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+
+  g_clear_pointer (&writer, eus_filez_cache_writer_free);
+
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_A), ==, 0);
+}
+
+/* Test that an #EusFilezCacheStream adds its contents to the cache if it is
+ * read to the end, and not otherwise. */
+static void
+test_filez_cache_stream (Fixture       *fixture,
+                         gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusFilezCache) cache = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GInputStream) base_stream = NULL;
+  g_autoptr(GInputStream) stream = NULL;
+  g_autoptr(GMappedFile) mapping = NULL;
+  guint8 data[1000];
+  guint8 buffer[100];
+  gsize i, bytes_read;
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = i % 256;
+  bytes = g_bytes_new_static (data, sizeof (data));
+
+  cache = eus_filez_cache_new (fixture->tmp_dir, 10000, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Read part of the stream, then drop it. */
+  base_stream = g_memory_input_stream_new_from_bytes (bytes);
+  stream = eus_filez_cache_stream_new (base_stream, cache, CHECKSUM_A, 1);
+  g_input_stream_read_all (stream, buffer, sizeof (buffer), &bytes_read,
+                           NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (bytes_read, ==, sizeof (buffer));
+  g_assert_true (eus_filez_cache_stream_is_caching (EUS_FILEZ_CACHE_STREAM (stream)));
+
+  g_clear_object (&stream);
+  g_clear_object (&base_stream);
+  g_assert_false (eus_filez_cache_contains (cache, CHECKSUM_A, 1));
+  g_assert_cmpuint (count_files (fixture, CHECKSUM_A), ==, 0);
+
+  /* Read the whole stream. */
+  base_stream = g_memory_input_stream_new_from_bytes (bytes);
+  stream = eus_filez_cache_stream_new (base_stream, cache, CHECKSUM_A, 1);
+  do
+    {
+      g_input_stream_read_all (stream, buffer, sizeof (buffer), &bytes_read,
+                               NULL, &error);
+      g_assert_no_error (error);
+    }
+  while (bytes_read == sizeof (buffer));
+
+  g_assert_false (eus_filez_cache_stream_is_caching (EUS_FILEZ_CACHE_STREAM (stream)));
+
+  mapping = eus_filez_cache_lookup (cache, CHECKSUM_A, 1);
+  g_assert_nonnull (mapping);
+  g_assert_cmpmem (g_mapped_file_get_contents (mapping),
+                   g_mapped_file_get_length (mapping),
+                   data, sizeof (data));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/filez-cache/lookup", Fixture, NULL, setup,
+              test_filez_cache_lookup, teardown);
+  g_test_add ("/filez-cache/lru-eviction", Fixture, NULL, setup,
+              test_filez_cache_lru_eviction, teardown);
+  g_test_add ("/filez-cache/oversized", Fixture, NULL, setup,
+              test_filez_cache_oversized, teardown);
+  g_test_add ("/filez-cache/reload", Fixture, NULL, setup,
+              test_filez_cache_reload, teardown);
+  g_test_add ("/filez-cache/reload-invalid", Fixture, NULL, setup,
+              test_filez_cache_reload_invalid, teardown);
+  g_test_add ("/filez-cache/abandoned-writer", Fixture, NULL, setup,
+              test_filez_cache_abandoned_writer, teardown);
+  g_test_add ("/filez-cache/stream", Fixture, NULL, setup,
+              test_filez_cache_stream, teardown);
+
+  return g_test_run ();
+}
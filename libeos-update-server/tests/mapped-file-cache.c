@@ -0,0 +1,361 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-update-server/mapped-file-cache.h>
+#include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* How long to wait for a file monitor event before failing. */
+#define EVENT_TIMEOUT_USEC (10 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  gchar *tmp_dir;
+  EusMappedFileCache *cache;
+} Fixture;
+
+/* Set up an empty temporary directory and cache. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-update-server-tests-mapped-file-cache-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  fixture->cache = eus_mapped_file_cache_new (1024);
+}
+
+static void
+remove_recursive (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_assert_cmpint (g_unlink (path), ==, 0);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_recursive (child);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_clear_object (&fixture->cache);
+  remove_recursive (fixture->tmp_dir);
+  g_free (fixture->tmp_dir);
+}
+
+/* Write @contents to @name in the temporary directory, and return its path. */
+static gchar *
+write_file (Fixture     *fixture,
+            const gchar *name,
+            const gchar *contents)
+{
+  g_autofree gchar *path = g_build_filename (fixture->tmp_dir, name, NULL);
+  g_autoptr(GError) error = NULL;
+
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&path);
+}
+
+/* Map the file at @path and insert it into the cache, as #EusRepo does. */
+static GMappedFile *
+map_and_insert (Fixture     *fixture,
+                const gchar *path)
+{
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GError) error = NULL;
+  struct stat buf;
+
+  g_assert_cmpint (g_stat (path, &buf), ==, 0);
+  mapping = g_mapped_file_new (path, FALSE, &error);
+  g_assert_no_error (error);
+
+  eus_mapped_file_cache_insert (fixture->cache, path, mapping, &buf);
+
+  return g_steal_pointer (&mapping);
+}
+
+/* Map the file at @path without caching it. */
+static GMappedFile *
+map_file (const gchar *path)
+{
+  g_autoptr(GError) error = NULL;
+  GMappedFile *mapping;
+
+  mapping = g_mapped_file_new (path, FALSE, &error);
+  g_assert_no_error (error);
+
+  return mapping;
+}
+
+static gboolean
+is_cached (EusMappedFileCache *cache,
+           const gchar        *key)
+{
+  g_autoptr(GMappedFile) mapping = NULL;
+  gint64 mtime;
+
+  mapping = eus_mapped_file_cache_lookup (cache, key, &mtime);
+
+  return (mapping != NULL);
+}
+
+/* Wait until @key drops out of the cache, failing if it takes too long. The
+ * cache’s file monitors run in its own thread, so no main context needs to be
+ * run for that to happen. */
+static void
+wait_for_invalidation (EusMappedFileCache *cache,
+                       const gchar        *key)
+{
+  gint64 deadline = g_get_monotonic_time () + EVENT_TIMEOUT_USEC;
+
+  while (is_cached (cache, key))
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      g_usleep (10 * 1000);
+    }
+}
+
+/* Test that a file can be looked up after it is inserted. */
+static void
+test_mapped_file_cache_lookup (Fixture       *fixture,
+                               gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = write_file (fixture, "summary", "contents");
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GMappedFile) cached = NULL;
+  struct stat buf;
+  gint64 mtime;
+
+  g_assert_null (eus_mapped_file_cache_lookup (fixture->cache, path, &mtime));
+
+  mapping = map_and_insert (fixture, path);
+  cached = eus_mapped_file_cache_lookup (fixture->cache, path, &mtime);
+
+  g_assert_true (cached == mapping);
+  g_assert_cmpint (g_stat (path, &buf), ==, 0);
+  g_assert_cmpint (mtime, ==, buf.st_mtime);
+}
+
+/* Test that an entry is dropped when its file is replaced, as ostree does
+ * when it updates the summary, or changed in place. */
+static void
+test_mapped_file_cache_replaced (Fixture       *fixture,
+                                 gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = write_file (fixture, "summary", "contents");
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GError) error = NULL;
+  FILE *file;
+
+  mapping = map_and_insert (fixture, path);
+  g_assert_true (is_cached (fixture->cache, path));
+
+  /* g_file_set_contents() writes a temporary file and renames it over the
+   * old one. */
+  g_file_set_contents (path, "new contents", -1, &error);
+  g_assert_no_error (error);
+  wait_for_invalidation (fixture->cache, path);
+
+  g_clear_pointer (&mapping, g_mapped_file_unref);
+  mapping = map_and_insert (fixture, path);
+  g_assert_true (is_cached (fixture->cache, path));
+
+  file = fopen (path, "a");
+  g_assert_nonnull (file);
+  g_assert_cmpint (fputs ("appended", file), >=, 0);
+  g_assert_cmpint (fclose (file), ==, 0);
+  wait_for_invalidation (fixture->cache, path);
+}
+
+/* Test that an entry is dropped when its file is deleted. */
+static void
+test_mapped_file_cache_deleted (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = write_file (fixture, "summary", "contents");
+  g_autoptr(GMappedFile) mapping = NULL;
+
+  mapping = map_and_insert (fixture, path);
+  g_assert_true (is_cached (fixture->cache, path));
+
+  g_assert_cmpint (g_unlink (path), ==, 0);
+  wait_for_invalidation (fixture->cache, path);
+}
+
+static gpointer
+insert_thread_cb (gpointer user_data)
+{
+  Fixture *fixture = user_data;
+  g_autofree gchar *path = g_build_filename (fixture->tmp_dir, "summary", NULL);
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(GMappedFile) mapping = NULL;
+
+  g_main_context_push_thread_default (context);
+  mapping = map_and_insert (fixture, path);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+/* Test that an entry inserted from a thread whose main context is never run,
+ * and which has exited, is still dropped when its file changes, as happens
+ * when a request is served by another server thread. */
+static void
+test_mapped_file_cache_other_thread (Fixture       *fixture,
+                                     gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = write_file (fixture, "summary", "contents");
+  g_autoptr(GError) error = NULL;
+  GThread *thread;
+
+  thread = g_thread_new ("insert", insert_thread_cb, fixture);
+  g_thread_join (thread);
+  g_assert_true (is_cached (fixture->cache, path));
+
+  g_file_set_contents (path, "new contents", -1, &error);
+  g_assert_no_error (error);
+  wait_for_invalidation (fixture->cache, path);
+}
+
+/* Test that a file which changed between being mapped and being inserted is
+ * not cached, as the change happened before its directory was watched. */
+static void
+test_mapped_file_cache_stale (Fixture       *fixture,
+                              gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = write_file (fixture, "summary", "contents");
+  g_autoptr(GMappedFile) mapping = NULL;
+  g_autoptr(GError) error = NULL;
+  struct stat buf;
+
+  g_assert_cmpint (g_stat (path, &buf), ==, 0);
+  mapping = map_file (path);
+
+  g_file_set_contents (path, "new contents", -1, &error);
+  g_assert_no_error (error);
+
+  eus_mapped_file_cache_insert (fixture->cache, path, mapping, &buf);
+  g_assert_false (is_cached (fixture->cache, path));
+}
+
+/* Test that immutable entries are not dropped when the file they were loaded
+ * from changes, while other entries from the same directory are. */
+static void
+test_mapped_file_cache_immutable (Fixture       *fixture,
+                                  gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *object_path = write_file (fixture, "object", "object");
+  g_autofree gchar *summary_path = write_file (fixture, "summary", "summary");
+  g_autoptr(GMappedFile) object_mapping = map_file (object_path);
+  g_autoptr(GMappedFile) summary_mapping = NULL;
+  g_autoptr(GError) error = NULL;
+
+  eus_mapped_file_cache_insert_immutable (fixture->cache, "object-key",
+                                          object_mapping, 1);
+  summary_mapping = map_and_insert (fixture, summary_path);
+
+  g_file_set_contents (object_path, "changed", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_unlink (summary_path), ==, 0);
+  wait_for_invalidation (fixture->cache, summary_path);
+
+  g_assert_true (is_cached (fixture->cache, "object-key"));
+}
+
+/* Test that the least recently used entries are evicted to keep the cache
+ * within its size, and that files larger than it are not cached. */
+static void
+test_mapped_file_cache_eviction (Fixture       *fixture,
+                                 gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *contents = g_strnfill (400, 'a');
+  g_autofree gchar *large_contents = g_strnfill (1025, 'b');
+  g_autofree gchar *path = write_file (fixture, "file", contents);
+  g_autofree gchar *large_path = write_file (fixture, "large", large_contents);
+  g_autoptr(GMappedFile) mapping = map_file (path);
+  g_autoptr(GMappedFile) large_mapping = NULL;
+
+  eus_mapped_file_cache_insert_immutable (fixture->cache, "a", mapping, 0);
+  eus_mapped_file_cache_insert_immutable (fixture->cache, "b", mapping, 0);
+
+  /* Make ‘a’ the most recently used, so ‘b’ is evicted for ‘c’. */
+  g_assert_true (is_cached (fixture->cache, "a"));
+  eus_mapped_file_cache_insert_immutable (fixture->cache, "c", mapping, 0);
+
+  g_assert_true (is_cached (fixture->cache, "a"));
+  g_assert_false (is_cached (fixture->cache, "b"));
+  g_assert_true (is_cached (fixture->cache, "c"));
+
+  large_mapping = map_and_insert (fixture, large_path);
+  g_assert_false (is_cached (fixture->cache, large_path));
+  g_assert_true (is_cached (fixture->cache, "a"));
+  g_assert_true (is_cached (fixture->cache, "c"));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/mapped-file-cache/lookup", Fixture, NULL, setup,
+              test_mapped_file_cache_lookup, teardown);
+  g_test_add ("/mapped-file-cache/replaced", Fixture, NULL, setup,
+              test_mapped_file_cache_replaced, teardown);
+  g_test_add ("/mapped-file-cache/deleted", Fixture, NULL, setup,
+              test_mapped_file_cache_deleted, teardown);
+  g_test_add ("/mapped-file-cache/other-thread", Fixture, NULL, setup,
+              test_mapped_file_cache_other_thread, teardown);
+  g_test_add ("/mapped-file-cache/stale", Fixture, NULL, setup,
+              test_mapped_file_cache_stale, teardown);
+  g_test_add ("/mapped-file-cache/immutable", Fixture, NULL, setup,
+              test_mapped_file_cache_immutable, teardown);
+  g_test_add ("/mapped-file-cache/eviction", Fixture, NULL, setup,
+              test_mapped_file_cache_eviction, teardown);
+
+  return g_test_run ();
+}
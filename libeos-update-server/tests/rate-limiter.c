@@ -0,0 +1,149 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <libeos-update-server/rate-limiter.h>
+#include <locale.h>
+
+/* Slow enough that the buckets barely refill while a test runs: a byte per
+ * millisecond. The buckets still hold a whole piece. */
+#define SLOW_RATE 1000
+
+/* Test that nothing is delayed if there are no limits. */
+static void
+test_rate_limiter_unlimited (void)
+{
+  g_autoptr(EusRateLimiter) limiter = eus_rate_limiter_new (0, 0);
+
+  g_assert_cmpuint (eus_rate_limiter_get_max_rate (limiter), ==, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_max_rate_per_client (limiter), ==, 0);
+
+  eus_rate_limiter_consume (limiter, "client1", G_MAXSIZE / 2);
+  eus_rate_limiter_consume (limiter, NULL, G_MAXSIZE / 2);
+
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client1"), ==, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, NULL), ==, 0);
+}
+
+/* Test that a full bucket lets a burst through, and then delays sending for
+ * as long as it takes to pay off the debt. */
+static void
+test_rate_limiter_burst (void)
+{
+  g_autoptr(EusRateLimiter) limiter = eus_rate_limiter_new (SLOW_RATE, 0);
+  guint delay;
+
+  g_assert_cmpuint (eus_rate_limiter_get_max_rate (limiter), ==, SLOW_RATE);
+
+  /* A bucket always holds at least one piece. */
+  eus_rate_limiter_consume (limiter, "client1", EUS_RATE_LIMITER_PIECE_SIZE);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client1"), ==, 0);
+
+  /* Half a second’s worth of debt. The bucket may have refilled by a few
+   * bytes since. */
+  eus_rate_limiter_consume (limiter, "client1", SLOW_RATE / 2);
+  delay = eus_rate_limiter_get_delay (limiter, "client1");
+  g_assert_cmpuint (delay, >, 400);
+  g_assert_cmpuint (delay, <=, 501);
+
+  /* The debt is paid off over time. */
+  g_usleep (100 * 1000);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client1"), <, delay);
+}
+
+/* Test that the total limit applies to all clients, including ones which have
+ * not sent anything yet. */
+static void
+test_rate_limiter_total (void)
+{
+  g_autoptr(EusRateLimiter) limiter = eus_rate_limiter_new (SLOW_RATE, 0);
+
+  eus_rate_limiter_consume (limiter, "client1",
+                            EUS_RATE_LIMITER_PIECE_SIZE + SLOW_RATE);
+
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client1"), >, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client2"), >, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, NULL), >, 0);
+}
+
+/* Test that the per-client limit only applies to the client which was sent
+ * to, and that a %NULL client is a client of its own. */
+static void
+test_rate_limiter_per_client (void)
+{
+  g_autoptr(EusRateLimiter) limiter = eus_rate_limiter_new (0, SLOW_RATE);
+
+  g_assert_cmpuint (eus_rate_limiter_get_max_rate_per_client (limiter), ==,
+                    SLOW_RATE);
+
+  eus_rate_limiter_consume (limiter, "client1",
+                            EUS_RATE_LIMITER_PIECE_SIZE + SLOW_RATE);
+
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client1"), >, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client2"), ==, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, NULL), ==, 0);
+
+  eus_rate_limiter_consume (limiter, NULL,
+                            EUS_RATE_LIMITER_PIECE_SIZE + SLOW_RATE);
+
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, NULL), >, 0);
+  g_assert_cmpuint (eus_rate_limiter_get_delay (limiter, "client2"), ==, 0);
+}
+
+/* Test that the longer of the total and per-client delays is used. */
+static void
+test_rate_limiter_both (void)
+{
+  g_autoptr(EusRateLimiter) limiter = eus_rate_limiter_new (2 * SLOW_RATE,
+                                                            SLOW_RATE);
+  guint delay1, delay2;
+
+  /* Both buckets hold one piece, so client1 is a second in debt to its own
+   * bucket and half a second to the total. */
+  eus_rate_limiter_consume (limiter, "client1",
+                            EUS_RATE_LIMITER_PIECE_SIZE + SLOW_RATE);
+
+  delay1 = eus_rate_limiter_get_delay (limiter, "client1");
+  delay2 = eus_rate_limiter_get_delay (limiter, "client2");
+
+  g_assert_cmpuint (delay1, >, 900);
+  g_assert_cmpuint (delay1, <=, 1001);
+  g_assert_cmpuint (delay2, >, 400);
+  g_assert_cmpuint (delay2, <=, 501);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/rate-limiter/unlimited", test_rate_limiter_unlimited);
+  g_test_add_func ("/rate-limiter/burst", test_rate_limiter_burst);
+  g_test_add_func ("/rate-limiter/total", test_rate_limiter_total);
+  g_test_add_func ("/rate-limiter/per-client", test_rate_limiter_per_client);
+  g_test_add_func ("/rate-limiter/both", test_rate_limiter_both);
+
+  return g_test_run ();
+}
@@ -0,0 +1,241 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libeos-update-server/ref-table.h>
+#include <locale.h>
+#include <string.h>
+
+/* How long to wait for a file monitor event before failing. */
+#define EVENT_TIMEOUT_USEC (10 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  gchar *repo_path;
+  EusRefTable *table;
+} Fixture;
+
+/* Write @contents to @relative_path in the repository, creating its parent
+ * directories if needed. */
+static void
+write_file (Fixture     *fixture,
+            const gchar *relative_path,
+            const gchar *contents)
+{
+  g_autofree gchar *path = g_build_filename (fixture->repo_path, relative_path,
+                                             NULL);
+  g_autofree gchar *dir_path = g_path_get_dirname (path);
+  g_autoptr(GError) error = NULL;
+
+  g_assert_cmpint (g_mkdir_with_parents (dir_path, 0755), ==, 0);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+}
+
+static void
+delete_file (Fixture     *fixture,
+             const gchar *relative_path)
+{
+  g_autofree gchar *path = g_build_filename (fixture->repo_path, relative_path,
+                                             NULL);
+
+  g_assert_cmpint (g_unlink (path), ==, 0);
+}
+
+/* Set up a repository with a local ref, a remote ref it shadows, and a remote
+ * ref of its own, plus a ref of another remote which must not be served. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  fixture->repo_path = g_dir_make_tmp ("eos-update-server-tests-ref-table-XXXXXX",
+                                       &error);
+  g_assert_no_error (error);
+
+  write_file (fixture, "refs/heads/os/eos/master", "local\n");
+  write_file (fixture, "refs/remotes/eos/os/eos/master", "remote\n");
+  write_file (fixture, "refs/remotes/eos/os/eos/other", "other\n");
+  write_file (fixture, "refs/remotes/flathub/app/org.example", "flathub\n");
+
+  fixture->table = eus_ref_table_new (fixture->repo_path, "eos");
+}
+
+static void
+remove_recursive (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_assert_cmpint (g_unlink (path), ==, 0);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_recursive (child);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_clear_object (&fixture->table);
+  remove_recursive (fixture->repo_path);
+  g_free (fixture->repo_path);
+}
+
+/* Look up @head, and return the ref file contents as a string, or %NULL. */
+static gchar *
+lookup (Fixture     *fixture,
+        const gchar *head)
+{
+  g_autoptr(GBytes) contents = NULL;
+  gint64 mtime;
+  gconstpointer data;
+  gsize len;
+
+  contents = eus_ref_table_lookup (fixture->table, head, &mtime);
+  if (contents == NULL)
+    return NULL;
+
+  data = g_bytes_get_data (contents, &len);
+
+  return g_strndup (data, len);
+}
+
+/* Run the main context until looking up @head gives @expected_contents (which
+ * may be %NULL), failing if it takes too long. */
+static void
+wait_for_ref (Fixture     *fixture,
+              const gchar *head,
+              const gchar *expected_contents)
+{
+  gint64 deadline = g_get_monotonic_time () + EVENT_TIMEOUT_USEC;
+
+  while (TRUE)
+    {
+      g_autofree gchar *contents = lookup (fixture, head);
+
+      if (g_strcmp0 (contents, expected_contents) == 0)
+        break;
+
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      g_main_context_iteration (NULL, FALSE);
+      g_usleep (10 * 1000);
+    }
+}
+
+/* Test that local refs shadow the served remote’s refs, which are served
+ * otherwise, and that other remotes’ refs are not served. */
+static void
+test_ref_table_lookup (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const struct
+    {
+      const gchar *head;
+      const gchar *expected_contents;  /* NULL if not found */
+    }
+  vectors[] =
+    {
+      { "os/eos/master", "local\n" },
+      { "os/eos/other", "other\n" },
+      { "os/eos/missing", NULL },
+      { "os/eos", NULL },
+      { "app/org.example", NULL },
+      { "eos/os/eos/master", NULL },
+    };
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (vectors); i++)
+    {
+      g_autofree gchar *contents = NULL;
+
+      g_test_message ("%" G_GSIZE_FORMAT ": %s", i, vectors[i].head);
+
+      contents = lookup (fixture, vectors[i].head);
+      g_assert_cmpstr (contents, ==, vectors[i].expected_contents);
+    }
+}
+
+/* Test that the table is reloaded when a ref is updated, added or deleted,
+ * including in a newly created directory. */
+static void
+test_ref_table_changes (Fixture       *fixture,
+                        gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *contents = lookup (fixture, "os/eos/master");
+
+  g_assert_cmpstr (contents, ==, "local\n");
+
+  /* Updated local and remote refs. */
+  write_file (fixture, "refs/heads/os/eos/master", "local2\n");
+  wait_for_ref (fixture, "os/eos/master", "local2\n");
+
+  write_file (fixture, "refs/remotes/eos/os/eos/other", "other2\n");
+  wait_for_ref (fixture, "os/eos/other", "other2\n");
+
+  /* New refs, including in directories which were not there before. */
+  write_file (fixture, "refs/heads/os/eos/new", "new\n");
+  wait_for_ref (fixture, "os/eos/new", "new\n");
+
+  write_file (fixture, "refs/heads/runtime/org.example/master", "runtime\n");
+  wait_for_ref (fixture, "runtime/org.example/master", "runtime\n");
+
+  write_file (fixture, "refs/remotes/eos/app/org.example/master", "app\n");
+  wait_for_ref (fixture, "app/org.example/master", "app\n");
+
+  /* Deleting a local ref reveals the remote ref it shadowed. */
+  delete_file (fixture, "refs/heads/os/eos/master");
+  wait_for_ref (fixture, "os/eos/master", "remote\n");
+
+  delete_file (fixture, "refs/remotes/eos/os/eos/master");
+  wait_for_ref (fixture, "os/eos/master", NULL);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/ref-table/lookup", Fixture, NULL, setup,
+              test_ref_table_lookup, teardown);
+  g_test_add ("/ref-table/changes", Fixture, NULL, setup,
+              test_ref_table_changes, teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,221 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+/* Microbenchmark for eus_route_parse(). It routes --iterations synthetic
+ * request paths, with the mix of object types seen in a metadata-heavy pull,
+ * and prints how many paths per second it handles. For comparison, the same
+ * paths are also routed by the previous implementation, which used chains of
+ * prefix and suffix checks and a #GRegex to extract the checksums of .filez
+ * objects. */
+
+#include <glib.h>
+#include <libeos-update-server/router.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of distinct paths to cycle through. */
+#define N_PATHS 4096
+
+static GPtrArray *
+generate_paths (void)
+{
+  static const gchar *const suffixes[] =
+    {
+      ".dirtree", ".dirtree", ".dirtree", ".dirmeta", ".filez", ".filez",
+      ".filez", ".filez", ".commit", ".commitmeta", ".sizes2",
+    };
+  g_autoptr(GRand) rand = g_rand_new_with_seed (0);
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+  gsize i, j;
+
+  for (i = 0; i < N_PATHS; i++)
+    {
+      gchar checksum[65];
+      guint choice = g_rand_int_range (rand, 0, 100);
+
+      for (j = 0; j < 64; j++)
+        checksum[j] = "0123456789abcdef"[g_rand_int_range (rand, 0, 16)];
+      checksum[64] = '\0';
+
+      if (choice < 95)
+        g_ptr_array_add (paths,
+                         g_strdup_printf ("/objects/%.2s/%s%s", checksum,
+                                          checksum + 2,
+                                          suffixes[g_rand_int_range (rand, 0, G_N_ELEMENTS (suffixes))]));
+      else if (choice < 97)
+        g_ptr_array_add (paths,
+                         g_strdup_printf ("/deltas/%.2s/%s/superblock",
+                                          checksum, checksum + 2));
+      else if (choice < 98)
+        g_ptr_array_add (paths, g_strdup ("/summary"));
+      else if (choice < 99)
+        g_ptr_array_add (paths, g_strdup ("/refs/heads/os/eos/amd64/master"));
+      else
+        g_ptr_array_add (paths, g_strdup ("/config"));
+    }
+
+  return paths;
+}
+
+/* The previous routing code from repo.c, minus the handlers. Returns an
+ * arbitrary number so the work is not optimised away. */
+static guint
+route_legacy (const gchar *path)
+{
+  static const gchar *const as_is_suffixes[] =
+    {
+      ".commit", ".commitmeta", ".dirmeta", ".dirtree", ".sig", ".sizes2", NULL
+    };
+  static GRegex *regex = NULL;
+  guint idx;
+
+  if (regex == NULL)
+    regex = g_regex_new ("^/objects/([a-fA-F0-9]{2})/([a-fA-F0-9]{62})\\.filez$",
+                         G_REGEX_OPTIMIZE, 0, NULL);
+
+  if (strstr (path, "..") != NULL)
+    return 1;
+
+  if (g_str_has_prefix (path, "/objects/") && g_str_has_suffix (path, ".filez"))
+    {
+      g_autoptr(GMatchInfo) match = NULL;
+      g_autofree gchar *first_two = NULL;
+      g_autofree gchar *rest = NULL;
+      g_autofree gchar *checksum = NULL;
+
+      if (!g_regex_match (regex, path, 0, &match))
+        return 0;
+
+      first_two = g_match_info_fetch (match, 1);
+      rest = g_match_info_fetch (match, 2);
+      checksum = g_strdup_printf ("%s%s", first_two, rest);
+
+      return checksum[0];
+    }
+
+  if (g_str_has_prefix (path, "/objects/"))
+    {
+      for (idx = 0; as_is_suffixes[idx]; ++idx)
+        if (g_str_has_suffix (path, as_is_suffixes[idx]))
+          return 2 + idx;
+
+      return 0;
+    }
+
+  if (g_str_has_prefix (path, "/deltas/") ||
+      g_str_has_prefix (path, "/extensions/") ||
+      g_str_equal (path, "/summary") ||
+      g_str_equal (path, "/summary.sig"))
+    return 10;
+  else if (g_strcmp0 (path, "/config") == 0)
+    return 11;
+  else if (g_str_has_prefix (path, "/refs/heads/"))
+    return 12;
+
+  return 0;
+}
+
+static guint
+route_new (const gchar *path)
+{
+  EusRoute route;
+
+  eus_route_parse (path, &route);
+
+  return route.kind + ((route.kind == EUS_ROUTE_OBJECT) ? route.checksum[0] : 0);
+}
+
+typedef guint (*RouteFunc) (const gchar *path);
+
+/* Route @n_iterations paths with @func, returning the paths per second. */
+static gdouble
+run (RouteFunc  func,
+     GPtrArray *paths,
+     guint64    n_iterations,
+     guint     *out_sum)
+{
+  gint64 start, end;
+  guint64 i;
+  guint sum = 0;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < n_iterations; i++)
+    sum += func (g_ptr_array_index (paths, i % paths->len));
+
+  end = g_get_monotonic_time ();
+
+  *out_sum = sum;
+  return (gdouble) n_iterations / ((gdouble) MAX (end - start, 1) / G_USEC_PER_SEC);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) paths = NULL;
+  gint64 n_iterations = 10000000;
+  gboolean skip_legacy = FALSE;
+  gdouble rate;
+  guint sum;
+  const GOptionEntry entries[] =
+    {
+      { "iterations", 'n', 0, G_OPTION_ARG_INT64, &n_iterations,
+        "Number of paths to route (default: 10000000)", "N" },
+      { "skip-legacy", 0, 0, G_OPTION_ARG_NONE, &skip_legacy,
+        "Do not benchmark the previous implementation", NULL },
+      { NULL }
+    };
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("— benchmark routing request paths");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (n_iterations <= 0)
+    {
+      g_printerr ("Invalid --iterations\n");
+      return EXIT_FAILURE;
+    }
+
+  paths = generate_paths ();
+
+  rate = run (route_new, paths, n_iterations, &sum);
+  g_print ("%-8s %14.0f paths/s  (checksum %u)\n", "Router", rate, sum);
+
+  if (!skip_legacy)
+    {
+      rate = run (route_legacy, paths, n_iterations, &sum);
+      g_print ("%-8s %14.0f paths/s  (checksum %u)\n", "Legacy", rate, sum);
+    }
+
+  return EXIT_SUCCESS;
+}
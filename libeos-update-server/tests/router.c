@@ -0,0 +1,201 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <glib.h>
+#include <libeos-update-server/router.h>
+#include <locale.h>
+#include <string.h>
+
+/* A checksum split as in an object path, and in full. */
+#define CHECKSUM_DIR "0f"
+#define CHECKSUM_REST "1e2d3c4b5a69788796a5b4c3d2e1f00112233445566778899aabbccddeeff0"
+#define CHECKSUM CHECKSUM_DIR CHECKSUM_REST
+#define OBJECT_PATH(suffix) "/objects/" CHECKSUM_DIR "/" CHECKSUM_REST suffix
+
+typedef struct
+{
+  const gchar *path;
+  EusRouteKind kind;
+  EusObjectKind object_kind;  /* only checked for %EUS_ROUTE_OBJECT */
+  gboolean immutable;
+  gboolean bulk;
+  const gchar *subpath;  /* (nullable) */
+} RouteTestData;
+
+static const RouteTestData route_test_data[] =
+  {
+    /* Objects of each type. */
+    { OBJECT_PATH (".filez"), EUS_ROUTE_OBJECT, EUS_OBJECT_FILEZ, FALSE, TRUE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".filez" },
+    { OBJECT_PATH (".commit"), EUS_ROUTE_OBJECT, EUS_OBJECT_COMMIT, TRUE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".commit" },
+    { OBJECT_PATH (".commitmeta"), EUS_ROUTE_OBJECT, EUS_OBJECT_COMMITMETA, FALSE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".commitmeta" },
+    { OBJECT_PATH (".dirmeta"), EUS_ROUTE_OBJECT, EUS_OBJECT_DIRMETA, TRUE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".dirmeta" },
+    { OBJECT_PATH (".dirtree"), EUS_ROUTE_OBJECT, EUS_OBJECT_DIRTREE, TRUE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".dirtree" },
+    { OBJECT_PATH (".sig"), EUS_ROUTE_OBJECT, EUS_OBJECT_SIG, FALSE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".sig" },
+    { OBJECT_PATH (".sizes2"), EUS_ROUTE_OBJECT, EUS_OBJECT_SIZES2, TRUE, FALSE,
+      CHECKSUM_DIR "/" CHECKSUM_REST ".sizes2" },
+
+    /* Unknown or partial suffixes. */
+    { OBJECT_PATH (".file"), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { OBJECT_PATH (".filezz"), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { OBJECT_PATH (".commit/"), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { OBJECT_PATH (".dirtree.tmp"), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { OBJECT_PATH (""), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { OBJECT_PATH ("."), EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+
+    /* Invalid checksums: upper case, short, long, non-hex, or split in the
+     * wrong place. */
+    { "/objects/0F/" CHECKSUM_REST ".commit", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/1E2D3C4B5A69788796A5B4C3D2E1F00112233445566778899AABBCCDDEEFF0.commit",
+      EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/1e2d3c4b5a69788796a5b4c3d2e1f00112233445566778899aabbccddeeff.commit",
+      EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/1e2d3c4b5a69788796a5b4c3d2e1f00112233445566778899aabbccddeeff01.commit",
+      EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/1e2d3c4b5a69788796a5b4c3d2e1f00112233445566778899aabbccddeeffg.commit",
+      EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/0/f1e2d3c4b5a69788796a5b4c3d2e1f00112233445566778899aabbccddeeff0.commit",
+      EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM ".commit", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/0", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+
+    /* Attempts to escape the repository. */
+    { "/..", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+    { "/../config", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+    { "/deltas/../../etc/passwd", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+    { "/extensions/eos/..", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+    { "/refs/heads/..", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+    { "/objects/" CHECKSUM_DIR "/../../config", EUS_ROUTE_FORBIDDEN, 0, FALSE, FALSE, NULL },
+
+    /* Exact routes only match the whole path. */
+    { "/summary", EUS_ROUTE_SUMMARY, 0, FALSE, FALSE, "" },
+    { "/summary.sig", EUS_ROUTE_SUMMARY_SIG, 0, FALSE, FALSE, "" },
+    { "/config", EUS_ROUTE_CONFIG, 0, FALSE, FALSE, "" },
+    { "/summary/", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/summary.si", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/summary.sig2", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/summaryx", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/config.bak", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/confi", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+
+    /* Prefix routes match anything under them. */
+    { "/deltas/ab/cdef/superblock", EUS_ROUTE_DELTA, 0, FALSE, FALSE,
+      "ab/cdef/superblock" },
+    { "/deltas/ab/cdef/0", EUS_ROUTE_DELTA, 0, FALSE, TRUE, "ab/cdef/0" },
+    { "/extensions/eos/eos-summary", EUS_ROUTE_EXTENSION, 0, FALSE, FALSE,
+      "eos/eos-summary" },
+    { "/refs/heads/os/eos/amd64/master", EUS_ROUTE_REFS_HEADS, 0, FALSE, FALSE,
+      "os/eos/amd64/master" },
+    { "/deltas", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/refs/heads", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/refs/remotes/origin/master", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+
+    /* Anything else. */
+    { "", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "/tmp/cache", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+    { "objects/" CHECKSUM_DIR "/" CHECKSUM_REST ".commit", EUS_ROUTE_NOT_FOUND, 0, FALSE, FALSE, NULL },
+  };
+
+/* Test each path in route_test_data is parsed as expected. */
+static void
+test_router_parse (void)
+{
+  gsize i;
+
+  for (i = 0; i < G_N_ELEMENTS (route_test_data); i++)
+    {
+      const RouteTestData *data = &route_test_data[i];
+      EusRoute route;
+
+      g_test_message ("%" G_GSIZE_FORMAT ": %s", i, data->path);
+
+      /* Make sure nothing is left over from the previous path. */
+      memset (&route, 0xaa, sizeof (route));
+      eus_route_parse (data->path, &route);
+
+      g_assert_cmpint (route.kind, ==, data->kind);
+      g_assert_cmpint (route.immutable, ==, data->immutable);
+      g_assert_cmpint (eus_route_is_bulk (&route), ==, data->bulk);
+      g_assert_cmpint (eus_route_get_priority (&route), ==,
+                       data->bulk ? EUS_ROUTE_BULK_PRIORITY : G_PRIORITY_DEFAULT);
+
+      /* The subpath points into the parsed path. */
+      if (data->subpath != NULL)
+        {
+          g_assert_cmpstr (route.subpath, ==, data->subpath);
+          g_assert_true (route.subpath >= data->path &&
+                         route.subpath <= data->path + strlen (data->path));
+        }
+
+      if (data->kind == EUS_ROUTE_OBJECT)
+        {
+          g_assert_cmpint (route.object_kind, ==, data->object_kind);
+          g_assert_cmpstr (route.checksum_string, ==, CHECKSUM);
+          g_assert_true (g_str_has_suffix (data->path,
+                                           eus_object_kind_to_suffix (route.object_kind)));
+        }
+    }
+}
+
+/* Test that object checksums are decoded into bytes, including the first
+ * byte, which is split from the rest by the ‘/’. */
+static void
+test_router_checksum (void)
+{
+  const guint8 expected[] =
+    {
+      0x0f, 0x1e, 0x2d, 0x3c, 0x4b, 0x5a, 0x69, 0x78,
+      0x87, 0x96, 0xa5, 0xb4, 0xc3, 0xd2, 0xe1, 0xf0,
+      0x01, 0x12, 0x23, 0x34, 0x45, 0x56, 0x67, 0x78,
+      0x89, 0x9a, 0xab, 0xbc, 0xcd, 0xde, 0xef, 0xf0,
+    };
+  EusRoute route;
+
+  eus_route_parse (OBJECT_PATH (".dirtree"), &route);
+
+  g_assert_cmpint (route.kind, ==, EUS_ROUTE_OBJECT);
+  g_assert_cmpmem (route.checksum, sizeof (route.checksum),
+                   expected, sizeof (expected));
+  g_assert_cmpuint (strlen (route.checksum_string), ==, 64);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/router/parse", test_router_parse);
+  g_test_add_func ("/router/checksum", test_router_checksum);
+
+  return g_test_run ();
+}
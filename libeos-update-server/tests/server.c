@@ -0,0 +1,1225 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2017 Endless Mobile, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Authors:
+ *  - Philip Withnall <withnall@endlessm.com>
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <ifaddrs.h>
+#include <libeos-update-server/client-table.h>
+#include <libeos-update-server/mapped-file-cache.h>
+#include <libeos-update-server/metrics.h>
+#include <libeos-update-server/repo.h>
+#include <libeos-update-server/scheduler.h>
+#include <libeos-update-server/server.h>
+#include <libsoup/soup.h>
+#include <locale.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <ostree.h>
+#include <string.h>
+
+/* Size of the file committed to the test repository. It is big enough to take
+ * a while to compress, so concurrent requests for it overlap. */
+#define BIG_FILE_SIZE (4 * 1024 * 1024)
+
+/* How long to wait for the server to finish handling requests before
+ * failing. */
+#define EVENT_TIMEOUT_USEC (30 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  gchar *tmp_dir;
+  gchar *repo_path;
+  gchar *commit_checksum;
+  gchar *big_checksum;  /* of the file object for ‘big’ in the commit */
+
+  SoupServer *soup_server;
+  guint port;
+  EusServer *server;  /* (nullable) created by each test */
+  SoupSession *session;
+} Fixture;
+
+/* Generate @size bytes of hex digits, which deflate to about half their size,
+ * but not quickly. The output is the same every time. */
+static GBytes *
+make_contents (gsize size)
+{
+  g_autoptr(GRand) rand = g_rand_new_with_seed (size);
+  gchar *data = g_malloc (size);
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    data[i] = "0123456789abcdef"[g_rand_int_range (rand, 0, 16)];
+
+  return g_bytes_new_take (data, size);
+}
+
+static void
+write_file (const gchar *path,
+            GBytes      *contents)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *dir_path = g_path_get_dirname (path);
+
+  g_assert_cmpint (g_mkdir_with_parents (dir_path, 0755), ==, 0);
+  g_file_set_contents (path, g_bytes_get_data (contents, NULL),
+                       g_bytes_get_size (contents), &error);
+  g_assert_no_error (error);
+}
+
+/* Commit a tree containing a big file to @repo, as the ‘test’ ref. */
+static void
+commit_tree (Fixture    *fixture,
+             OstreeRepo *repo)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *src_path = g_build_filename (fixture->tmp_dir, "src", NULL);
+  g_autofree gchar *big_path = g_build_filename (src_path, "big", NULL);
+  g_autoptr(GBytes) big_contents = make_contents (BIG_FILE_SIZE);
+  g_autoptr(GFile) src_dir = NULL;
+  g_autoptr(OstreeRepoCommitModifier) modifier = NULL;
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) big = NULL;
+
+  write_file (big_path, big_contents);
+
+  /* The files are committed as owned by the current user and without
+   * xattrs, so a bare repository can be written to without root, on any
+   * file system. */
+  src_dir = g_file_new_for_path (src_path);
+  modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
+                                              NULL, NULL, NULL);
+  mtree = ostree_mutable_tree_new ();
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_directory_to_mtree (repo, src_dir, mtree, modifier,
+                                        NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "Test", NULL, NULL,
+                            OSTREE_REPO_FILE (root), &fixture->commit_checksum,
+                            NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_transaction_set_ref (repo, NULL, "test", fixture->commit_checksum);
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  big = g_file_get_child (root, "big");
+  ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (big), &error);
+  g_assert_no_error (error);
+  fixture->big_checksum = g_strdup (ostree_repo_file_get_checksum (OSTREE_REPO_FILE (big)));
+}
+
+/* Set up a bare repository with one commit and a summary, a #SoupServer
+ * listening on a loopback port for the test to create an #EusServer for, and
+ * a #SoupSession to make requests to it with. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) repo_dir = NULL;
+  g_autoptr(OstreeRepo) repo = NULL;
+  GSList *uris;
+
+  fixture->tmp_dir = g_dir_make_tmp ("eos-update-server-tests-server-XXXXXX",
+                                     &error);
+  g_assert_no_error (error);
+
+  fixture->repo_path = g_build_filename (fixture->tmp_dir, "repo", NULL);
+  repo_dir = g_file_new_for_path (fixture->repo_path);
+  repo = ostree_repo_new (repo_dir);
+  ostree_repo_create (repo, OSTREE_REPO_MODE_BARE, NULL, &error);
+  g_assert_no_error (error);
+
+  commit_tree (fixture, repo);
+  ostree_repo_regenerate_summary (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  fixture->soup_server = soup_server_new (NULL, NULL);
+  soup_server_listen_local (fixture->soup_server, 0,
+                            SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (fixture->soup_server);
+  g_assert_nonnull (uris);
+  fixture->port = soup_uri_get_port (uris->data);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  fixture->session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS, 64,
+                                                    SOUP_SESSION_MAX_CONNS_PER_HOST, 32,
+                                                    NULL);
+}
+
+static void
+remove_recursive (const gchar *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const gchar *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_assert_cmpint (g_unlink (path), ==, 0);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_recursive (child);
+    }
+
+  g_assert_cmpint (g_rmdir (path), ==, 0);
+}
+
+/* Inverse of setup(). */
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  soup_session_abort (fixture->session);
+  g_clear_object (&fixture->session);
+  g_clear_object (&fixture->server);
+  soup_server_disconnect (fixture->soup_server);
+  g_clear_object (&fixture->soup_server);
+
+  while (g_main_context_iteration (NULL, FALSE));
+
+  remove_recursive (fixture->tmp_dir);
+  g_free (fixture->big_checksum);
+  g_free (fixture->commit_checksum);
+  g_free (fixture->repo_path);
+  g_free (fixture->tmp_dir);
+}
+
+/* Serve the test repository from @server at the root. It is opened afresh
+ * for each server, as eos-update-server does. */
+static void
+add_repo (Fixture   *fixture,
+          EusServer *server)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) repo_dir = g_file_new_for_path (fixture->repo_path);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (repo_dir);
+  g_autoptr(EusRepo) eus_repo = NULL;
+
+  ostree_repo_open (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  eus_repo = eus_repo_new (repo, "", "eos", NULL, &error);
+  g_assert_no_error (error);
+  eus_server_add_repo (server, eus_repo);
+}
+
+/* Build the path of the object @checksum with @suffix, such as `filez`. */
+static gchar *
+build_object_path (const gchar *checksum,
+                   const gchar *suffix)
+{
+  return g_strdup_printf ("/objects/%.2s/%s.%s", checksum, checksum + 2,
+                          suffix);
+}
+
+/* Create a GET request for @path on the fixture’s server. */
+static SoupMessage *
+new_message (Fixture     *fixture,
+             const gchar *path)
+{
+  g_autofree gchar *uri = g_strdup_printf ("http://127.0.0.1:%u%s",
+                                           fixture->port, path);
+
+  return soup_message_new (SOUP_METHOD_GET, uri);
+}
+
+static void
+count_done_cb (SoupSession *session,
+               SoupMessage *msg,
+               gpointer     user_data)
+{
+  guint *n_done = user_data;
+
+  *n_done += 1;
+}
+
+/* Send @msg, and iterate the main context until its response is complete. */
+static void
+send_message (Fixture     *fixture,
+              SoupMessage *msg)
+{
+  guint n_done = 0;
+
+  soup_session_queue_message (fixture->session, g_object_ref (msg),
+                              count_done_cb, &n_done);
+
+  while (n_done == 0)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Get the value of the sample @name, including its labels, from the
+ * server’s metrics. */
+static guint64
+get_metric (Fixture     *fixture,
+            const gchar *name)
+{
+  g_autofree gchar *text = eus_server_format_metrics (fixture->server);
+  g_auto(GStrv) lines = g_strsplit (text, "\n", -1);
+  gsize name_len = strlen (name);
+  gsize i;
+
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (strncmp (lines[i], name, name_len) == 0 && lines[i][name_len] == ' ')
+        return g_ascii_strtoull (lines[i] + name_len + 1, NULL, 10);
+    }
+
+  g_test_message ("Metric %s not found in:\n%s", name, text);
+  g_assert_not_reached ();
+}
+
+/* Iterate the main context until @server has no requests in progress. The
+ * server may finish a request after its client has seen the whole response,
+ * so this is needed before checking the request accounting. */
+static void
+wait_for_idle (EusServer *server)
+{
+  gint64 deadline = g_get_monotonic_time () + EVENT_TIMEOUT_USEC;
+
+  while (eus_server_get_pending_requests (server) > 0)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (1000);
+    }
+}
+
+/* Test that concurrent requests for the same .filez object share one
+ * compression stream, and all get the same response. The object takes far
+ * longer to compress than the requests take to arrive, so all but the first
+ * join its stream. */
+static void
+test_server_filez_coalesced (Fixture       *fixture,
+                             gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = build_object_path (fixture->big_checksum, "filez");
+  SoupMessage *msgs[4];
+  guint n_done = 0;
+  gsize i;
+
+  fixture->server = g_object_new (EUS_TYPE_SERVER,
+                                  "server", fixture->soup_server,
+                                  "min-compression-level", 9,
+                                  "max-compression-level", 9,
+                                  NULL);
+  add_repo (fixture, fixture->server);
+
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    {
+      msgs[i] = new_message (fixture, path);
+      soup_session_queue_message (fixture->session, g_object_ref (msgs[i]),
+                                  count_done_cb, &n_done);
+    }
+
+  while (n_done < G_N_ELEMENTS (msgs))
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    {
+      g_test_message ("Request %" G_GSIZE_FORMAT, i);
+      g_assert_cmpuint (msgs[i]->status_code, ==, SOUP_STATUS_OK);
+      g_assert_cmpint (msgs[i]->response_body->length, >, 0);
+      g_assert_cmpint (msgs[i]->response_body->length, ==,
+                       msgs[0]->response_body->length);
+      g_assert_cmpint (memcmp (msgs[i]->response_body->data,
+                               msgs[0]->response_body->data,
+                               msgs[0]->response_body->length), ==, 0);
+      g_assert_cmpstr (soup_message_headers_get_one (msgs[i]->response_headers, "ETag"), ==,
+                       soup_message_headers_get_one (msgs[0]->response_headers, "ETag"));
+    }
+
+  wait_for_idle (fixture->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_filez_lookups_total{result=\"compressed\"}"), ==, 1);
+  g_assert_cmpuint (get_metric (fixture, "eus_filez_lookups_total{result=\"shared_stream\"}"), ==,
+                    G_N_ELEMENTS (msgs) - 1);
+
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    g_object_unref (msgs[i]);
+}
+
+/* Assert that @msg’s response body is bytes @start to @end (inclusive) of
+ * @full’s. */
+static void
+assert_body_range (SoupMessage *msg,
+                   SoupMessage *full,
+                   goffset      start,
+                   goffset      end)
+{
+  g_assert_cmpint (msg->response_body->length, ==, end - start + 1);
+  g_assert_cmpint (memcmp (msg->response_body->data,
+                           full->response_body->data + start,
+                           end - start + 1), ==, 0);
+}
+
+/* Test that a .filez object is sent with a strong ETag, and once its
+ * compressed size is known, with a Content-Length; and that a download of it
+ * can then be resumed with a Range request, as long as the If-Range header
+ * matches the ETag. */
+static void
+test_server_filez_range (Fixture       *fixture,
+                         gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = build_object_path (fixture->big_checksum, "filez");
+  g_autofree gchar *etag_prefix = g_strdup_printf ("\"%s.z", fixture->big_checksum);
+  g_autoptr(SoupMessage) full = NULL;
+  g_autoptr(SoupMessage) sized = NULL;
+  g_autoptr(SoupMessage) resumed = NULL;
+  g_autoptr(SoupMessage) other_version = NULL;
+  g_autoptr(SoupMessage) no_if_range = NULL;
+  g_autoptr(SoupMessage) unsatisfiable = NULL;
+  const gchar *etag;
+  goffset start, end, total;
+
+  fixture->server = g_object_new (EUS_TYPE_SERVER,
+                                  "server", fixture->soup_server,
+                                  "min-compression-level", 6,
+                                  "max-compression-level", 6,
+                                  NULL);
+  add_repo (fixture, fixture->server);
+
+  /* The first response is sent as the object is compressed, so its size is
+   * not known up front. */
+  full = new_message (fixture, path);
+  send_message (fixture, full);
+  g_assert_cmpuint (full->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (soup_message_headers_get_encoding (full->response_headers), ==,
+                   SOUP_ENCODING_CHUNKED);
+  etag = soup_message_headers_get_one (full->response_headers, "ETag");
+  g_assert_nonnull (etag);
+  g_assert_true (g_str_has_prefix (etag, etag_prefix));
+  g_assert_cmpint (full->response_body->length, >, 2000);
+  wait_for_idle (fixture->server);
+
+  /* Compressing the object again at the same level gives the same bytes, so
+   * now its size is known. */
+  sized = new_message (fixture, path);
+  send_message (fixture, sized);
+  g_assert_cmpuint (sized->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (soup_message_headers_get_encoding (sized->response_headers), ==,
+                   SOUP_ENCODING_CONTENT_LENGTH);
+  g_assert_cmpint (soup_message_headers_get_content_length (sized->response_headers), ==,
+                   full->response_body->length);
+  g_assert_cmpstr (soup_message_headers_get_one (sized->response_headers, "Accept-Ranges"), ==,
+                   "bytes");
+  g_assert_cmpstr (soup_message_headers_get_one (sized->response_headers, "ETag"), ==,
+                   etag);
+  assert_body_range (sized, full, 0, full->response_body->length - 1);
+
+  /* Resuming the download gets the rest of the same bytes. */
+  resumed = new_message (fixture, path);
+  soup_message_headers_set_range (resumed->request_headers, 1000, 1999);
+  soup_message_headers_replace (resumed->request_headers, "If-Range", etag);
+  send_message (fixture, resumed);
+  g_assert_cmpuint (resumed->status_code, ==, SOUP_STATUS_PARTIAL_CONTENT);
+  g_assert_true (soup_message_headers_get_content_range (resumed->response_headers,
+                                                         &start, &end, &total));
+  g_assert_cmpint (start, ==, 1000);
+  g_assert_cmpint (end, ==, 1999);
+  g_assert_cmpint (total, ==, full->response_body->length);
+  assert_body_range (resumed, full, 1000, 1999);
+
+  /* A partial copy of some other version has to be replaced in full, and so
+   * does one of an unknown version. */
+  other_version = new_message (fixture, path);
+  soup_message_headers_set_range (other_version->request_headers, 1000, 1999);
+  soup_message_headers_replace (other_version->request_headers, "If-Range",
+                                "\"other\"");
+  send_message (fixture, other_version);
+  g_assert_cmpuint (other_version->status_code, ==, SOUP_STATUS_OK);
+  assert_body_range (other_version, full, 0, full->response_body->length - 1);
+
+  no_if_range = new_message (fixture, path);
+  soup_message_headers_set_range (no_if_range->request_headers, 1000, 1999);
+  send_message (fixture, no_if_range);
+  g_assert_cmpuint (no_if_range->status_code, ==, SOUP_STATUS_OK);
+  assert_body_range (no_if_range, full, 0, full->response_body->length - 1);
+
+  /* A range past the end of the object cannot be satisfied. */
+  unsatisfiable = new_message (fixture, path);
+  soup_message_headers_set_range (unsatisfiable->request_headers,
+                                  full->response_body->length, -1);
+  soup_message_headers_replace (unsatisfiable->request_headers, "If-Range", etag);
+  send_message (fixture, unsatisfiable);
+  g_assert_cmpuint (unsatisfiable->status_code, ==,
+                    SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+}
+
+/* Send a request for @path with @header set to @value, and return the
+ * response status. */
+static guint
+send_conditional (Fixture     *fixture,
+                  const gchar *path,
+                  const gchar *header,
+                  const gchar *value)
+{
+  g_autoptr(SoupMessage) msg = new_message (fixture, path);
+
+  g_test_message ("%s: %s", header, value);
+  soup_message_headers_replace (msg->request_headers, header, value);
+  send_message (fixture, msg);
+
+  if (msg->status_code == SOUP_STATUS_NOT_MODIFIED)
+    g_assert_cmpint (msg->response_body->length, ==, 0);
+
+  return msg->status_code;
+}
+
+/* Test that content-addressed objects are sent with a strong ETag and as
+ * immutable, and that If-None-Match requests for them are answered with 304
+ * Not Modified when the ETag matches. */
+static void
+test_server_not_modified_object (Fixture       *fixture,
+                                 gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = build_object_path (fixture->commit_checksum, "commit");
+  g_autofree gchar *expected_etag = g_strdup_printf ("\"%s.commit\"",
+                                                     fixture->commit_checksum);
+  g_autofree gchar *weak_etag = g_strconcat ("W/", expected_etag, NULL);
+  g_autofree gchar *etag_list = g_strconcat ("\"other\", ", expected_etag, NULL);
+  g_autoptr(SoupMessage) msg = NULL;
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  msg = new_message (fixture, path);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (msg->response_body->length, >, 0);
+  g_assert_cmpstr (soup_message_headers_get_one (msg->response_headers, "ETag"), ==,
+                   expected_etag);
+  g_assert_true (soup_message_headers_header_contains (msg->response_headers,
+                                                       "Cache-Control", "immutable"));
+
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", expected_etag), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", weak_etag), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", etag_list), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", "*"), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", "\"other\""), ==,
+                    SOUP_STATUS_OK);
+}
+
+/* Test that a client with a .filez object compressed at any level gets 304
+ * Not Modified, without the object being compressed again. */
+static void
+test_server_not_modified_filez (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = build_object_path (fixture->big_checksum, "filez");
+  g_autofree gchar *etag = g_strdup_printf ("\"%s.z3\"", fixture->big_checksum);
+  g_autofree gchar *bad_level_etag = g_strdup_printf ("\"%s.z\"", fixture->big_checksum);
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", etag), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  wait_for_idle (fixture->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_filez_lookups_total{result=\"compressed\"}"), ==, 0);
+
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", bad_level_etag), ==,
+                    SOUP_STATUS_OK);
+}
+
+/* Test that the summary, which changes, is sent with Last-Modified rather
+ * than as immutable, and that If-Modified-Since requests for it are answered
+ * with 304 Not Modified if it has not changed since. */
+static void
+test_server_not_modified_summary (Fixture       *fixture,
+                                  gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(SoupMessage) msg = NULL;
+  const gchar *last_modified;
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  msg = new_message (fixture, "/summary");
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+  g_assert_false (soup_message_headers_header_contains (msg->response_headers,
+                                                        "Cache-Control", "immutable"));
+  last_modified = soup_message_headers_get_one (msg->response_headers, "Last-Modified");
+  g_assert_nonnull (last_modified);
+
+  g_assert_cmpuint (send_conditional (fixture, "/summary", "If-Modified-Since", last_modified), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+  g_assert_cmpuint (send_conditional (fixture, "/summary", "If-Modified-Since",
+                                      "Thu, 01 Jan 1970 00:00:01 GMT"), ==,
+                    SOUP_STATUS_OK);
+  g_assert_cmpuint (send_conditional (fixture, "/summary", "If-Modified-Since", "invalid"), ==,
+                    SOUP_STATUS_OK);
+}
+
+/* Test that static delta files, which can be regenerated with different
+ * contents, are sent with an ETag which changes when they do, and not as
+ * immutable. */
+static void
+test_server_not_modified_delta (Fixture       *fixture,
+                                gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *path = "/deltas/ab/cdef/0";
+  g_autofree gchar *raw_path = g_build_filename (fixture->repo_path, path, NULL);
+  g_autoptr(GBytes) contents = make_contents (1024);
+  g_autoptr(GBytes) new_contents = make_contents (2048);
+  g_autoptr(SoupMessage) msg = NULL;
+  g_autofree gchar *etag = NULL;
+
+  write_file (raw_path, contents);
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  msg = new_message (fixture, path);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+  g_assert_false (soup_message_headers_header_contains (msg->response_headers,
+                                                        "Cache-Control", "immutable"));
+  g_assert_nonnull (soup_message_headers_get_one (msg->response_headers, "Last-Modified"));
+  etag = g_strdup (soup_message_headers_get_one (msg->response_headers, "ETag"));
+  g_assert_nonnull (etag);
+
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", etag), ==,
+                    SOUP_STATUS_NOT_MODIFIED);
+
+  /* A regenerated delta has a new ETag. */
+  write_file (raw_path, new_contents);
+  g_assert_cmpuint (send_conditional (fixture, path, "If-None-Match", etag), ==,
+                    SOUP_STATUS_OK);
+}
+
+/* Test that large files are sent in full, with sendfile() where it is
+ * available, and that the requests are accounted for once they finish; and
+ * that connections are kept alive for them unless the client asked for them
+ * to be closed. */
+static void
+test_server_send_file (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *path = "/deltas/ab/cdef/0";
+  g_autofree gchar *raw_path = g_build_filename (fixture->repo_path, path, NULL);
+  g_autoptr(GBytes) contents = make_contents (2 * 1024 * 1024);
+  g_autoptr(SoupMessage) closing = NULL;
+  g_autoptr(SoupMessage) keep_alive = NULL;
+  gsize size = g_bytes_get_size (contents);
+
+  write_file (raw_path, contents);
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  closing = new_message (fixture, path);
+  soup_message_headers_replace (closing->request_headers, "Connection", "close");
+  send_message (fixture, closing);
+  g_assert_cmpuint (closing->status_code, ==, SOUP_STATUS_OK);
+  g_assert_true (soup_message_headers_header_contains (closing->response_headers,
+                                                       "Connection", "close"));
+  g_assert_cmpint (closing->response_body->length, ==, size);
+  g_assert_cmpint (memcmp (closing->response_body->data,
+                           g_bytes_get_data (contents, NULL), size), ==, 0);
+
+  wait_for_idle (fixture->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_total{class=\"delta\"}"), ==, 1);
+  g_assert_cmpuint (get_metric (fixture, "eus_response_bytes_total{class=\"delta\"}"), ==, size);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_aborted_total"), ==, 0);
+  g_assert_cmpuint (get_metric (fixture, "eus_pending_requests"), ==, 0);
+
+  keep_alive = new_message (fixture, path);
+  send_message (fixture, keep_alive);
+  g_assert_cmpuint (keep_alive->status_code, ==, SOUP_STATUS_OK);
+  g_assert_false (soup_message_headers_header_contains (keep_alive->response_headers,
+                                                        "Connection", "close"));
+  g_assert_cmpint (keep_alive->response_body->length, ==, size);
+  g_assert_cmpint (memcmp (keep_alive->response_body->data,
+                           g_bytes_get_data (contents, NULL), size), ==, 0);
+
+  wait_for_idle (fixture->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_total{class=\"delta\"}"), ==, 2);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_aborted_total"), ==, 0);
+}
+
+static void
+cancel_message_cb (SoupMessage *msg,
+                   gpointer     user_data)
+{
+  Fixture *fixture = user_data;
+
+  soup_session_cancel_message (fixture->session, msg, SOUP_STATUS_CANCELLED);
+}
+
+/* Test that a large file download which the client gives up on is accounted
+ * for as aborted. The upload rate is limited, so the client goes away while
+ * the file is still being sent. */
+static void
+test_server_send_file_aborted (Fixture       *fixture,
+                               gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *path = "/deltas/ab/cdef/0";
+  g_autofree gchar *raw_path = g_build_filename (fixture->repo_path, path, NULL);
+  g_autoptr(GBytes) contents = make_contents (4 * 1024 * 1024);
+  g_autoptr(SoupMessage) msg = NULL;
+
+  write_file (raw_path, contents);
+
+  fixture->server = g_object_new (EUS_TYPE_SERVER,
+                                  "server", fixture->soup_server,
+                                  "max-rate-per-client", (guint64) 256 * 1024,
+                                  NULL);
+  add_repo (fixture, fixture->server);
+
+  msg = new_message (fixture, path);
+  soup_message_headers_replace (msg->request_headers, "Connection", "close");
+  g_signal_connect (msg, "got-headers", (GCallback) cancel_message_cb, fixture);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_CANCELLED);
+
+  wait_for_idle (fixture->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_aborted_total"), ==, 1);
+  g_assert_cmpuint (get_metric (fixture, "eus_pending_requests"), ==, 0);
+}
+
+/* Send a request for @path, and assert that it is rejected with 503 Service
+ * Unavailable and a Retry-After of between @retry_after and one and a half
+ * times that. */
+static void
+assert_rejected (Fixture     *fixture,
+                 const gchar *path,
+                 guint        retry_after)
+{
+  g_autoptr(SoupMessage) msg = new_message (fixture, path);
+  const gchar *header;
+  guint64 value;
+
+  g_test_message ("Requesting %s", path);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_SERVICE_UNAVAILABLE);
+
+  header = soup_message_headers_get_one (msg->response_headers, "Retry-After");
+  g_assert_nonnull (header);
+  value = g_ascii_strtoull (header, NULL, 10);
+  g_assert_cmpuint (value, >=, retry_after);
+  g_assert_cmpuint (value, <=, retry_after + retry_after / 2);
+}
+
+/* Send a request for @path from @session, and return the response status. */
+static guint
+send_from (Fixture     *fixture,
+           SoupSession *session,
+           const gchar *path)
+{
+  g_autoptr(SoupMessage) msg = new_message (fixture, path);
+  guint n_done = 0;
+
+  g_test_message ("Requesting %s", path);
+  soup_session_queue_message (session, g_object_ref (msg), count_done_cb,
+                              &n_done);
+
+  while (n_done == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  return msg->status_code;
+}
+
+/* Test that once the server has #EusServer:max-pending-requests requests in
+ * progress, new pulls are rejected with 503 and a Retry-After header; but
+ * requests from clients which have already started pulling are not, since
+ * ostree fails the whole pull if any of them fails. Requests from another
+ * loopback address count as another client. */
+static void
+test_server_admission (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *delta_path = "/deltas/ab/cdef/0";
+  g_autofree gchar *raw_path = g_build_filename (fixture->repo_path, delta_path, NULL);
+  g_autoptr(GBytes) contents = make_contents (4 * 1024 * 1024);
+  g_autofree gchar *commit_path = build_object_path (fixture->commit_checksum, "commit");
+  g_autoptr(SoupSession) other_session = NULL;
+  SoupAddress *other_address;
+  g_autoptr(SoupMessage) download = NULL;
+  guint n_downloads_done = 0;
+  const guint retry_after = 60;
+
+  write_file (raw_path, contents);
+
+  fixture->server = g_object_new (EUS_TYPE_SERVER,
+                                  "server", fixture->soup_server,
+                                  "max-pending-requests", 1,
+                                  "retry-after", retry_after,
+                                  "max-rate-per-client", (guint64) 64 * 1024,
+                                  NULL);
+  add_repo (fixture, fixture->server);
+
+  other_address = soup_address_new ("127.0.0.2", SOUP_ADDRESS_ANY_PORT);
+  other_session = soup_session_new_with_options (SOUP_SESSION_LOCAL_ADDRESS, other_address,
+                                                 NULL);
+  g_object_unref (other_address);
+
+  /* The other client starts a download which will take a minute at its
+   * limited rate, bringing the server up to its limit. */
+  download = new_message (fixture, delta_path);
+  soup_session_queue_message (other_session, g_object_ref (download),
+                              count_done_cb, &n_downloads_done);
+
+  while (eus_server_get_pending_requests (fixture->server) == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  assert_rejected (fixture, "/config", retry_after);
+  assert_rejected (fixture, "/summary", retry_after);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_rejected_total"), ==, 2);
+
+  g_assert_cmpuint (send_from (fixture, fixture->session, commit_path), ==,
+                    SOUP_STATUS_OK);
+  g_assert_cmpuint (send_from (fixture, other_session, "/config"), ==,
+                    SOUP_STATUS_OK);
+  g_assert_cmpuint (send_from (fixture, other_session, "/summary"), ==,
+                    SOUP_STATUS_OK);
+
+  /* Once the download is cancelled, new pulls are accepted again. */
+  soup_session_abort (other_session);
+  while (n_downloads_done == 0)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (download->status_code, ==, SOUP_STATUS_CANCELLED);
+  wait_for_idle (fixture->server);
+
+  g_assert_cmpuint (send_from (fixture, fixture->session, "/config"), ==,
+                    SOUP_STATUS_OK);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_rejected_total"), ==, 2);
+}
+
+/* Test that the metrics are served to loopback clients, and reflect the
+ * requests the server has handled. */
+static void
+test_server_metrics (Fixture       *fixture,
+                     gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(SoupMessage) msg = NULL;
+  g_autoptr(SoupMessage) post = NULL;
+  g_autoptr(SoupMessage) not_found = NULL;
+  g_autofree gchar *body = NULL;
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  g_assert_cmpuint (send_from (fixture, fixture->session, "/config"), ==,
+                    SOUP_STATUS_OK);
+  wait_for_idle (fixture->server);
+
+  msg = new_message (fixture, EUS_SERVER_METRICS_PATH);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpstr (soup_message_headers_get_content_type (msg->response_headers, NULL), ==,
+                   "text/plain");
+  body = g_strndup (msg->response_body->data, msg->response_body->length);
+  g_assert_nonnull (strstr (body, "# TYPE eus_requests_total counter\n"));
+  g_assert_nonnull (strstr (body, "\neus_requests_total{class=\"config\"} 1\n"));
+  g_assert_nonnull (strstr (body, "\neus_responses_total{status=\"2xx\"} 1\n"));
+
+  post = new_message (fixture, EUS_SERVER_METRICS_PATH);
+  g_object_set (post, SOUP_MESSAGE_METHOD, SOUP_METHOD_POST, NULL);
+  send_message (fixture, post);
+  g_assert_cmpuint (post->status_code, ==, SOUP_STATUS_NOT_IMPLEMENTED);
+
+  not_found = new_message (fixture, EUS_SERVER_METRICS_PATH "/other");
+  send_message (fixture, not_found);
+  g_assert_cmpuint (not_found->status_code, ==, SOUP_STATUS_NOT_FOUND);
+}
+
+/* Get a non-loopback IPv4 address of this machine, or %NULL if it has
+ * none. */
+static GInetAddress *
+get_non_loopback_address (void)
+{
+  struct ifaddrs *addrs, *ifa;
+  GInetAddress *result = NULL;
+
+  if (getifaddrs (&addrs) != 0)
+    return NULL;
+
+  for (ifa = addrs; ifa != NULL && result == NULL; ifa = ifa->ifa_next)
+    {
+      g_autoptr(GSocketAddress) address = NULL;
+      GInetAddress *inet_address;
+
+      if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET ||
+          !(ifa->ifa_flags & IFF_UP))
+        continue;
+
+      address = g_socket_address_new_from_native (ifa->ifa_addr,
+                                                  sizeof (struct sockaddr_in));
+      inet_address = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (address));
+      if (!g_inet_address_get_is_loopback (inet_address))
+        result = g_object_ref (inet_address);
+    }
+
+  freeifaddrs (addrs);
+
+  return result;
+}
+
+/* Test that the metrics are not served to clients on the network. The client
+ * connects to one of the machine’s own network addresses, so the request
+ * comes from that address rather than a loopback one. */
+static void
+test_server_metrics_non_loopback (Fixture       *fixture,
+                                  gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GInetAddress) address = NULL;
+  g_autoptr(GSocketAddress) socket_address = NULL;
+  g_autofree gchar *address_string = NULL;
+  g_autofree gchar *uri = NULL;
+  g_autoptr(SoupMessage) msg = NULL;
+  GSList *uris, *l;
+  guint port = 0;
+
+  address = get_non_loopback_address ();
+  if (address == NULL)
+    {
+      g_test_skip ("No non-loopback IPv4 address to listen on");
+      return;
+    }
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+
+  socket_address = g_inet_socket_address_new (address, 0);
+  soup_server_listen (fixture->soup_server, socket_address, 0, &error);
+  g_assert_no_error (error);
+
+  address_string = g_inet_address_to_string (address);
+  uris = soup_server_get_uris (fixture->soup_server);
+  for (l = uris; l != NULL; l = l->next)
+    {
+      if (g_strcmp0 (soup_uri_get_host (l->data), address_string) == 0)
+        port = soup_uri_get_port (l->data);
+    }
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+  g_assert_cmpuint (port, !=, 0);
+
+  uri = g_strdup_printf ("http://%s:%u%s", address_string, port,
+                         EUS_SERVER_METRICS_PATH);
+  msg = soup_message_new (SOUP_METHOD_GET, uri);
+  send_message (fixture, msg);
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_FORBIDDEN);
+}
+
+/* A second #SoupServer and #EusServer, run in a thread and main context of
+ * their own, as eos-update-server runs its shards. */
+typedef struct
+{
+  GMainContext *context;
+  GMainLoop *loop;
+  SoupServer *soup_server;
+  EusServer *server;
+  guint port;
+  GThread *thread;
+} Shard;
+
+static gpointer
+shard_thread_cb (gpointer user_data)
+{
+  Shard *shard = user_data;
+
+  g_main_context_push_thread_default (shard->context);
+  g_main_loop_run (shard->loop);
+  g_main_context_pop_thread_default (shard->context);
+
+  return NULL;
+}
+
+static gboolean
+quit_loop_cb (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Create a shard serving the test repository, sharing the scheduler, client
+ * table, metrics and mapped file cache of @primary, and start its thread. It
+ * listens on a port of its own, rather than sharing @primary’s with
+ * `SO_REUSEPORT`, so the test can choose which server handles each
+ * request. */
+static Shard *
+shard_new (Fixture   *fixture,
+           EusServer *primary)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusScheduler) scheduler = NULL;
+  g_autoptr(EusClientTable) client_table = NULL;
+  g_autoptr(EusMetrics) metrics = NULL;
+  g_autoptr(EusMappedFileCache) mapped_file_cache = NULL;
+  Shard *shard;
+  GSList *uris;
+
+  g_object_get (primary,
+                "scheduler", &scheduler,
+                "client-table", &client_table,
+                "metrics", &metrics,
+                "mapped-file-cache", &mapped_file_cache,
+                NULL);
+
+  shard = g_new0 (Shard, 1);
+  shard->context = g_main_context_new ();
+  shard->loop = g_main_loop_new (shard->context, FALSE);
+
+  g_main_context_push_thread_default (shard->context);
+  shard->soup_server = soup_server_new (NULL, NULL);
+  shard->server = g_object_new (EUS_TYPE_SERVER,
+                                "server", shard->soup_server,
+                                "scheduler", scheduler,
+                                "client-table", client_table,
+                                "metrics", metrics,
+                                "mapped-file-cache", mapped_file_cache,
+                                NULL);
+  add_repo (fixture, shard->server);
+  soup_server_listen_local (shard->soup_server, 0,
+                            SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+  g_main_context_pop_thread_default (shard->context);
+
+  uris = soup_server_get_uris (shard->soup_server);
+  g_assert_nonnull (uris);
+  shard->port = soup_uri_get_port (uris->data);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  shard->thread = g_thread_new ("eus-shard-1", shard_thread_cb, shard);
+
+  return shard;
+}
+
+/* Stop the shard’s thread, and then free it with its context as the
+ * thread-default, as it was created. */
+static void
+shard_free (Shard *shard)
+{
+  g_autoptr(GSource) source = g_idle_source_new ();
+
+  /* g_main_loop_quit() would be lost if the thread had not started running
+   * the loop yet. */
+  g_source_set_callback (source, quit_loop_cb, shard->loop, NULL);
+  g_source_attach (source, shard->context);
+  g_thread_join (shard->thread);
+
+  g_main_context_push_thread_default (shard->context);
+  g_clear_object (&shard->server);
+  soup_server_disconnect (shard->soup_server);
+  g_clear_object (&shard->soup_server);
+  g_main_context_pop_thread_default (shard->context);
+
+  g_main_loop_unref (shard->loop);
+  g_main_context_unref (shard->context);
+  g_free (shard);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Shard, shard_free)
+
+/* Test that a server run in another thread, sharing the first one’s caches,
+ * client table and metrics, serves the same repository; that its requests are
+ * counted in the shared metrics; and that objects mapped by either server are
+ * served from the shared cache by the other. */
+static void
+test_server_shards (Fixture       *fixture,
+                    gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autofree gchar *path = build_object_path (fixture->commit_checksum, "commit");
+  g_autofree gchar *shard_uri = NULL;
+  g_autoptr(Shard) shard = NULL;
+  g_autoptr(SoupMessage) primary_msg = NULL;
+  g_autoptr(SoupMessage) shard_msg = NULL;
+  SoupMessage *msgs[16];
+  guint n_done = 0;
+  gsize i;
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  add_repo (fixture, fixture->server);
+  shard = shard_new (fixture, fixture->server);
+  shard_uri = g_strdup_printf ("http://127.0.0.1:%u%s", shard->port, path);
+
+  primary_msg = new_message (fixture, path);
+  send_message (fixture, primary_msg);
+  g_assert_cmpuint (primary_msg->status_code, ==, SOUP_STATUS_OK);
+
+  shard_msg = soup_message_new (SOUP_METHOD_GET, shard_uri);
+  send_message (fixture, shard_msg);
+  g_assert_cmpuint (shard_msg->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpint (shard_msg->response_body->length, ==,
+                   primary_msg->response_body->length);
+  g_assert_cmpint (memcmp (shard_msg->response_body->data,
+                           primary_msg->response_body->data,
+                           primary_msg->response_body->length), ==, 0);
+
+  wait_for_idle (fixture->server);
+  wait_for_idle (shard->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_total{class=\"object\"}"), ==, 2);
+  g_assert_cmpuint (get_metric (fixture, "eus_mapped_file_lookups_total{result=\"miss\"}"), ==, 1);
+  g_assert_cmpuint (get_metric (fixture, "eus_mapped_file_lookups_total{result=\"hit\"}"), ==, 1);
+
+  /* Both servers handle requests at once. */
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    {
+      if (i % 2 == 0)
+        msgs[i] = new_message (fixture, path);
+      else
+        msgs[i] = soup_message_new (SOUP_METHOD_GET, shard_uri);
+      soup_session_queue_message (fixture->session, g_object_ref (msgs[i]),
+                                  count_done_cb, &n_done);
+    }
+
+  while (n_done < G_N_ELEMENTS (msgs))
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (msgs); i++)
+    {
+      g_assert_cmpuint (msgs[i]->status_code, ==, SOUP_STATUS_OK);
+      g_assert_cmpint (msgs[i]->response_body->length, ==,
+                       primary_msg->response_body->length);
+      g_object_unref (msgs[i]);
+    }
+
+  wait_for_idle (fixture->server);
+  wait_for_idle (shard->server);
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_total{class=\"object\"}"), ==,
+                    2 + G_N_ELEMENTS (msgs));
+  g_assert_cmpuint (get_metric (fixture, "eus_mapped_file_lookups_total{result=\"hit\"}"), ==,
+                    1 + G_N_ELEMENTS (msgs));
+  g_assert_cmpuint (get_metric (fixture, "eus_pending_requests"), ==, 0);
+}
+
+/* Test that a metadata request from a client is handled while the client’s
+ * bulk requests are held back by #EusServer:max-requests-per-client, rather
+ * than waiting for them. The upload rate is limited, so the bulk requests take
+ * a while to be sent. */
+static void
+test_server_lanes (Fixture       *fixture,
+                   gconstpointer  user_data G_GNUC_UNUSED)
+{
+  const gchar *delta_path = "/deltas/ab/cdef/0";
+  g_autofree gchar *raw_path = g_build_filename (fixture->repo_path, delta_path, NULL);
+  g_autoptr(GBytes) contents = make_contents (512 * 1024);
+  g_autoptr(SoupMessage) summary = NULL;
+  SoupMessage *downloads[3];
+  guint n_downloads_done = 0;
+  guint n_summaries_done = 0;
+  gint64 deadline = g_get_monotonic_time () + EVENT_TIMEOUT_USEC;
+  gsize i;
+
+  write_file (raw_path, contents);
+
+  fixture->server = g_object_new (EUS_TYPE_SERVER,
+                                  "server", fixture->soup_server,
+                                  "max-requests-per-client", 1,
+                                  "max-rate-per-client", (guint64) 1024 * 1024,
+                                  NULL);
+  add_repo (fixture, fixture->server);
+
+  for (i = 0; i < G_N_ELEMENTS (downloads); i++)
+    {
+      downloads[i] = new_message (fixture, delta_path);
+      soup_session_queue_message (fixture->session, g_object_ref (downloads[i]),
+                                  count_done_cb, &n_downloads_done);
+    }
+
+  /* Wait for all but the first download to be held back. */
+  while (get_metric (fixture, "eus_requests_deferred_total") < G_N_ELEMENTS (downloads) - 1)
+    {
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      g_main_context_iteration (NULL, TRUE);
+    }
+
+  summary = new_message (fixture, "/summary");
+  soup_session_queue_message (fixture->session, g_object_ref (summary),
+                              count_done_cb, &n_summaries_done);
+
+  while (n_summaries_done == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (summary->status_code, ==, SOUP_STATUS_OK);
+  g_assert_cmpuint (n_downloads_done, <, G_N_ELEMENTS (downloads));
+
+  while (n_downloads_done < G_N_ELEMENTS (downloads))
+    g_main_context_iteration (NULL, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (downloads); i++)
+    {
+      g_assert_cmpuint (downloads[i]->status_code, ==, SOUP_STATUS_OK);
+      g_assert_cmpint (downloads[i]->response_body->length, ==,
+                       g_bytes_get_size (contents));
+      g_object_unref (downloads[i]);
+    }
+
+  g_assert_cmpuint (get_metric (fixture, "eus_requests_deferred_total"), ==,
+                    G_N_ELEMENTS (downloads) - 1);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add ("/server/filez/coalesced", Fixture, NULL, setup,
+              test_server_filez_coalesced, teardown);
+  g_test_add ("/server/filez/range", Fixture, NULL, setup,
+              test_server_filez_range, teardown);
+  g_test_add ("/server/not-modified/object", Fixture, NULL, setup,
+              test_server_not_modified_object, teardown);
+  g_test_add ("/server/not-modified/filez", Fixture, NULL, setup,
+              test_server_not_modified_filez, teardown);
+  g_test_add ("/server/not-modified/summary", Fixture, NULL, setup,
+              test_server_not_modified_summary, teardown);
+  g_test_add ("/server/not-modified/delta", Fixture, NULL, setup,
+              test_server_not_modified_delta, teardown);
+  g_test_add ("/server/send-file", Fixture, NULL, setup,
+              test_server_send_file, teardown);
+  g_test_add ("/server/send-file/aborted", Fixture, NULL, setup,
+              test_server_send_file_aborted, teardown);
+  g_test_add ("/server/admission", Fixture, NULL, setup,
+              test_server_admission, teardown);
+  g_test_add ("/server/metrics", Fixture, NULL, setup,
+              test_server_metrics, teardown);
+  g_test_add ("/server/metrics/non-loopback", Fixture, NULL, setup,
+              test_server_metrics_non_loopback, teardown);
+  g_test_add ("/server/shards", Fixture, NULL, setup,
+              test_server_shards, teardown);
+  g_test_add ("/server/lanes", Fixture, NULL, setup,
+              test_server_lanes, teardown);
+
+  return g_test_run ();
+}
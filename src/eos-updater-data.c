@@ -35,6 +35,7 @@ eos_updater_data_init (EosUpdaterData *data,
 
   memset (data, 0, sizeof *data);
   data->repo = g_object_ref (repo);
+  data->soup_session = soup_session_new ();
 }
 
 void
@@ -44,5 +45,6 @@ eos_updater_data_clear (EosUpdaterData *data)
 
   g_clear_pointer (&data->overridden_urls, g_strfreev);
   g_clear_object (&data->extensions);
+  g_clear_object (&data->soup_session);
   g_clear_object (&data->repo);
 }
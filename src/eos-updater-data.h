@@ -24,6 +24,7 @@
 
 #include <libeos-updater-util/extensions.h>
 
+#include <libsoup/soup.h>
 #include <ostree.h>
 
 G_BEGIN_DECLS
@@ -34,6 +35,13 @@ struct EosUpdaterData
 {
   OstreeRepo *repo;
 
+  /* soup_session is used for all the HTTP requests the updater makes
+   * itself, rather than through libostree, from any thread. It lives as
+   * long as the daemon, so its kept-alive connections are reused across
+   * requests, sources and polls.
+   */
+  SoupSession *soup_session;
+
   /* fields below are meant to be shared between some update stages;
    * when adding a new one, document it.
    */
@@ -50,7 +58,7 @@ struct EosUpdaterData
   gchar **overridden_urls;
 };
 
-#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL }
+#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL, NULL }
 
 void eos_updater_data_init (EosUpdaterData *data,
                             OstreeRepo *repo);
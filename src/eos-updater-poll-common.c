@@ -37,6 +37,7 @@
 
 #include <libsoup/soup.h>
 
+#include <errno.h>
 #include <string.h>
 
 static const gchar *const VENDOR_KEY = "sys_vendor";
@@ -67,6 +68,20 @@ static const gchar *const order_key_str[] = {
 
 G_STATIC_ASSERT (G_N_ELEMENTS (order_key_str) == EOS_UPDATER_DOWNLOAD_LAST + 1);
 
+/* Default number of seconds each source is given to be polled, before it is
+ * cancelled. The internet server may be slow; the other sources are local. */
+static const guint default_timeout_secs[] = {
+  300,  /* main */
+  60,  /* lan */
+  60  /* volume */
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (default_timeout_secs) == EOS_UPDATER_DOWNLOAD_LAST + 1);
+
+/* Key in a fetcher’s source variant holding the number of seconds it may take,
+ * as a `u`. If it is 0, the fetcher is given as long as it needs. */
+const gchar *const FETCHER_TIMEOUT_KEY = "timeout";
+
 #ifdef HAS_EOSMETRICS_0
 /*
  * Records which branch will be used by the updater. The payload is a 4-tuple
@@ -203,6 +218,7 @@ eos_metadata_fetch_data_dispose_impl (EosMetadataFetchData *fetch_data)
 {
   g_main_context_pop_thread_default (fetch_data->context);
   g_clear_pointer (&fetch_data->context, g_main_context_unref);
+  g_clear_object (&fetch_data->cancellable);
   g_clear_object (&fetch_data->task);
 }
 
@@ -218,15 +234,19 @@ eos_metadata_fetch_data_new (GTask *task,
                              GMainContext *context)
 {
   EosMetadataFetchData *fetch_data;
+  GCancellable *cancellable;
 
   g_return_val_if_fail (G_IS_TASK (task), NULL);
   g_return_val_if_fail (data != NULL, NULL);
   g_return_val_if_fail (context != NULL, NULL);
 
+  cancellable = g_task_get_cancellable (task);
+
   fetch_data = g_object_new (EOS_TYPE_METADATA_FETCH_DATA, NULL);
   fetch_data->task = g_object_ref (task);
   fetch_data->data = data;
   fetch_data->context = g_main_context_ref (context);
+  fetch_data->cancellable = (cancellable != NULL) ? g_object_ref (cancellable) : NULL;
 
   g_main_context_push_thread_default (context);
   return fetch_data;
@@ -303,9 +323,12 @@ get_booted_refspec (gchar **booted_refspec,
   return TRUE;
 }
 
+/* Options to pull just the commit object @checksum, whose checksum has
+ * already been verified by fetch_commit_checksum(), so ostree does not need to
+ * resolve a ref. */
 static GVariant *
 get_repo_pull_options (const gchar *url_override,
-                       const gchar *ref)
+                       const gchar *checksum)
 {
   g_auto(GVariantBuilder) builder;
 
@@ -316,7 +339,7 @@ get_repo_pull_options (const gchar *url_override,
   g_variant_builder_add (&builder, "{s@v}", "flags",
                          g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY)));
   g_variant_builder_add (&builder, "{s@v}", "refs",
-                         g_variant_new_variant (g_variant_new_strv (&ref, 1)));
+                         g_variant_new_variant (g_variant_new_strv (&checksum, 1)));
 
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 };
@@ -338,8 +361,34 @@ get_extensions_url (OstreeRepo *repo,
   return TRUE;
 }
 
+/* Get the directory to keep eos-updater’s caches in for @repo. This is inside
+ * the repository’s own cache directory, which ostree does not clean up. */
+static GFile *
+get_cache_dir (OstreeRepo *repo)
+{
+  g_autofree gchar *rel_path = g_build_filename ("tmp", "cache", "eos-updater", NULL);
+
+  return g_file_get_child (ostree_repo_get_path (repo), rel_path);
+}
+
+/* Get the directory to cache downloaded metadata files for @repo in; see
+ * download_file(). */
+static GFile *
+get_http_cache_dir (OstreeRepo *repo)
+{
+  g_autoptr(GFile) cache_dir = get_cache_dir (repo);
+
+  return g_file_get_child (cache_dir, "http");
+}
+
+static void http_cache_forget_file_and_signature (GFile *cache_dir,
+                                                  const gchar *url);
+
 static gboolean
 must_download_file_and_signature (const gchar *url,
+                                  SoupSession *soup_session,
+                                  GFile *cache_dir,
+                                  GCancellable *cancellable,
                                   GBytes **contents,
                                   GBytes **signature,
                                   GError **error)
@@ -347,7 +396,8 @@ must_download_file_and_signature (const gchar *url,
   g_autoptr(GBytes) bytes = NULL;
   g_autoptr(GBytes) sig_bytes = NULL;
 
-  if (!download_file_and_signature (url, &bytes, &sig_bytes, error))
+  if (!download_file_and_signature (url, soup_session, cache_dir, cancellable,
+                                    &bytes, &sig_bytes, error))
     return FALSE;
 
   if (bytes == NULL)
@@ -369,36 +419,25 @@ must_download_file_and_signature (const gchar *url,
   return TRUE;
 }
 
-static gboolean
-commit_checksum_from_extensions_ref (OstreeRepo *repo,
-                                     GCancellable *cancellable,
-                                     const gchar *remote_name,
-                                     const gchar *ref,
-                                     const gchar *url_override,
-                                     gchar **out_checksum,
-                                     EosExtensions **out_extensions,
-                                     GError **error)
+/* Verify the extensions ref file downloaded from @eos_ref_url and get the
+ * commit checksum from it. */
+static gchar *
+parse_extensions_ref (OstreeRepo *repo,
+                      GCancellable *cancellable,
+                      const gchar *remote_name,
+                      const gchar *ref,
+                      const gchar *eos_ref_url,
+                      GBytes *contents,
+                      GBytes *signature,
+                      GError **error)
 {
-  g_autofree gchar *extensions_url = NULL;
-  g_autofree gchar *eos_ref_url = NULL;
-  g_autoptr(GBytes) contents = NULL;
-  g_autoptr(GBytes) signature = NULL;
   g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autofree gchar *checksum = NULL;
   gconstpointer raw_data;
   gsize raw_len;
-  g_autoptr(EosExtensions) extensions = NULL;
-  g_autoptr(EosRef) ext_ref = NULL;
   g_autoptr(GKeyFile) ref_keyfile = NULL;
   g_autofree gchar *actual_ref = NULL;
 
-  if (!get_extensions_url (repo, remote_name, url_override, &extensions_url, error))
-    return FALSE;
-
-  eos_ref_url = g_build_path ("/", extensions_url, "refs.d", ref, NULL);
-  if (!must_download_file_and_signature (eos_ref_url, &contents, &signature, error))
-    return FALSE;
-
   gpg_result = ostree_repo_gpg_verify_data (repo,
                                             remote_name,
                                             contents,
@@ -408,7 +447,7 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
                                             cancellable,
                                             error);
   if (!ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
-    return FALSE;
+    return NULL;
 
   ref_keyfile = g_key_file_new ();
   raw_data = g_bytes_get_data (contents, &raw_len);
@@ -417,21 +456,21 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
                                   raw_len,
                                   G_KEY_FILE_NONE,
                                   error))
-    return FALSE;
+    return NULL;
 
   actual_ref = g_key_file_get_string (ref_keyfile,
                                       "mapping",
                                       "ref",
                                       error);
   if (actual_ref == NULL)
-    return FALSE;
+    return NULL;
 
   if (g_strcmp0 (actual_ref, ref) != 0)
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    "The file under %s contains data about ref %s, instead of %s",
                    eos_ref_url, actual_ref, ref);
-      return FALSE;
+      return NULL;
     }
 
   checksum = g_key_file_get_string (ref_keyfile,
@@ -439,12 +478,59 @@ commit_checksum_from_extensions_ref (OstreeRepo *repo,
                                     "commit",
                                     error);
   if (checksum == NULL)
-    return FALSE;
+    return NULL;
   g_strstrip (checksum);
 
   if (!ostree_validate_structureof_checksum_string (checksum, error))
+    return NULL;
+
+  return g_steal_pointer (&checksum);
+}
+
+static gboolean
+commit_checksum_from_extensions_ref (OstreeRepo *repo,
+                                     SoupSession *soup_session,
+                                     GCancellable *cancellable,
+                                     const gchar *remote_name,
+                                     const gchar *ref,
+                                     const gchar *url_override,
+                                     gchar **out_checksum,
+                                     EosExtensions **out_extensions,
+                                     GError **error)
+{
+  g_autofree gchar *extensions_url = NULL;
+  g_autofree gchar *eos_ref_url = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  g_autoptr(GBytes) signature = NULL;
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(EosExtensions) extensions = NULL;
+  g_autoptr(EosRef) ext_ref = NULL;
+  g_autoptr(GFile) http_cache_dir = get_http_cache_dir (repo);
+  g_autoptr(GError) local_error = NULL;
+
+  if (!get_extensions_url (repo, remote_name, url_override, &extensions_url, error))
     return FALSE;
 
+  eos_ref_url = g_build_path ("/", extensions_url, "refs.d", ref, NULL);
+  if (!must_download_file_and_signature (eos_ref_url, soup_session,
+                                         http_cache_dir, cancellable,
+                                         &contents, &signature, error))
+    return FALSE;
+
+  checksum = parse_extensions_ref (repo, cancellable, remote_name, ref,
+                                   eos_ref_url, contents, signature,
+                                   &local_error);
+  if (checksum == NULL)
+    {
+      /* The file or its signature may have come from the cache, and been
+       * revalidated separately from the other, so drop both to download
+       * them afresh next time. */
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        http_cache_forget_file_and_signature (http_cache_dir, eos_ref_url);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
   ext_ref = eos_ref_new_empty ();
   ext_ref->contents = g_steal_pointer (&contents);
   ext_ref->signature = g_steal_pointer (&signature);
@@ -546,6 +632,7 @@ commit_checksum_from_any_summary (OstreeRepo *repo,
                                   const gchar *remote_name,
                                   const gchar *ref,
                                   const gchar *summary_url,
+                                  SoupSession *soup_session,
                                   GCancellable *cancellable,
                                   gchar **out_checksum,
                                   EosExtensions **out_extensions,
@@ -557,8 +644,12 @@ commit_checksum_from_any_summary (OstreeRepo *repo,
   g_autoptr(GVariant) summary = NULL;
   g_autofree gchar *checksum = NULL;
   g_autoptr(EosExtensions) extensions = NULL;
+  g_autoptr(GFile) http_cache_dir = get_http_cache_dir (repo);
+  g_autoptr(GError) local_error = NULL;
 
-  if (!must_download_file_and_signature (summary_url, &contents, &signature, error))
+  if (!must_download_file_and_signature (summary_url, soup_session,
+                                         http_cache_dir, cancellable,
+                                         &contents, &signature, error))
     return FALSE;
 
   gpg_result = ostree_repo_verify_summary (repo,
@@ -566,16 +657,23 @@ commit_checksum_from_any_summary (OstreeRepo *repo,
                                            contents,
                                            signature,
                                            cancellable,
-                                           error);
-  if (!ostree_gpg_verify_result_require_valid_signature (gpg_result, error))
-    return FALSE;
+                                           &local_error);
+  if (ostree_gpg_verify_result_require_valid_signature (gpg_result, &local_error))
+    {
+      summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                              contents,
+                                                              FALSE));
+      checksum = get_commit_checksum_from_summary (summary, ref, &local_error);
+    }
 
-  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
-                                                          contents,
-                                                          FALSE));
-  checksum = get_commit_checksum_from_summary (summary, ref, error);
   if (checksum == NULL)
-    return FALSE;
+    {
+      /* See commit_checksum_from_extensions_ref(). */
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        http_cache_forget_file_and_signature (http_cache_dir, summary_url);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
 
   extensions = eos_extensions_new_empty ();
   extensions->summary = g_steal_pointer (&contents);
@@ -588,6 +686,7 @@ commit_checksum_from_any_summary (OstreeRepo *repo,
 
 static gboolean
 commit_checksum_from_extensions_summary (OstreeRepo *repo,
+                                         SoupSession *soup_session,
                                          GCancellable *cancellable,
                                          const gchar *remote_name,
                                          const gchar *ref,
@@ -607,6 +706,7 @@ commit_checksum_from_extensions_summary (OstreeRepo *repo,
                                            remote_name,
                                            ref,
                                            eos_summary_url,
+                                           soup_session,
                                            cancellable,
                                            out_checksum,
                                            out_extensions,
@@ -615,6 +715,7 @@ commit_checksum_from_extensions_summary (OstreeRepo *repo,
 
 static gboolean
 commit_checksum_from_summary (OstreeRepo *repo,
+                              SoupSession *soup_session,
                               GCancellable *cancellable,
                               const gchar *remote_name,
                               const gchar *ref,
@@ -636,14 +737,197 @@ commit_checksum_from_summary (OstreeRepo *repo,
                                            remote_name,
                                            ref,
                                            summary_url,
+                                           soup_session,
                                            cancellable,
                                            out_checksum,
                                            out_extensions,
                                            error);
 }
 
+typedef gboolean (*CommitChecksumFunc) (OstreeRepo *repo,
+                                        SoupSession *soup_session,
+                                        GCancellable *cancellable,
+                                        const gchar *remote_name,
+                                        const gchar *ref,
+                                        const gchar *url_override,
+                                        gchar **out_checksum,
+                                        EosExtensions **out_extensions,
+                                        GError **error);
+
+typedef struct
+{
+  const gchar *name;  /* as stored in the method cache */
+  const gchar *description;
+  CommitChecksumFunc func;
+} CommitChecksumMethod;
+
+/* In the order they are tried, if the method cache has nothing better to
+ * suggest. */
+static const CommitChecksumMethod commit_checksum_methods[] = {
+  { "refs.d", "extensions refs", commit_checksum_from_extensions_ref },
+  { "eos-summary", "extensions summary", commit_checksum_from_extensions_summary },
+  { "summary", "ostree summary", commit_checksum_from_summary },
+};
+
+/* Number of seconds to trust a cached method for. Once this has passed, all
+ * the methods are tried again in order, so a remote which gains support for a
+ * preferred method starts being polled with it. */
+#define METHOD_CACHE_TTL_SECS (24 * 60 * 60)
+
+/* The method cache is shared by all the fetchers, which run concurrently. */
+static GMutex method_cache_lock;
+
+static gchar *
+get_method_cache_path (OstreeRepo *repo)
+{
+  g_autoptr(GFile) cache_dir = get_cache_dir (repo);
+  g_autoptr(GFile) cache_file = g_file_get_child (cache_dir, "checksum-methods");
+
+  return g_file_get_path (cache_file);
+}
+
+/* Remote URLs can contain characters which are not allowed in key file group
+ * names (such as the brackets around IPv6 addresses), so the group for a
+ * remote and URL is named after a hash of them. */
+static gchar *
+get_method_cache_group (const gchar *remote_name,
+                        const gchar *url)
+{
+  g_autofree gchar *id = g_strdup_printf ("%s\n%s", remote_name, url);
+
+  return g_compute_checksum_for_string (G_CHECKSUM_SHA256, id, -1);
+}
+
+/* Must be called with method_cache_lock held. Returns an empty key file if the
+ * cache does not exist or cannot be read. */
+static GKeyFile *
+method_cache_load (OstreeRepo *repo)
+{
+  g_autofree gchar *path = get_method_cache_path (repo);
+  g_autoptr(GKeyFile) cache = g_key_file_new ();
+  g_autoptr(GError) local_error = NULL;
+
+  if (!g_key_file_load_from_file (cache, path, G_KEY_FILE_NONE, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("Failed to load checksum method cache ‘%s’: %s",
+                 path, local_error->message);
+      g_key_file_free (cache);
+      cache = g_key_file_new ();
+    }
+
+  return g_steal_pointer (&cache);
+}
+
+/* Must be called with method_cache_lock held. Expired entries are dropped, so
+ * entries for URLs which are no longer used (such as peers on the local
+ * network) do not accumulate. Failure to save the cache is not fatal; it just
+ * means the methods will be tried in order next time. */
+static void
+method_cache_save (OstreeRepo *repo,
+                   GKeyFile *cache)
+{
+  g_autofree gchar *path = get_method_cache_path (repo);
+  g_autofree gchar *dir = g_path_get_dirname (path);
+  g_auto(GStrv) groups = NULL;
+  gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+  gsize i;
+  g_autoptr(GError) local_error = NULL;
+
+  groups = g_key_file_get_groups (cache, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      gint64 recorded = g_key_file_get_int64 (cache, groups[i], "Time", NULL);
+
+      if (recorded > now || now - recorded >= METHOD_CACHE_TTL_SECS)
+        g_key_file_remove_group (cache, groups[i], NULL);
+    }
+
+  if (g_mkdir_with_parents (dir, 0755) != 0)
+    {
+      int saved_errno = errno;
+
+      g_debug ("Failed to create cache directory ‘%s’: %s",
+               dir, g_strerror (saved_errno));
+      return;
+    }
+
+  if (!g_key_file_save_to_file (cache, path, &local_error))
+    g_debug ("Failed to save checksum method cache ‘%s’: %s",
+             path, local_error->message);
+}
+
+/* Look up which method last worked for @remote_name at @url. Returns an index
+ * into commit_checksum_methods, or -1 if there is no unexpired entry. */
+static gssize
+method_cache_lookup (OstreeRepo *repo,
+                     const gchar *remote_name,
+                     const gchar *url)
+{
+  g_autoptr(GKeyFile) cache = NULL;
+  g_autofree gchar *group = get_method_cache_group (remote_name, url);
+  g_autofree gchar *method = NULL;
+  gint64 recorded, now;
+  gsize i;
+
+  g_mutex_lock (&method_cache_lock);
+  cache = method_cache_load (repo);
+  g_mutex_unlock (&method_cache_lock);
+
+  method = g_key_file_get_string (cache, group, "Method", NULL);
+  recorded = g_key_file_get_int64 (cache, group, "Time", NULL);
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  if (method == NULL || recorded > now || now - recorded >= METHOD_CACHE_TTL_SECS)
+    return -1;
+
+  for (i = 0; i < G_N_ELEMENTS (commit_checksum_methods); i++)
+    {
+      if (g_str_equal (commit_checksum_methods[i].name, method))
+        return (gssize) i;
+    }
+
+  return -1;
+}
+
+/* Record that method @method_index worked for @remote_name at @url, or forget
+ * the entry for them if @method_index is -1. */
+static void
+method_cache_update (OstreeRepo *repo,
+                     const gchar *remote_name,
+                     const gchar *url,
+                     gssize method_index)
+{
+  g_autoptr(GKeyFile) cache = NULL;
+  g_autofree gchar *group = get_method_cache_group (remote_name, url);
+
+  g_mutex_lock (&method_cache_lock);
+  cache = method_cache_load (repo);
+
+  if (method_index >= 0)
+    {
+      g_key_file_set_string (cache, group, "Remote", remote_name);
+      g_key_file_set_string (cache, group, "URL", url);
+      g_key_file_set_string (cache, group, "Method",
+                             commit_checksum_methods[method_index].name);
+      g_key_file_set_int64 (cache, group, "Time",
+                            g_get_real_time () / G_USEC_PER_SEC);
+    }
+  else
+    {
+      g_key_file_remove_group (cache, group, NULL);
+    }
+
+  method_cache_save (repo, cache);
+  g_mutex_unlock (&method_cache_lock);
+}
+
+/* Try the methods of finding the checksum in turn. The one which last worked
+ * for this remote and URL is tried first, so a remote which only has an
+ * ostree summary is not asked for the files it does not have on every poll. */
 static gboolean
 fetch_commit_checksum (OstreeRepo *repo,
+                       SoupSession *soup_session,
                        GCancellable *cancellable,
                        const gchar *remote_name,
                        const gchar *ref,
@@ -654,47 +938,58 @@ fetch_commit_checksum (OstreeRepo *repo,
 {
   g_autoptr(GPtrArray) failures = NULL;
   g_autofree gchar *failures_str = NULL;
-  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *url = g_strdup (url_override);
+  gssize cached_index = -1;
+  gsize attempt;
 
-  if (commit_checksum_from_extensions_ref (repo,
-                                           cancellable,
-                                           remote_name,
-                                           ref,
-                                           url_override,
-                                           out_checksum,
-                                           out_extensions,
-                                           &local_error))
-    return TRUE;
+  /* If the URL cannot be found, the methods will fail with a better error
+   * than we could give here. */
+  if (url == NULL)
+    ostree_repo_remote_get_url (repo, remote_name, &url, NULL);
+  if (url != NULL)
+    cached_index = method_cache_lookup (repo, remote_name, url);
 
   failures = g_ptr_array_new_with_free_func (g_free);
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get extensions refs: %s", local_error->message));
-  g_clear_error (&local_error);
-  if (commit_checksum_from_extensions_summary (repo,
-                                               cancellable,
-                                               remote_name,
-                                               ref,
-                                               url_override,
-                                               out_checksum,
-                                               out_extensions,
-                                               &local_error))
-    return TRUE;
-
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get extensions summary: %s", local_error->message));
-  g_clear_error (&local_error);
-  if (commit_checksum_from_summary (repo,
-                                    cancellable,
-                                    remote_name,
-                                    ref,
-                                    url_override,
-                                    out_checksum,
-                                    out_extensions,
-                                    &local_error))
-    return TRUE;
-
-  g_ptr_array_add (failures, g_strdup_printf ("Failed to get ostree summary: %s", local_error->message));
+
+  /* Attempt 0 is the cached method, if there is one. */
+  for (attempt = 0; attempt <= G_N_ELEMENTS (commit_checksum_methods); attempt++)
+    {
+      gssize i = (attempt == 0) ? cached_index : (gssize) attempt - 1;
+      const CommitChecksumMethod *method;
+      g_autoptr(GError) local_error = NULL;
+
+      if (i < 0 || (attempt > 0 && i == cached_index))
+        continue;
+
+      method = &commit_checksum_methods[i];
+
+      if (method->func (repo,
+                        soup_session,
+                        cancellable,
+                        remote_name,
+                        ref,
+                        url_override,
+                        out_checksum,
+                        out_extensions,
+                        &local_error))
+        {
+          if (url != NULL && i != cached_index)
+            method_cache_update (repo, remote_name, url, i);
+          return TRUE;
+        }
+
+      g_ptr_array_add (failures, g_strdup_printf ("Failed to get %s: %s",
+                                                  method->description,
+                                                  local_error->message));
+
+      /* Don’t forget what works just because the poll was cancelled. */
+      if (url != NULL && i == cached_index &&
+          !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        method_cache_update (repo, remote_name, url, -1);
+    }
+
   g_ptr_array_add (failures, NULL);
   failures_str = g_strjoinv ("; ", (gchar **)failures->pdata);
-  g_clear_error (&local_error);
   if (url_override != NULL)
     g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                  "Failed to get the checksum of the latest commit in ref %s from remote %s with URL %s, reasons: %s",
@@ -711,8 +1006,82 @@ fetch_commit_checksum (OstreeRepo *repo,
   return FALSE;
 }
 
+/* The fetchers run concurrently (see run_fetchers()), but an #OstreeRepo can
+ * only have one transaction open at once, so pulls into it are serialised. */
+static GMutex pull_lock;
+
+/* Resolve @ref on @remote_name to a commit checksum, and load that commit,
+ * pulling it only if it is not already in @repo. Polls which find no update
+ * therefore only download the ref metadata. As the commit is pulled by
+ * checksum, the remote ref is not updated here: several fetchers may resolve
+ * the same ref at once, so run_fetchers() points it at the update it picks. */
+static gboolean
+resolve_latest_commit (OstreeRepo *repo,
+                       SoupSession *soup_session,
+                       GCancellable *cancellable,
+                       const gchar *remote_name,
+                       const gchar *ref,
+                       const gchar *url_override,
+                       gchar **out_checksum,
+                       GVariant **out_commit,
+                       EosExtensions **out_extensions,
+                       GError **error)
+{
+  g_autofree gchar *checksum = NULL;
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(EosExtensions) extensions = NULL;
+
+  if (!fetch_commit_checksum (repo,
+                              soup_session,
+                              cancellable,
+                              remote_name,
+                              ref,
+                              url_override,
+                              &checksum,
+                              &extensions,
+                              error))
+    return FALSE;
+
+  if (!ostree_repo_load_variant_if_exists (repo,
+                                           OSTREE_OBJECT_TYPE_COMMIT,
+                                           checksum,
+                                           &commit,
+                                           error))
+    return FALSE;
+
+  if (commit == NULL)
+    {
+      g_autoptr(GVariant) options = get_repo_pull_options (url_override, checksum);
+      gboolean pulled;
+
+      g_mutex_lock (&pull_lock);
+      pulled = ostree_repo_pull_with_options (repo,
+                                              remote_name,
+                                              options,
+                                              NULL,
+                                              cancellable,
+                                              error);
+      g_mutex_unlock (&pull_lock);
+      if (!pulled)
+        return FALSE;
+
+      if (!ostree_repo_load_variant (repo,
+                                     OSTREE_OBJECT_TYPE_COMMIT,
+                                     checksum,
+                                     &commit,
+                                     error))
+        return FALSE;
+    }
+
+  *out_checksum = g_steal_pointer (&checksum);
+  *out_commit = g_steal_pointer (&commit);
+  *out_extensions = g_steal_pointer (&extensions);
+  return TRUE;
+}
+
 gboolean
 fetch_latest_commit (OstreeRepo *repo,
+                     SoupSession *soup_session,
                      GCancellable *cancellable,
                      const gchar *refspec,
                      const gchar *url_override,
@@ -721,10 +1090,7 @@ fetch_latest_commit (OstreeRepo *repo,
                      EosExtensions **out_extensions,
                      GError **error)
 {
-  g_autoptr(GBytes) summary_bytes = NULL;
-  g_autoptr(GVariant) summary = NULL;
   g_autofree gchar *checksum = NULL;
-  g_autoptr(GVariant) options = NULL;
   g_autoptr(GVariant) commit = NULL;
   g_autoptr(GVariant) rebase = NULL;
   g_autoptr(GVariant) metadata = NULL;
@@ -733,6 +1099,7 @@ fetch_latest_commit (OstreeRepo *repo,
   g_autofree gchar *ref = NULL;
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
+  g_return_val_if_fail (SOUP_IS_SESSION (soup_session), FALSE);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
   g_return_val_if_fail (refspec != NULL, FALSE);
   g_return_val_if_fail (out_checksum != NULL, FALSE);
@@ -742,32 +1109,18 @@ fetch_latest_commit (OstreeRepo *repo,
   if (!ostree_parse_refspec (refspec, &remote_name, &ref, error))
     return FALSE;
 
-  options = get_repo_pull_options (url_override, ref);
-  if (!ostree_repo_pull_with_options (repo,
-                                      remote_name,
-                                      options,
-                                      NULL,
-                                      cancellable,
-                                      error))
-    return FALSE;
-
-  if (!fetch_commit_checksum (repo,
+  if (!resolve_latest_commit (repo,
+                              soup_session,
                               cancellable,
                               remote_name,
                               ref,
                               url_override,
                               &checksum,
+                              &commit,
                               &extensions,
                               error))
     return FALSE;
 
-  if (!ostree_repo_load_variant (repo,
-                                 OSTREE_OBJECT_TYPE_COMMIT,
-                                 checksum,
-                                 &commit,
-                                 error))
-    return FALSE;
-
   /* If this is a redirect commit, follow it and fetch the new ref instead */
   metadata = g_variant_get_child_value (commit, 0);
   rebase = g_variant_lookup_value (metadata, "ostree.endoflife-rebase", G_VARIANT_TYPE_STRING);
@@ -777,24 +1130,17 @@ fetch_latest_commit (OstreeRepo *repo,
       g_clear_pointer (&ref, g_free);
       ref = g_variant_dup_string (rebase, NULL);
 
-      g_clear_pointer (&options, g_variant_unref);
-      options = get_repo_pull_options (url_override, ref);
-      if (!ostree_repo_pull_with_options (repo,
-                                          remote_name,
-                                          options,
-                                          NULL,
-                                          cancellable,
-                                          error))
-        return FALSE;
-
-      g_clear_object (&extensions);
       g_clear_pointer (&checksum, g_free);
-      if (!fetch_commit_checksum (repo,
+      g_clear_pointer (&commit, g_variant_unref);
+      g_clear_object (&extensions);
+      if (!resolve_latest_commit (repo,
+                                  soup_session,
                                   cancellable,
                                   remote_name,
                                   ref,
                                   url_override,
                                   &checksum,
+                                  &commit,
                                   &extensions,
                                   error))
         return FALSE;
@@ -818,8 +1164,176 @@ get_uri_to_sig (SoupURI *uri)
   return sig_uri;
 }
 
+/* Entries in the HTTP cache which have not been used for this long are
+ * deleted, so entries for URLs which are no longer polled (such as peers on
+ * the local network, whose ports change) do not accumulate. */
+#define HTTP_CACHE_MAX_AGE_SECS (7 * 24 * 60 * 60)
+
+/* URL, ETag, Last-Modified and body of a cached response. The validators are
+ * empty strings if the server did not send them. */
+#define HTTP_CACHE_ENTRY_FORMAT "(sssay)"
+
+static GFile *
+get_http_cache_file (GFile *cache_dir,
+                     const gchar *url)
+{
+  g_autofree gchar *name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, url, -1);
+
+  return g_file_get_child (cache_dir, name);
+}
+
+/* Returns the cached response for @url, or %NULL if there is none. */
+static GVariant *
+http_cache_load (GFile *cache_file,
+                 const gchar *url)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  const gchar *entry_url;
+
+  if (!eos_updater_read_file_to_bytes (cache_file, NULL, &bytes, NULL))
+    return NULL;
+
+  entry = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (HTTP_CACHE_ENTRY_FORMAT),
+                                                        bytes,
+                                                        FALSE));
+
+  /* Guard against corrupt entries and hash collisions. */
+  g_variant_get_child (entry, 0, "&s", &entry_url);
+  if (!g_str_equal (entry_url, url))
+    return NULL;
+
+  return g_steal_pointer (&entry);
+}
+
+static void
+http_cache_prune (GFile *cache_dir)
+{
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  guint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+  enumerator = g_file_enumerate_children (cache_dir,
+                                          G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          NULL,
+                                          NULL);
+  if (enumerator == NULL)
+    return;
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      GFile *child;
+      guint64 mtime;
+
+      if (!g_file_enumerator_iterate (enumerator, &info, &child, NULL, NULL) ||
+          info == NULL)
+        break;
+
+      mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+      if (mtime + HTTP_CACHE_MAX_AGE_SECS < now)
+        g_file_delete (child, NULL, NULL);
+    }
+}
+
+/* Cache the response to @msg, if it can be revalidated. Failure to cache it
+ * is not fatal; the file will just be downloaded in full next time. */
+static void
+http_cache_store (GFile *cache_dir,
+                  GFile *cache_file,
+                  const gchar *url,
+                  SoupMessage *msg,
+                  GBytes *contents)
+{
+  const gchar *etag = soup_message_headers_get_one (msg->response_headers, "ETag");
+  const gchar *last_modified = soup_message_headers_get_one (msg->response_headers, "Last-Modified");
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GBytes) entry_bytes = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (etag == NULL && last_modified == NULL)
+    {
+      g_file_delete (cache_file, NULL, NULL);
+      return;
+    }
+
+  entry = g_variant_ref_sink (g_variant_new ("(sss@ay)",
+                                             url,
+                                             (etag != NULL) ? etag : "",
+                                             (last_modified != NULL) ? last_modified : "",
+                                             g_variant_new_from_bytes (G_VARIANT_TYPE_BYTESTRING,
+                                                                       contents,
+                                                                       TRUE)));
+  entry_bytes = g_variant_get_data_as_bytes (entry);
+
+  if (!g_file_make_directory_with_parents (cache_dir, NULL, &local_error) &&
+      !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+      g_debug ("Failed to create HTTP cache directory: %s", local_error->message);
+      return;
+    }
+  g_clear_error (&local_error);
+
+  /* The file is replaced atomically, so concurrent fetchers never see a
+   * partially written entry. */
+  if (!g_file_replace_contents (cache_file,
+                                g_bytes_get_data (entry_bytes, NULL),
+                                g_bytes_get_size (entry_bytes),
+                                NULL,
+                                FALSE,
+                                G_FILE_CREATE_REPLACE_DESTINATION,
+                                NULL,
+                                NULL,
+                                &local_error))
+    {
+      g_debug ("Failed to cache %s: %s", url, local_error->message);
+      return;
+    }
+
+  http_cache_prune (cache_dir);
+}
+
+/* Drop the cached responses for @url and its signature, so both are
+ * downloaded in full next time. They are cached and revalidated
+ * independently, so if either turns out to be bad, the pair may be out of
+ * step. */
+static void
+http_cache_forget_file_and_signature (GFile *cache_dir,
+                                      const gchar *url)
+{
+  g_autoptr(SoupURI) uri = soup_uri_new (url);
+  g_autoptr(SoupURI) sig_uri = NULL;
+  SoupURI *uris[2];
+  gsize i;
+
+  if (uri == NULL)
+    return;
+
+  sig_uri = get_uri_to_sig (uri);
+  uris[0] = uri;
+  uris[1] = sig_uri;
+
+  for (i = 0; i < G_N_ELEMENTS (uris); i++)
+    {
+      g_autofree gchar *uri_str = soup_uri_to_string (uris[i], FALSE);
+      g_autoptr(GFile) cache_file = get_http_cache_file (cache_dir, uri_str);
+
+      g_debug ("Dropping cached copy of %s", uri_str);
+      g_file_delete (cache_file, NULL, NULL);
+    }
+}
+
+/* Download the file at @uri. If @cache_dir is non-%NULL, HTTP responses are
+ * cached in it along with their `ETag` and `Last-Modified` headers, and the
+ * next download of the same URL is made conditional on them, so a file which
+ * has not changed since the last poll is not sent again. The contents of
+ * cached files are returned as if they had been downloaded, so they are
+ * verified by the callers as usual. */
 static GBytes *
-download_file (SoupURI *uri)
+download_file (SoupSession *soup_session,
+               SoupURI *uri,
+               GFile *cache_dir,
+               GCancellable *cancellable)
 {
   g_autoptr(GBytes) contents = NULL;
 
@@ -827,25 +1341,107 @@ download_file (SoupURI *uri)
     {
       g_autoptr(GFile) file = g_file_new_for_path (soup_uri_get_path (uri));
 
-      eos_updater_read_file_to_bytes (file, NULL, &contents, NULL);
+      eos_updater_read_file_to_bytes (file, cancellable, &contents, NULL);
     }
   else
     {
-      g_autoptr(SoupSession) soup = soup_session_new ();
       g_autoptr(SoupMessage) msg = soup_message_new_from_uri ("GET", uri);
-      guint status = soup_session_send_message (soup, msg);
+      g_autoptr(GInputStream) stream = NULL;
+      g_autoptr(GOutputStream) body = NULL;
+      g_autofree gchar *url = soup_uri_to_string (uri, FALSE);
+      g_autoptr(GFile) cache_file = NULL;
+      g_autoptr(GVariant) cached = NULL;
+
+      if (cache_dir != NULL)
+        {
+          cache_file = get_http_cache_file (cache_dir, url);
+          cached = http_cache_load (cache_file, url);
+        }
 
-      if (SOUP_STATUS_IS_SUCCESSFUL (status))
-        g_object_get (msg,
-                      SOUP_MESSAGE_RESPONSE_BODY_DATA, &contents,
-                      NULL);
+      if (cached != NULL)
+        {
+          const gchar *etag, *last_modified;
+
+          g_variant_get (cached, "(&s&s&s@ay)", NULL, &etag, &last_modified, NULL);
+
+          if (*etag != '\0')
+            soup_message_headers_append (msg->request_headers, "If-None-Match", etag);
+          if (*last_modified != '\0')
+            soup_message_headers_append (msg->request_headers, "If-Modified-Since", last_modified);
+        }
+
+      /* Stream the body, rather than using soup_session_send_message(), so
+       * the download can be cancelled. The body of an error response is read
+       * too, so the connection can be kept alive for the next request. */
+      stream = soup_session_send (soup_session, msg, cancellable, NULL);
+      if (stream == NULL)
+        return NULL;
+
+      body = g_memory_output_stream_new_resizable ();
+      if (g_output_stream_splice (body, stream,
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                  G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                  cancellable, NULL) < 0)
+        return NULL;
+
+      if (msg->status_code == SOUP_STATUS_NOT_MODIFIED && cached != NULL)
+        {
+          g_autoptr(GVariant) cached_body = g_variant_get_child_value (cached, 3);
+
+          /* Mark the entry as used, so it is not pruned. */
+          g_file_set_attribute_uint64 (cache_file,
+                                       G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                       g_get_real_time () / G_USEC_PER_SEC,
+                                       G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                       NULL,
+                                       NULL);
+
+          return g_variant_get_data_as_bytes (cached_body);
+        }
+
+      if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+        return NULL;
+
+      contents = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (body));
+
+      if (cache_file != NULL && msg->status_code == SOUP_STATUS_OK)
+        http_cache_store (cache_dir, cache_file, url, msg, contents);
     }
 
   return g_steal_pointer (&contents);
 }
 
+typedef struct
+{
+  SoupSession *soup_session;
+  SoupURI *uri;
+  GFile *cache_dir;  /* (nullable) */
+  GCancellable *cancellable;
+  GBytes *contents;  /* (owned) (nullable) */
+} DownloadData;
+
+static gpointer
+download_thread_cb (gpointer user_data)
+{
+  DownloadData *download_data = user_data;
+
+  download_data->contents = download_file (download_data->soup_session,
+                                           download_data->uri,
+                                           download_data->cache_dir,
+                                           download_data->cancellable);
+
+  return NULL;
+}
+
+/* Download the file at @url and its signature, from `@url.sig`, using
+ * @soup_session, which may be used from several threads at once. If
+ * @cache_dir is non-%NULL, both are cached in it across polls; see
+ * download_file(). */
 gboolean
 download_file_and_signature (const gchar *url,
+                             SoupSession *soup_session,
+                             GFile *cache_dir,
+                             GCancellable *cancellable,
                              GBytes **contents,
                              GBytes **signature,
                              GError **error)
@@ -861,8 +1457,33 @@ download_file_and_signature (const gchar *url,
     }
 
   sig_uri = get_uri_to_sig (uri);
-  *contents = download_file (uri);
-  *signature = download_file (sig_uri);
+
+  /* Over the network, the signature is downloaded in another thread at the
+   * same time as the file, on a second pooled connection, so on high latency
+   * links the pair takes one round trip rather than two. */
+  if (soup_uri_get_scheme (uri) == SOUP_URI_SCHEME_FILE)
+    {
+      *contents = download_file (soup_session, uri, NULL, cancellable);
+      *signature = download_file (soup_session, sig_uri, NULL, cancellable);
+    }
+  else
+    {
+      DownloadData sig_data = { soup_session, sig_uri, cache_dir, cancellable, NULL };
+      GThread *sig_thread;
+
+      sig_thread = g_thread_new ("download-sig", download_thread_cb, &sig_data);
+      *contents = download_file (soup_session, uri, cache_dir, cancellable);
+      g_thread_join (sig_thread);
+      *signature = sig_data.contents;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      g_clear_pointer (contents, g_bytes_unref);
+      g_clear_pointer (signature, g_bytes_unref);
+      return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -1120,17 +1741,242 @@ get_latest_update (GArray *sources,
   return NULL;
 }
 
+/* State of one of the fetchers started by run_fetchers(). The fetcher runs in
+ * a worker thread, which only reads @parent, @fetcher and @source_variant;
+ * everything else is only used in the thread calling run_fetchers(). */
+typedef struct
+{
+  EosMetadataFetchData *parent;  /* (owned) */
+  MetadataFetcher fetcher;
+  GVariant *source_variant;  /* (owned) */
+  EosUpdaterDownloadSource source;
+  guint timeout_secs;
+
+  GCancellable *cancellable;  /* (owned) */
+  gulong parent_cancelled_id;
+  GSource *timeout_source;  /* (owned) (nullable) */
+  gboolean running;
+  gboolean timed_out;
+  gboolean stopped_early;
+
+  EosUpdateInfo *info;  /* (owned) (nullable) */
+  GError *error;  /* (owned) (nullable) */
+} FetcherRun;
+
+static void
+fetcher_run_free (FetcherRun *run)
+{
+  if (run->timeout_source != NULL)
+    {
+      g_source_destroy (run->timeout_source);
+      g_source_unref (run->timeout_source);
+    }
+
+  if (run->parent_cancelled_id != 0)
+    g_cancellable_disconnect (run->parent->cancellable,
+                              run->parent_cancelled_id);
+
+  g_clear_error (&run->error);
+  g_clear_object (&run->info);
+  g_clear_object (&run->cancellable);
+  g_variant_unref (run->source_variant);
+  g_object_unref (run->parent);
+  g_free (run);
+}
+
+static void
+fetcher_thread_cb (GTask *task,
+                   gpointer source_object,
+                   gpointer task_data,
+                   GCancellable *cancellable)
+{
+  FetcherRun *run = task_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(EosMetadataFetchData) fetch_data = NULL;
+  g_autoptr(EosUpdateInfo) info = NULL;
+  GError *error = NULL;
+
+  /* Each fetcher gets its own main context, as some of them iterate it, and
+   * its own cancellable, so it can be stopped separately. */
+  fetch_data = eos_metadata_fetch_data_new (run->parent->task,
+                                            run->parent->data,
+                                            context);
+  g_set_object (&fetch_data->cancellable, cancellable);
+
+  if (!run->fetcher (fetch_data, run->source_variant, &info, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, g_steal_pointer (&info), g_object_unref);
+}
+
+static void
+fetcher_run_finished_cb (GObject *source_object,
+                         GAsyncResult *result,
+                         gpointer user_data)
+{
+  FetcherRun *run = user_data;
+
+  run->info = g_task_propagate_pointer (G_TASK (result), &run->error);
+  run->running = FALSE;
+
+  if (run->timeout_source != NULL)
+    {
+      g_source_destroy (run->timeout_source);
+      g_clear_pointer (&run->timeout_source, g_source_unref);
+    }
+}
+
+static gboolean
+fetcher_run_timeout_cb (gpointer user_data)
+{
+  FetcherRun *run = user_data;
+
+  run->timed_out = TRUE;
+  g_cancellable_cancel (run->cancellable);
+  g_clear_pointer (&run->timeout_source, g_source_unref);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+parent_cancelled_cb (GCancellable *parent_cancellable,
+                     gpointer user_data)
+{
+  g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+/* Start @fetcher in a worker thread. Its result is stored in the returned
+ * #FetcherRun once the thread-default main context has been iterated after it
+ * finishes. */
+static FetcherRun *
+fetcher_run_start (EosMetadataFetchData *fetch_data,
+                   MetadataFetcher fetcher,
+                   GVariant *source_variant,
+                   EosUpdaterDownloadSource source)
+{
+  g_autoptr(GTask) task = NULL;
+  FetcherRun *run;
+
+  run = g_new0 (FetcherRun, 1);
+  run->parent = g_object_ref (fetch_data);
+  run->fetcher = fetcher;
+  run->source_variant = g_variant_ref (source_variant);
+  run->source = source;
+  run->cancellable = g_cancellable_new ();
+  run->running = TRUE;
+
+  if (!g_variant_lookup (source_variant, FETCHER_TIMEOUT_KEY, "u",
+                         &run->timeout_secs))
+    run->timeout_secs = download_source_get_default_timeout (source);
+
+  if (fetch_data->cancellable != NULL)
+    run->parent_cancelled_id = g_cancellable_connect (fetch_data->cancellable,
+                                                      (GCallback) parent_cancelled_cb,
+                                                      run->cancellable,
+                                                      NULL);
+
+  if (run->timeout_secs > 0)
+    {
+      run->timeout_source = g_timeout_source_new_seconds (run->timeout_secs);
+      g_source_set_callback (run->timeout_source, fetcher_run_timeout_cb,
+                             run, NULL);
+      g_source_attach (run->timeout_source, fetch_data->context);
+    }
+
+  /* Keep the result if the fetcher finished just as it was cancelled. */
+  task = g_task_new (NULL, run->cancellable, fetcher_run_finished_cb, run);
+  g_task_set_source_tag (task, fetcher_run_start);
+  g_task_set_check_cancellable (task, FALSE);
+  g_task_set_task_data (task, run, NULL);
+  g_task_run_in_thread (task, fetcher_thread_cb);
+
+  return run;
+}
+
+/* Whether the update to use is known before all of @runs have finished: the
+ * main source has succeeded, and all the sources before it in the order have
+ * finished. Updates are published on the main server first, so no other
+ * source can have a newer one, and sources later in the order lose ties. */
+static gboolean
+fetcher_runs_are_decided (GPtrArray *runs)
+{
+  gsize idx;
+
+  for (idx = 0; idx < runs->len; ++idx)
+    {
+      FetcherRun *run = g_ptr_array_index (runs, idx);
+
+      if (run->running)
+        return FALSE;
+      if (run->source == EOS_UPDATER_DOWNLOAD_MAIN)
+        return (run->error == NULL);
+    }
+
+  return FALSE;
+}
+
+static guint
+fetcher_runs_count_running (GPtrArray *runs)
+{
+  guint n_running = 0;
+  gsize idx;
+
+  for (idx = 0; idx < runs->len; ++idx)
+    {
+      FetcherRun *run = g_ptr_array_index (runs, idx);
+
+      if (run->running)
+        n_running++;
+    }
+
+  return n_running;
+}
+
+/* Point the remote ref of @update at the commit it found. The commit was
+ * pulled by checksum, so the pull did not update the ref. This is only done
+ * once all the fetchers have finished, as they may each have resolved the
+ * same ref to a different commit. Failing to update it is not fatal: the
+ * fetch step pulls the ref again. */
+static void
+update_remote_ref (OstreeRepo *repo,
+                   EosUpdateInfo *update,
+                   GCancellable *cancellable)
+{
+  g_autofree gchar *remote_name = NULL;
+  g_autofree gchar *ref = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!ostree_parse_refspec (update->refspec, &remote_name, &ref, &error) ||
+      !ostree_repo_set_ref_immediate (repo,
+                                      remote_name,
+                                      ref,
+                                      update->checksum,
+                                      cancellable,
+                                      &error))
+    g_message ("Failed to point %s at the latest commit %s: %s",
+               update->refspec, update->checksum, error->message);
+}
+
+/* Run all the @fetchers concurrently, each in its own thread and with its own
+ * deadline (see %FETCHER_TIMEOUT_KEY), so polling takes as long as the slowest
+ * source rather than all of them together. Once they have all finished, the
+ * update with the newest commit is returned; ties are broken by the order of
+ * @sources. If @early_exit is %TRUE, the fetchers still running are cancelled
+ * as soon as the result is known (see fetcher_runs_are_decided()). */
 EosUpdateInfo *
 run_fetchers (EosMetadataFetchData *fetch_data,
               GPtrArray *fetchers,
               GPtrArray *source_variants,
-              GArray *sources)
+              GArray *sources,
+              gboolean early_exit)
 {
   guint idx;
   g_autoptr(GHashTable) source_to_update = g_hash_table_new_full (NULL,
                                                                   NULL,
                                                                   NULL,
                                                                   (GDestroyNotify) g_object_unref);
+  g_autoptr(GPtrArray) runs = NULL;
+  gboolean stopped_early = FALSE;
 
   g_return_val_if_fail (EOS_IS_METADATA_FETCH_DATA (fetch_data), NULL);
   g_return_val_if_fail (fetchers != NULL, NULL);
@@ -1139,16 +1985,16 @@ run_fetchers (EosMetadataFetchData *fetch_data,
   g_return_val_if_fail (fetchers->len == source_variants->len, NULL);
   g_return_val_if_fail (source_variants->len == sources->len, NULL);
 
+  runs = g_ptr_array_new_with_free_func ((GDestroyNotify) fetcher_run_free);
+
   for (idx = 0; idx < fetchers->len; ++idx)
     {
       MetadataFetcher fetcher = g_ptr_array_index (fetchers, idx);
       GVariant *source_variant = g_ptr_array_index (source_variants, idx);
-      g_autoptr(EosUpdateInfo) info = NULL;
       EosUpdaterDownloadSource source = g_array_index (sources,
                                                        EosUpdaterDownloadSource,
                                                        idx);
       const gchar *name = download_source_to_string (source);
-      g_autoptr(GError) local_error = NULL;
       const GVariantType *source_variant_type = g_variant_get_type (source_variant);
 
       if (!g_variant_type_equal (source_variant_type, G_VARIANT_TYPE_VARDICT))
@@ -1163,17 +2009,55 @@ run_fetchers (EosMetadataFetchData *fetch_data,
           continue;
         }
 
-      if (!fetcher (fetch_data, source_variant, &info, &local_error))
+      g_ptr_array_add (runs,
+                       fetcher_run_start (fetch_data, fetcher, source_variant,
+                                          source));
+    }
+
+  while (fetcher_runs_count_running (runs) > 0)
+    {
+      g_main_context_iteration (fetch_data->context, TRUE);
+
+      if (early_exit && !stopped_early && fetcher_runs_are_decided (runs))
         {
-          g_message ("Failed to poll metadata from source %s: %s",
-                     name, local_error->message);
+          for (idx = 0; idx < runs->len; ++idx)
+            {
+              FetcherRun *run = g_ptr_array_index (runs, idx);
+
+              if (run->running)
+                {
+                  run->stopped_early = TRUE;
+                  g_cancellable_cancel (run->cancellable);
+                }
+            }
+
+          stopped_early = TRUE;
+        }
+    }
+
+  for (idx = 0; idx < runs->len; ++idx)
+    {
+      FetcherRun *run = g_ptr_array_index (runs, idx);
+      const gchar *name = download_source_to_string (run->source);
+
+      if (run->error != NULL)
+        {
+          if (run->stopped_early)
+            g_message ("Stopped polling metadata from source %s, as a "
+                       "higher priority source has the latest update", name);
+          else if (run->timed_out)
+            g_message ("Timed out polling metadata from source %s after %u "
+                       "seconds", name, run->timeout_secs);
+          else
+            g_message ("Failed to poll metadata from source %s: %s",
+                       name, run->error->message);
           continue;
         }
 
-      if (info != NULL)
+      if (run->info != NULL)
         {
           g_hash_table_insert (source_to_update,
-                               (gpointer) name, g_object_ref (info));
+                               (gpointer) name, g_object_ref (run->info));
         }
     }
 
@@ -1199,7 +2083,11 @@ run_fetchers (EosMetadataFetchData *fetch_data,
 
       latest_update = get_latest_update (sources, source_to_update);
       if (latest_update != NULL)
-        return g_object_ref (latest_update);
+        {
+          update_remote_ref (fetch_data->data->repo, latest_update,
+                             fetch_data->cancellable);
+          return g_object_ref (latest_update);
+        }
     }
 
   return NULL;
@@ -1220,6 +2108,14 @@ download_source_to_string (EosUpdaterDownloadSource source)
     }
 }
 
+guint
+download_source_get_default_timeout (EosUpdaterDownloadSource source)
+{
+  g_return_val_if_fail (source <= EOS_UPDATER_DOWNLOAD_LAST, 0);
+
+  return default_timeout_secs[source];
+}
+
 gboolean
 string_to_download_source (const gchar *str,
                            EosUpdaterDownloadSource *source,
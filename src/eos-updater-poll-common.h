@@ -27,6 +27,7 @@
 #include <libeos-updater-util/extensions.h>
 #include <libeos-updater-util/refcounted.h>
 
+#include <libsoup/soup.h>
 #include <ostree.h>
 
 #include <glib.h>
@@ -100,6 +101,7 @@ struct _EosMetadataFetchData
   GTask *task;
   EosUpdaterData *data;
   GMainContext *context;
+  GCancellable *cancellable;  /* (nullable) */
 };
 
 EosMetadataFetchData *
@@ -112,12 +114,15 @@ typedef gboolean (*MetadataFetcher) (EosMetadataFetchData *fetch_data,
                                      EosUpdateInfo **info,
                                      GError **error);
 
+extern const gchar *const FETCHER_TIMEOUT_KEY;
+
 gboolean get_booted_refspec (gchar **booted_refspec,
                              gchar **booted_remote,
                              gchar **booted_ref,
                              GError **error);
 
 gboolean fetch_latest_commit (OstreeRepo *repo,
+                              SoupSession *soup_session,
                               GCancellable *cancellable,
                               const gchar *refspec,
                               const gchar *url_override,
@@ -127,6 +132,9 @@ gboolean fetch_latest_commit (OstreeRepo *repo,
                               GError **error);
 
 gboolean download_file_and_signature (const gchar *url,
+                                      SoupSession *soup_session,
+                                      GFile *cache_dir,
+                                      GCancellable *cancellable,
                                       GBytes **contents,
                                       GBytes **signature,
                                       GError **error);
@@ -153,10 +161,13 @@ gboolean string_to_download_source (const gchar *str,
                                     EosUpdaterDownloadSource *source,
                                     GError **error);
 
+guint download_source_get_default_timeout (EosUpdaterDownloadSource source);
+
 EosUpdateInfo *run_fetchers (EosMetadataFetchData *fetch_data,
                              GPtrArray *fetchers,
                              GPtrArray *source_variants,
-                             GArray *sources);
+                             GArray *sources,
+                             gboolean early_exit);
 
 void metadata_fetch_finished (GObject *object,
                               GAsyncResult *res,
@@ -431,7 +431,7 @@ get_update_info_from_swms (LanData *lan_data,
       g_autoptr(GVariant) commit = NULL;
       guint64 timestamp;
       g_autoptr(EosExtensions) extensions = NULL;
-      GCancellable *cancellable = g_task_get_cancellable (lan_data->fetch_data->task);
+      GCancellable *cancellable = lan_data->fetch_data->cancellable;
 
       /* Build the URI. */
       _url_override = soup_uri_new (NULL);
@@ -442,6 +442,7 @@ get_update_info_from_swms (LanData *lan_data,
       url_override = soup_uri_to_string (_url_override, FALSE);
 
       if (!fetch_latest_commit (repo,
+                                lan_data->fetch_data->data->soup_session,
                                 cancellable,
                                 refspec,
                                 url_override,
@@ -591,6 +592,13 @@ discoverer_callback (EosAvahiDiscoverer *discoverer,
 {
   LanData *lan_data = lan_data_ptr;
 
+  /* The poll may have been cancelled in the same main context iteration. */
+  if (!g_main_loop_is_running (lan_data->main_loop))
+    {
+      g_clear_error (&error);
+      return;
+    }
+
   lan_data->error = g_steal_pointer (&error);
   if (lan_data->error == NULL)
     check_lan_updates (lan_data, found_services, &lan_data->error);
@@ -598,6 +606,21 @@ discoverer_callback (EosAvahiDiscoverer *discoverer,
   g_main_loop_quit (lan_data->main_loop);
 }
 
+static gboolean
+lan_cancelled_cb (GCancellable *cancellable,
+                  gpointer lan_data_ptr)
+{
+  LanData *lan_data = lan_data_ptr;
+
+  if (g_main_loop_is_running (lan_data->main_loop))
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, &lan_data->error);
+      g_main_loop_quit (lan_data->main_loop);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
 gboolean
 metadata_fetch_from_lan (EosMetadataFetchData *fetch_data,
                          GVariant *source_variant,
@@ -606,6 +629,7 @@ metadata_fetch_from_lan (EosMetadataFetchData *fetch_data,
 {
   g_autoptr(EosAvahiDiscoverer) discoverer = NULL;
   g_auto(LanData) lan_data = LAN_DATA_CLEARED;
+  g_autoptr(GSource) cancelled_source = NULL;
 
   g_return_val_if_fail (EOS_IS_METADATA_FETCH_DATA (fetch_data), FALSE);
   g_return_val_if_fail (out_info != NULL, FALSE);
@@ -623,7 +647,20 @@ metadata_fetch_from_lan (EosMetadataFetchData *fetch_data,
   if (discoverer == NULL)
     return FALSE;
 
+  /* Stop browsing for servers if the poll is cancelled or times out. */
+  if (fetch_data->cancellable != NULL)
+    {
+      cancelled_source = g_cancellable_source_new (fetch_data->cancellable);
+      g_source_set_callback (cancelled_source, (GSourceFunc) lan_cancelled_cb,
+                             &lan_data, NULL);
+      g_source_attach (cancelled_source, fetch_data->context);
+    }
+
   g_main_loop_run (lan_data.main_loop);
+
+  if (cancelled_source != NULL)
+    g_source_destroy (cancelled_source);
+
   if (lan_data.error != NULL)
     {
       g_propagate_error (error, g_steal_pointer (&lan_data.error));
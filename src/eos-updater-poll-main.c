@@ -47,7 +47,8 @@ metadata_fetch_from_main (EosMetadataFetchData *fetch_data,
     return FALSE;
 
   if (!fetch_latest_commit (repo,
-                            g_task_get_cancellable (fetch_data->task),
+                            fetch_data->data->soup_session,
+                            fetch_data->cancellable,
                             refspec,
                             NULL,
                             &checksum,
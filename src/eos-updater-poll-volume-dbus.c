@@ -95,7 +95,8 @@ volume_metadata_fetch (GTask *task,
   info = run_fetchers (fetch_data,
                        fetchers,
                        source_variants,
-                       download_order);
+                       download_order,
+                       FALSE);
 
   g_task_return_pointer (task,
                          (info != NULL) ? g_object_ref (info) : NULL,
@@ -80,7 +80,7 @@ metadata_fetch_from_volume (EosMetadataFetchData *fetch_data,
                             GError **error)
 {
   OstreeRepo *repo = fetch_data->data->repo;
-  GCancellable *cancellable = g_task_get_cancellable (fetch_data->task);
+  GCancellable *cancellable = fetch_data->cancellable;
   g_autoptr(OstreeRepo) volume_repo = NULL;
   g_autofree gchar *refspec = NULL;
   g_autofree gchar *new_refspec = NULL;
@@ -111,6 +111,7 @@ metadata_fetch_from_volume (EosMetadataFetchData *fetch_data,
     return FALSE;
 
   if (!fetch_latest_commit (repo,
+                            fetch_data->data->soup_session,
                             cancellable,
                             refspec,
                             repo_url,
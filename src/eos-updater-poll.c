@@ -38,6 +38,8 @@ static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/" PACKAG
 static const gchar *const STATIC_CONFIG_FILE_PATH = PKGDATADIR "/eos-updater.conf";
 static const gchar *const DOWNLOAD_GROUP = "Download";
 static const gchar *const ORDER_KEY = "Order";
+static const gchar *const EARLY_EXIT_KEY = "EarlyExit";
+static const gchar *const TIMEOUT_KEY = "Timeout";
 
 static gboolean
 strv_to_download_order (gchar **sources,
@@ -89,11 +91,13 @@ get_config_file_path (void)
 typedef struct
 {
   GArray *download_order;
+  gboolean early_exit;
+  guint timeout_secs[EOS_UPDATER_DOWNLOAD_LAST + 1];
 
   gchar *volume_path;
 } SourcesConfig;
 
-#define SOURCES_CONFIG_CLEARED { NULL, NULL }
+#define SOURCES_CONFIG_CLEARED { NULL, FALSE, { 0, }, NULL }
 
 static void
 sources_config_clear (SourcesConfig *config)
@@ -129,6 +133,48 @@ sources_config_has_source (SourcesConfig *config,
   return FALSE;
 }
 
+/* Read the optional Timeout key from the section for @source, which defaults
+ * to download_source_get_default_timeout(). */
+static gboolean
+read_source_timeout (GKeyFile *config,
+                     EosUpdaterDownloadSource source,
+                     guint *out_timeout_secs,
+                     GError **error)
+{
+  g_autofree gchar *group_name = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gint timeout_secs;
+
+  group_name = g_strdup_printf ("Source \"%s\"",
+                                download_source_to_string (source));
+  timeout_secs = g_key_file_get_integer (config, group_name, TIMEOUT_KEY,
+                                         &local_error);
+
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_GROUP_NOT_FOUND) ||
+      g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    {
+      *out_timeout_secs = download_source_get_default_timeout (source);
+      return TRUE;
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  if (timeout_secs < 0)
+    {
+      g_set_error (error, EOS_UPDATER_ERROR, EOS_UPDATER_ERROR_WRONG_CONFIGURATION,
+                   "Negative %s in %s section", TIMEOUT_KEY, group_name);
+      return FALSE;
+    }
+
+  *out_timeout_secs = (guint) timeout_secs;
+  return TRUE;
+}
+
 static gboolean
 read_config (const gchar *config_file_path,
              SourcesConfig *sources_config,
@@ -137,6 +183,8 @@ read_config (const gchar *config_file_path,
   g_autoptr(GKeyFile) config = NULL;
   g_auto(GStrv) download_order_strv = NULL;
   g_autofree gchar *group_name = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gsize idx;
   const gchar * const paths[] =
     {
       config_file_path,  /* typically CONFIG_FILE_PATH unless testing */
@@ -164,6 +212,34 @@ read_config (const gchar *config_file_path,
                                error))
     return FALSE;
 
+  /* EarlyExit is optional, and off by default. */
+  sources_config->early_exit = g_key_file_get_boolean (config,
+                                                       DOWNLOAD_GROUP,
+                                                       EARLY_EXIT_KEY,
+                                                       &local_error);
+  if (g_error_matches (local_error, G_KEY_FILE_ERROR,
+                       G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+    {
+      g_clear_error (&local_error);
+    }
+  else if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  for (idx = 0; idx < sources_config->download_order->len; ++idx)
+    {
+      EosUpdaterDownloadSource source = g_array_index (sources_config->download_order,
+                                                       EosUpdaterDownloadSource,
+                                                       idx);
+
+      if (!read_source_timeout (config, source,
+                                &sources_config->timeout_secs[source],
+                                error))
+        return FALSE;
+    }
+
   if (sources_config_has_source (sources_config,
                                  EOS_UPDATER_DOWNLOAD_VOLUME,
                                  &group_name))
@@ -215,11 +291,16 @@ get_fetchers (SourcesConfig *config,
   for (idx = 0; idx < config->download_order->len; ++idx)
     {
       g_auto(GVariantDict) dict_builder;
+      EosUpdaterDownloadSource source = g_array_index (config->download_order,
+                                                       EosUpdaterDownloadSource,
+                                                       idx);
 
       g_variant_dict_init (&dict_builder, NULL);
-      switch (g_array_index (config->download_order,
-                             EosUpdaterDownloadSource,
-                             idx))
+      g_variant_dict_insert_value (&dict_builder,
+                                   FETCHER_TIMEOUT_KEY,
+                                   g_variant_new_uint32 (config->timeout_secs[source]));
+
+      switch (source)
         {
         case EOS_UPDATER_DOWNLOAD_MAIN:
           add_fetcher (fetchers, metadata_fetch_from_main);
@@ -290,7 +371,8 @@ metadata_fetch (GTask *task,
   info = run_fetchers (fetch_data,
                        fetchers,
                        source_variants,
-                       config.download_order);
+                       config.download_order,
+                       config.early_exit);
 
   g_task_return_pointer (task,
                          (info != NULL) ? g_object_ref (info) : NULL,
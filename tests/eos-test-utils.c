@@ -1229,7 +1229,12 @@ set_source_specific_config (GKeyFile *config,
     {
     case DOWNLOAD_MAIN:
     case DOWNLOAD_LAN:
-      /* no specific config for now */
+      /* the variant is optional, and holds the timeout in seconds */
+      if (source_variant != NULL)
+        g_key_file_set_integer (config,
+                                group_name,
+                                "Timeout",
+                                (gint) g_variant_get_uint32 (source_variant));
       return;
 
     case DOWNLOAD_VOLUME:
@@ -1973,11 +1978,22 @@ prepare_update_server_dir (GFile *update_server_dir,
   g_autoptr(GFile) quit_file = NULL;
   g_autoptr(GFile) config_file = NULL;
   g_autofree gchar *config_file_path = NULL;
-  const gchar *config = "[Local Network Updates]\nAdvertiseUpdates=true";
+  g_autoptr(GFile) cache_dir = NULL;
+  g_autofree gchar *cache_dir_path = NULL;
+  g_autofree gchar *config = NULL;
 
   if (!create_directory (update_server_dir, error))
     return FALSE;
 
+  /* Keep the cache of compressed objects inside the test directory. */
+  cache_dir = g_file_get_child (update_server_dir, "cache");
+  cache_dir_path = g_file_get_path (cache_dir);
+  config = g_strdup_printf ("[Local Network Updates]\n"
+                            "AdvertiseUpdates=true\n"
+                            "[Cache]\n"
+                            "Path=%s\n",
+                            cache_dir_path);
+
   quit_file = get_update_server_quit_file (update_server_dir);
   if (!create_file (quit_file, NULL, error))
     return FALSE;
@@ -256,6 +256,25 @@ ostree_ref_delete (GFile *repo,
                                       error);
 }
 
+gboolean
+ostree_rev_parse (GFile *repo,
+                  const gchar *refspec,
+                  CmdResult *cmd,
+                  GError **error)
+{
+  CmdArg args[] =
+    {
+      { NULL, "rev-parse" },
+      { NULL, refspec },
+      { NULL, NULL }
+    };
+
+    return spawn_ostree_in_repo_args (repo,
+                                      args,
+                                      cmd,
+                                      error);
+}
+
 gboolean
 ostree_prune (GFile *repo,
               OstreePruneFlags flags,
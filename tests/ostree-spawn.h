@@ -80,6 +80,11 @@ gboolean ostree_ref_delete (GFile *repo,
                             CmdResult *cmd,
                             GError **error);
 
+gboolean ostree_rev_parse (GFile *repo,
+                           const gchar *refspec,
+                           CmdResult *cmd,
+                           GError **error);
+
 typedef enum
   {
     OSTREE_PRUNE_REFS_ONLY = 1 << 0,
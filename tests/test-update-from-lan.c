@@ -22,6 +22,7 @@
 
 #include "misc-utils.h"
 #include "spawn-utils.h"
+#include "ostree-spawn.h"
 #include "eos-test-utils.h"
 
 #include <gio/gio.h>
@@ -199,6 +200,168 @@ test_update_from_lan (EosUpdaterFixture *fixture,
   g_assert_true (has_commit);
 }
 
+static gchar *
+rev_parse (GFile *repo,
+           const gchar *refspec)
+{
+  g_auto(CmdResult) parsed = CMD_RESULT_CLEARED;
+  g_autoptr(GError) error = NULL;
+
+  ostree_rev_parse (repo, refspec, &parsed, &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (&parsed));
+
+  return g_strdup (g_strstrip (parsed.standard_output));
+}
+
+/* The main and LAN sources are polled at the same time, and both resolve the
+ * same remote ref. Check that, when a LAN peer is behind the main server, the
+ * client’s remote ref ends up pointing to the main server’s newer commit,
+ * whichever source finished last. */
+static void
+test_poll_lan_behind_main (EosUpdaterFixture *fixture,
+                           gconstpointer user_data)
+{
+  g_autoptr(GFile) server_root = NULL;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosTestSubserver) subserver = NULL;
+  g_autoptr(GFile) client_root = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GFile) lan_server_root = NULL;
+  g_autoptr(EosTestClient) lan_server = NULL;
+  g_autoptr(GKeyFile) definition = NULL;
+  g_auto(CmdAsyncResult) lan_server_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped_lan_server = CMD_RESULT_CLEARED;
+  DownloadSource sources[] = { DOWNLOAD_MAIN, DOWNLOAD_LAN };
+  GVariant *source_variants[] = { NULL, NULL };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  g_autoptr(GPtrArray) cmds = NULL;
+  g_autoptr(GFile) client_repo = NULL;
+  g_autofree gchar *remote_refspec = NULL;
+  g_autofree gchar *lan_checksum = NULL;
+  g_autofree gchar *main_checksum = NULL;
+  g_autofree gchar *client_checksum = NULL;
+
+  g_test_message ("Setting up server");
+
+  server_root = g_file_get_child (fixture->tmpdir, "main");
+  server = eos_test_server_new_quick (server_root,
+                                      default_vendor,
+                                      default_product,
+                                      default_ref,
+                                      0,
+                                      fixture->gpg_home,
+                                      keyid,
+                                      default_ostree_path,
+                                      &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (server->subservers->len, ==, 1u);
+
+  g_test_message ("Setting up client");
+
+  subserver = g_object_ref (EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0)));
+  client_root = g_file_get_child (fixture->tmpdir, "client");
+  client = eos_test_client_new (client_root,
+                                default_remote_name,
+                                subserver,
+                                default_ref,
+                                default_vendor,
+                                default_product,
+                                &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Setting up LAN server at commit 1");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_update (subserver,
+                             &error);
+  g_assert_no_error (error);
+  lan_checksum = rev_parse (subserver->repo, default_ref);
+
+  lan_server_root = g_file_get_child (fixture->tmpdir, "lan_server");
+  lan_server = eos_test_client_new (lan_server_root,
+                                    default_remote_name,
+                                    subserver,
+                                    default_ref,
+                                    default_vendor,
+                                    default_product,
+                                    &error);
+  g_assert_no_error (error);
+
+  eos_test_client_run_update_server (lan_server,
+                                     &lan_server_cmd,
+                                     &definition,
+                                     &error);
+  g_assert_no_error (error);
+
+  eos_test_client_store_definition (client,
+                                    "lan_server",
+                                    definition,
+                                    &error);
+  g_assert_no_error (error);
+
+  g_test_message ("Updating main server to commit 2");
+
+  g_hash_table_insert (subserver->ref_to_commit,
+                       g_strdup (default_ref),
+                       GUINT_TO_POINTER (2));
+  eos_test_subserver_update (subserver,
+                             &error);
+  g_assert_no_error (error);
+  main_checksum = rev_parse (subserver->repo, default_ref);
+  g_assert_cmpstr (lan_checksum, !=, main_checksum);
+
+  g_test_message ("Polling main and LAN sources");
+
+  eos_test_client_run_updater (client,
+                               sources,
+                               source_variants,
+                               G_N_ELEMENTS (sources),
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  autoupdater_root = g_file_get_child (fixture->tmpdir, "autoupdater");
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          UPDATE_STEP_POLL,
+                                          1,
+                                          TRUE,
+                                          &error);
+  g_assert_no_error (error);
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  eos_test_client_remove_update_server_quit_file (lan_server, &error);
+  g_assert_no_error (error);
+  eos_test_client_wait_for_update_server (lan_server,
+                                          &lan_server_cmd,
+                                          &reaped_lan_server,
+                                          &error);
+  g_assert_no_error (error);
+
+  cmds = g_ptr_array_new ();
+  g_ptr_array_add (cmds, &reaped_lan_server);
+  g_ptr_array_add (cmds, &reaped);
+  g_ptr_array_add (cmds, autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+
+  client_repo = eos_test_client_get_repo (client);
+  remote_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+  client_checksum = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum, ==, main_checksum);
+}
+
 int
 main (int argc,
       char **argv)
@@ -208,6 +371,7 @@ main (int argc,
   g_test_init (&argc, &argv, NULL);
 
   eos_test_add ("/updater/update-from-lan", NULL, test_update_from_lan);
+  eos_test_add ("/updater/poll-lan-behind-main", NULL, test_poll_lan_behind_main);
 
   return g_test_run ();
 }
@@ -22,10 +22,13 @@
 
 #include "misc-utils.h"
 #include "spawn-utils.h"
+#include "ostree-spawn.h"
 #include "eos-test-utils.h"
+#include "eos-test-convenience.h"
 
 #include <gio/gio.h>
 #include <locale.h>
+#include <string.h>
 
 static void
 test_update_from_main (EosUpdaterFixture *fixture,
@@ -114,6 +117,338 @@ test_update_from_main (EosUpdaterFixture *fixture,
   g_assert_true (has_commit);
 }
 
+static gchar *
+rev_parse (GFile *repo,
+           const gchar *refspec)
+{
+  g_auto(CmdResult) parsed = CMD_RESULT_CLEARED;
+  g_autoptr(GError) error = NULL;
+
+  ostree_rev_parse (repo, refspec, &parsed, &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (&parsed));
+
+  return g_strdup (g_strstrip (parsed.standard_output));
+}
+
+/* Run the updater and an autoupdater which only polls the main source, and
+ * check that both succeed. If @timeout_secs is non-zero, it is the source’s
+ * Timeout= in the updater configuration. Each poll needs its own
+ * @autoupdater_name, as an autoupdater does not poll again on the same day. */
+static void
+poll_main (EtcData *data,
+           guint timeout_secs,
+           const gchar *autoupdater_name)
+{
+  DownloadSource main_source = DOWNLOAD_MAIN;
+  g_autoptr(GVariant) main_source_variant = NULL;
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  g_autoptr(GPtrArray) cmds = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (timeout_secs > 0)
+    main_source_variant = g_variant_ref_sink (g_variant_new_uint32 (timeout_secs));
+
+  eos_test_client_run_updater (data->client,
+                               &main_source,
+                               &main_source_variant,
+                               1,
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  autoupdater_root = g_file_get_child (data->fixture->tmpdir, autoupdater_name);
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          UPDATE_STEP_POLL,
+                                          1,
+                                          TRUE,
+                                          &error);
+  g_assert_no_error (error);
+
+  eos_test_client_reap_updater (data->client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  cmds = g_ptr_array_new ();
+  g_ptr_array_add (cmds, &reaped);
+  g_ptr_array_add (cmds, autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+}
+
+/* Polling pulls the new commit by checksum, so check that it also updates the
+ * remote ref on the client to point to the commit it found. */
+static void
+test_poll_updates_remote_ref (EosUpdaterFixture *fixture,
+                              gconstpointer user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  g_autoptr(GFile) client_repo = NULL;
+  g_autofree gchar *remote_refspec = NULL;
+  g_autofree gchar *old_checksum = NULL;
+  g_autofree gchar *server_checksum = NULL;
+  g_autofree gchar *client_checksum = NULL;
+
+  etc_data_init (data, fixture);
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+
+  client_repo = eos_test_client_get_repo (data->client);
+  remote_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+  old_checksum = rev_parse (client_repo, remote_refspec);
+
+  etc_update_server (data, 1);
+  server_checksum = rev_parse (data->subserver->repo, default_ref);
+  g_assert_cmpstr (old_checksum, !=, server_checksum);
+
+  poll_main (data, 0, "autoupdater");
+
+  client_checksum = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum, ==, server_checksum);
+}
+
+/* Get the directory the updater keeps its poll caches in, in the client’s
+ * repository. */
+static GFile *
+get_updater_cache_dir (EtcData *data)
+{
+  g_autoptr(GFile) client_repo = eos_test_client_get_repo (data->client);
+
+  return g_file_resolve_relative_path (client_repo, "tmp/cache/eos-updater");
+}
+
+/* Check that the updater has remembered which method of finding the latest
+ * commit checksum worked for the client’s remote. */
+static void
+assert_checksum_method_cached (EtcData *data)
+{
+  g_autoptr(GFile) cache_dir = get_updater_cache_dir (data);
+  g_autoptr(GFile) cache_file = g_file_get_child (cache_dir, "checksum-methods");
+  g_autofree gchar *cache_path = g_file_get_path (cache_file);
+  g_autoptr(GKeyFile) cache = g_key_file_new ();
+  g_auto(GStrv) groups = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize idx;
+  gboolean found = FALSE;
+
+  g_key_file_load_from_file (cache, cache_path, G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+
+  groups = g_key_file_get_groups (cache, NULL);
+  for (idx = 0; groups[idx] != NULL; ++idx)
+    {
+      g_autofree gchar *remote = g_key_file_get_string (cache, groups[idx],
+                                                        "Remote", NULL);
+      g_autofree gchar *method = NULL;
+
+      if (g_strcmp0 (remote, default_remote_name) != 0)
+        continue;
+
+      method = g_key_file_get_string (cache, groups[idx], "Method", &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (method, !=, "");
+      found = TRUE;
+    }
+
+  g_assert_true (found);
+}
+
+/* Check that the updater remembers which method of finding the latest commit
+ * checksum worked for the remote, and that a later poll using the remembered
+ * method still finds a newer commit. */
+static void
+test_poll_remembers_checksum_method (EosUpdaterFixture *fixture,
+                                     gconstpointer user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  g_autoptr(GFile) client_repo = NULL;
+  g_autofree gchar *remote_refspec = NULL;
+  g_autofree gchar *server_checksum = NULL;
+  g_autofree gchar *client_checksum = NULL;
+
+  etc_data_init (data, fixture);
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+
+  client_repo = eos_test_client_get_repo (data->client);
+  remote_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+
+  etc_update_server (data, 1);
+  poll_main (data, 0, "autoupdater1");
+  assert_checksum_method_cached (data);
+
+  etc_update_server (data, 2);
+  server_checksum = rev_parse (data->subserver->repo, default_ref);
+
+  poll_main (data, 0, "autoupdater2");
+
+  client_checksum = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum, ==, server_checksum);
+  assert_checksum_method_cached (data);
+}
+
+/* Overwrite every metadata file the updater has cached, so that the cached
+ * copies no longer match their signatures. */
+static void
+corrupt_http_cache (EtcData *data)
+{
+  g_autoptr(GFile) cache_dir = get_updater_cache_dir (data);
+  g_autoptr(GFile) http_cache_dir = g_file_get_child (cache_dir, "http");
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  g_autoptr(GError) error = NULL;
+  guint n_corrupted = 0;
+
+  enumerator = g_file_enumerate_children (http_cache_dir,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          G_FILE_QUERY_INFO_NONE,
+                                          NULL,
+                                          &error);
+
+  /* Responses are only cached if the server sends validators for them. */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_test_message ("Nothing was cached to corrupt");
+      return;
+    }
+  g_assert_no_error (error);
+
+  while (TRUE)
+    {
+      GFileInfo *info;
+      g_autoptr(GFile) file = NULL;
+
+      g_file_enumerator_iterate (enumerator, &info, NULL, NULL, &error);
+      g_assert_no_error (error);
+
+      if (info == NULL)
+        break;
+
+      file = g_file_get_child (http_cache_dir, g_file_info_get_name (info));
+      g_file_replace_contents (file, "garbage", strlen ("garbage"), NULL,
+                               FALSE, G_FILE_CREATE_NONE, NULL, NULL,
+                               &error);
+      g_assert_no_error (error);
+      n_corrupted++;
+    }
+
+  g_test_message ("Corrupted %u cached files", n_corrupted);
+}
+
+/* Check that the metadata files the updater caches are revalidated, rather
+ * than hiding a newer commit on the server on the next poll. If
+ * @corrupt_cache is set, the cached files are corrupted before the second
+ * poll, which must still succeed. */
+static void
+test_poll_caches (EosUpdaterFixture *fixture,
+                  gconstpointer user_data)
+{
+  gboolean corrupt_cache = GPOINTER_TO_INT (user_data);
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  g_autoptr(GFile) client_repo = NULL;
+  g_autofree gchar *remote_refspec = NULL;
+  g_autofree gchar *server_checksum1 = NULL;
+  g_autofree gchar *server_checksum2 = NULL;
+  g_autofree gchar *client_checksum1 = NULL;
+  g_autofree gchar *client_checksum2 = NULL;
+
+  etc_data_init (data, fixture);
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+
+  client_repo = eos_test_client_get_repo (data->client);
+  remote_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+
+  etc_update_server (data, 1);
+  server_checksum1 = rev_parse (data->subserver->repo, default_ref);
+
+  poll_main (data, 0, "autoupdater1");
+
+  client_checksum1 = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum1, ==, server_checksum1);
+
+  if (corrupt_cache)
+    corrupt_http_cache (data);
+
+  etc_update_server (data, 2);
+  server_checksum2 = rev_parse (data->subserver->repo, default_ref);
+  g_assert_cmpstr (server_checksum1, !=, server_checksum2);
+
+  poll_main (data, 0, "autoupdater2");
+
+  client_checksum2 = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum2, ==, server_checksum2);
+}
+
+/* Check that a main server which accepts connections but never responds does
+ * not hold up the poll beyond the source’s Timeout=, and that the poll then
+ * finishes without an update rather than failing. */
+static void
+test_poll_main_timeout (EosUpdaterFixture *fixture,
+                        gconstpointer user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  g_autoptr(GSocketListener) listener = NULL;
+  guint16 port;
+  g_autoptr(GFile) client_repo = NULL;
+  g_autoptr(GFile) client_config_file = NULL;
+  g_autofree gchar *client_config_path = NULL;
+  g_autoptr(GKeyFile) client_config = NULL;
+  g_autofree gchar *remote_group = NULL;
+  g_autofree gchar *stalled_url = NULL;
+  g_autofree gchar *remote_refspec = NULL;
+  g_autofree gchar *old_checksum = NULL;
+  g_autofree gchar *client_checksum = NULL;
+  gint64 start_time, elapsed_secs;
+  g_autoptr(GError) error = NULL;
+
+  etc_data_init (data, fixture);
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+  etc_update_server (data, 1);
+
+  /* The kernel completes the TCP handshake for connections to a listening
+   * socket, but nothing ever accepts them, so requests never get a
+   * response. */
+  listener = g_socket_listener_new ();
+  port = g_socket_listener_add_any_inet_port (listener, NULL, &error);
+  g_assert_no_error (error);
+
+  client_repo = eos_test_client_get_repo (data->client);
+  client_config_file = g_file_get_child (client_repo, "config");
+  client_config_path = g_file_get_path (client_config_file);
+  client_config = g_key_file_new ();
+  g_key_file_load_from_file (client_config, client_config_path,
+                             G_KEY_FILE_KEEP_COMMENTS, &error);
+  g_assert_no_error (error);
+
+  remote_group = g_strdup_printf ("remote \"%s\"", default_remote_name);
+  stalled_url = g_strdup_printf ("http://127.0.0.1:%" G_GUINT16_FORMAT, port);
+  g_key_file_set_string (client_config, remote_group, "url", stalled_url);
+  g_key_file_save_to_file (client_config, client_config_path, &error);
+  g_assert_no_error (error);
+
+  remote_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+  old_checksum = rev_parse (client_repo, remote_refspec);
+
+  start_time = g_get_monotonic_time ();
+  poll_main (data, 2, "autoupdater");
+  elapsed_secs = (g_get_monotonic_time () - start_time) / G_USEC_PER_SEC;
+
+  /* Well under the default timeout for the main source. */
+  g_assert_cmpint (elapsed_secs, <, 60);
+
+  client_checksum = rev_parse (client_repo, remote_refspec);
+  g_assert_cmpstr (client_checksum, ==, old_checksum);
+}
+
 int
 main (int argc,
       char **argv)
@@ -123,6 +458,11 @@ main (int argc,
   g_test_init (&argc, &argv, NULL);
 
   eos_test_add ("/updater/update-from-main", NULL, test_update_from_main);
+  eos_test_add ("/updater/poll-updates-remote-ref", NULL, test_poll_updates_remote_ref);
+  eos_test_add ("/updater/poll-main-timeout", NULL, test_poll_main_timeout);
+  eos_test_add ("/updater/poll-remembers-checksum-method", NULL, test_poll_remembers_checksum_method);
+  eos_test_add ("/updater/poll-revalidates-cache", GINT_TO_POINTER (FALSE), test_poll_caches);
+  eos_test_add ("/updater/poll-corrupt-cache", GINT_TO_POINTER (TRUE), test_poll_caches);
 
   return g_test_run ();
 }